@@ -42,7 +42,7 @@ void interrupt_handler( int /*dummy*/ )
 
 int ClientServerMain()
 {
-    double time = 100.0;
+    double time = yojimbo_time();
 
     ClientServerConfig config;
 
@@ -70,8 +70,6 @@ int ClientServerMain()
 
     client.InsecureConnect( privateKey, clientId, serverAddress );
 
-    const double deltaTime = 0.1;
-
     signal( SIGINT, interrupt_handler );    
 
     while ( !quit )
@@ -81,19 +79,21 @@ int ClientServerMain()
 
         server.ReceivePackets();
         client.ReceivePackets();
-     
-        time += deltaTime;
+
+        // sleep until the earlier of the client and server wakeup times. the poll only watches the server transport, so packets for the client are picked up on the next pass
+
+        const double wakeupTime = yojimbo_min( server.GetNextWakeupTime(), client.GetNextWakeupTime() );
+
+        server.Poll( wakeupTime - yojimbo_time() );
+
+        time = yojimbo_time();
 
         client.AdvanceTime( time );
 
         if ( client.IsDisconnected() )
             break;
 
-        time += deltaTime;
-
         server.AdvanceTime( time );
-
-        yojimbo_sleep( deltaTime );
     }
 
     client.Disconnect();
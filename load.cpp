@@ -0,0 +1,555 @@
+/*
+    Yojimbo Load Test Program.
+
+    Copyright © 2016 - 2017, The Network Protocol Company, Inc.
+
+    Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+        1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+        2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer
+           in the documentation and/or other materials provided with the distribution.
+
+        3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote products derived
+           from this software without specific prior written permission.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+    INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+    SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+    WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+    USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+    Runs many clients against one or more servers in a single process, over in-memory transports, on a virtual clock.
+
+    There are no sockets, no sleeps and no encryption, so thousands of clients fit in one process and the program runs
+    as fast as the CPU allows. Use it to measure server CPU and memory cost per-client under a scripted traffic profile.
+
+    Usage: load [numClients] [profile] [seconds] [clientsPerServer] [seed]
+
+        numClients          Number of simulated clients (default 1024).
+        profile             Traffic profile: idle, chat or game (default game).
+        seconds             Virtual time to run for, once all clients are connected (default 60).
+        clientsPerServer    Client slots per-server. Servers are added until there is a slot for each client (default 256).
+        seed                Seed for the traffic generator. Runs with the same arguments and seed send exactly the same messages (default 0).
+*/
+
+#include "yojimbo.h"
+#include "shared.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+
+static volatile int quit = 0;
+
+void interrupt_handler( int /*dummy*/ )
+{
+    quit = 1;
+}
+
+static const int RELIABLE_ORDERED_CHANNEL = 0;
+static const int UNRELIABLE_UNORDERED_CHANNEL = 1;
+
+static const double TickRate = 60.0;
+static const double ReportInterval = 10.0;
+static const double ConnectTimeout = 30.0;
+
+/// Traffic sent each tick, per-client.
+
+enum TrafficProfile
+{
+    TRAFFIC_PROFILE_IDLE,                                   ///< No messages. Measures the cost of keeping connections alive.
+    TRAFFIC_PROFILE_CHAT,                                   ///< Clients occasionally send a reliable message, and the server sends one back. Lobby and chat servers.
+    TRAFFIC_PROFILE_GAME,                                   ///< Clients send an unreliable input every tick, and the server sends an unreliable snapshot back. Action game servers.
+    NUM_TRAFFIC_PROFILES
+};
+
+static const char * TrafficProfileNames[NUM_TRAFFIC_PROFILES] = { "idle", "chat", "game" };
+
+static const float ChatMessagePercent = 1.0f;
+
+/**
+    Counts bytes allocated through it, so memory per-client can be reported.
+    Each allocation is prefixed with its size. Not thread safe, like the memory transports.
+ */
+
+class CountingAllocator : public Allocator
+{
+public:
+
+    explicit CountingAllocator( Allocator & allocator ) : m_allocator( &allocator ), m_currentBytes( 0 ), m_peakBytes( 0 ) {}
+
+    void * Allocate( size_t size, const char * file, int line )
+    {
+        uint8_t * p = (uint8_t*) m_allocator->Allocate( size + HeaderBytes, file, line );
+        if ( !p )
+        {
+            SetErrorLevel( ALLOCATOR_ERROR_OUT_OF_MEMORY );
+            return NULL;
+        }
+        *( (size_t*) p ) = size;
+        m_currentBytes += size;
+        if ( m_currentBytes > m_peakBytes )
+            m_peakBytes = m_currentBytes;
+        return p + HeaderBytes;
+    }
+
+    void Free( void * p, const char * file, int line )
+    {
+        if ( !p )
+            return;
+        uint8_t * block = ( (uint8_t*) p ) - HeaderBytes;
+        m_currentBytes -= *( (size_t*) block );
+        m_allocator->Free( block, file, line );
+    }
+
+    uint64_t GetCurrentBytes() const { return m_currentBytes; }
+
+    uint64_t GetPeakBytes() const { return m_peakBytes; }
+
+private:
+
+    static const int HeaderBytes = 16;                      ///< Keeps allocations 16 byte aligned.
+
+    Allocator * m_allocator;                                ///< The allocator that does the work.
+    uint64_t m_currentBytes;                                ///< Bytes currently allocated.
+    uint64_t m_peakBytes;                                   ///< Most bytes allocated at any time.
+
+    CountingAllocator( const CountingAllocator & other );
+    CountingAllocator & operator = ( const CountingAllocator & other );
+};
+
+/// Totals for one report interval.
+
+struct LoadStats
+{
+    uint64_t numTicks;
+    uint64_t messagesSentToServer;
+    uint64_t messagesSentToClient;
+    uint64_t messagesReceivedFromClient;
+    uint64_t messagesReceivedFromServer;
+    uint64_t packetsSent;
+    uint64_t packetsReceived;
+    double wallTime;
+    TimingHistogram tickTime;
+    TimingHistogram serverTickTime;
+
+    void Reset()
+    {
+        numTicks = 0;
+        messagesSentToServer = 0;
+        messagesSentToClient = 0;
+        messagesReceivedFromClient = 0;
+        messagesReceivedFromServer = 0;
+        packetsSent = 0;
+        packetsReceived = 0;
+        wallTime = 0.0;
+        tickTime.Reset();
+        serverTickTime.Reset();
+    }
+};
+
+static uint64_t GetServerPacketCount( Server ** servers, int numServers, bool sent )
+{
+    uint64_t count = 0;
+    for ( int i = 0; i < numServers; ++i )
+    {
+        for ( int j = 0; j < servers[i]->GetMaxClients(); ++j )
+        {
+            if ( !servers[i]->IsClientConnected( j ) )
+                continue;
+            NetworkInfo info;
+            servers[i]->GetNetworkInfo( j, info );
+            count += sent ? info.numPacketsSent : info.numPacketsReceived;
+        }
+    }
+    return count;
+}
+
+static void PrintReport( double time, int numConnected, const LoadStats & stats, double interval )
+{
+    TimingStats tick;
+    TimingStats serverTick;
+    stats.tickTime.GetStats( tick );
+    stats.serverTickTime.GetStats( serverTick );
+
+    printf( "%8.1fs | %5d clients | c2s %9.0f msg/s | s2c %9.0f msg/s | server %9.0f pkt/s out %9.0f pkt/s in | tick p50 %7.3fms p99 %7.3fms max %7.3fms | server p50 %7.3fms p99 %7.3fms max %7.3fms | %6.1fx realtime\n",
+        time,
+        numConnected,
+        stats.messagesReceivedFromClient / interval,
+        stats.messagesReceivedFromServer / interval,
+        stats.packetsSent / interval,
+        stats.packetsReceived / interval,
+        tick.p50 * 1000.0, tick.p99 * 1000.0, tick.max * 1000.0,
+        serverTick.p50 * 1000.0, serverTick.p99 * 1000.0, serverTick.max * 1000.0,
+        stats.wallTime > 0.0 ? interval / stats.wallTime : 0.0 );
+}
+
+static void SendClientMessages( Client & client, TrafficProfile profile, RandomGenerator & random, LoadStats & stats )
+{
+    switch ( profile )
+    {
+        case TRAFFIC_PROFILE_CHAT:
+        {
+            if ( random.GenerateFloat( 0.0f, 100.0f ) >= ChatMessagePercent || !client.CanSendMessage( RELIABLE_ORDERED_CHANNEL ) )
+                break;
+            TestMessage * message = (TestMessage*) client.CreateMessage( TEST_MESSAGE );
+            if ( !message )
+                break;
+            message->sequence = (uint16_t) random.GenerateInt( 0, 65535 );
+            client.SendMessage( RELIABLE_ORDERED_CHANNEL, message );
+            stats.messagesSentToServer++;
+        }
+        break;
+
+        case TRAFFIC_PROFILE_GAME:
+        {
+            TestMessage * message = (TestMessage*) client.CreateMessage( TEST_MESSAGE );
+            if ( !message )
+                break;
+            message->sequence = (uint16_t) random.GenerateInt( 0, 65535 );
+            client.SendMessage( UNRELIABLE_UNORDERED_CHANNEL, message );
+            stats.messagesSentToServer++;
+        }
+        break;
+
+        default:
+            break;
+    }
+}
+
+static void ProcessServerMessages( Server & server, TrafficProfile profile, LoadStats & stats )
+{
+    for ( int i = 0; i < server.GetMaxClients(); ++i )
+    {
+        if ( !server.IsClientConnected( i ) )
+            continue;
+
+        for ( int channelIndex = 0; channelIndex < 2; ++channelIndex )
+        {
+            while ( Message * message = server.ReceiveMessage( i, channelIndex ) )
+            {
+                stats.messagesReceivedFromClient++;
+
+                // chat messages are answered on the same channel
+
+                if ( profile == TRAFFIC_PROFILE_CHAT && server.CanSendMessage( i, RELIABLE_ORDERED_CHANNEL ) )
+                {
+                    TestMessage * reply = (TestMessage*) server.CreateMessage( i, TEST_MESSAGE );
+                    if ( reply )
+                    {
+                        reply->sequence = ( (TestMessage*) message )->sequence;
+                        server.SendMessage( i, RELIABLE_ORDERED_CHANNEL, reply );
+                        stats.messagesSentToClient++;
+                    }
+                }
+
+                server.ReleaseMessage( i, message );
+            }
+        }
+
+        if ( profile == TRAFFIC_PROFILE_GAME )
+        {
+            TestMessage * snapshot = (TestMessage*) server.CreateMessage( i, TEST_MESSAGE );
+            if ( snapshot )
+            {
+                snapshot->sequence = (uint16_t) stats.numTicks;
+                server.SendMessage( i, UNRELIABLE_UNORDERED_CHANNEL, snapshot );
+                stats.messagesSentToClient++;
+            }
+        }
+    }
+}
+
+static void ProcessClientMessages( Client & client, LoadStats & stats )
+{
+    for ( int channelIndex = 0; channelIndex < 2; ++channelIndex )
+    {
+        while ( Message * message = client.ReceiveMessage( channelIndex ) )
+        {
+            stats.messagesReceivedFromServer++;
+            client.ReleaseMessage( message );
+        }
+    }
+}
+
+int LoadMain( int argc, char * argv[] )
+{
+    int numClients = 1024;
+    TrafficProfile profile = TRAFFIC_PROFILE_GAME;
+    double duration = 60.0;
+    int clientsPerServer = 256;
+    uint64_t seed = 0;
+
+    if ( argc > 1 )
+        numClients = atoi( argv[1] );
+
+    if ( argc > 2 )
+    {
+        int i = 0;
+        while ( i < NUM_TRAFFIC_PROFILES && strcmp( argv[2], TrafficProfileNames[i] ) != 0 )
+            ++i;
+        if ( i == NUM_TRAFFIC_PROFILES )
+        {
+            printf( "error: unknown traffic profile '%s'. expected idle, chat or game\n", argv[2] );
+            return 1;
+        }
+        profile = (TrafficProfile) i;
+    }
+
+    if ( argc > 3 )
+        duration = atof( argv[3] );
+
+    if ( argc > 4 )
+        clientsPerServer = atoi( argv[4] );
+
+    if ( argc > 5 )
+        seed = (uint64_t) strtoull( argv[5], NULL, 10 );
+
+    if ( numClients < 1 || clientsPerServer < 1 || duration <= 0.0 )
+    {
+        printf( "usage: load [numClients] [idle|chat|game] [seconds] [clientsPerServer] [seed]\n" );
+        return 1;
+    }
+
+    const int numServers = ( numClients + clientsPerServer - 1 ) / clientsPerServer;
+
+    printf( "%d clients, %d servers, %s traffic, %.0f seconds, seed %" PRIu64 "\n\n", numClients, numServers, TrafficProfileNames[profile], duration, seed );
+
+    ClientServerConfig config;
+    config.numChannels = 2;
+    config.channel[RELIABLE_ORDERED_CHANNEL].type = CHANNEL_TYPE_RELIABLE_ORDERED;
+    config.channel[UNRELIABLE_UNORDERED_CHANNEL].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+    config.SetLightweightClientProfile();
+    config.clientMemory = config.serverPerClientMemory;
+    config.serverGlobalMemory = 1024 * 1024;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    CountingAllocator serverAllocator( GetDefaultAllocator() );
+    CountingAllocator clientAllocator( GetDefaultAllocator() );
+
+    MemoryServerTransport ** serverTransports = (MemoryServerTransport**) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( MemoryServerTransport* ) * numServers );
+    Server ** servers = (Server**) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( Server* ) * numServers );
+
+    int result = 0;
+    int numServersCreated = 0;
+
+    for ( int i = 0; i < numServers; ++i )
+    {
+        serverTransports[i] = YOJIMBO_NEW( serverAllocator, MemoryServerTransport, serverAllocator );
+        servers[i] = YOJIMBO_NEW( serverAllocator, Server, serverAllocator, *serverTransports[i], config, adapter, time );
+        numServersCreated++;
+        servers[i]->Start( yojimbo_min( clientsPerServer, numClients - i * clientsPerServer ) );
+        if ( !servers[i]->IsRunning() )
+        {
+            printf( "error: server %d failed to start\n", i );
+            result = 1;
+            break;
+        }
+    }
+
+    const uint64_t serverStartBytes = serverAllocator.GetCurrentBytes();
+
+    MemoryClientTransport ** clientTransports = (MemoryClientTransport**) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( MemoryClientTransport* ) * numClients );
+    Client ** clients = (Client**) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( Client* ) * numClients );
+    RandomGenerator * random = (RandomGenerator*) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( RandomGenerator ) * numClients );
+
+    // if a server failed to start, skip straight to cleanup
+
+    const int numClientsCreated = result ? 0 : numClients;
+
+    for ( int i = 0; i < numClientsCreated; ++i )
+    {
+        clientTransports[i] = YOJIMBO_NEW( clientAllocator, MemoryClientTransport, clientAllocator, *serverTransports[i/clientsPerServer] );
+        clients[i] = YOJIMBO_NEW( clientAllocator, Client, clientAllocator, *clientTransports[i], config, adapter, time );
+        clients[i]->InsecureConnect( privateKey, uint64_t( i + 1 ), serverAddress );
+        new ( &random[i] ) RandomGenerator( seed, uint64_t( i ) );
+    }
+
+    signal( SIGINT, interrupt_handler );
+
+    const double deltaTime = 1.0 / TickRate;
+
+    LoadStats stats;
+    stats.Reset();
+
+    int numConnected = 0;
+    bool connected = false;
+    double startTime = 0.0;
+    double reportTime = 0.0;
+    uint64_t packetsSent = 0;
+    uint64_t packetsReceived = 0;
+
+    while ( !quit && !result )
+    {
+        const double tickStart = yojimbo_time();
+
+        // clients
+
+        numConnected = 0;
+
+        for ( int i = 0; i < numClients; ++i )
+        {
+            Client & client = *clients[i];
+
+            client.SendPackets();
+            client.ReceivePackets();
+
+            if ( client.ConnectionFailed() || ( connected && !client.IsConnected() ) )
+            {
+                printf( "error: client %d %s\n", i, connected ? "disconnected" : "failed to connect" );
+                result = 1;
+                break;
+            }
+
+            if ( client.IsConnected() )
+            {
+                numConnected++;
+                if ( connected )
+                {
+                    ProcessClientMessages( client, stats );
+                    SendClientMessages( client, profile, random[i], stats );
+                }
+            }
+
+            client.AdvanceTime( time );
+        }
+
+        if ( result )
+            break;
+
+        // servers
+
+        const double serverTickStart = yojimbo_time();
+
+        for ( int i = 0; i < numServers; ++i )
+        {
+            Server & server = *servers[i];
+
+            server.SendPackets();
+            server.ReceivePackets();
+
+            if ( connected )
+                ProcessServerMessages( server, profile, stats );
+
+            server.AdvanceTime( time );
+        }
+
+        const double tickFinish = yojimbo_time();
+
+        time += deltaTime;
+
+        if ( !connected )
+        {
+            if ( numConnected == numClients )
+            {
+                connected = true;
+                startTime = time;
+                reportTime = time + ReportInterval;
+
+                const uint64_t serverBytes = serverAllocator.GetCurrentBytes();
+                const uint64_t clientBytes = clientAllocator.GetCurrentBytes();
+
+                printf( "all clients connected after %.2f seconds\n", time - 100.0 );
+                printf( "server memory: %.1fMB total, %.1fKB per-client (%.1fKB allocated after start)\n", serverBytes / ( 1024.0 * 1024.0 ), serverBytes / 1024.0 / numClients, ( serverBytes - serverStartBytes ) / 1024.0 / numClients );
+                printf( "client memory: %.1fMB total, %.1fKB per-client\n\n", clientBytes / ( 1024.0 * 1024.0 ), clientBytes / 1024.0 / numClients );
+
+                packetsSent = GetServerPacketCount( servers, numServers, true );
+                packetsReceived = GetServerPacketCount( servers, numServers, false );
+
+                stats.Reset();
+            }
+            else if ( time - 100.0 > ConnectTimeout )
+            {
+                printf( "error: only %d/%d clients connected after %.0f seconds\n", numConnected, numClients, ConnectTimeout );
+                result = 1;
+                break;
+            }
+            continue;
+        }
+
+        stats.numTicks++;
+        stats.wallTime += tickFinish - tickStart;
+        stats.tickTime.AddSample( tickFinish - tickStart );
+        stats.serverTickTime.AddSample( tickFinish - serverTickStart );
+
+        if ( time >= reportTime || time >= startTime + duration )
+        {
+            const uint64_t currentPacketsSent = GetServerPacketCount( servers, numServers, true );
+            const uint64_t currentPacketsReceived = GetServerPacketCount( servers, numServers, false );
+            stats.packetsSent = currentPacketsSent - packetsSent;
+            stats.packetsReceived = currentPacketsReceived - packetsReceived;
+            packetsSent = currentPacketsSent;
+            packetsReceived = currentPacketsReceived;
+
+            PrintReport( time - startTime, numConnected, stats, stats.numTicks * deltaTime );
+
+            stats.Reset();
+            reportTime += ReportInterval;
+
+            if ( time >= startTime + duration )
+                break;
+        }
+    }
+
+    if ( quit )
+    {
+        printf( "\nstopped\n" );
+    }
+
+    printf( "\npeak memory: server %.1fMB, client %.1fMB\n", serverAllocator.GetPeakBytes() / ( 1024.0 * 1024.0 ), clientAllocator.GetPeakBytes() / ( 1024.0 * 1024.0 ) );
+
+    for ( int i = 0; i < numClientsCreated; ++i )
+    {
+        clients[i]->Disconnect();
+        YOJIMBO_DELETE( clientAllocator, Client, clients[i] );
+        YOJIMBO_DELETE( clientAllocator, MemoryClientTransport, clientTransports[i] );
+    }
+
+    for ( int i = 0; i < numServersCreated; ++i )
+    {
+        servers[i]->Stop();
+        YOJIMBO_DELETE( serverAllocator, Server, servers[i] );
+        YOJIMBO_DELETE( serverAllocator, MemoryServerTransport, serverTransports[i] );
+    }
+
+    YOJIMBO_FREE( GetDefaultAllocator(), random );
+    YOJIMBO_FREE( GetDefaultAllocator(), clients );
+    YOJIMBO_FREE( GetDefaultAllocator(), clientTransports );
+    YOJIMBO_FREE( GetDefaultAllocator(), servers );
+    YOJIMBO_FREE( GetDefaultAllocator(), serverTransports );
+
+    return result;
+}
+
+int main( int argc, char * argv[] )
+{
+    printf( "\nload\n\n" );
+
+    if ( !InitializeYojimbo() )
+    {
+        printf( "error: failed to initialize Yojimbo!\n" );
+        return 1;
+    }
+
+    yojimbo_log_level( YOJIMBO_LOG_LEVEL_ERROR );
+
+    int result = LoadMain( argc, argv );
+
+    ShutdownYojimbo();
+
+    printf( "\n" );
+
+    return result;
+}
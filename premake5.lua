@@ -14,6 +14,7 @@ solution "Yojimbo"
     else
         includedirs { ".", "/usr/local/include", "netcode.io", "reliable.io" }
         targetdir "bin/"  
+        links { "pthread" }
     end
     rtti "Off"
     links { libs }
@@ -61,6 +62,10 @@ project "soak"
     files { "soak.cpp", "shared.h" }
     links { "yojimbo" }
 
+project "load"
+    files { "load.cpp", "shared.h" }
+    links { "yojimbo" }
+
 if not os.is "windows" then
 
     -- MacOSX and Linux.
@@ -219,6 +224,18 @@ if not os.is "windows" then
         end
     }
 
+    newaction
+    {
+        trigger     = "load",
+        description = "Build and run load test with many in-memory clients",
+        execute = function ()
+            os.execute "test ! -e Makefile && premake5 gmake"
+            if os.execute "make -j32 load" == 0 then
+                os.execute "./bin/load"
+            end
+        end
+    }
+
     newaction
     {
         trigger     = "cppcheck",
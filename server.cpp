@@ -41,7 +41,7 @@ int ServerMain()
 {
     printf( "started server on port %d (insecure)\n", ServerPort );
 
-    double time = 100.0;
+    double time = yojimbo_time();
 
     ClientServerConfig config;
 
@@ -56,8 +56,6 @@ int ServerMain()
     server.GetAddress().ToString( addressString, sizeof( addressString ) );
     printf( "server address is %s\n", addressString );
 
-    const double deltaTime = 0.01f;
-
     signal( SIGINT, interrupt_handler );    
 
     while ( !quit )
@@ -66,14 +64,16 @@ int ServerMain()
 
         server.ReceivePackets();
 
-        time += deltaTime;
+        // sleep until the server next has work to do, instead of waking up on a fixed tick
+
+        server.Poll( server.GetNextWakeupTime() - yojimbo_time() );
+
+        time = yojimbo_time();
 
         server.AdvanceTime( time );
 
         if ( !server.IsRunning() )
             break;
-
-        yojimbo_sleep( deltaTime );
     }
 
     server.Stop();
@@ -22,8 +22,35 @@
     USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+/*
+    Runs clients against a server, sending reliable messages, blocks and unreliable messages both ways, and checks that
+    every reliable message and block arrives in order with the right contents.
+
+    Usage: soak [-option=value ...]
+
+        -clients=N          Number of clients (default 1).
+        -seconds=N          Virtual time to run for. 0 runs until interrupted (default 0).
+        -tick=N             Virtual time step (seconds, default 0.01).
+        -reliable=N         Up to this many reliable messages sent each tick, per-client and direction (default 2).
+        -blocks=N           Percentage of reliable messages that are block messages (default 1).
+        -unreliable=N       Unreliable messages sent each tick, per-client and direction (default 4).
+        -latency=N          Simulated latency, each direction (milliseconds).
+        -jitter=N           Simulated jitter, each direction (milliseconds).
+        -loss=N             Simulated packet loss, each direction (percent).
+        -duplicates=N       Simulated duplicate packets, each direction (percent).
+        -bandwidth=N        Simulated link bandwidth, each direction (kbps).
+        -seed=N             Seed for traffic, client ids and the network simulators. Defaults to the current time. Always printed, so runs can be repeated.
+        -report=N           Time between reports (virtual seconds, default 10).
+        -quiet              Only log errors. Use this to run for hours as a regression gate. Exits with 1 on the first error.
+        -verbose            Log every message received.
+*/
+
 #include "shared.h"
 #include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
 
 const int MaxPacketSize = 16 * 1024;
 const int MaxSnapshotSize = 8 * 1024;
@@ -39,9 +66,411 @@ void interrupt_handler( int /*dummy*/ )
 static const int UNRELIABLE_UNORDERED_CHANNEL = 0;
 static const int RELIABLE_ORDERED_CHANNEL = 1;
 
-int SoakMain()
+/// Soak test settings, parsed from the command line.
+
+struct SoakOptions
+{
+    int numClients;
+    double seconds;
+    double deltaTime;
+    int reliableMessages;
+    float blockPercent;
+    int unreliableMessages;
+    float latency;
+    float jitter;
+    float packetLoss;
+    float duplicates;
+    float bandwidth;
+    uint64_t seed;
+    double reportInterval;
+    bool quiet;
+    bool verbose;
+
+    SoakOptions()
+    {
+        numClients = 1;
+        seconds = 0.0;
+        deltaTime = 0.01;
+        reliableMessages = 2;
+        blockPercent = 1.0f;
+        unreliableMessages = 4;
+        latency = 0.0f;
+        jitter = 0.0f;
+        packetLoss = 0.0f;
+        duplicates = 0.0f;
+        bandwidth = 0.0f;
+        seed = (uint64_t) time( NULL );
+        reportInterval = 10.0;
+        quiet = false;
+        verbose = false;
+    }
+};
+
+/// Messages sent one way between a client and the server.
+
+struct SoakStream
+{
+    static const int SendTimeBufferSize = 4096;                     ///< Must be at least the reliable channel message send queue size.
+
+    uint64_t numReliableSent;
+    uint64_t numReliableReceived;
+    uint64_t numUnreliableSent;
+    double sendTime[SendTimeBufferSize];                            ///< The time each reliable message in flight was sent, indexed by sequence.
+};
+
+/// Counters for one direction, summed across clients since the last report.
+
+struct SoakDirectionStats
+{
+    uint64_t messagesReceived;
+    uint64_t messageBytes;
+    uint64_t blocksReceived;
+    uint64_t blockBytes;
+    uint64_t unreliableSent;
+    uint64_t unreliableReceived;
+    TimingHistogram latency;                                        ///< Message delivery latency, from SendMessage to ReceiveMessage in virtual time. Includes queueing, resends and simulated latency.
+
+    void Reset()
+    {
+        messagesReceived = 0;
+        messageBytes = 0;
+        blocksReceived = 0;
+        blockBytes = 0;
+        unreliableSent = 0;
+        unreliableReceived = 0;
+        latency.Reset();
+    }
+};
+
+/// Channel counters that make up the resend ratio, summed across clients and both directions.
+
+struct SoakResendCounters
+{
+    uint64_t messagesSent;
+    uint64_t messagesResent;
+    uint64_t fragmentsSent;
+    uint64_t fragmentsResent;
+};
+
+/// Sends and receives messages on either side of a connection, so traffic is generated and checked the same way in both directions.
+
+class SoakEndpoint
+{
+public:
+
+    SoakEndpoint( Client & client ) : m_client( &client ), m_server( NULL ), m_clientIndex( -1 ), m_name( "client" ) {}
+
+    SoakEndpoint( Server & server, int clientIndex ) : m_client( NULL ), m_server( &server ), m_clientIndex( clientIndex ), m_name( "server" ) {}
+
+    const char * GetName() const { return m_name; }
+
+    bool CanSendMessage( int channelIndex ) const { return m_client ? m_client->CanSendMessage( channelIndex ) : m_server->CanSendMessage( m_clientIndex, channelIndex ); }
+
+    Message * CreateMessage( int type ) { return m_client ? m_client->CreateMessage( type ) : m_server->CreateMessage( m_clientIndex, type ); }
+
+    uint8_t * AllocateBlock( int bytes ) { return m_client ? m_client->AllocateBlock( bytes ) : m_server->AllocateBlock( m_clientIndex, bytes ); }
+
+    void AttachBlockToMessage( Message * message, uint8_t * block, int bytes )
+    {
+        if ( m_client )
+            m_client->AttachBlockToMessage( message, block, bytes );
+        else
+            m_server->AttachBlockToMessage( m_clientIndex, message, block, bytes );
+    }
+
+    void SendMessage( int channelIndex, Message * message )
+    {
+        if ( m_client )
+            m_client->SendMessage( channelIndex, message );
+        else
+            m_server->SendMessage( m_clientIndex, channelIndex, message );
+    }
+
+    Message * ReceiveMessage( int channelIndex ) { return m_client ? m_client->ReceiveMessage( channelIndex ) : m_server->ReceiveMessage( m_clientIndex, channelIndex ); }
+
+    void ReleaseMessage( Message * message )
+    {
+        if ( m_client )
+            m_client->ReleaseMessage( message );
+        else
+            m_server->ReleaseMessage( m_clientIndex, message );
+    }
+
+    uint64_t GetChannelCounter( int channelIndex, int index ) const { return m_client ? m_client->GetChannelCounter( channelIndex, index ) : m_server->GetChannelCounter( m_clientIndex, channelIndex, index ); }
+
+private:
+
+    Client * m_client;
+    Server * m_server;
+    int m_clientIndex;
+    const char * m_name;
+};
+
+static int GetBlockSize( uint64_t sequence )
+{
+    return 1 + ( int( sequence ) * 33 ) % MaxBlockSize;
+}
+
+static void SendSoakMessages( SoakEndpoint & endpoint, SoakStream & stream, SoakDirectionStats & stats, const SoakOptions & options, RandomGenerator & random, double time )
+{
+    const int messagesToSend = options.reliableMessages > 0 ? random.GenerateInt( 0, options.reliableMessages ) : 0;
+
+    for ( int i = 0; i < messagesToSend; ++i )
+    {
+        if ( !endpoint.CanSendMessage( RELIABLE_ORDERED_CHANNEL ) )
+            break;
+
+        const uint16_t sequence = (uint16_t) stream.numReliableSent;
+
+        if ( options.blockPercent <= 0.0f || random.GenerateFloat( 0.0f, 100.0f ) >= options.blockPercent )
+        {
+            TestMessage * message = (TestMessage*) endpoint.CreateMessage( TEST_MESSAGE );
+            if ( !message )
+                break;
+            message->sequence = sequence;
+            endpoint.SendMessage( RELIABLE_ORDERED_CHANNEL, message );
+        }
+        else
+        {
+            TestBlockMessage * blockMessage = (TestBlockMessage*) endpoint.CreateMessage( TEST_BLOCK_MESSAGE );
+            if ( !blockMessage )
+                break;
+            blockMessage->sequence = sequence;
+            const int blockSize = GetBlockSize( stream.numReliableSent );
+            uint8_t * blockData = endpoint.AllocateBlock( blockSize );
+            if ( !blockData )
+            {
+                endpoint.ReleaseMessage( blockMessage );
+                break;
+            }
+            for ( int j = 0; j < blockSize; ++j )
+                blockData[j] = uint8_t( stream.numReliableSent + j );
+            endpoint.AttachBlockToMessage( blockMessage, blockData, blockSize );
+            endpoint.SendMessage( RELIABLE_ORDERED_CHANNEL, blockMessage );
+        }
+
+        stream.sendTime[stream.numReliableSent % SoakStream::SendTimeBufferSize] = time;
+        stream.numReliableSent++;
+    }
+
+    for ( int i = 0; i < options.unreliableMessages; ++i )
+    {
+        if ( !endpoint.CanSendMessage( UNRELIABLE_UNORDERED_CHANNEL ) )
+            break;
+
+        TestMessage * message = (TestMessage*) endpoint.CreateMessage( TEST_MESSAGE );
+        if ( !message )
+            break;
+
+        message->sequence = (uint16_t) stream.numUnreliableSent;
+        endpoint.SendMessage( UNRELIABLE_UNORDERED_CHANNEL, message );
+        stream.numUnreliableSent++;
+        stats.unreliableSent++;
+    }
+}
+
+static bool ReceiveSoakMessages( SoakEndpoint & endpoint, SoakStream & stream, SoakDirectionStats & stats, const SoakOptions & options, double time )
+{
+    while ( Message * message = endpoint.ReceiveMessage( RELIABLE_ORDERED_CHANNEL ) )
+    {
+        const uint16_t expectedSequence = uint16_t( stream.numReliableReceived );
+
+        if ( message->GetId() != expectedSequence )
+        {
+            printf( "error: %s received message id %d, expected %d\n", endpoint.GetName(), message->GetId(), expectedSequence );
+            endpoint.ReleaseMessage( message );
+            return false;
+        }
+
+        switch ( message->GetType() )
+        {
+            case TEST_MESSAGE:
+            {
+                TestMessage * testMessage = (TestMessage*) message;
+                if ( testMessage->sequence != expectedSequence )
+                {
+                    printf( "error: %s received message sequence %d, expected %d\n", endpoint.GetName(), testMessage->sequence, expectedSequence );
+                    endpoint.ReleaseMessage( message );
+                    return false;
+                }
+                stats.messageBytes += 2 + GetNumBitsForMessage( testMessage->sequence ) / 8;
+            }
+            break;
+
+            case TEST_BLOCK_MESSAGE:
+            {
+                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+                if ( blockMessage->sequence != expectedSequence )
+                {
+                    printf( "error: %s received block message sequence %d, expected %d\n", endpoint.GetName(), blockMessage->sequence, expectedSequence );
+                    endpoint.ReleaseMessage( message );
+                    return false;
+                }
+                const int blockSize = blockMessage->GetBlockSize();
+                const int expectedBlockSize = GetBlockSize( stream.numReliableReceived );
+                if ( blockSize != expectedBlockSize )
+                {
+                    printf( "error: %s block size mismatch. expected %d, got %d\n", endpoint.GetName(), expectedBlockSize, blockSize );
+                    endpoint.ReleaseMessage( message );
+                    return false;
+                }
+                const uint8_t * blockData = blockMessage->GetBlockData();
+                yojimbo_assert( blockData );
+                for ( int i = 0; i < blockSize; ++i )
+                {
+                    if ( blockData[i] != uint8_t( stream.numReliableReceived + i ) )
+                    {
+                        printf( "error: %s block data mismatch. expected %d, but blockData[%d] = %d\n", endpoint.GetName(), uint8_t( stream.numReliableReceived + i ), i, blockData[i] );
+                        endpoint.ReleaseMessage( message );
+                        return false;
+                    }
+                }
+                stats.blocksReceived++;
+                stats.blockBytes += blockSize;
+            }
+            break;
+
+            default:
+            {
+                printf( "error: %s received unexpected message type %d\n", endpoint.GetName(), message->GetType() );
+                endpoint.ReleaseMessage( message );
+                return false;
+            }
+        }
+
+        if ( options.verbose )
+            printf( "%s received message %d\n", endpoint.GetName(), expectedSequence );
+
+        stats.messagesReceived++;
+        stats.latency.AddSample( time - stream.sendTime[stream.numReliableReceived % SoakStream::SendTimeBufferSize] );
+
+        stream.numReliableReceived++;
+
+        endpoint.ReleaseMessage( message );
+    }
+
+    while ( Message * message = endpoint.ReceiveMessage( UNRELIABLE_UNORDERED_CHANNEL ) )
+    {
+        if ( message->GetType() != TEST_MESSAGE )
+        {
+            printf( "error: %s received unexpected unreliable message type %d\n", endpoint.GetName(), message->GetType() );
+            endpoint.ReleaseMessage( message );
+            return false;
+        }
+        stats.unreliableReceived++;
+        endpoint.ReleaseMessage( message );
+    }
+
+    return true;
+}
+
+static void AddResendCounters( SoakEndpoint & endpoint, SoakResendCounters & counters )
 {
-    srand( (unsigned int) time( NULL ) );
+    counters.messagesSent += endpoint.GetChannelCounter( RELIABLE_ORDERED_CHANNEL, CHANNEL_COUNTER_MESSAGES_SENT );
+    counters.messagesResent += endpoint.GetChannelCounter( RELIABLE_ORDERED_CHANNEL, CHANNEL_COUNTER_MESSAGES_RESENT );
+    counters.fragmentsSent += endpoint.GetChannelCounter( RELIABLE_ORDERED_CHANNEL, CHANNEL_COUNTER_FRAGMENTS_SENT );
+    counters.fragmentsResent += endpoint.GetChannelCounter( RELIABLE_ORDERED_CHANNEL, CHANNEL_COUNTER_FRAGMENTS_RESENT );
+}
+
+static void PrintDirectionReport( const char * name, const SoakDirectionStats & stats, double interval )
+{
+    TimingStats latency;
+    stats.latency.GetStats( latency );
+
+    printf( "    %s: %8.0f msg/s %8.1f KB/s | blocks %6.1f/s %8.1f KB/s | unreliable %5.1f%% delivered | latency p50 %6.1fms p99 %6.1fms max %6.1fms\n",
+        name,
+        stats.messagesReceived / interval,
+        stats.messageBytes / 1024.0 / interval,
+        stats.blocksReceived / interval,
+        stats.blockBytes / 1024.0 / interval,
+        stats.unreliableSent ? 100.0 * stats.unreliableReceived / stats.unreliableSent : 100.0,
+        latency.p50 * 1000.0,
+        latency.p99 * 1000.0,
+        latency.max * 1000.0 );
+}
+
+static bool ParseOption( const char * arg, const char * name, const char ** value )
+{
+    const size_t length = strlen( name );
+    if ( arg[0] != '-' || strncmp( arg + 1, name, length ) != 0 )
+        return false;
+    if ( arg[length+1] == '\0' )
+    {
+        *value = NULL;
+        return true;
+    }
+    if ( arg[length+1] != '=' )
+        return false;
+    *value = arg + length + 2;
+    return true;
+}
+
+static bool ParseOptions( int argc, char * argv[], SoakOptions & options )
+{
+    for ( int i = 1; i < argc; ++i )
+    {
+        const char * value = NULL;
+        const char * arg = argv[i];
+
+        if ( ParseOption( arg, "quiet", &value ) )
+            options.quiet = true;
+        else if ( ParseOption( arg, "verbose", &value ) )
+            options.verbose = true;
+        else if ( ParseOption( arg, "clients", &value ) && value )
+            options.numClients = atoi( value );
+        else if ( ParseOption( arg, "seconds", &value ) && value )
+            options.seconds = atof( value );
+        else if ( ParseOption( arg, "tick", &value ) && value )
+            options.deltaTime = atof( value );
+        else if ( ParseOption( arg, "reliable", &value ) && value )
+            options.reliableMessages = atoi( value );
+        else if ( ParseOption( arg, "blocks", &value ) && value )
+            options.blockPercent = (float) atof( value );
+        else if ( ParseOption( arg, "unreliable", &value ) && value )
+            options.unreliableMessages = atoi( value );
+        else if ( ParseOption( arg, "latency", &value ) && value )
+            options.latency = (float) atof( value );
+        else if ( ParseOption( arg, "jitter", &value ) && value )
+            options.jitter = (float) atof( value );
+        else if ( ParseOption( arg, "loss", &value ) && value )
+            options.packetLoss = (float) atof( value );
+        else if ( ParseOption( arg, "duplicates", &value ) && value )
+            options.duplicates = (float) atof( value );
+        else if ( ParseOption( arg, "bandwidth", &value ) && value )
+            options.bandwidth = (float) atof( value );
+        else if ( ParseOption( arg, "seed", &value ) && value )
+            options.seed = (uint64_t) strtoull( value, NULL, 10 );
+        else if ( ParseOption( arg, "report", &value ) && value )
+            options.reportInterval = atof( value );
+        else
+        {
+            printf( "error: unknown option '%s'\n", arg );
+            return false;
+        }
+    }
+
+    if ( options.numClients < 1 || options.deltaTime <= 0.0 || options.reportInterval <= 0.0 || options.reliableMessages < 0 || options.unreliableMessages < 0 )
+    {
+        printf( "error: invalid options\n" );
+        return false;
+    }
+
+    return true;
+}
+
+int SoakMain( int argc, char * argv[] )
+{
+    SoakOptions options;
+
+    if ( !ParseOptions( argc, argv, options ) )
+        return 1;
+
+    if ( !options.quiet )
+    {
+        printf( "%d clients, reliable %d/tick (%.0f%% blocks), unreliable %d/tick, tick %.3fs\n", options.numClients, options.reliableMessages, options.blockPercent, options.unreliableMessages, options.deltaTime );
+        printf( "latency %.0fms, jitter %.0fms, loss %.1f%%, duplicates %.1f%%, bandwidth %.0fkbps\n", options.latency, options.jitter, options.packetLoss, options.duplicates, options.bandwidth );
+        printf( "seed %" PRIu64 "\n\n", options.seed );
+    }
 
     ClientServerConfig config;
     config.maxPacketSize = MaxPacketSize;
@@ -55,6 +484,8 @@ int SoakMain()
     config.channel[RELIABLE_ORDERED_CHANNEL].maxBlockSize = MaxBlockSize;
     config.channel[RELIABLE_ORDERED_CHANNEL].blockFragmentSize = 1024;
 
+    yojimbo_assert( config.channel[RELIABLE_ORDERED_CHANNEL].messageSendQueueSize <= SoakStream::SendTimeBufferSize );
+
     uint8_t privateKey[KeyBytes];
     memset( privateKey, 0, KeyBytes );
 
@@ -64,261 +495,220 @@ int SoakMain()
 
     Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
 
-    server.Start( 1 );
+    server.Start( options.numClients );
+
+    if ( !server.IsRunning() )
+    {
+        printf( "error: server failed to start\n" );
+        return 1;
+    }
+
+    server.SetNetworkSimulatorSeed( options.seed );
+    server.SetLatency( options.latency );
+    server.SetJitter( options.jitter );
+    server.SetPacketLoss( options.packetLoss );
+    server.SetDuplicates( options.duplicates );
+    server.SetBandwidth( options.bandwidth );
 
-    uint64_t clientId = 0;
-    random_bytes( (uint8_t*) &clientId, 8 );
+    const int numClients = options.numClients;
 
-    Client client( GetDefaultAllocator(), Address("0.0.0.0"), config, adapter, time );
+    Client ** clients = (Client**) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( Client* ) * numClients );
+    SoakStream * toServer = (SoakStream*) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( SoakStream ) * numClients );
+    SoakStream * toClient = (SoakStream*) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( SoakStream ) * numClients );
+    bool * connected = (bool*) YOJIMBO_ALLOCATE( GetDefaultAllocator(), sizeof( bool ) * numClients );
 
-    client.InsecureConnect( privateKey, clientId, serverAddress );
+    memset( toServer, 0, sizeof( SoakStream ) * numClients );
+    memset( toClient, 0, sizeof( SoakStream ) * numClients );
+    memset( connected, 0, sizeof( bool ) * numClients );
 
-    uint64_t numMessagesSentToServer = 0;
-    uint64_t numMessagesSentToClient = 0;
-    uint64_t numMessagesReceivedFromClient = 0;
-    uint64_t numMessagesReceivedFromServer = 0;
+    // client ids come from the seed too, so a run repeats exactly when rerun with the same seed
+
+    RandomGenerator clientIdRandom( options.seed, numClients + 1 );
+
+    for ( int i = 0; i < numClients; ++i )
+    {
+        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), Address("0.0.0.0"), config, adapter, time );
+
+        const uint64_t clientId = ( uint64_t( clientIdRandom.GenerateUint32() ) << 32 ) | clientIdRandom.GenerateUint32();
+
+        clients[i]->InsecureConnect( privateKey, clientId, serverAddress );
+
+        clients[i]->SetNetworkSimulatorSeed( options.seed, 1 + i );
+        clients[i]->SetLatency( options.latency );
+        clients[i]->SetJitter( options.jitter );
+        clients[i]->SetPacketLoss( options.packetLoss );
+        clients[i]->SetDuplicates( options.duplicates );
+        clients[i]->SetBandwidth( options.bandwidth );
+    }
+
+    RandomGenerator random( options.seed );
+
+    SoakDirectionStats clientToServer;
+    SoakDirectionStats serverToClient;
+    clientToServer.Reset();
+    serverToClient.Reset();
+
+    SoakResendCounters previousResendCounters;
+    memset( &previousResendCounters, 0, sizeof( previousResendCounters ) );
+
+    double reportTime = options.reportInterval;
+    double lastReportTime = 0.0;
 
     signal( SIGINT, interrupt_handler );
 
-    bool clientConnected = false;
-    bool serverConnected = false;
+    int result = 0;
 
-    while ( !quit )
+    while ( !quit && result == 0 )
     {
-        client.SendPackets();
+        for ( int i = 0; i < numClients; ++i )
+            clients[i]->SendPackets();
+
         server.SendPackets();
 
-        client.ReceivePackets();
-        server.ReceivePackets();
+        for ( int i = 0; i < numClients; ++i )
+            clients[i]->ReceivePackets();
 
-        if ( client.ConnectionFailed() )
-        {
-            printf( "error: client connect failed!\n" );
-            break;
-        }
+        server.ReceivePackets();
 
-        time += 0.1f;
+        time += options.deltaTime;
 
-        if ( client.IsConnected() )
+        for ( int i = 0; i < numClients && result == 0; ++i )
         {
-            clientConnected = true;
-
-			{
-				const int messagesToSend = random_int( 0, 64 );
-
-				for ( int i = 0; i < messagesToSend; ++i )
-				{
-					if ( !client.CanSendMessage( RELIABLE_ORDERED_CHANNEL ) )
-						break;
-
-					if ( rand() % 25 )
-					{
-						TestMessage * message = (TestMessage*) client.CreateMessage( TEST_MESSAGE );
-						if ( message )
-						{
-							message->sequence = (uint16_t) numMessagesSentToServer;
-							client.SendMessage( RELIABLE_ORDERED_CHANNEL, message );
-							numMessagesSentToServer++;
-						}
-					}
-					else
-					{
-						TestBlockMessage * blockMessage = (TestBlockMessage*) client.CreateMessage( TEST_BLOCK_MESSAGE );
-						if ( blockMessage )
-						{
-							blockMessage->sequence = (uint16_t) numMessagesSentToServer;
-							const int blockSize = 1 + ( int( numMessagesSentToServer ) * 33 ) % MaxBlockSize;
-							uint8_t * blockData = client.AllocateBlock( blockSize );
-							if ( blockData )
-							{
-								for ( int j = 0; j < blockSize; ++j )
-									blockData[j] = uint8_t( numMessagesSentToServer + j );
-								client.AttachBlockToMessage( blockMessage, blockData, blockSize );
-								client.SendMessage( RELIABLE_ORDERED_CHANNEL, blockMessage );
-								numMessagesSentToServer++;
-							}
-							else
-							{
-								client.ReleaseMessage( blockMessage );
-							}
-						}
-					}
-				}
-			}
+            Client & client = *clients[i];
 
-            const int clientIndex = client.GetClientIndex();
+            if ( client.ConnectionFailed() )
+            {
+                printf( "error: client %d connect failed!\n", i );
+                result = 1;
+                break;
+            }
 
-            if ( server.IsClientConnected( clientIndex ) )
+            if ( !client.IsConnected() )
             {
-                serverConnected = true;
+                if ( connected[i] )
+                {
+                    printf( "error: client %d disconnected!\n", i );
+                    result = 1;
+                }
+                continue;
+            }
 
-                const int messagesToSend = random_int( 0, 64 );
+            const int clientIndex = client.GetClientIndex();
 
-                for ( int i = 0; i < messagesToSend; ++i )
+            if ( !server.IsClientConnected( clientIndex ) )
+            {
+                if ( connected[i] )
                 {
-                    if ( !server.CanSendMessage( clientIndex, RELIABLE_ORDERED_CHANNEL ) )
-                        break;
-
-                    if ( rand() % 25 )
-                    {
-                        TestMessage * message = (TestMessage*) server.CreateMessage( clientIndex, TEST_MESSAGE );
-                        if ( message )
-                        {
-                            message->sequence = (uint16_t) numMessagesSentToClient;
-                            server.SendMessage( clientIndex, RELIABLE_ORDERED_CHANNEL, message );
-                            numMessagesSentToClient++;
-                        }
-                    }
-                    else
-                    {
-                        TestBlockMessage * blockMessage = (TestBlockMessage*) server.CreateMessage( clientIndex, TEST_BLOCK_MESSAGE );
-                        if ( blockMessage )
-                        {
-                            blockMessage->sequence = (uint16_t) numMessagesSentToClient;
-                            const int blockSize = 1 + ( int( numMessagesSentToClient ) * 33 ) % MaxBlockSize;
-                            uint8_t * blockData = server.AllocateBlock( clientIndex, blockSize );
-                            if ( blockData )
-                            {
-                                for ( int j = 0; j < blockSize; ++j )
-                                    blockData[j] = uint8_t( numMessagesSentToClient + j );
-                                server.AttachBlockToMessage( clientIndex, blockMessage, blockData, blockSize );
-                                server.SendMessage( clientIndex, RELIABLE_ORDERED_CHANNEL, blockMessage );
-                                numMessagesSentToClient++;
-                            }
-                            else
-                            {
-                                server.ReleaseMessage( clientIndex, blockMessage );
-                            }
-                        }
-                    }
+                    printf( "error: server disconnected client %d!\n", i );
+                    result = 1;
                 }
+                continue;
+            }
 
-                while ( true )
-                {
-                    Message * message = server.ReceiveMessage( clientIndex, RELIABLE_ORDERED_CHANNEL );
-                    if ( !message )
-                        break;
+            connected[i] = true;
 
-                    yojimbo_assert( message->GetId() == (uint16_t) numMessagesReceivedFromClient );
+            SoakEndpoint clientEndpoint( client );
+            SoakEndpoint serverEndpoint( server, clientIndex );
 
-                    switch ( message->GetType() )
-                    {
-                        case TEST_MESSAGE:
-                        {
-                            TestMessage * testMessage = (TestMessage*) message;
-                            yojimbo_assert( testMessage->sequence == uint16_t( numMessagesReceivedFromClient ) );
-                            printf( "server received message %d\n", testMessage->sequence );
-                            server.ReleaseMessage( clientIndex, message );
-                            numMessagesReceivedFromClient++;
-                        }
-                        break;
-
-                        case TEST_BLOCK_MESSAGE:
-                        {
-                            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
-                            yojimbo_assert( blockMessage->sequence == uint16_t( numMessagesReceivedFromClient ) );
-                            const int blockSize = blockMessage->GetBlockSize();
-                            const int expectedBlockSize = 1 + ( int( numMessagesReceivedFromClient ) * 33 ) % MaxBlockSize;
-                            if ( blockSize  != expectedBlockSize )
-                            {
-                                printf( "error: block size mismatch. expected %d, got %d\n", expectedBlockSize, blockSize );
-                                return 1;
-                            }
-                            const uint8_t * blockData = blockMessage->GetBlockData();
-                            yojimbo_assert( blockData );
-                            for ( int i = 0; i < blockSize; ++i )
-                            {
-                                if ( blockData[i] != uint8_t( numMessagesReceivedFromClient + i ) )
-                                {
-                                    printf( "error: block data mismatch. expected %d, but blockData[%d] = %d\n", uint8_t( numMessagesReceivedFromClient + i ), i, blockData[i] );
-                                    return 1;
-                                }
-                            }
-                            printf( "server received message %d\n", uint16_t( numMessagesReceivedFromClient ) );
-                            server.ReleaseMessage( clientIndex, message );
-                            numMessagesReceivedFromClient++;
-                        }
-                        break;
-                    }
-                }
+            SendSoakMessages( clientEndpoint, toServer[i], clientToServer, options, random, time );
+            SendSoakMessages( serverEndpoint, toClient[i], serverToClient, options, random, time );
+
+            if ( !ReceiveSoakMessages( serverEndpoint, toServer[i], clientToServer, options, time ) ||
+                 !ReceiveSoakMessages( clientEndpoint, toClient[i], serverToClient, options, time ) )
+            {
+                printf( "error: client %d failed at time %.3f. rerun with -seed=%" PRIu64 " to repeat\n", i, time, options.seed );
+                result = 1;
             }
+        }
 
-            while ( true )
+        if ( time >= reportTime )
+        {
+            SoakResendCounters resendCounters;
+            memset( &resendCounters, 0, sizeof( resendCounters ) );
+
+            int numConnected = 0;
+
+            for ( int i = 0; i < numClients; ++i )
             {
-                Message * message = client.ReceiveMessage( RELIABLE_ORDERED_CHANNEL );
+                if ( !clients[i]->IsConnected() || !server.IsClientConnected( clients[i]->GetClientIndex() ) )
+                    continue;
+                numConnected++;
+                SoakEndpoint clientEndpoint( *clients[i] );
+                SoakEndpoint serverEndpoint( server, clients[i]->GetClientIndex() );
+                AddResendCounters( clientEndpoint, resendCounters );
+                AddResendCounters( serverEndpoint, resendCounters );
+            }
 
-                if ( !message )
-                    break;
+            const uint64_t messagesSent = resendCounters.messagesSent - previousResendCounters.messagesSent;
+            const uint64_t messagesResent = resendCounters.messagesResent - previousResendCounters.messagesResent;
+            const uint64_t fragmentsSent = resendCounters.fragmentsSent - previousResendCounters.fragmentsSent;
+            const uint64_t fragmentsResent = resendCounters.fragmentsResent - previousResendCounters.fragmentsResent;
 
-                yojimbo_assert( message->GetId() == (uint16_t) numMessagesReceivedFromServer );
+            previousResendCounters = resendCounters;
 
-                switch ( message->GetType() )
-                {
-                    case TEST_MESSAGE:
-                    {
-                        TestMessage * testMessage = (TestMessage*) message;
-                        yojimbo_assert( testMessage->sequence == uint16_t( numMessagesReceivedFromServer ) );
-                        printf( "client received message %d\n", testMessage->sequence );
-                        client.ReleaseMessage( message );
-                        numMessagesReceivedFromServer++;
-                    }
-                    break;
+            if ( !options.quiet )
+            {
+                const double interval = time - lastReportTime;
 
-                    case TEST_BLOCK_MESSAGE:
-                    {
-                        TestBlockMessage * blockMessage = (TestBlockMessage*) message;
-                        yojimbo_assert( blockMessage->sequence == uint16_t( numMessagesReceivedFromServer ) );
-                        const int blockSize = blockMessage->GetBlockSize();
-                        const int expectedBlockSize = 1 + ( int( numMessagesReceivedFromServer ) * 33 ) % MaxBlockSize;
-                        if ( blockSize  != expectedBlockSize )
-                        {
-                            printf( "error: block size mismatch. expected %d, got %d\n", expectedBlockSize, blockSize );
-                            return 1;
-                        }
-                        const uint8_t * blockData = blockMessage->GetBlockData();
-                        yojimbo_assert( blockData );
-                        for ( int i = 0; i < blockSize; ++i )
-                        {
-                            if ( blockData[i] != uint8_t( numMessagesReceivedFromServer + i ) )
-                            {
-                                printf( "error: block data mismatch. expected %d, but blockData[%d] = %d\n", uint8_t( numMessagesReceivedFromServer + i ), i, blockData[i] );
-                                return 1;
-                            }
-                        }
-                        printf( "client received message %d\n", uint16_t( numMessagesReceivedFromServer ) );
-                        client.ReleaseMessage( message );
-                        numMessagesReceivedFromServer++;
-                    }
-                    break;
-                }
+                printf( "%.1fs: %d/%d clients connected | resent %.1f%% of messages, %.1f%% of block fragments\n",
+                    time,
+                    numConnected,
+                    numClients,
+                    messagesSent ? 100.0 * messagesResent / messagesSent : 0.0,
+                    fragmentsSent ? 100.0 * fragmentsResent / fragmentsSent : 0.0 );
+
+                PrintDirectionReport( "client -> server", clientToServer, interval );
+                PrintDirectionReport( "server -> client", serverToClient, interval );
             }
 
-            if ( clientConnected && !client.IsConnected() )
-                break;
+            clientToServer.Reset();
+            serverToClient.Reset();
 
-            if ( serverConnected && server.GetNumConnectedClients() == 0 )
-                break;
+            lastReportTime = time;
+            reportTime += options.reportInterval;
         }
 
-        client.AdvanceTime( time );
+        if ( options.seconds > 0.0 && time >= options.seconds )
+            break;
+
+        for ( int i = 0; i < numClients; ++i )
+            clients[i]->AdvanceTime( time );
+
         server.AdvanceTime( time );
     }
 
-    if ( quit )
+    if ( quit && !options.quiet )
     {
         printf( "\nstopped\n" );
     }
 
-    client.Disconnect();
-    
+    for ( int i = 0; i < numClients; ++i )
+    {
+        clients[i]->Disconnect();
+        YOJIMBO_DELETE( GetDefaultAllocator(), Client, clients[i] );
+    }
+
     server.Stop();
 
-    return 0;
+    YOJIMBO_FREE( GetDefaultAllocator(), connected );
+    YOJIMBO_FREE( GetDefaultAllocator(), toClient );
+    YOJIMBO_FREE( GetDefaultAllocator(), toServer );
+    YOJIMBO_FREE( GetDefaultAllocator(), clients );
+
+    return result;
 }
 
-int main()
+int main( int argc, char * argv[] )
 {
-    printf( "\nsoak\n" );
+    bool quiet = false;
+    for ( int i = 1; i < argc; ++i )
+    {
+        if ( strcmp( argv[i], "-quiet" ) == 0 )
+            quiet = true;
+    }
+
+    if ( !quiet )
+        printf( "\nsoak\n\n" );
 
     if ( !InitializeYojimbo() )
     {
@@ -326,15 +716,14 @@ int main()
         return 1;
     }
 
-    yojimbo_log_level( YOJIMBO_LOG_LEVEL_INFO );
-
-    srand( (unsigned int) time( NULL ) );
+    yojimbo_log_level( quiet ? YOJIMBO_LOG_LEVEL_ERROR : YOJIMBO_LOG_LEVEL_INFO );
 
-    int result = SoakMain();
+    int result = SoakMain( argc, argv );
 
     ShutdownYojimbo();
 
-    printf( "\n" );
+    if ( !quiet )
+        printf( "\n" );
 
     return result;
 }
@@ -787,1070 +787,3537 @@ void test_sequence_buffer()
         check( sequence_buffer.Find(i) == NULL );
 }
 
-void test_allocator_tlsf()
+void test_timing_histogram()
 {
-    const int NumBlocks = 256;
-    const int BlockSize = 1024;
-    const int MemorySize = NumBlocks * BlockSize;
+    TimingHistogram histogram;
+    histogram.Reset();
 
-    uint8_t * memory = (uint8_t*) malloc( MemorySize );
+    TimingStats stats;
+    histogram.GetStats( stats );
+    check( stats.numSamples == 0 );
+    check( stats.max == 0.0 );
 
-    TLSF_Allocator allocator( memory, MemorySize );
+    for ( int i = 0; i < 980; ++i )
+        histogram.AddSample( 0.00001 );
 
-    uint8_t * blockData[NumBlocks];
-    memset( blockData, 0, sizeof( blockData ) );
+    for ( int i = 0; i < 20; ++i )
+        histogram.AddSample( 0.001 );
 
-    int stopIndex = 0;
+    histogram.GetStats( stats );
+    check( stats.numSamples == 1000 );
+    check( stats.p50 >= 0.00001 );
+    check( stats.p50 < 0.000012 );
+    check( stats.p99 == 0.001 );
+    check( stats.max == 0.001 );
 
-    for ( int i = 0; i < NumBlocks; ++i )
-    {
-        blockData[i] = (uint8_t*) YOJIMBO_ALLOCATE( allocator, BlockSize );
-        
-        if ( !blockData[i] )
-        {
-            check( allocator.GetErrorLevel() == ALLOCATOR_ERROR_OUT_OF_MEMORY );
-            allocator.ClearError();
-            check( allocator.GetErrorLevel() == ALLOCATOR_ERROR_NONE );
-            stopIndex = i;
-            break;
-        }
-        
-        check( blockData[i] );
-        check( allocator.GetErrorLevel() == ALLOCATOR_ERROR_NONE );
-        
-        memset( blockData[i], i + 10, BlockSize );
-    }
+    // the slow samples roll out of the histogram after two windows
 
-    check( stopIndex > NumBlocks / 2 );
+    for ( int i = 0; i < TimingHistogram::WindowSize * 2; ++i )
+        histogram.AddSample( 0.00001 );
 
-    for ( int i = 0; i < NumBlocks - 1; ++i )
-    {
-        if ( blockData[i] )
-        {
-            for ( int j = 0; j < BlockSize; ++j )
-                check( blockData[i][j] == uint8_t( i + 10 ) );
-        }
+    histogram.GetStats( stats );
+    check( stats.p99 < 0.000012 );
+    check( stats.max == 0.00001 );
 
-        YOJIMBO_FREE( allocator, blockData[i] );
-    }
+    TimingHistogram other;
+    other.Reset();
+    other.AddSample( 0.01 );
 
-    free( memory );
-}
+    histogram.Merge( other );
 
-void PumpConnectionUpdate( ConnectionConfig & connectionConfig, double & time, Connection & sender, Connection & receiver, uint16_t & senderSequence, uint16_t & receiverSequence, float deltaTime = 0.1f, int packetLossPercent = 90 )
-{
-    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+    histogram.GetStats( stats );
+    check( stats.numSamples == 1000 + TimingHistogram::WindowSize * 2 + 1 );
+    check( stats.max == 0.01 );
 
-    int packetBytes;
-    if ( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) )
-    {
-        if ( random_int( 0, 100 ) >= packetLossPercent )
-        {
-            receiver.ProcessPacket( NULL, senderSequence, packetData, packetBytes );
-            sender.ProcessAcks( &senderSequence, 1 );
-        }
-    }
+    // samples over a typical tick budget still get their own buckets, instead of all reporting the max
 
-    if ( receiver.GeneratePacket( NULL, receiverSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) )
-    {
-        if ( random_int( 0, 100 ) >= packetLossPercent )
-        {
-            sender.ProcessPacket( NULL, receiverSequence, packetData, packetBytes );
-            receiver.ProcessAcks( &receiverSequence, 1 );
-        }
-    }
+    TimingHistogram slow;
+    slow.Reset();
 
-    time += deltaTime;
+    for ( int i = 0; i < 99; ++i )
+        slow.AddSample( 0.1 );
 
-    sender.AdvanceTime( time );
-    receiver.AdvanceTime( time );
+    slow.AddSample( 0.5 );
 
-    senderSequence++;
-    receiverSequence++;
+    slow.GetStats( stats );
+    check( stats.p50 >= 0.1 );
+    check( stats.p50 < 0.12 );
+    check( stats.max == 0.5 );
+
+    // histograms reset with a larger minimum cover a longer range, eg. message latencies of seconds
+
+    TimingHistogram latency;
+    latency.Reset( 0.001 );
+
+    for ( int i = 0; i < 99; ++i )
+        latency.AddSample( 5.0 );
+
+    latency.AddSample( 60.0 );
+
+    latency.GetStats( stats );
+    check( stats.p50 >= 5.0 );
+    check( stats.p50 < 6.0 );
+    check( stats.max == 60.0 );
 }
 
-void test_connection_reliable_ordered_messages()
+void test_network_simulator()
 {
-    TestMessageFactory messageFactory( GetDefaultAllocator() );
-
     double time = 100.0;
 
-    ConnectionConfig connectionConfig;
- 
-    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
-    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    const int NumPackets = 8;
 
-    const int NumMessagesSent = 64;
+    NetworkSimulator networkSimulator( GetDefaultAllocator(), NumPackets, time );
 
-    for ( int i = 0; i < NumMessagesSent; ++i )
+    check( !networkSimulator.IsActive() );
+    check( networkSimulator.GetNextDeliveryTime() == time + MaxWakeupInterval );
+
+    // packets are delivered in order of delivery time, not send order
+
+    uint8_t packet[NumPackets];
+    for ( int i = 0; i < NumPackets; ++i )
+        packet[i] = uint8_t( i );
+
+    for ( int i = 0; i < NumPackets; ++i )
     {
-        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
-        check( message );
-        message->sequence = i;
-        sender.SendMessage( 0, message );
+        networkSimulator.SetLatency( float( 100 + ( ( i * 5 ) % NumPackets ) * 10 ) );
+        networkSimulator.SendPacket( i % 2, &packet[i], 1 );
     }
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
+    check( networkSimulator.IsActive() );
+    check( networkSimulator.GetNextDeliveryTime() == time + 0.1 );
 
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+    // the simulator is full, so new packets are dropped rather than evicting packets in flight
 
-    int numMessagesReceived = 0;
+    networkSimulator.SendPacket( 0, &packet[0], 1 );
 
-    const int NumIterations = 1000;
+    check( networkSimulator.GetNumOverflowPackets() == 1 );
 
-    uint16_t senderSequence = 0;
-    uint16_t receiverSequence = 0;
+    // packets too large for the simulator packet buffers are dropped and counted
 
-    for ( int i = 0; i < NumIterations; ++i )
-    {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+    uint8_t largePacket[16 * 1024];
+    memset( largePacket, 0, sizeof( largePacket ) );
+    networkSimulator.SendPacket( 0, largePacket, sizeof( largePacket ) );
 
-        while ( true )
-        {
-            Message * message = receiver.ReceiveMessage( 0 );
-            if ( !message )
-                break;
+    check( networkSimulator.GetNumOversizedPackets() == 1 );
+    check( networkSimulator.GetNumOverflowPackets() == 1 );
 
-            check( message->GetId() == (int) numMessagesReceived );
-            check( message->GetType() == TEST_MESSAGE );
+    uint8_t * packetData[NumPackets];
+    int packetBytes[NumPackets];
+    int to[NumPackets];
 
-            TestMessage * testMessage = (TestMessage*) message;
+    check( networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, to ) == 0 );
 
-            check( testMessage->sequence == numMessagesReceived );
+    networkSimulator.DiscardClientPackets( 1 );
 
-            ++numMessagesReceived;
+    time += 1.0;
 
-            messageFactory.ReleaseMessage( message );
-        }
+    networkSimulator.AdvanceTime( time );
 
-        if ( numMessagesReceived == NumMessagesSent )
-            break;
+    const int numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, to );
+
+    check( numPackets == NumPackets / 2 );
+
+    int previousDelay = -1;
+
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        check( packetBytes[i] == 1 );
+        check( to[i] == 0 );
+        const int packetIndex = packetData[i][0];
+        const int delay = ( packetIndex * 5 ) % NumPackets;
+        check( delay > previousDelay );
+        previousDelay = delay;
     }
 
-    check( numMessagesReceived == NumMessagesSent );
+    networkSimulator.ReleasePackets( packetData, numPackets );
+
+    check( networkSimulator.GetNextDeliveryTime() == time + MaxWakeupInterval );
 }
 
-void test_connection_reliable_ordered_blocks()
+void test_network_simulator_bandwidth()
 {
-    TestMessageFactory messageFactory( GetDefaultAllocator() );
-
     double time = 100.0;
 
-    ConnectionConfig connectionConfig;
-    
-    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
-    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    const int NumPackets = 16;
+    const int PacketBytes = 1000;
 
-    const int NumMessagesSent = 32;
+    NetworkSimulator networkSimulator( GetDefaultAllocator(), NumPackets, time );
 
-    for ( int i = 0; i < NumMessagesSent; ++i )
+    // 80 kbps is 10000 bytes per-second, so each packet takes 0.1 seconds to send
+
+    networkSimulator.SetBandwidth( 80.0f );
+    networkSimulator.SetQueueLimit( 4 * PacketBytes );
+
+    check( networkSimulator.IsActive() );
+
+    uint8_t packet[PacketBytes];
+    memset( packet, 0, sizeof( packet ) );
+
+    // packets past the queue limit are tail dropped
+
+    for ( int i = 0; i < 10; ++i )
     {
-        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
-        check( message );
-        message->sequence = i;
-        const int blockSize = 1 + ( ( i * 901 ) % 3333 );
-        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
-        for ( int j = 0; j < blockSize; ++j )
-            blockData[j] = i + j;
-        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
-        sender.SendMessage( 0, message );
+        networkSimulator.SendPacket( 0, packet, PacketBytes );
     }
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
+    check( networkSimulator.GetNumQueueDrops() == 6 );
+    check( networkSimulator.GetQueuedBytes() == 4 * PacketBytes );
+    check( fabs( networkSimulator.GetNextDeliveryTime() - ( time + 0.1 ) ) < 0.000001 );
 
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+    // queued packets are delivered one serialization time apart
 
-    int numMessagesReceived = 0;
+    uint8_t * packetData[NumPackets];
+    int packetBytes[NumPackets];
 
-    uint16_t senderSequence = 0;
-    uint16_t receiverSequence = 0;
+    time += 0.25;
 
-    const int NumIterations = 10000;
+    networkSimulator.AdvanceTime( time );
 
-    for ( int i = 0; i < NumIterations; ++i )
-    {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+    int numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, NULL );
 
-        while ( true )
-        {
-            Message * message = receiver.ReceiveMessage( 0 );
-            if ( !message )
-                break;
+    check( numPackets == 2 );
 
-            check( message->GetId() == (int) numMessagesReceived );
+    networkSimulator.ReleasePackets( packetData, numPackets );
 
-            check( message->GetType() == TEST_BLOCK_MESSAGE );
+    check( networkSimulator.GetQueuedBytes() == 1500 );
 
-            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+    // a new packet waits behind the queue
 
-            check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+    networkSimulator.SendPacket( 0, packet, PacketBytes );
 
-            const int blockSize = blockMessage->GetBlockSize();
+    check( networkSimulator.GetNumQueueDrops() == 6 );
 
-            check( blockSize == 1 + ( ( numMessagesReceived * 901 ) % 3333 ) );
+    time += 0.2;
 
-            const uint8_t * blockData = blockMessage->GetBlockData();
+    networkSimulator.AdvanceTime( time );
 
-            check( blockData );
+    numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, NULL );
 
-            for ( int j = 0; j < blockSize; ++j )
-            {
-                check( blockData[j] == uint8_t( numMessagesReceived + j ) );
-            }
+    check( numPackets == 2 );
 
-            ++numMessagesReceived;
+    networkSimulator.ReleasePackets( packetData, numPackets );
 
-            messageFactory.ReleaseMessage( message );
+    time += 0.1;
+
+    networkSimulator.AdvanceTime( time );
+
+    numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, NULL );
+
+    check( numPackets == 1 );
+    check( networkSimulator.GetQueuedBytes() == 0 );
+
+    networkSimulator.ReleasePackets( packetData, numPackets );
+
+    // with random early drop, packets are dropped before the queue is full
+
+    networkSimulator.SetQueueLimit( 8 * PacketBytes, 2 * PacketBytes );
+
+    for ( int i = 0; i < 100; ++i )
+    {
+        networkSimulator.SetBandwidth( 80.0f );
+
+        for ( int j = 0; j < 8; ++j )
+        {
+            networkSimulator.SendPacket( 0, packet, PacketBytes );
         }
 
-        if ( numMessagesReceived == NumMessagesSent )
-            break;
+        networkSimulator.DiscardPackets();
     }
 
-    check( numMessagesReceived == NumMessagesSent );
+    check( networkSimulator.GetNumQueueDrops() > 6 );
 }
 
-void test_connection_reliable_ordered_messages_and_blocks()
+void test_network_simulator_loss_models()
 {
-    TestMessageFactory messageFactory( GetDefaultAllocator() );
-
     double time = 100.0;
-    
-    ConnectionConfig connectionConfig;
-    
-    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
 
-    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    const int NumPackets = 64;
 
-    const int NumMessagesSent = 32;
+    NetworkSimulator networkSimulator( GetDefaultAllocator(), NumPackets, time );
 
-    for ( int i = 0; i < NumMessagesSent; ++i )
+    uint8_t * packetData[NumPackets];
+    int packetBytes[NumPackets];
+
+    // burst loss drops the same share of packets as independent loss would, but in longer runs
+
+    networkSimulator.SetBurstLoss( 5.0f, 20.0f );
+
+    check( networkSimulator.IsActive() );
+
+    const int NumBurstPackets = 10000;
+
+    int numLost = 0;
+    int numLossRuns = 0;
+    bool previousLost = false;
+
+    for ( int i = 0; i < NumBurstPackets; ++i )
     {
-        if ( rand() % 2 )
-        {
-            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
-            check( message );
-            message->sequence = i;
-            sender.SendMessage( 0, message );
-        }
-        else
+        uint8_t packet = 0;
+        networkSimulator.SendPacket( 0, &packet, 1 );
+        time += 0.01;
+        networkSimulator.AdvanceTime( time );
+        const int numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, NULL );
+        check( numPackets <= 1 );
+        networkSimulator.ReleasePackets( packetData, numPackets );
+        const bool lost = numPackets == 0;
+        if ( lost )
         {
-            TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
-            check( message );
-            message->sequence = i;
-            const int blockSize = 1 + ( ( i * 901 ) % 3333 );
-            uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
-            for ( int j = 0; j < blockSize; ++j )
-                blockData[j] = i + j;
-            message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
-            sender.SendMessage( 0, message );
+            numLost++;
+            if ( !previousLost )
+                numLossRuns++;
         }
+        previousLost = lost;
     }
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
+    check( numLost > NumBurstPackets / 10 );
+    check( numLost < NumBurstPackets * 3 / 10 );
+    check( numLost > numLossRuns * 3 );
 
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+    networkSimulator.SetBurstLoss( 0.0f, 0.0f );
 
-    int numMessagesReceived = 0;
+    // packets sent during an outage are dropped
 
-    uint16_t senderSequence = 0;
-    uint16_t receiverSequence = 0;
+    networkSimulator.SetOutage( 1.0f, 0.3f );
 
-    const int NumIterations = 10000;
+    time += 0.05;
+    networkSimulator.AdvanceTime( time );
 
-    for ( int i = 0; i < NumIterations; ++i )
-    {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+    int numReceived = 0;
 
-        while ( true )
-        {
-            Message * message = receiver.ReceiveMessage( 0 );
-            if ( !message )
-                break;
+    for ( int i = 0; i < 20; ++i )
+    {
+        uint8_t packet = 0;
+        networkSimulator.SendPacket( 0, &packet, 1 );
+        time += 0.1;
+        networkSimulator.AdvanceTime( time );
+        const int numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, NULL );
+        networkSimulator.ReleasePackets( packetData, numPackets );
+        numReceived += numPackets;
+    }
 
-            check( message->GetId() == (int) numMessagesReceived );
+    check( numReceived == 14 );
 
-            switch ( message->GetType() )
-            {
-                case TEST_MESSAGE:
-                {
-                    TestMessage * testMessage = (TestMessage*) message;
+    networkSimulator.SetOutage( 0.0f, 0.0f );
 
-                    check( testMessage->sequence == uint16_t( numMessagesReceived ) );
+    // reordered packets are overtaken by packets sent after them
 
-                    ++numMessagesReceived;
-                }
-                break;
+    networkSimulator.SetLatency( 10.0f );
+    networkSimulator.SetReordering( 25.0f, 100.0f );
 
-                case TEST_BLOCK_MESSAGE:
-                {
-                    TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+    int numOutOfOrder = 0;
+    int previousIndex = -1;
 
-                    check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+    for ( int i = 0; i < 200; ++i )
+    {
+        uint8_t packet = uint8_t( i );
+        networkSimulator.SendPacket( 0, &packet, 1 );
+        time += 0.01;
+        networkSimulator.AdvanceTime( time );
+        const int numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, NULL );
+        for ( int j = 0; j < numPackets; ++j )
+        {
+            if ( packetData[j][0] < previousIndex )
+                numOutOfOrder++;
+            previousIndex = packetData[j][0];
+        }
+        networkSimulator.ReleasePackets( packetData, numPackets );
+    }
 
-                    const int blockSize = blockMessage->GetBlockSize();
+    check( numOutOfOrder > 0 );
 
-                    check( blockSize == 1 + ( ( numMessagesReceived * 901 ) % 3333 ) );
-        
-                    const uint8_t * blockData = blockMessage->GetBlockData();
+    networkSimulator.DiscardPackets();
+}
 
-                    check( blockData );
+void test_network_simulator_trace()
+{
+    double time = 100.0;
 
-                    for ( int j = 0; j < blockSize; ++j )
-                    {
-                        check( blockData[j] == uint8_t( numMessagesReceived + j ) );
-                    }
+    const int NumPackets = 16;
 
-                    ++numMessagesReceived;
-                }
-                break;
-            }
+    NetworkSimulator networkSimulator( GetDefaultAllocator(), NumPackets, time );
 
-            messageFactory.ReleaseMessage( message );
-        }
+    const char * TraceFilename = "test_network_trace.bin";
 
-        if ( numMessagesReceived == NumMessagesSent )
-            break;
-    }
+    check( !networkSimulator.LoadTrace( TraceFilename, false ) );
 
-    check( numMessagesReceived == NumMessagesSent );
-}
+    // write a trace: 10ms, 20ms, dropped, 5ms
 
-void test_connection_reliable_ordered_messages_and_blocks_multiple_channels()
-{
-    const int NumChannels = 2;
+    const int NumTraceEntries = 4;
 
-    double time = 100.0;
-    
-    TestMessageFactory messageFactory( GetDefaultAllocator() );
+    NetworkTraceHeader header;
+    header.magic = host_to_network( NetworkTraceMagic );
+    header.version = host_to_network( NetworkTraceVersion );
+    header.numEntries = host_to_network( uint32_t( NumTraceEntries ) );
+    header.reserved = 0;
 
-    ConnectionConfig connectionConfig;
-    connectionConfig.numChannels = NumChannels;
-    connectionConfig.channel[0].type = CHANNEL_TYPE_RELIABLE_ORDERED;
-    connectionConfig.channel[0].maxMessagesPerPacket = 8;
-    connectionConfig.channel[1].type = CHANNEL_TYPE_RELIABLE_ORDERED;
-    connectionConfig.channel[1].maxMessagesPerPacket = 8;
+    NetworkTraceEntry entries[NumTraceEntries];
+    const uint32_t entryDelay[NumTraceEntries] = { 10000, 20000, 0, 5000 };
+    for ( int i = 0; i < NumTraceEntries; ++i )
+    {
+        entries[i].delay = host_to_network( entryDelay[i] );
+        entries[i].flags = host_to_network( i == 2 ? NetworkTraceDropped : 0 );
+    }
 
-    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    FILE * file = fopen( TraceFilename, "wb" );
+    check( file );
+    check( fwrite( &header, sizeof( header ), 1, file ) == 1 );
+    check( fwrite( entries, sizeof( entries ), 1, file ) == 1 );
+    fclose( file );
 
-    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    // one-shot: each packet takes the next trace entry, then packets go back to regular network conditions
 
-    const int NumMessagesSent = 32;
+    check( networkSimulator.LoadTrace( TraceFilename, false ) );
+    check( networkSimulator.IsActive() );
+    check( networkSimulator.IsTracePlaying() );
 
-    for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+    for ( int i = 0; i < NumTraceEntries + 1; ++i )
     {
-        for ( int i = 0; i < NumMessagesSent; ++i )
-        {
-            if ( rand() % 2 )
-            {
-                TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
-                check( message );
-                message->sequence = i;
-                sender.SendMessage( channelIndex, message );
-            }
-            else
-            {
-                TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
-                check( message );
-                message->sequence = i;
-                const int blockSize = 1 + ( ( i * 901 ) % 3333 );
-                uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
-                for ( int j = 0; j < blockSize; ++j )
-                    blockData[j] = i + j;
-                message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
-                sender.SendMessage( channelIndex, message );
-            }
-        }
+        uint8_t packet = uint8_t( i );
+        networkSimulator.SendPacket( 0, &packet, 1 );
     }
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
+    check( !networkSimulator.IsTracePlaying() );
 
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+    uint8_t * packetData[NumPackets];
+    int packetBytes[NumPackets];
 
-    const int NumIterations = 10000;
+    time += 1.0;
 
-    int numMessagesReceived[NumChannels];
-    memset( numMessagesReceived, 0, sizeof( numMessagesReceived ) );
+    networkSimulator.AdvanceTime( time );
 
-    uint16_t senderSequence = 0;
-    uint16_t receiverSequence = 0;
+    int numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, NULL );
 
-    for ( int i = 0; i < NumIterations; ++i )
-    {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+    check( numPackets == 4 );
+    check( packetData[0][0] == 4 );
+    check( packetData[1][0] == 3 );
+    check( packetData[2][0] == 0 );
+    check( packetData[3][0] == 1 );
 
-        for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
-        {
-            while ( true )
-            {
-                Message * message = receiver.ReceiveMessage( channelIndex );
-                if ( !message )
-                    break;
+    networkSimulator.ReleasePackets( packetData, numPackets );
 
-                check( message->GetId() == (int) numMessagesReceived[channelIndex] );
+    // looping: the trace starts over when it runs out
 
-                switch ( message->GetType() )
-                {
-                    case TEST_MESSAGE:
-                    {
-                        TestMessage * testMessage = (TestMessage*) message;
+    check( networkSimulator.LoadTrace( TraceFilename, true ) );
 
-                        check( testMessage->sequence == uint16_t( numMessagesReceived[channelIndex] ) );
+    for ( int i = 0; i < NumTraceEntries * 2; ++i )
+    {
+        uint8_t packet = uint8_t( i );
+        networkSimulator.SendPacket( 0, &packet, 1 );
+    }
 
-                        ++numMessagesReceived[channelIndex];
-                    }
-                    break;
+    check( networkSimulator.IsTracePlaying() );
 
-                    case TEST_BLOCK_MESSAGE:
-                    {
-                        TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+    time += 1.0;
 
-                        check( blockMessage->sequence == uint16_t( numMessagesReceived[channelIndex] ) );
+    networkSimulator.AdvanceTime( time );
 
-                        const int blockSize = blockMessage->GetBlockSize();
+    numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, NULL );
 
-                        check( blockSize == 1 + ( ( numMessagesReceived[channelIndex] * 901 ) % 3333 ) );
-            
-                        const uint8_t * blockData = blockMessage->GetBlockData();
+    check( numPackets == 6 );
 
-                        check( blockData );
+    networkSimulator.ReleasePackets( packetData, numPackets );
 
-                        for ( int j = 0; j < blockSize; ++j )
-                        {
-                            check( blockData[j] == uint8_t( numMessagesReceived[channelIndex] + j ) );
-                        }
+    networkSimulator.ClearTrace();
 
-                        ++numMessagesReceived[channelIndex];
-                    }
-                    break;
-                }
+    check( !networkSimulator.IsActive() );
 
-                messageFactory.ReleaseMessage( message );
-            }
-        }
+    // each client link plays the trace from its own position. clients with their own network conditions don't use it
 
-        bool receivedAllMessages = true;
+    const int NumClients = 3;
 
-        for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
-        {
-            if ( numMessagesReceived[channelIndex] != NumMessagesSent )
-            {
-                receivedAllMessages = false;
-                break;
-            }
-        }
+    NetworkSimulator clientSimulator( GetDefaultAllocator(), NumPackets, time, 1024, NumClients );
 
-        if ( receivedAllMessages )
-            break;
-    }
+    check( clientSimulator.LoadTrace( TraceFilename, false ) );
 
-    for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
-    {
-        check( numMessagesReceived[channelIndex] == NumMessagesSent );
-    }
-}
+    NetworkConditions conditions;
+    conditions.latency = 50.0f;
+    clientSimulator.SetClientConditions( 2, conditions );
 
-void test_connection_unreliable_unordered_messages()
-{
-    TestMessageFactory messageFactory( GetDefaultAllocator() );
+    check( clientSimulator.IsTracePlaying( 0 ) );
+    check( clientSimulator.IsTracePlaying( 1 ) );
+    check( !clientSimulator.IsTracePlaying( 2 ) );
 
-    double time = 100.0;
+    for ( int i = 0; i < NumTraceEntries; ++i )
+    {
+        uint8_t packet = uint8_t( i );
+        clientSimulator.SendPacket( 0, &packet, 1 );
+        clientSimulator.SendPacket( 1, &packet, 1 );
+    }
 
-    ConnectionConfig connectionConfig;
-    connectionConfig.numChannels = 1;
-    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+    check( !clientSimulator.IsTracePlaying( 0 ) );
+    check( !clientSimulator.IsTracePlaying( 1 ) );
 
-    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
-    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    time += 1.0;
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
+    clientSimulator.AdvanceTime( time );
 
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+    numPackets = clientSimulator.ReceivePackets( NumPackets, packetData, packetBytes, NULL );
 
-    const int NumIterations = 256;
+    check( numPackets == 2 * ( NumTraceEntries - 1 ) );
 
-    const int NumMessagesSent = 16;
+    clientSimulator.ReleasePackets( packetData, numPackets );
 
-    for ( int j = 0; j < NumMessagesSent; ++j )
-    {
-        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
-        check( message );
-        message->sequence = j;
-        sender.SendMessage( 0, message );
-    }
+    clientSimulator.ClearTrace();
 
-    int numMessagesReceived = 0;
+    remove( TraceFilename );
+}
 
-    uint16_t senderSequence = 0;
-    uint16_t receiverSequence = 0;
+void test_network_simulator_client_conditions()
+{
+    double time = 100.0;
 
-    for ( int i = 0; i < NumIterations; ++i )
-    {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+    const int NumPackets = 32;
+    const int NumClients = 2;
 
-        while ( true )
-        {
-            Message * message = receiver.ReceiveMessage( 0 );
-            if ( !message )
-                break;
+    NetworkSimulator networkSimulator( GetDefaultAllocator(), NumPackets, time, 1024, NumClients );
 
-            check( message->GetType() == TEST_MESSAGE );
+    networkSimulator.SetLatency( 100.0f );
 
-            TestMessage * testMessage = (TestMessage*) message;
+    check( networkSimulator.GetConditions( 0 ).latency == 100.0f );
+    check( networkSimulator.GetConditions( 1 ).latency == 100.0f );
 
-            check( testMessage->sequence == uint16_t( numMessagesReceived ) );
+    // client 1 drops everything, client 0 keeps the default conditions
 
-            ++numMessagesReceived;
+    NetworkConditions conditions;
+    conditions.packetLoss = 100.0f;
 
-            messageFactory.ReleaseMessage( message );
-        }
+    networkSimulator.SetClientConditions( 1, conditions );
 
-        if ( numMessagesReceived == NumMessagesSent )
-            break;
-    }
+    check( networkSimulator.GetConditions( 0 ).latency == 100.0f );
+    check( networkSimulator.GetConditions( 1 ).latency == 0.0f );
+    check( networkSimulator.GetConditions( 1 ).packetLoss == 100.0f );
 
-    check( numMessagesReceived == NumMessagesSent );
-}
+    // default changes only apply to clients without their own conditions
 
-void test_connection_unreliable_unordered_blocks()
-{
-    TestMessageFactory messageFactory( GetDefaultAllocator() );
+    networkSimulator.SetLatency( 50.0f );
 
-    double time = 100.0;
-    
-    ConnectionConfig connectionConfig;
-    connectionConfig.numChannels = 1;
-    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+    check( networkSimulator.GetConditions( 0 ).latency == 50.0f );
+    check( networkSimulator.GetConditions( 1 ).latency == 0.0f );
 
-    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    const int NumSent = 10;
 
-    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    for ( int i = 0; i < NumSent; ++i )
+    {
+        uint8_t packet = uint8_t( i );
+        networkSimulator.SendPacket( 0, &packet, 1 );
+        networkSimulator.SendPacket( 1, &packet, 1 );
+    }
 
-    const int SenderPort = 10000;
-    const int ReceiverPort = 10001;
+    uint8_t * packetData[NumPackets];
+    int packetBytes[NumPackets];
+    int to[NumPackets];
 
-    Address senderAddress( "::1", SenderPort );
-    Address receiverAddress( "::1", ReceiverPort );
+    time += 1.0;
 
-    const int NumIterations = 256;
+    networkSimulator.AdvanceTime( time );
 
-    const int NumMessagesSent = 8;
+    int numPackets = networkSimulator.ReceivePackets( NumPackets, packetData, packetBytes, to );
 
-    for ( int j = 0; j < NumMessagesSent; ++j )
+    check( numPackets == NumSent );
+    for ( int i = 0; i < numPackets; ++i )
     {
-        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
-        check( message );
-        message->sequence = j;
-        const int blockSize = 1 + ( j * 7 );
-        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
-        for ( int k = 0; k < blockSize; ++k )
-            blockData[k] = j + k;
-        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
-        sender.SendMessage( 0, message );
+        check( to[i] == 0 );
     }
 
-    int numMessagesReceived = 0;
+    networkSimulator.ReleasePackets( packetData, numPackets );
 
-    uint16_t senderSequence = 0;
-    uint16_t receiverSequence = 0;
+    // each client link has its own bandwidth queue
 
-    for ( int i = 0; i < NumIterations; ++i )
-    {
-        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+    conditions = NetworkConditions();
+    conditions.bandwidth = 8.0f;
 
-        while ( true )
-        {
-            Message * message = receiver.ReceiveMessage( 0 );
-            if ( !message )
-                break;
+    networkSimulator.SetClientConditions( 0, conditions );
+    networkSimulator.SetClientConditions( 1, conditions );
 
-            check( message->GetType() == TEST_BLOCK_MESSAGE );
+    uint8_t packet[10];
+    memset( packet, 0, sizeof( packet ) );
 
-            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+    networkSimulator.SendPacket( 0, packet, sizeof( packet ) );
+    networkSimulator.SendPacket( 0, packet, sizeof( packet ) );
+    networkSimulator.SendPacket( 1, packet, sizeof( packet ) );
 
-            check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+    check( networkSimulator.GetQueuedBytes( 0 ) == 20 );
+    check( networkSimulator.GetQueuedBytes( 1 ) == 10 );
 
-            const int blockSize = blockMessage->GetBlockSize();
+    // clearing client conditions goes back to the defaults
 
-            check( blockSize == 1 + ( numMessagesReceived * 7 ) );
+    networkSimulator.ClearClientConditions( 0 );
+    networkSimulator.ClearClientConditions( 1 );
 
-            const uint8_t * blockData = blockMessage->GetBlockData();
+    check( networkSimulator.GetConditions( 0 ).latency == 50.0f );
+    check( networkSimulator.GetConditions( 1 ).latency == 50.0f );
+    check( networkSimulator.GetConditions( 1 ).packetLoss == 0.0f );
+    check( networkSimulator.GetQueuedBytes( 0 ) == 0 );
 
-            check( blockData );
+    networkSimulator.SetLatency( 0.0f );
 
-            for ( int j = 0; j < blockSize; ++j )
-            {
-                check( blockData[j] == uint8_t( numMessagesReceived + j ) );
-            }
+    check( !networkSimulator.IsActive() );
+}
 
-            ++numMessagesReceived;
+void test_random_generator()
+{
+    // reference values from the PCG32 demo program
 
-            messageFactory.ReleaseMessage( message );
-        }
+    RandomGenerator random( 42, 54 );
 
-        if ( numMessagesReceived == NumMessagesSent )
-            break;
+    check( random.GenerateUint32() == 0xa15c02b7 );
+    check( random.GenerateUint32() == 0x7b47f409 );
+    check( random.GenerateUint32() == 0xba1d3330 );
+
+    // same seed and stream gives the same sequence, different streams diverge
+
+    RandomGenerator a( 1000 );
+    RandomGenerator b( 1000 );
+    RandomGenerator c( 1000, 1 );
+
+    bool different = false;
+
+    for ( int i = 0; i < 1000; ++i )
+    {
+        const int value = a.GenerateInt( -10, 10 );
+        check( value == b.GenerateInt( -10, 10 ) );
+        check( value >= -10 );
+        check( value <= 10 );
+        if ( value != c.GenerateInt( -10, 10 ) )
+            different = true;
+
+        const float f = a.GenerateFloat( 1.0f, 2.0f );
+        check( f == b.GenerateFloat( 1.0f, 2.0f ) );
+        check( f >= 1.0f );
+        check( f < 2.0f );
+        c.GenerateFloat( 1.0f, 2.0f );
     }
 
-    check( numMessagesReceived == NumMessagesSent );
+    check( different );
+
+    a.Seed( 1000 );
+
+    check( a.GenerateInt( -10, 10 ) == RandomGenerator( 1000 ).GenerateInt( -10, 10 ) );
 }
 
-void PumpClientServerUpdate( double & time, Client ** client, int numClients, Server ** server, int numServers, float deltaTime = 0.1f )
+void test_network_simulator_seed()
 {
-    for ( int i = 0; i < numClients; ++i )
-        client[i]->SendPackets();
+    // two simulators with the same seed drop exactly the same packets
 
-    for ( int i = 0; i < numServers; ++i )
-        server[i]->SendPackets();
+    const int NumPackets = 256;
 
-    for ( int i = 0; i < numClients; ++i )
-        client[i]->ReceivePackets();
+    NetworkSimulator a( GetDefaultAllocator(), NumPackets, 0.0, 1024, 0, 12345 );
+    NetworkSimulator b( GetDefaultAllocator(), NumPackets, 0.0, 1024, 0, 12345 );
 
-    for ( int i = 0; i < numServers; ++i )
-        server[i]->ReceivePackets();
+    a.SetPacketLoss( 50.0f );
+    b.SetPacketLoss( 50.0f );
+    a.SetJitter( 10.0f );
+    b.SetJitter( 10.0f );
 
-    time += deltaTime;
+    for ( int i = 0; i < NumPackets; ++i )
+    {
+        uint8_t packet = uint8_t( i );
+        a.SendPacket( 0, &packet, 1 );
+        b.SendPacket( 0, &packet, 1 );
+    }
 
-    for ( int i = 0; i < numClients; ++i )
-        client[i]->AdvanceTime( time );
+    a.AdvanceTime( 1.0 );
+    b.AdvanceTime( 1.0 );
 
-    for ( int i = 0; i < numServers; ++i )
-        server[i]->AdvanceTime( time );
+    uint8_t * packetDataA[NumPackets];
+    uint8_t * packetDataB[NumPackets];
+    int packetBytes[NumPackets];
 
-    yojimbo_sleep( 0.0f );
-}
+    const int numPacketsA = a.ReceivePackets( NumPackets, packetDataA, packetBytes, NULL );
+    const int numPacketsB = b.ReceivePackets( NumPackets, packetDataB, packetBytes, NULL );
 
-void SendClientToServerMessages( Client & client, int numMessagesToSend, int channelIndex = 0 )
-{
-    for ( int i = 0; i < numMessagesToSend; ++i )
+    check( numPacketsA > 0 );
+    check( numPacketsA < NumPackets );
+    check( numPacketsA == numPacketsB );
+
+    uint8_t deliveredA[NumPackets];
+
+    for ( int i = 0; i < numPacketsA; ++i )
     {
-        if ( !client.CanSendMessage( channelIndex ) )
-            break;
+        check( packetDataA[i][0] == packetDataB[i][0] );
+        deliveredA[i] = packetDataA[i][0];
+    }
+
+    a.ReleasePackets( packetDataA, numPacketsA );
+    b.ReleasePackets( packetDataB, numPacketsB );
+
+    // the same seed on a different stream drops different packets. reseeding with the original stream replays the original run
+
+    for ( int run = 0; run < 2; ++run )
+    {
+        NetworkSimulator c( GetDefaultAllocator(), NumPackets, 0.0, 1024, 0, 12345, 1 );
+
+        if ( run == 1 )
+            c.SetSeed( 12345, 0 );
 
-        if ( rand() % 10 )
+        c.SetPacketLoss( 50.0f );
+        c.SetJitter( 10.0f );
+
+        for ( int i = 0; i < NumPackets; ++i )
         {
-            TestMessage * message = (TestMessage*) client.CreateMessage( TEST_MESSAGE );
-            check( message );
-            message->sequence = i;
-            client.SendMessage( channelIndex, message );
+            uint8_t packet = uint8_t( i );
+            c.SendPacket( 0, &packet, 1 );
         }
-        else
+
+        c.AdvanceTime( 1.0 );
+
+        uint8_t * packetDataC[NumPackets];
+
+        const int numPacketsC = c.ReceivePackets( NumPackets, packetDataC, packetBytes, NULL );
+
+        bool same = numPacketsC == numPacketsA;
+        for ( int i = 0; i < numPacketsC && same; ++i )
         {
-            TestBlockMessage * message = (TestBlockMessage*) client.CreateMessage( TEST_BLOCK_MESSAGE );
-            check( message );
-            message->sequence = i;
-            const int blockSize = 1 + ( ( i * 901 ) % 1001 );
-            uint8_t * blockData = client.AllocateBlock( blockSize );
-            check( blockData );
-            for ( int j = 0; j < blockSize; ++j )
-                blockData[j] = i + j;
-            client.AttachBlockToMessage( message, blockData, blockSize );
-            client.SendMessage( channelIndex, message );
+            same = packetDataC[i][0] == deliveredA[i];
         }
+
+        check( same == ( run == 1 ) );
+
+        c.ReleasePackets( packetDataC, numPacketsC );
     }
 }
 
-void SendServerToClientMessages( Server & server, int clientIndex, int numMessagesToSend, int channelIndex = 0 )
+void test_pointer_map()
 {
-    for ( int i = 0; i < numMessagesToSend; ++i )
-    {
-        if ( !server.CanSendMessage( clientIndex, channelIndex ) )
-            break;
+    const int NumEntries = 10000;
 
-        if ( rand() % 10 )
+    static uint8_t buffer[NumEntries];
+
+    bool inserted[NumEntries];
+    memset( inserted, 0, sizeof( inserted ) );
+
+    PointerMap<int> map;
+
+    check( map.GetSize() == 0 );
+    check( map.Find( buffer ) == NULL );
+    check( !map.Remove( buffer ) );
+
+    int size = 0;
+
+    for ( int i = 0; i < 100000; ++i )
+    {
+        const int index = random_int( 0, NumEntries - 1 );
+        if ( inserted[index] )
         {
-            TestMessage * message = (TestMessage*) server.CreateMessage( clientIndex, TEST_MESSAGE );
-            check( message );
-            message->sequence = i;
-            server.SendMessage( clientIndex, channelIndex, message );
+            check( map.Find( buffer + index ) );
+            check( *map.Find( buffer + index ) == index );
+            check( map.Remove( buffer + index ) );
+            check( map.Find( buffer + index ) == NULL );
+            inserted[index] = false;
+            size--;
         }
         else
         {
-            TestBlockMessage * message = (TestBlockMessage*) server.CreateMessage( clientIndex, TEST_BLOCK_MESSAGE );
-            check( message );
-            message->sequence = i;
-            const int blockSize = 1 + ( ( i * 901 ) % 1001 );
-            uint8_t * blockData = server.AllocateBlock( clientIndex, blockSize );
-            check( blockData );
-            for ( int j = 0; j < blockSize; ++j )
-                blockData[j] = i + j;
-            server.AttachBlockToMessage( clientIndex, message, blockData, blockSize );
-            server.SendMessage( clientIndex, channelIndex, message );
+            check( map.Find( buffer + index ) == NULL );
+            map.Insert( buffer + index, index );
+            inserted[index] = true;
+            size++;
         }
+        check( map.GetSize() == size );
+    }
+
+    int count = 0;
+    for ( int i = 0; i < map.GetCapacity(); ++i )
+    {
+        const uint8_t * key = (const uint8_t*) map.GetKey( i );
+        if ( !key )
+            continue;
+        const int index = int( key - buffer );
+        check( inserted[index] );
+        check( map.GetValue( i ) == index );
+        count++;
+    }
+
+    check( count == size );
+
+    for ( int i = 0; i < NumEntries; ++i )
+    {
+        check( ( map.Find( buffer + i ) != NULL ) == inserted[i] );
     }
 }
 
-void ProcessServerToClientMessages( Client & client, int & numMessagesReceivedFromServer )
+void test_allocator_tlsf()
 {
-    while ( true )
-    {
-        Message * message = client.ReceiveMessage( 0 );
+    const int NumBlocks = 256;
+    const int BlockSize = 1024;
+    const int MemorySize = NumBlocks * BlockSize;
 
-        if ( !message )
-            break;
+    uint8_t * memory = (uint8_t*) malloc( MemorySize );
 
-        check( message->GetId() == (int) numMessagesReceivedFromServer );
+    TLSF_Allocator allocator( memory, MemorySize );
+
+    uint8_t * blockData[NumBlocks];
+    memset( blockData, 0, sizeof( blockData ) );
+
+    int stopIndex = 0;
+
+    for ( int i = 0; i < NumBlocks; ++i )
+    {
+        blockData[i] = (uint8_t*) YOJIMBO_ALLOCATE( allocator, BlockSize );
         
-        switch ( message->GetType() )
+        if ( !blockData[i] )
         {
-            case TEST_MESSAGE:
-            {
-                TestMessage * testMessage = (TestMessage*) message;
-                check( !message->IsBlockMessage() );
-                check( testMessage->sequence == uint16_t( numMessagesReceivedFromServer ) );
-                ++numMessagesReceivedFromServer;
-            }
+            check( allocator.GetErrorLevel() == ALLOCATOR_ERROR_OUT_OF_MEMORY );
+            allocator.ClearError();
+            check( allocator.GetErrorLevel() == ALLOCATOR_ERROR_NONE );
+            stopIndex = i;
             break;
+        }
+        
+        check( blockData[i] );
+        check( allocator.GetErrorLevel() == ALLOCATOR_ERROR_NONE );
+        
+        memset( blockData[i], i + 10, BlockSize );
+    }
 
-            case TEST_BLOCK_MESSAGE:
-            {
-                check( message->IsBlockMessage() );
-                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
-                check( blockMessage->sequence == uint16_t( numMessagesReceivedFromServer ) );
-                const int blockSize = blockMessage->GetBlockSize();
-                check( blockSize == 1 + ( ( numMessagesReceivedFromServer * 901 ) % 1001 ) );
-                const uint8_t * blockData = blockMessage->GetBlockData();
-                check( blockData );
-                for ( int j = 0; j < blockSize; ++j )
-                {
-                    check( blockData[j] == uint8_t( numMessagesReceivedFromServer + j ) );
-                }
-                ++numMessagesReceivedFromServer;
-            }
-            break;
+    check( stopIndex > NumBlocks / 2 );
+
+    for ( int i = 0; i < NumBlocks - 1; ++i )
+    {
+        if ( blockData[i] )
+        {
+            for ( int j = 0; j < BlockSize; ++j )
+                check( blockData[i][j] == uint8_t( i + 10 ) );
         }
 
-        client.ReleaseMessage( message );
+        YOJIMBO_FREE( allocator, blockData[i] );
     }
+
+    free( memory );
 }
 
-void ProcessClientToServerMessages( Server & server, int clientIndex, int & numMessagesReceivedFromClient )
+void test_allocator_mapped_memory()
 {
-    while ( true )
+    const int NumBlocks = 64;
+    const int BlockSize = 16 * 1024;
+    const int MemorySize = 4 * 1024 * 1024;
+
+    uint8_t * memory = (uint8_t*) yojimbo_map_memory( MemorySize, true );
+
+    check( memory );
+
+    TLSF_Allocator allocator( memory, MemorySize );
+
+    uint8_t * blockData[NumBlocks];
+
+    for ( int i = 0; i < NumBlocks; ++i )
     {
-        Message * message = server.ReceiveMessage( clientIndex, 0 );
+        blockData[i] = (uint8_t*) YOJIMBO_ALLOCATE( allocator, BlockSize );
+        check( blockData[i] );
+        memset( blockData[i], i + 10, BlockSize );
+    }
 
-        if ( !message )
-            break;
+    for ( int i = 0; i < NumBlocks; i += 2 )
+    {
+        YOJIMBO_FREE( allocator, blockData[i] );
+    }
 
-        check( message->GetId() == (int) numMessagesReceivedFromClient );
+    allocator.ReleaseFreePages();
 
-        switch ( message->GetType() )
+    for ( int i = 1; i < NumBlocks; i += 2 )
+    {
+        for ( int j = 0; j < BlockSize; ++j )
+            check( blockData[i][j] == uint8_t( i + 10 ) );
+    }
+
+    for ( int i = 0; i < NumBlocks; i += 2 )
+    {
+        blockData[i] = (uint8_t*) YOJIMBO_ALLOCATE( allocator, BlockSize );
+        check( blockData[i] );
+        memset( blockData[i], i + 10, BlockSize );
+    }
+
+    for ( int i = 0; i < NumBlocks; ++i )
+    {
+        for ( int j = 0; j < BlockSize; ++j )
+            check( blockData[i][j] == uint8_t( i + 10 ) );
+
+        YOJIMBO_FREE( allocator, blockData[i] );
+    }
+
+    allocator.ReleaseFreePages();
+
+    yojimbo_unmap_memory( memory, MemorySize, true );
+}
+
+struct TestAlignedMessage : public Message
+{
+    uint16_t sequence;
+    uint8_t data[5];
+
+    TestAlignedMessage()
+    {
+        sequence = 0;
+        memset( data, 0, sizeof( data ) );
+    }
+
+    template <typename Stream> bool Serialize( Stream & stream )
+    {
+        serialize_bits( stream, sequence, 16 );
+        serialize_bytes( stream, data, sizeof( data ) );
+        return true;
+    }
+
+    YOJIMBO_VIRTUAL_SERIALIZE_FUNCTIONS();
+};
+
+enum TestAlignedMessageType
+{
+    TEST_ALIGNED_MESSAGE,
+    NUM_TEST_ALIGNED_MESSAGE_TYPES
+};
+
+YOJIMBO_MESSAGE_FACTORY_START( TestAlignedMessageFactory, NUM_TEST_ALIGNED_MESSAGE_TYPES );
+    YOJIMBO_DECLARE_MESSAGE_TYPE( TEST_ALIGNED_MESSAGE, TestAlignedMessage );
+YOJIMBO_MESSAGE_FACTORY_FINISH();
+
+void test_serialized_message()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    TestAlignedMessageFactory alignedMessageFactory( GetDefaultAllocator() );
+
+    TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+    check( message );
+    message->sequence = 4;
+
+    TestAlignedMessage * alignedMessage = (TestAlignedMessage*) alignedMessageFactory.CreateMessage( TEST_ALIGNED_MESSAGE );
+    check( alignedMessage );
+    alignedMessage->sequence = 1000;
+    for ( int i = 0; i < (int) sizeof( alignedMessage->data ); ++i )
+        alignedMessage->data[i] = uint8_t( i + 10 );
+
+    SerializedMessageData * data = SerializedMessageData::Create( GetDefaultAllocator(), *message, NULL );
+    check( data );
+    check( data->GetType() == TEST_MESSAGE );
+    check( data->GetRefCount() == 1 );
+
+    SerializedMessageData * alignedData = SerializedMessageData::Create( GetDefaultAllocator(), *alignedMessage, NULL );
+    check( alignedData );
+    check( alignedData->GetType() == TEST_ALIGNED_MESSAGE );
+
+    messageFactory.ReleaseMessage( message );
+    alignedMessageFactory.ReleaseMessage( alignedMessage );
+
+    // the serialized bits must read back as the original message, wherever they are written in the stream
+
+    const int BufferSize = 1024;
+
+    uint8_t buffer[BufferSize];
+
+    for ( int offset = 0; offset < 8; ++offset )
+    {
+        Message * serializedMessage = messageFactory.CreateSerializedMessage( *data );
+        Message * serializedAlignedMessage = alignedMessageFactory.CreateSerializedMessage( *alignedData );
+        check( serializedMessage );
+        check( serializedAlignedMessage );
+        check( serializedMessage->GetType() == TEST_MESSAGE );
+        check( data->GetRefCount() == 2 );
+
+        memset( buffer, 0, sizeof( buffer ) );
+
+        WriteStream writeStream( GetDefaultAllocator(), buffer, BufferSize );
+        if ( offset > 0 )
+            writeStream.SerializeBits( 0, offset );
+        check( serializedMessage->SerializeInternal( writeStream ) );
+        check( serializedAlignedMessage->SerializeInternal( writeStream ) );
+        writeStream.SerializeBits( 12345, 16 );
+        writeStream.Flush();
+
+        messageFactory.ReleaseMessage( serializedMessage );
+        alignedMessageFactory.ReleaseMessage( serializedAlignedMessage );
+        check( data->GetRefCount() == 1 );
+
+        ReadStream readStream( GetDefaultAllocator(), buffer, writeStream.GetBytesProcessed() );
+        uint32_t value = 0;
+        if ( offset > 0 )
+            readStream.SerializeBits( value, offset );
+
+        TestMessage * readMessage = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( readMessage );
+        check( readMessage->SerializeInternal( readStream ) );
+        check( readMessage->sequence == 4 );
+        messageFactory.ReleaseMessage( readMessage );
+
+        TestAlignedMessage * readAlignedMessage = (TestAlignedMessage*) alignedMessageFactory.CreateMessage( TEST_ALIGNED_MESSAGE );
+        check( readAlignedMessage );
+        check( readAlignedMessage->SerializeInternal( readStream ) );
+        check( readAlignedMessage->sequence == 1000 );
+        for ( int i = 0; i < (int) sizeof( readAlignedMessage->data ); ++i )
+            check( readAlignedMessage->data[i] == uint8_t( i + 10 ) );
+        alignedMessageFactory.ReleaseMessage( readAlignedMessage );
+
+        readStream.SerializeBits( value, 16 );
+        check( value == 12345 );
+    }
+
+    data->Release();
+    alignedData->Release();
+}
+
+/**
+    Wraps another allocator and counts the bytes currently allocated through it.
+    Lets tests check when memory is allocated and released, not just that messages get through.
+ */
+
+class CountingAllocator : public Allocator
+{
+public:
+
+    explicit CountingAllocator( Allocator & allocator ) : m_allocator( &allocator ), m_currentBytes( 0 ) {}
+
+    void * Allocate( size_t size, const char * file, int line )
+    {
+        uint8_t * p = (uint8_t*) m_allocator->Allocate( size + HeaderBytes, file, line );
+        if ( !p )
         {
-            case TEST_MESSAGE:
-            {
-                check( !message->IsBlockMessage() );
-                TestMessage * testMessage = (TestMessage*) message;
-                check( testMessage->sequence == uint16_t( numMessagesReceivedFromClient ) );
-                ++numMessagesReceivedFromClient;
-            }
-            break;
+            SetErrorLevel( ALLOCATOR_ERROR_OUT_OF_MEMORY );
+            return NULL;
+        }
+        *( (size_t*) p ) = size;
+        m_currentBytes += size;
+        return p + HeaderBytes;
+    }
 
-            case TEST_BLOCK_MESSAGE:
-            {
-                check( message->IsBlockMessage() );
-                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
-                check( blockMessage->sequence == uint16_t( numMessagesReceivedFromClient ) );
-                const int blockSize = blockMessage->GetBlockSize();
-                check( blockSize == 1 + ( ( numMessagesReceivedFromClient * 901 ) % 1001 ) );
-                const uint8_t * blockData = blockMessage->GetBlockData();
-                check( blockData );
-                for ( int j = 0; j < blockSize; ++j )
-                {
-                    check( blockData[j] == uint8_t( numMessagesReceivedFromClient + j ) );
-                }
-                ++numMessagesReceivedFromClient;
+    void Free( void * p, const char * file, int line )
+    {
+        if ( !p )
+            return;
+        uint8_t * block = ( (uint8_t*) p ) - HeaderBytes;
+        m_currentBytes -= *( (size_t*) block );
+        m_allocator->Free( block, file, line );
+    }
+
+    uint64_t GetCurrentBytes() const { return m_currentBytes; }
+
+private:
+
+    static const int HeaderBytes = 16;
+
+    Allocator * m_allocator;
+    uint64_t m_currentBytes;
+
+    CountingAllocator( const CountingAllocator & other );
+    CountingAllocator & operator = ( const CountingAllocator & other );
+};
+
+void PumpConnectionUpdate( ConnectionConfig & connectionConfig, double & time, Connection & sender, Connection & receiver, uint16_t & senderSequence, uint16_t & receiverSequence, float deltaTime = 0.1f, int packetLossPercent = 90 )
+{
+    uint8_t * packetData = (uint8_t*) alloca( connectionConfig.maxPacketSize );
+
+    int packetBytes;
+    if ( sender.GeneratePacket( NULL, senderSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) )
+    {
+        if ( random_int( 0, 100 ) >= packetLossPercent )
+        {
+            receiver.ProcessPacket( NULL, senderSequence, packetData, packetBytes );
+            sender.ProcessAcks( &senderSequence, 1 );
+        }
+    }
+
+    if ( receiver.GeneratePacket( NULL, receiverSequence, packetData, connectionConfig.maxPacketSize, packetBytes ) )
+    {
+        if ( random_int( 0, 100 ) >= packetLossPercent )
+        {
+            sender.ProcessPacket( NULL, receiverSequence, packetData, packetBytes );
+            receiver.ProcessAcks( &receiverSequence, 1 );
+        }
+    }
+
+    time += deltaTime;
+
+    sender.AdvanceTime( time );
+    receiver.AdvanceTime( time );
+
+    senderSequence++;
+    receiverSequence++;
+}
+
+void test_connection_reliable_ordered_messages()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+ 
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 64;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = i;
+        sender.SendMessage( 0, message );
+    }
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    int numMessagesReceived = 0;
+    int numUpdates = 0;
+
+    const int NumIterations = 1000;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        ++numUpdates;
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetId() == (int) numMessagesReceived );
+            check( message->GetType() == TEST_MESSAGE );
+
+            TestMessage * testMessage = (TestMessage*) message;
+
+            check( testMessage->sequence == numMessagesReceived );
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+
+    check( sender.GetChannelCounter( 0, CHANNEL_COUNTER_MESSAGES_SENT ) == NumMessagesSent );
+
+    // all messages fit in one packet, so they are only resent if the first packet was lost
+
+    check( ( sender.GetChannelCounter( 0, CHANNEL_COUNTER_MESSAGES_RESENT ) > 0 ) == ( numUpdates > 1 ) );
+    check( receiver.GetChannelCounter( 0, CHANNEL_COUNTER_MESSAGES_RECEIVED ) == NumMessagesSent );
+}
+
+void test_connection_shared_config()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 2;
+    connectionConfig.channel[1].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+    connectionConfig.channel[1].maxMessagesPerPacket = 7;
+
+    SharedConnectionConfig * sharedConfig = SharedConnectionConfig::Create( GetDefaultAllocator(), connectionConfig );
+
+    check( sharedConfig );
+    check( sharedConfig->GetRefCount() == 1 );
+    check( sharedConfig->GetNumChannels() == 2 );
+    check( sharedConfig->GetMaxPacketSize() == connectionConfig.maxPacketSize );
+    check( sharedConfig->GetChannelConfig( 0 ).type == CHANNEL_TYPE_RELIABLE_ORDERED );
+    check( sharedConfig->GetChannelConfig( 1 ).type == CHANNEL_TYPE_UNRELIABLE_UNORDERED );
+    check( sharedConfig->GetChannelConfig( 1 ).maxMessagesPerPacket == 7 );
+
+    {
+        Connection sender( GetDefaultAllocator(), messageFactory, *sharedConfig, time );
+        Connection receiver( GetDefaultAllocator(), messageFactory, *sharedConfig, time );
+
+        check( sharedConfig->GetRefCount() == 3 );
+
+        const int NumMessagesSent = 64;
+
+        for ( int i = 0; i < NumMessagesSent; ++i )
+        {
+            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+            check( message );
+            message->sequence = i;
+            sender.SendMessage( 0, message );
+        }
+
+        int numMessagesReceived = 0;
+
+        uint16_t senderSequence = 0;
+        uint16_t receiverSequence = 0;
+
+        for ( int i = 0; i < 1000; ++i )
+        {
+            PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+            while ( true )
+            {
+                Message * message = receiver.ReceiveMessage( 0 );
+                if ( !message )
+                    break;
+
+                check( message->GetId() == (int) numMessagesReceived );
+                check( ( (TestMessage*) message )->sequence == numMessagesReceived );
+
+                ++numMessagesReceived;
+
+                messageFactory.ReleaseMessage( message );
+            }
+
+            if ( numMessagesReceived == NumMessagesSent )
+                break;
+        }
+
+        check( numMessagesReceived == NumMessagesSent );
+    }
+
+    check( sharedConfig->GetRefCount() == 1 );
+
+    sharedConfig->Release();
+}
+
+void test_connection_reliable_ordered_blocks()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 32;
+
+    int numFragments = 0;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        check( message );
+        message->sequence = i;
+        const int blockSize = 1 + ( ( i * 901 ) % 3333 );
+        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+        for ( int j = 0; j < blockSize; ++j )
+            blockData[j] = i + j;
+        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+        sender.SendMessage( 0, message );
+        numFragments += ( blockSize + connectionConfig.channel[0].blockFragmentSize - 1 ) / connectionConfig.channel[0].blockFragmentSize;
+    }
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    int numMessagesReceived = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetId() == (int) numMessagesReceived );
+
+            check( message->GetType() == TEST_BLOCK_MESSAGE );
+
+            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+
+            check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+
+            const int blockSize = blockMessage->GetBlockSize();
+
+            check( blockSize == 1 + ( ( numMessagesReceived * 901 ) % 3333 ) );
+
+            const uint8_t * blockData = blockMessage->GetBlockData();
+
+            check( blockData );
+
+            for ( int j = 0; j < blockSize; ++j )
+            {
+                check( blockData[j] == uint8_t( numMessagesReceived + j ) );
+            }
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+
+    const uint64_t numFragmentsSent = sender.GetChannelCounter( 0, CHANNEL_COUNTER_FRAGMENTS_SENT );
+    const uint64_t numFragmentsResent = sender.GetChannelCounter( 0, CHANNEL_COUNTER_FRAGMENTS_RESENT );
+
+    check( numFragmentsResent > 0 );
+    check( numFragmentsSent - numFragmentsResent == uint64_t( numFragments ) );
+}
+
+void test_connection_reliable_ordered_latency()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.channel[0].trackLatency = true;
+    connectionConfig.channel[0].sendTimestamps = true;
+    
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 32;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        if ( i == NumMessagesSent / 2 )
+        {
+            TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+            check( message );
+            message->sequence = i;
+            const int blockSize = 3000;
+            uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+            memset( blockData, i, blockSize );
+            message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+            sender.SendMessage( 0, message );
+        }
+        else
+        {
+            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+            check( message );
+            message->sequence = i;
+            sender.SendMessage( 0, message );
+        }
+    }
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    int numMessagesReceived = 0;
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetId() == (int) numMessagesReceived );
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        TimingStats acked;
+        check( sender.GetChannelLatencyStats( 0, CHANNEL_LATENCY_ACKED, acked ) );
+        if ( numMessagesReceived == NumMessagesSent && acked.numSamples == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+
+    TimingStats queued;
+    TimingStats acked;
+    TimingStats delivered;
+
+    check( sender.GetChannelLatencyStats( 0, CHANNEL_LATENCY_QUEUED, queued ) );
+    check( sender.GetChannelLatencyStats( 0, CHANNEL_LATENCY_ACKED, acked ) );
+    check( receiver.GetChannelLatencyStats( 0, CHANNEL_LATENCY_DELIVERED, delivered ) );
+
+    check( queued.numSamples == NumMessagesSent );
+    check( acked.numSamples == NumMessagesSent );
+    check( acked.p99 > 0.0 );
+    check( acked.max >= acked.p99 );
+
+    // sender and receiver share the same clock and packets are delivered instantly
+
+    check( delivered.numSamples == NumMessagesSent );
+    check( delivered.max == 0.0 );
+
+    // channels only have latency histograms when latency tracking is enabled
+
+    ConnectionConfig untrackedConfig;
+
+    Connection untracked( GetDefaultAllocator(), messageFactory, untrackedConfig, time );
+
+    check( !untracked.GetChannelLatencyStats( 0, CHANNEL_LATENCY_ACKED, acked ) );
+}
+
+void test_connection_reliable_ordered_blocks_release()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    const float BlockReleaseTime = 1.0f;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.channel[0].blockReleaseTime = BlockReleaseTime;
+
+    // block send and receive state comes from the connection allocator, so count it there
+
+    CountingAllocator senderAllocator( GetDefaultAllocator() );
+    CountingAllocator receiverAllocator( GetDefaultAllocator() );
+    
+    Connection * sender = YOJIMBO_NEW( GetDefaultAllocator(), Connection, senderAllocator, messageFactory, connectionConfig, time );
+    Connection * receiver = YOJIMBO_NEW( GetDefaultAllocator(), Connection, receiverAllocator, messageFactory, connectionConfig, time );
+
+    const uint64_t senderBaseBytes = senderAllocator.GetCurrentBytes();
+    const uint64_t receiverBaseBytes = receiverAllocator.GetCurrentBytes();
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    const int NumWaves = 4;
+    const int NumMessagesPerWave = 8;
+
+    int numMessagesSent = 0;
+    int numMessagesReceived = 0;
+
+    for ( int wave = 0; wave < NumWaves; ++wave )
+    {
+        for ( int i = 0; i < NumMessagesPerWave; ++i )
+        {
+            TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+            check( message );
+            message->sequence = numMessagesSent;
+            const int blockSize = 1 + ( ( numMessagesSent * 901 ) % 3333 );
+            uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+            for ( int j = 0; j < blockSize; ++j )
+                blockData[j] = numMessagesSent + j;
+            message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+            sender->SendMessage( 0, message );
+            numMessagesSent++;
+        }
+
+        // no block state is held between waves, so it must be allocated again for the first block of each wave
+
+        check( senderAllocator.GetCurrentBytes() == senderBaseBytes );
+        check( receiverAllocator.GetCurrentBytes() == receiverBaseBytes );
+
+        PumpConnectionUpdate( connectionConfig, time, *sender, *receiver, senderSequence, receiverSequence, 0.01f, 0 );
+
+        check( senderAllocator.GetCurrentBytes() > senderBaseBytes );
+        check( receiverAllocator.GetCurrentBytes() > receiverBaseBytes );
+
+        const int NumIterations = 10000;
+
+        for ( int i = 0; i < NumIterations; ++i )
+        {
+            while ( true )
+            {
+                Message * message = receiver->ReceiveMessage( 0 );
+                if ( !message )
+                    break;
+
+                check( message->GetType() == TEST_BLOCK_MESSAGE );
+
+                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+
+                check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+
+                const int blockSize = blockMessage->GetBlockSize();
+
+                check( blockSize == 1 + ( ( numMessagesReceived * 901 ) % 3333 ) );
+
+                const uint8_t * blockData = blockMessage->GetBlockData();
+
+                check( blockData );
+
+                for ( int j = 0; j < blockSize; ++j )
+                {
+                    check( blockData[j] == uint8_t( numMessagesReceived + j ) );
+                }
+
+                ++numMessagesReceived;
+
+                messageFactory.ReleaseMessage( message );
+            }
+
+            if ( numMessagesReceived == numMessagesSent )
+                break;
+
+            PumpConnectionUpdate( connectionConfig, time, *sender, *receiver, senderSequence, receiverSequence );
+        }
+
+        check( numMessagesReceived == numMessagesSent );
+
+        // deliver the outstanding acks. the channels are now idle, but the release time has not passed yet
+
+        PumpConnectionUpdate( connectionConfig, time, *sender, *receiver, senderSequence, receiverSequence, 0.01f, 0 );
+
+        check( senderAllocator.GetCurrentBytes() > senderBaseBytes );
+        check( receiverAllocator.GetCurrentBytes() > receiverBaseBytes );
+
+        // idle past the release time. the block send and receive state is released
+
+        PumpConnectionUpdate( connectionConfig, time, *sender, *receiver, senderSequence, receiverSequence, BlockReleaseTime, 0 );
+
+        check( senderAllocator.GetCurrentBytes() == senderBaseBytes );
+        check( receiverAllocator.GetCurrentBytes() == receiverBaseBytes );
+    }
+
+    YOJIMBO_DELETE( GetDefaultAllocator(), Connection, sender );
+    YOJIMBO_DELETE( GetDefaultAllocator(), Connection, receiver );
+
+    check( senderAllocator.GetCurrentBytes() == 0 );
+    check( receiverAllocator.GetCurrentBytes() == 0 );
+}
+
+void test_connection_reliable_ordered_messages_and_blocks()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+    
+    ConnectionConfig connectionConfig;
+    
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 32;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        if ( rand() % 2 )
+        {
+            TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+            check( message );
+            message->sequence = i;
+            sender.SendMessage( 0, message );
+        }
+        else
+        {
+            TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+            check( message );
+            message->sequence = i;
+            const int blockSize = 1 + ( ( i * 901 ) % 3333 );
+            uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+            for ( int j = 0; j < blockSize; ++j )
+                blockData[j] = i + j;
+            message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+            sender.SendMessage( 0, message );
+        }
+    }
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    int numMessagesReceived = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetId() == (int) numMessagesReceived );
+
+            switch ( message->GetType() )
+            {
+                case TEST_MESSAGE:
+                {
+                    TestMessage * testMessage = (TestMessage*) message;
+
+                    check( testMessage->sequence == uint16_t( numMessagesReceived ) );
+
+                    ++numMessagesReceived;
+                }
+                break;
+
+                case TEST_BLOCK_MESSAGE:
+                {
+                    TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+
+                    check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+
+                    const int blockSize = blockMessage->GetBlockSize();
+
+                    check( blockSize == 1 + ( ( numMessagesReceived * 901 ) % 3333 ) );
+        
+                    const uint8_t * blockData = blockMessage->GetBlockData();
+
+                    check( blockData );
+
+                    for ( int j = 0; j < blockSize; ++j )
+                    {
+                        check( blockData[j] == uint8_t( numMessagesReceived + j ) );
+                    }
+
+                    ++numMessagesReceived;
+                }
+                break;
+            }
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+void test_connection_reliable_ordered_messages_and_blocks_multiple_channels()
+{
+    const int NumChannels = 2;
+
+    double time = 100.0;
+    
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = NumChannels;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_RELIABLE_ORDERED;
+    connectionConfig.channel[0].maxMessagesPerPacket = 8;
+    connectionConfig.channel[1].type = CHANNEL_TYPE_RELIABLE_ORDERED;
+    connectionConfig.channel[1].maxMessagesPerPacket = 8;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int NumMessagesSent = 32;
+
+    for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+    {
+        for ( int i = 0; i < NumMessagesSent; ++i )
+        {
+            if ( rand() % 2 )
+            {
+                TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+                check( message );
+                message->sequence = i;
+                sender.SendMessage( channelIndex, message );
+            }
+            else
+            {
+                TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+                check( message );
+                message->sequence = i;
+                const int blockSize = 1 + ( ( i * 901 ) % 3333 );
+                uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+                for ( int j = 0; j < blockSize; ++j )
+                    blockData[j] = i + j;
+                message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+                sender.SendMessage( channelIndex, message );
+            }
+        }
+    }
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    const int NumIterations = 10000;
+
+    int numMessagesReceived[NumChannels];
+    memset( numMessagesReceived, 0, sizeof( numMessagesReceived ) );
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence );
+
+        for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+        {
+            while ( true )
+            {
+                Message * message = receiver.ReceiveMessage( channelIndex );
+                if ( !message )
+                    break;
+
+                check( message->GetId() == (int) numMessagesReceived[channelIndex] );
+
+                switch ( message->GetType() )
+                {
+                    case TEST_MESSAGE:
+                    {
+                        TestMessage * testMessage = (TestMessage*) message;
+
+                        check( testMessage->sequence == uint16_t( numMessagesReceived[channelIndex] ) );
+
+                        ++numMessagesReceived[channelIndex];
+                    }
+                    break;
+
+                    case TEST_BLOCK_MESSAGE:
+                    {
+                        TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+
+                        check( blockMessage->sequence == uint16_t( numMessagesReceived[channelIndex] ) );
+
+                        const int blockSize = blockMessage->GetBlockSize();
+
+                        check( blockSize == 1 + ( ( numMessagesReceived[channelIndex] * 901 ) % 3333 ) );
+            
+                        const uint8_t * blockData = blockMessage->GetBlockData();
+
+                        check( blockData );
+
+                        for ( int j = 0; j < blockSize; ++j )
+                        {
+                            check( blockData[j] == uint8_t( numMessagesReceived[channelIndex] + j ) );
+                        }
+
+                        ++numMessagesReceived[channelIndex];
+                    }
+                    break;
+                }
+
+                messageFactory.ReleaseMessage( message );
+            }
+        }
+
+        bool receivedAllMessages = true;
+
+        for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+        {
+            if ( numMessagesReceived[channelIndex] != NumMessagesSent )
+            {
+                receivedAllMessages = false;
+                break;
+            }
+        }
+
+        if ( receivedAllMessages )
+            break;
+    }
+
+    for ( int channelIndex = 0; channelIndex < NumChannels; ++channelIndex )
+    {
+        check( numMessagesReceived[channelIndex] == NumMessagesSent );
+    }
+}
+
+void test_connection_unreliable_unordered_messages()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    const int NumIterations = 256;
+
+    const int NumMessagesSent = 16;
+
+    for ( int j = 0; j < NumMessagesSent; ++j )
+    {
+        TestMessage * message = (TestMessage*) messageFactory.CreateMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = j;
+        sender.SendMessage( 0, message );
+    }
+
+    int numMessagesReceived = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetType() == TEST_MESSAGE );
+
+            TestMessage * testMessage = (TestMessage*) message;
+
+            check( testMessage->sequence == uint16_t( numMessagesReceived ) );
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+void test_connection_unreliable_unordered_blocks()
+{
+    TestMessageFactory messageFactory( GetDefaultAllocator() );
+
+    double time = 100.0;
+    
+    ConnectionConfig connectionConfig;
+    connectionConfig.numChannels = 1;
+    connectionConfig.channel[0].type = CHANNEL_TYPE_UNRELIABLE_UNORDERED;
+
+    Connection sender( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    Connection receiver( GetDefaultAllocator(), messageFactory, connectionConfig, time );
+
+    const int SenderPort = 10000;
+    const int ReceiverPort = 10001;
+
+    Address senderAddress( "::1", SenderPort );
+    Address receiverAddress( "::1", ReceiverPort );
+
+    const int NumIterations = 256;
+
+    const int NumMessagesSent = 8;
+
+    for ( int j = 0; j < NumMessagesSent; ++j )
+    {
+        TestBlockMessage * message = (TestBlockMessage*) messageFactory.CreateMessage( TEST_BLOCK_MESSAGE );
+        check( message );
+        message->sequence = j;
+        const int blockSize = 1 + ( j * 7 );
+        uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( messageFactory.GetAllocator(), blockSize );
+        for ( int k = 0; k < blockSize; ++k )
+            blockData[k] = j + k;
+        message->AttachBlock( messageFactory.GetAllocator(), blockData, blockSize );
+        sender.SendMessage( 0, message );
+    }
+
+    int numMessagesReceived = 0;
+
+    uint16_t senderSequence = 0;
+    uint16_t receiverSequence = 0;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpConnectionUpdate( connectionConfig, time, sender, receiver, senderSequence, receiverSequence, 0.1f, 0 );
+
+        while ( true )
+        {
+            Message * message = receiver.ReceiveMessage( 0 );
+            if ( !message )
+                break;
+
+            check( message->GetType() == TEST_BLOCK_MESSAGE );
+
+            TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+
+            check( blockMessage->sequence == uint16_t( numMessagesReceived ) );
+
+            const int blockSize = blockMessage->GetBlockSize();
+
+            check( blockSize == 1 + ( numMessagesReceived * 7 ) );
+
+            const uint8_t * blockData = blockMessage->GetBlockData();
+
+            check( blockData );
+
+            for ( int j = 0; j < blockSize; ++j )
+            {
+                check( blockData[j] == uint8_t( numMessagesReceived + j ) );
+            }
+
+            ++numMessagesReceived;
+
+            messageFactory.ReleaseMessage( message );
+        }
+
+        if ( numMessagesReceived == NumMessagesSent )
+            break;
+    }
+
+    check( numMessagesReceived == NumMessagesSent );
+}
+
+void PumpClientServerUpdate( double & time, Client ** client, int numClients, Server ** server, int numServers, float deltaTime = 0.1f )
+{
+    for ( int i = 0; i < numClients; ++i )
+        client[i]->SendPackets();
+
+    for ( int i = 0; i < numServers; ++i )
+        server[i]->SendPackets();
+
+    for ( int i = 0; i < numClients; ++i )
+        client[i]->ReceivePackets();
+
+    for ( int i = 0; i < numServers; ++i )
+        server[i]->ReceivePackets();
+
+    time += deltaTime;
+
+    for ( int i = 0; i < numClients; ++i )
+        client[i]->AdvanceTime( time );
+
+    for ( int i = 0; i < numServers; ++i )
+        server[i]->AdvanceTime( time );
+
+    yojimbo_sleep( 0.0f );
+}
+
+void PumpClientServerUpdate( double & time, Client ** client, int numClients, ServerHost & host, float deltaTime = 0.1f )
+{
+    for ( int i = 0; i < numClients; ++i )
+        client[i]->SendPackets();
+
+    host.SendPackets();
+
+    for ( int i = 0; i < numClients; ++i )
+        client[i]->ReceivePackets();
+
+    host.ReceivePackets();
+
+    time += deltaTime;
+
+    for ( int i = 0; i < numClients; ++i )
+        client[i]->AdvanceTime( time );
+
+    host.AdvanceTime( time );
+
+    yojimbo_sleep( 0.0f );
+}
+
+void SendClientToServerMessages( Client & client, int numMessagesToSend, int channelIndex = 0, bool blockMessages = true )
+{
+    for ( int i = 0; i < numMessagesToSend; ++i )
+    {
+        if ( !client.CanSendMessage( channelIndex ) )
+            break;
+
+        if ( !blockMessages || rand() % 10 )
+        {
+            TestMessage * message = (TestMessage*) client.CreateMessage( TEST_MESSAGE );
+            check( message );
+            message->sequence = i;
+            client.SendMessage( channelIndex, message );
+        }
+        else
+        {
+            TestBlockMessage * message = (TestBlockMessage*) client.CreateMessage( TEST_BLOCK_MESSAGE );
+            check( message );
+            message->sequence = i;
+            const int blockSize = 1 + ( ( i * 901 ) % 1001 );
+            uint8_t * blockData = client.AllocateBlock( blockSize );
+            check( blockData );
+            for ( int j = 0; j < blockSize; ++j )
+                blockData[j] = i + j;
+            client.AttachBlockToMessage( message, blockData, blockSize );
+            client.SendMessage( channelIndex, message );
+        }
+    }
+}
+
+void SendServerToClientMessages( Server & server, int clientIndex, int numMessagesToSend, int channelIndex = 0, bool blockMessages = true )
+{
+    for ( int i = 0; i < numMessagesToSend; ++i )
+    {
+        if ( !server.CanSendMessage( clientIndex, channelIndex ) )
+            break;
+
+        if ( !blockMessages || rand() % 10 )
+        {
+            TestMessage * message = (TestMessage*) server.CreateMessage( clientIndex, TEST_MESSAGE );
+            check( message );
+            message->sequence = i;
+            server.SendMessage( clientIndex, channelIndex, message );
+        }
+        else
+        {
+            TestBlockMessage * message = (TestBlockMessage*) server.CreateMessage( clientIndex, TEST_BLOCK_MESSAGE );
+            check( message );
+            message->sequence = i;
+            const int blockSize = 1 + ( ( i * 901 ) % 1001 );
+            uint8_t * blockData = server.AllocateBlock( clientIndex, blockSize );
+            check( blockData );
+            for ( int j = 0; j < blockSize; ++j )
+                blockData[j] = i + j;
+            server.AttachBlockToMessage( clientIndex, message, blockData, blockSize );
+            server.SendMessage( clientIndex, channelIndex, message );
+        }
+    }
+}
+
+void ProcessServerToClientMessages( Client & client, int & numMessagesReceivedFromServer )
+{
+    while ( true )
+    {
+        Message * message = client.ReceiveMessage( 0 );
+
+        if ( !message )
+            break;
+
+        check( message->GetId() == (int) numMessagesReceivedFromServer );
+        
+        switch ( message->GetType() )
+        {
+            case TEST_MESSAGE:
+            {
+                TestMessage * testMessage = (TestMessage*) message;
+                check( !message->IsBlockMessage() );
+                check( testMessage->sequence == uint16_t( numMessagesReceivedFromServer ) );
+                ++numMessagesReceivedFromServer;
+            }
+            break;
+
+            case TEST_BLOCK_MESSAGE:
+            {
+                check( message->IsBlockMessage() );
+                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+                check( blockMessage->sequence == uint16_t( numMessagesReceivedFromServer ) );
+                const int blockSize = blockMessage->GetBlockSize();
+                check( blockSize == 1 + ( ( numMessagesReceivedFromServer * 901 ) % 1001 ) );
+                const uint8_t * blockData = blockMessage->GetBlockData();
+                check( blockData );
+                for ( int j = 0; j < blockSize; ++j )
+                {
+                    check( blockData[j] == uint8_t( numMessagesReceivedFromServer + j ) );
+                }
+                ++numMessagesReceivedFromServer;
+            }
+            break;
+        }
+
+        client.ReleaseMessage( message );
+    }
+}
+
+void ProcessClientToServerMessages( Server & server, int clientIndex, int & numMessagesReceivedFromClient )
+{
+    while ( true )
+    {
+        Message * message = server.ReceiveMessage( clientIndex, 0 );
+
+        if ( !message )
+            break;
+
+        check( message->GetId() == (int) numMessagesReceivedFromClient );
+
+        switch ( message->GetType() )
+        {
+            case TEST_MESSAGE:
+            {
+                check( !message->IsBlockMessage() );
+                TestMessage * testMessage = (TestMessage*) message;
+                check( testMessage->sequence == uint16_t( numMessagesReceivedFromClient ) );
+                ++numMessagesReceivedFromClient;
+            }
+            break;
+
+            case TEST_BLOCK_MESSAGE:
+            {
+                check( message->IsBlockMessage() );
+                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+                check( blockMessage->sequence == uint16_t( numMessagesReceivedFromClient ) );
+                const int blockSize = blockMessage->GetBlockSize();
+                check( blockSize == 1 + ( ( numMessagesReceivedFromClient * 901 ) % 1001 ) );
+                const uint8_t * blockData = blockMessage->GetBlockData();
+                check( blockData );
+                for ( int j = 0; j < blockSize; ++j )
+                {
+                    check( blockData[j] == uint8_t( numMessagesReceivedFromClient + j ) );
+                }
+                ++numMessagesReceivedFromClient;
+            }
+            break;
+        }
+
+        server.ReleaseMessage( clientIndex, message );
+    }
+}
+
+void test_client_server_messages()
+{
+    const uint64_t clientId = 1;
+
+    Address clientAddress( "0.0.0.0", ClientPort );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+    
+    ClientServerConfig config;
+    config.channel[0].messageSendQueueSize = 32;
+    config.channel[0].maxMessagesPerPacket = 8;
+    config.channel[0].maxBlockSize = 1024;
+    config.channel[0].blockFragmentSize = 200;
+
+    Client client( GetDefaultAllocator(), clientAddress, config, adapter, time );
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    server.Start( MaxClients );
+
+    client.SetLatency( 250 );
+    client.SetJitter( 100 );
+    client.SetPacketLoss( 25 );
+    client.SetDuplicates( 25 );
+
+    server.SetLatency( 250 );
+    server.SetJitter( 100 );
+    server.SetPacketLoss( 25 );
+    server.SetDuplicates( 25 );
+
+    for ( int iteration = 0; iteration < 2; ++iteration )
+    {
+        client.InsecureConnect( privateKey, clientId, serverAddress );
+
+        const int NumIterations = 10000;
+
+        for ( int i = 0; i < NumIterations; ++i )
+        {
+            Client * clients[] = { &client };
+            Server * servers[] = { &server };
+            
+            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+
+            if ( client.ConnectionFailed() )
+                break;
+
+            if ( !client.IsConnecting() && client.IsConnected() && server.GetNumConnectedClients() == 1 )
+                break;
+        }
+
+        check( !client.IsConnecting() );
+        check( client.IsConnected() );
+        check( server.GetNumConnectedClients() == 1 );
+        check( client.GetClientIndex() == 0 );
+        check( server.IsClientConnected(0) );
+
+        const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+
+        SendClientToServerMessages( client, NumMessagesSent );
+
+        SendServerToClientMessages( server, client.GetClientIndex(), NumMessagesSent );
+
+        int numMessagesReceivedFromClient = 0;
+        int numMessagesReceivedFromServer = 0;
+
+        for ( int i = 0; i < NumIterations; ++i )
+        {
+            if ( !client.IsConnected() )
+                break;
+
+            Client * clients[] = { &client };
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+
+            ProcessServerToClientMessages( client, numMessagesReceivedFromServer );
+
+            ProcessClientToServerMessages( server, client.GetClientIndex(), numMessagesReceivedFromClient );
+
+            if ( numMessagesReceivedFromClient == NumMessagesSent && numMessagesReceivedFromServer == NumMessagesSent )
+                break;
+        }
+
+        check( client.IsConnected() );
+        check( server.IsClientConnected( client.GetClientIndex() ) );
+        check( numMessagesReceivedFromClient == NumMessagesSent );
+        check( numMessagesReceivedFromServer == NumMessagesSent );
+
+        client.Disconnect();
+
+        for ( int i = 0; i < NumIterations; ++i )
+        {
+            Client * clients[] = { &client };
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+
+            if ( !client.IsConnected() && server.GetNumConnectedClients() == 0 )
+                break;
+        }
+
+        check( !client.IsConnected() && server.GetNumConnectedClients() == 0 );
+    }
+
+    server.Stop();
+}
+
+void CreateClients( int numClients, Client ** clients, const Address & address, const ClientServerConfig & config, Adapter & _adapter, double time )
+{
+    for ( int i = 0; i < numClients; ++i )
+    {
+        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), address, config, _adapter, time );
+        clients[i]->SetLatency( 250 );
+        clients[i]->SetJitter( 100 );
+        clients[i]->SetPacketLoss( 25 );
+        clients[i]->SetDuplicates( 25 );
+    }
+}
+
+void ConnectClients( int numClients, Client ** clients, const uint8_t privateKey[], const Address & serverAddress )
+{
+    for ( int i = 0; i < numClients; ++i )
+    {
+        clients[i]->InsecureConnect( privateKey, i + 1, serverAddress );
+    }
+}
+
+void DestroyClients( int numClients, Client ** clients )
+{
+    for ( int i = 0; i < numClients; ++i )
+    {
+        clients[i]->Disconnect();
+
+        YOJIMBO_DELETE( GetDefaultAllocator(), Client, clients[i] );
+    }
+}
+
+bool AllClientsConnected( int numClients, Server & server, Client ** clients )
+{
+    if ( server.GetNumConnectedClients() != numClients )
+        return false;
+
+    for ( int i = 0; i < numClients; ++i )
+    {
+        if ( !clients[i]->IsConnected() )
+            return false;
+    }
+
+    return true;    
+}
+
+bool AnyClientDisconnected( int numClients, Client ** clients )
+{
+    for ( int i = 0; i < numClients; ++i )
+    {
+        if ( clients[i]->IsDisconnected() )
+            return true;
+    }
+
+    return false;
+}
+
+bool AllClientsConnected( int numClients, Server ** servers, int numServers, Client ** clients )
+{
+    const int clientsPerServer = numClients / numServers;
+
+    for ( int i = 0; i < numServers; ++i )
+    {
+        if ( !AllClientsConnected( clientsPerServer, *servers[i], clients + i * clientsPerServer ) )
+            return false;
+    }
+
+    return true;
+}
+
+// connect clients, then send messages both ways and check every message is received. clients are split evenly across servers, in order.
+// pass in a server host to update servers through the host. returns the number of updates it took.
+
+int ConnectClientsAndExchangeMessages( double & time, Client ** clients, int numClients, Server ** servers, int numServers, const uint8_t privateKey[], const Address & serverAddress, int numMessagesSent, bool blockMessages = true, ServerHost * host = NULL )
+{
+    const int MaxTestClients = 2 * MaxClients;
+    const int NumIterations = 10000;
+
+    check( numClients <= MaxTestClients );
+    check( numClients % numServers == 0 );
+
+    const int clientsPerServer = numClients / numServers;
+
+    int numUpdates = 0;
+
+    ConnectClients( numClients, clients, privateKey, serverAddress );
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        if ( host )
+            PumpClientServerUpdate( time, clients, numClients, *host );
+        else
+            PumpClientServerUpdate( time, clients, numClients, servers, numServers );
+
+        numUpdates++;
+
+        if ( AnyClientDisconnected( numClients, clients ) )
+            break;
+
+        if ( AllClientsConnected( numClients, servers, numServers, clients ) )
+            break;
+    }
+
+    check( AllClientsConnected( numClients, servers, numServers, clients ) );
+
+    if ( numMessagesSent == 0 )
+        return numUpdates;
+
+    for ( int i = 0; i < numClients; ++i )
+    {
+        SendClientToServerMessages( *clients[i], numMessagesSent, 0, blockMessages );
+        SendServerToClientMessages( *servers[i / clientsPerServer], clients[i]->GetClientIndex(), numMessagesSent, 0, blockMessages );
+    }
+
+    int numMessagesReceivedFromClient[MaxTestClients];
+    int numMessagesReceivedFromServer[MaxTestClients];
+
+    memset( numMessagesReceivedFromClient, 0, sizeof( numMessagesReceivedFromClient ) );
+    memset( numMessagesReceivedFromServer, 0, sizeof( numMessagesReceivedFromServer ) );
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        if ( host )
+            PumpClientServerUpdate( time, clients, numClients, *host );
+        else
+            PumpClientServerUpdate( time, clients, numClients, servers, numServers );
+
+        numUpdates++;
+
+        bool allMessagesReceived = true;
+
+        for ( int j = 0; j < numClients; ++j )
+        {
+            ProcessServerToClientMessages( *clients[j], numMessagesReceivedFromServer[j] );
+
+            if ( numMessagesReceivedFromServer[j] != numMessagesSent )
+                allMessagesReceived = false;
+
+            ProcessClientToServerMessages( *servers[j / clientsPerServer], clients[j]->GetClientIndex(), numMessagesReceivedFromClient[j] );
+
+            if ( numMessagesReceivedFromClient[j] != numMessagesSent )
+                allMessagesReceived = false;
+        }
+
+        if ( allMessagesReceived )
+            break;
+    }
+
+    for ( int i = 0; i < numClients; ++i )
+    {
+        check( numMessagesReceivedFromServer[i] == numMessagesSent );
+        check( numMessagesReceivedFromClient[i] == numMessagesSent );
+    }
+
+    return numUpdates;
+}
+
+void test_client_server_start_stop_restart()
+{
+    Address clientAddress( "0.0.0.0", 0 );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+    
+    ClientServerConfig config;
+    config.channel[0].messageSendQueueSize = 32;
+    config.channel[0].maxMessagesPerPacket = 8;
+    config.channel[0].maxBlockSize = 1024;
+    config.channel[0].blockFragmentSize = 200;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    server.Start( MaxClients );
+
+    server.SetLatency( 250 );
+    server.SetJitter( 100 );
+    server.SetPacketLoss( 25 );
+    server.SetDuplicates( 25 );
+
+    int numClients[] = { 3, 5, 1 };
+
+    const int NumIterations = sizeof( numClients ) / sizeof( int );
+
+    for ( int iteration = 0; iteration < NumIterations; ++iteration )
+    {
+        server.Start( numClients[iteration] );
+
+        Client * clients[MaxClients];
+
+        CreateClients( numClients[iteration], clients, clientAddress, config, adapter, time );
+
+        ConnectClients( numClients[iteration], clients, privateKey, serverAddress );
+
+        while ( true )
+        {
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, (Client**) clients, numClients[iteration], servers, 1 );
+
+            if ( AnyClientDisconnected( numClients[iteration], clients ) )
+                break;
+
+            if ( AllClientsConnected( numClients[iteration], server, clients ) )
+                break;
+        }
+
+        check( AllClientsConnected( numClients[iteration], server, clients ) );
+
+        const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+
+        for ( int clientIndex = 0; clientIndex < numClients[iteration]; ++clientIndex )
+        {
+            SendClientToServerMessages( *clients[clientIndex], NumMessagesSent );
+            SendServerToClientMessages( server, clientIndex, NumMessagesSent );
+        }
+
+        int numMessagesReceivedFromClient[MaxClients];
+        int numMessagesReceivedFromServer[MaxClients];
+
+        memset( numMessagesReceivedFromClient, 0, sizeof( numMessagesReceivedFromClient ) );
+        memset( numMessagesReceivedFromServer, 0, sizeof( numMessagesReceivedFromServer ) );
+
+		const int NumInternalIterations = 10000;
+
+        for ( int i = 0; i < NumInternalIterations; ++i )
+        {
+            Server * servers[] = { &server };
+
+            PumpClientServerUpdate( time, clients, numClients[iteration], servers, 1 );
+
+            bool allMessagesReceived = true;
+
+            for ( int j = 0; j < numClients[iteration]; ++j )
+            {
+                ProcessServerToClientMessages( *clients[j], numMessagesReceivedFromServer[j] );
+
+                if ( numMessagesReceivedFromServer[j] != NumMessagesSent )
+                    allMessagesReceived = false;
+
+                int clientIndex = clients[j]->GetClientIndex();
+
+                ProcessClientToServerMessages( server, clientIndex, numMessagesReceivedFromClient[clientIndex] );
+
+                if ( numMessagesReceivedFromClient[clientIndex] != NumMessagesSent )
+                    allMessagesReceived = false;
+            }
+
+            if ( allMessagesReceived )
+                break;
+        }
+
+        for ( int clientIndex = 0; clientIndex < numClients[iteration]; ++clientIndex )
+        {
+            check( numMessagesReceivedFromClient[clientIndex] == NumMessagesSent );
+            check( numMessagesReceivedFromServer[clientIndex] == NumMessagesSent );
+        }
+
+        DestroyClients( numClients[iteration], clients );
+
+        server.Stop();
+    }
+}
+
+uint64_t GetServerBytesPerClient( const ClientServerConfig & config )
+{
+    CountingAllocator allocator( GetDefaultAllocator() );
+
+    MemoryServerTransport serverTransport( GetDefaultAllocator() );
+
+    Server server( allocator, serverTransport, config, adapter, 100.0 );
+
+    server.Start( 1 );
+
+    const uint64_t oneClientBytes = allocator.GetCurrentBytes();
+
+    server.Start( 2 );
+
+    const uint64_t twoClientBytes = allocator.GetCurrentBytes();
+
+    server.Stop();
+
+    return twoClientBytes - oneClientBytes;
+}
+
+void test_client_server_lightweight_clients()
+{
+    Address clientAddress( "0.0.0.0", 0 );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    ClientServerConfig config;
+    config.SetLightweightClientProfile();
+
+    // each lightweight client slot should cost the server a small fraction of a default client slot
+
+    ClientServerConfig defaultConfig;
+
+    const uint64_t bytesPerClient = GetServerBytesPerClient( config );
+    const uint64_t defaultBytesPerClient = GetServerBytesPerClient( defaultConfig );
+
+    check( bytesPerClient >= uint64_t( config.serverPerClientMemory ) );
+    check( bytesPerClient < uint64_t( config.serverPerClientMemory ) * 2 );
+    check( bytesPerClient * 16 < defaultBytesPerClient );
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    const int NumClients = 2 * MaxClients;
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    server.Start( NumClients );
+
+    check( server.GetMaxClients() == NumClients );
+
+    Client * clients[NumClients];
+
+    CreateClients( NumClients, clients, clientAddress, config, adapter, time );
+
+    Server * servers[] = { &server };
+
+    ConnectClientsAndExchangeMessages( time, clients, NumClients, servers, 1, privateKey, serverAddress, config.channel[0].messageSendQueueSize, false );
+
+    DestroyClients( NumClients, clients );
+
+    server.Stop();
+}
+
+void test_client_server_worker_threads()
+{
+    Address clientAddress( "0.0.0.0", 0 );
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    ClientServerConfig config;
+    config.channel[0].messageSendQueueSize = 32;
+    config.channel[0].maxMessagesPerPacket = 8;
+    config.channel[0].maxBlockSize = 1024;
+    config.channel[0].blockFragmentSize = 200;
+    config.serverWorkerThreads = 3;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    const int NumClients = 8;
+
+    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    server.Start( NumClients );
+
+    const WorkerPool * workerPool = server.GetWorkerPool();
+    check( workerPool );
+    check( workerPool->GetNumThreads() == config.serverWorkerThreads );
+    check( workerPool->GetNumWorkerTasks() == 0 );
+
+    Client * clients[NumClients];
+
+    CreateClients( NumClients, clients, clientAddress, config, adapter, time );
+
+    Server * servers[] = { &server };
+
+    ConnectClientsAndExchangeMessages( time, clients, NumClients, servers, 1, privateKey, serverAddress, config.channel[0].messageSendQueueSize );
+
+    // per-client work should have been picked up by the worker threads, not just the thread updating the server
+
+    check( workerPool->GetNumWorkerTasks() > 0 );
+
+    DestroyClients( NumClients, clients );
+
+    server.Stop();
+
+    check( server.GetWorkerPool() == NULL );
+}
+
+void test_client_server_memory_transport()
+{
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    ClientServerConfig config;
+    config.channel[0].messageSendQueueSize = 32;
+    config.channel[0].maxMessagesPerPacket = 8;
+    config.channel[0].maxBlockSize = 1024;
+    config.channel[0].blockFragmentSize = 200;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    const int NumClients = 4;
+
+    MemoryServerTransport serverTransport( GetDefaultAllocator() );
+
+    Server server( GetDefaultAllocator(), serverTransport, config, adapter, time );
+
+    server.Start( NumClients );
+
+    check( server.IsRunning() );
+
+    MemoryClientTransport * clientTransports[NumClients];
+    Client * clients[NumClients];
+
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        clientTransports[i] = YOJIMBO_NEW( GetDefaultAllocator(), MemoryClientTransport, GetDefaultAllocator(), serverTransport );
+        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), *clientTransports[i], config, adapter, time );
+    }
+
+    Server * servers[] = { &server };
+
+    ConnectClientsAndExchangeMessages( time, clients, NumClients, servers, 1, privateKey, serverAddress, config.channel[0].messageSendQueueSize );
+
+    // memory transports never open a socket, so a socket server can start on the server port while the memory server is running
+
+    check( server.GetAddress().GetPort() == 0 );
+
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        check( clients[i]->GetAddress().GetPort() == 0 );
+    }
+
+    Server socketServer( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+
+    socketServer.Start( 1 );
+
+    check( socketServer.IsRunning() );
+    check( socketServer.GetAddress().GetPort() == ServerPort );
+
+    socketServer.Stop();
+
+    // one more client than there are client slots should be denied
+
+    MemoryClientTransport extraClientTransport( GetDefaultAllocator(), serverTransport );
+
+    Client extraClient( GetDefaultAllocator(), extraClientTransport, config, adapter, time );
+
+    extraClient.InsecureConnect( privateKey, NumClients + 1, serverAddress );
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        Client * extraClients[] = { &extraClient };
+
+        PumpClientServerUpdate( time, extraClients, 1, servers, 1 );
+
+        if ( !extraClient.IsConnecting() )
+            break;
+    }
+
+    check( extraClient.ConnectionFailed() );
+
+    // disconnect one client from the client side, and one from the server side
+
+    const int serverDisconnectedClientIndex = clients[1]->GetClientIndex();
+
+    clients[0]->Disconnect();
+
+    server.DisconnectClient( serverDisconnectedClientIndex );
+
+    for ( int i = 0; i < 10; ++i )
+    {
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+    }
+
+    check( clients[0]->IsDisconnected() );
+    check( clients[1]->IsDisconnected() );
+    check( server.GetNumConnectedClients() == NumClients - 2 );
+
+    // the connected client list should hold exactly the connected client slots
+
+    const int * connectedClients = server.GetConnectedClients();
+
+    for ( int i = 2; i < NumClients; ++i )
+    {
+        const int clientIndex = clients[i]->GetClientIndex();
+        check( server.IsClientConnected( clientIndex ) );
+        int count = 0;
+        for ( int j = 0; j < server.GetNumConnectedClients(); ++j )
+        {
+            if ( connectedClients[j] == clientIndex )
+                count++;
+        }
+        check( count == 1 );
+    }
+
+    check( !server.IsClientConnected( serverDisconnectedClientIndex ) );
+
+    extraClient.Disconnect();
+
+    DestroyClients( NumClients, clients );
+
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        YOJIMBO_DELETE( GetDefaultAllocator(), MemoryClientTransport, clientTransports[i] );
+    }
+
+    server.Stop();
+}
+
+class CountingMemoryServerTransport : public MemoryServerTransport
+{
+public:
+
+    explicit CountingMemoryServerTransport( Allocator & allocator ) : MemoryServerTransport( allocator )
+    {
+        numSendCalls = 0;
+        numPacketsSent = 0;
+    }
+
+    void SendPackets( const TransportPacket * packets, int numPackets )
+    {
+        numSendCalls++;
+        numPacketsSent += numPackets;
+        MemoryServerTransport::SendPackets( packets, numPackets );
+    }
+
+    int numSendCalls;
+    int numPacketsSent;
+};
+
+void test_client_server_batched_send()
+{
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    ClientServerConfig config;
+    config.serverWorkerThreads = 2;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    const int NumClients = 4;
+
+    CountingMemoryServerTransport serverTransport( GetDefaultAllocator() );
+
+    Server server( GetDefaultAllocator(), serverTransport, config, adapter, time );
+
+    server.Start( NumClients );
+
+    MemoryClientTransport * clientTransports[NumClients];
+    Client * clients[NumClients];
+
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        clientTransports[i] = YOJIMBO_NEW( GetDefaultAllocator(), MemoryClientTransport, GetDefaultAllocator(), serverTransport );
+        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), *clientTransports[i], config, adapter, time );
+    }
+
+    Server * servers[] = { &server };
+
+    const int numUpdates = ConnectClientsAndExchangeMessages( time, clients, NumClients, servers, 1, privateKey, serverAddress, 32 );
+
+    // sends from every client go to the transport in at most one batch per update
+
+    check( serverTransport.numSendCalls > 0 );
+    check( serverTransport.numSendCalls <= numUpdates );
+    check( serverTransport.numPacketsSent >= serverTransport.numSendCalls );
+
+    // once all clients are connected, each call to send packets should pass one packet per-client to the transport in a single batch
+
+    for ( int i = 0; i < 10; ++i )
+    {
+        serverTransport.numSendCalls = 0;
+        serverTransport.numPacketsSent = 0;
+
+        server.SendPackets();
+
+        check( serverTransport.numSendCalls == 1 );
+        check( serverTransport.numPacketsSent == NumClients );
+
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+    }
+
+    DestroyClients( NumClients, clients );
+
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        YOJIMBO_DELETE( GetDefaultAllocator(), MemoryClientTransport, clientTransports[i] );
+    }
+
+    server.Stop();
+}
+
+void test_client_server_wakeup_time()
+{
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    ClientServerConfig config;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    MemoryServerTransport serverTransport( GetDefaultAllocator() );
+
+    Server server( GetDefaultAllocator(), serverTransport, config, adapter, time );
+
+    server.Start( 1 );
+
+    MemoryClientTransport clientTransport( GetDefaultAllocator(), serverTransport );
+
+    Client client( GetDefaultAllocator(), clientTransport, config, adapter, time );
+
+    client.InsecureConnect( privateKey, 1, serverAddress );
+
+    // the client connects on the next update, so both sides want to wake up now
+
+    check( client.GetNextWakeupTime() <= time );
+
+    Client * clients[] = { &client };
+    Server * servers[] = { &server };
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpClientServerUpdate( time, clients, 1, servers, 1 );
+
+        if ( client.ConnectionFailed() )
+            break;
+
+        if ( client.IsConnected() && server.IsClientConnected( client.GetClientIndex() ) )
+            break;
+    }
+
+    check( client.IsConnected() );
+
+    PumpClientServerUpdate( time, clients, 1, servers, 1 );
+
+    // nothing to send: sleep as long as possible
+
+    check( server.GetNextWakeupTime() == time + MaxWakeupInterval );
+    check( client.GetNextWakeupTime() == time + MaxWakeupInterval );
+    check( !server.Poll( 0.0 ) );
+    check( !client.Poll( 0.0 ) );
+
+    // queued messages go out with the next packet, then wait for the resend time
+
+    const int NumMessagesSent = 8;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
+    {
+        TestMessage * message = (TestMessage*) server.CreateMessage( client.GetClientIndex(), TEST_MESSAGE );
+        check( message );
+        message->sequence = i;
+        server.SendMessage( client.GetClientIndex(), 0, message );
+    }
+
+    check( server.GetNextWakeupTime() <= time );
+
+    server.SendPackets();
+
+    check( server.GetNextWakeupTime() == time + config.channel[0].messageResendTime );
+    check( client.Poll( 0.0 ) );
+
+    // received messages must be acked, so the client wakes up until it sends a packet
+
+    client.ReceivePackets();
+
+    check( client.GetNextWakeupTime() <= time );
+
+    client.SendPackets();
+
+    check( client.GetNextWakeupTime() > time );
+    check( server.Poll( 0.0 ) );
+
+    server.ReceivePackets();
+
+    time += 0.01;
+
+    client.AdvanceTime( time );
+    server.AdvanceTime( time );
+
+    // once the messages are acked the server is idle again
+
+    check( server.GetNextWakeupTime() == time + MaxWakeupInterval );
+
+    int numMessagesReceivedFromServer = 0;
+
+    ProcessServerToClientMessages( client, numMessagesReceivedFromServer );
+
+    check( numMessagesReceivedFromServer == NumMessagesSent );
+
+    client.Disconnect();
+
+    server.Stop();
+}
+
+void test_client_server_profile()
+{
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    ClientServerConfig config;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    MemoryServerTransport serverTransport( GetDefaultAllocator() );
+
+    Server server( GetDefaultAllocator(), serverTransport, config, adapter, time );
+
+    server.Start( 1 );
+
+    MemoryClientTransport clientTransport( GetDefaultAllocator(), serverTransport );
+
+    Client client( GetDefaultAllocator(), clientTransport, config, adapter, time );
+
+    client.InsecureConnect( privateKey, 1, serverAddress );
+
+    Client * clients[] = { &client };
+    Server * servers[] = { &server };
+
+    const int NumIterations = 100;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpClientServerUpdate( time, clients, 1, servers, 1 );
+    }
+
+    check( client.IsConnected() );
+
+    const int clientIndex = client.GetClientIndex();
+
+    TimingStats stats;
+
+#if YOJIMBO_PROFILE
+
+    for ( int i = 0; i < SERVER_PROFILE_NUM_PHASES; ++i )
+    {
+        if ( i == SERVER_PROFILE_NETWORK_SIMULATOR )
+            continue;
+        check( server.GetPhaseTimingStats( (ServerProfilePhase) i, stats ) );
+        check( stats.numSamples == NumIterations );
+        check( stats.p50 <= stats.p99 );
+        check( stats.p99 <= stats.max );
+    }
+
+    for ( int i = 0; i < CLIENT_PROFILE_NUM_TIMINGS; ++i )
+    {
+        check( server.GetClientTimingStats( clientIndex, (ClientProfileTiming) i, stats ) );
+        check( stats.numSamples > 0 );
+    }
+
+    check( server.GetChannelTimingStats( 0, stats ) );
+    check( stats.numSamples > 0 );
+
+    server.ResetTimingStats();
+
+    check( server.GetPhaseTimingStats( SERVER_PROFILE_SEND_PACKETS, stats ) );
+    check( stats.numSamples == 0 );
+
+#else // #if YOJIMBO_PROFILE
+
+    // profiling is compiled out
+
+    check( !server.GetPhaseTimingStats( SERVER_PROFILE_SEND_PACKETS, stats ) );
+    check( !server.GetClientTimingStats( clientIndex, CLIENT_PROFILE_GENERATE_PACKET, stats ) );
+    check( !server.GetChannelTimingStats( 0, stats ) );
+
+#endif // #if YOJIMBO_PROFILE
+
+    client.Disconnect();
+
+    server.Stop();
+}
+
+void test_server_host()
+{
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    ClientServerConfig config;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    const int NumServers = 3;
+    const int ClientsPerServer = 2;
+    const int NumClients = NumServers * ClientsPerServer;
+    const int TransportMemory = 1024 * 1024;
+
+    ServerHost host( GetDefaultAllocator(), NumServers, 2, config.serverPerClientMemory, time );
+
+    // servers are updated in parallel, so each server and its clients get their own transport allocator
+
+    uint8_t * transportMemory[NumServers];
+    TLSF_Allocator * transportAllocators[NumServers];
+    MemoryServerTransport * serverTransports[NumServers];
+    MemoryClientTransport * clientTransports[NumClients];
+    Server * servers[NumServers];
+    Client * clients[NumClients];
+
+    for ( int i = 0; i < NumServers; ++i )
+    {
+        transportMemory[i] = (uint8_t*) malloc( TransportMemory );
+        transportAllocators[i] = YOJIMBO_NEW( GetDefaultAllocator(), TLSF_Allocator, transportMemory[i], TransportMemory );
+        serverTransports[i] = YOJIMBO_NEW( GetDefaultAllocator(), MemoryServerTransport, *transportAllocators[i] );
+        servers[i] = host.CreateServer( *serverTransports[i], config, adapter );
+        check( servers[i] );
+        servers[i]->Start( ClientsPerServer );
+        check( servers[i]->IsRunning() );
+    }
+
+    check( host.GetNumServers() == NumServers );
+    check( host.CreateServer( *serverTransports[0], config, adapter ) == NULL );
+
+    SlabPool & slabPool = host.GetClientMemoryPool();
+
+    check( slabPool.GetNumSlabs() == NumClients );
+    check( slabPool.GetNumFreeSlabs() == 0 );
+
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        const int serverIndex = i / ClientsPerServer;
+        clientTransports[i] = YOJIMBO_NEW( GetDefaultAllocator(), MemoryClientTransport, *transportAllocators[serverIndex], *serverTransports[serverIndex] );
+        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), *clientTransports[i], config, adapter, time );
+    }
+
+    ConnectClientsAndExchangeMessages( time, clients, NumClients, servers, NumServers, privateKey, serverAddress, 32, true, &host );
+
+    for ( int i = 0; i < NumServers; ++i )
+    {
+        check( servers[i]->GetTime() == host.GetTime() );
+    }
+
+    DestroyClients( NumClients, clients );
+
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        YOJIMBO_DELETE( GetDefaultAllocator(), MemoryClientTransport, clientTransports[i] );
+    }
+
+    // a new server reuses the per-client memory of the server it replaces
+
+    const int numSlabs = slabPool.GetNumSlabs();
+
+    host.DestroyServer( servers[0] );
+
+    check( host.GetNumServers() == NumServers - 1 );
+    check( slabPool.GetNumSlabs() - slabPool.GetNumFreeSlabs() == NumClients - ClientsPerServer );
+
+    servers[0] = host.CreateServer( *serverTransports[0], config, adapter );
+    check( servers[0] );
+    servers[0]->Start( ClientsPerServer );
+
+    check( slabPool.GetNumSlabs() == numSlabs );
+    check( slabPool.GetNumSlabs() - slabPool.GetNumFreeSlabs() == NumClients );
+
+    // clients of the new server run on the reused memory
+
+    for ( int i = 0; i < ClientsPerServer; ++i )
+    {
+        clientTransports[i] = YOJIMBO_NEW( GetDefaultAllocator(), MemoryClientTransport, *transportAllocators[0], *serverTransports[0] );
+        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), *clientTransports[i], config, adapter, time );
+    }
+
+    ConnectClientsAndExchangeMessages( time, clients, ClientsPerServer, servers, 1, privateKey, serverAddress, 32, true, &host );
+
+    check( slabPool.GetNumSlabs() == numSlabs );
+
+    DestroyClients( ClientsPerServer, clients );
+
+    for ( int i = 0; i < ClientsPerServer; ++i )
+    {
+        YOJIMBO_DELETE( GetDefaultAllocator(), MemoryClientTransport, clientTransports[i] );
+    }
+
+    for ( int i = 0; i < NumServers; ++i )
+    {
+        host.DestroyServer( servers[i] );
+        YOJIMBO_DELETE( GetDefaultAllocator(), MemoryServerTransport, serverTransports[i] );
+        YOJIMBO_DELETE( GetDefaultAllocator(), TLSF_Allocator, transportAllocators[i] );
+        free( transportMemory[i] );
+    }
+
+    check( host.GetNumServers() == 0 );
+    check( slabPool.GetNumFreeSlabs() == slabPool.GetNumSlabs() );
+}
+
+static Message * CreateEntityMessage( void * context, int clientIndex, int entityId )
+{
+    Server * server = (Server*) context;
+    TestMessage * message = (TestMessage*) server->CreateMessage( clientIndex, TEST_MESSAGE );
+    if ( message )
+        message->sequence = uint16_t( entityId );
+    return message;
+}
+
+void test_client_server_interest_management()
+{
+    Address serverAddress( "127.0.0.1", ServerPort );
+
+    double time = 100.0;
+
+    ClientServerConfig config;
+
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
+
+    const int NumClients = 2;
+
+    MemoryServerTransport serverTransport( GetDefaultAllocator() );
+
+    Server server( GetDefaultAllocator(), serverTransport, config, adapter, time );
+
+    server.Start( NumClients );
+
+    MemoryClientTransport * clientTransports[NumClients];
+    Client * clients[NumClients];
+
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        clientTransports[i] = YOJIMBO_NEW( GetDefaultAllocator(), MemoryClientTransport, GetDefaultAllocator(), serverTransport );
+        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), *clientTransports[i], config, adapter, time );
+    }
+
+    ConnectClients( NumClients, clients, privateKey, serverAddress );
+
+    const int NumIterations = 10000;
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+
+        if ( AnyClientDisconnected( NumClients, clients ) )
+            break;
+
+        if ( AllClientsConnected( NumClients, server, clients ) )
+            break;
+    }
+
+    check( AllClientsConnected( NumClients, server, clients ) );
+
+    // entities 0-3 are near the first client, 4-5 are near the second client, 6 is in a group with the second client and 7 is relevant to nobody
+
+    const int NumEntities = 8;
+
+    const float entityX[NumEntities] = { 0.0f, 3.0f, 6.0f, 9.0f, 100.0f, 105.0f, 50.0f, -50.0f };
+
+    const uint64_t entityGroups[NumEntities] = { 0, 0, 0, 0, 0, 0, 1, 0 };
+
+    const bool entityRelevant[NumClients][NumEntities] =
+    {
+        { true, true, true, true, false, false, false, false },
+        { false, false, false, false, true, true, true, false },
+    };
+
+    InterestManager interest( GetDefaultAllocator(), 16, NumClients, NumEntities, 10.0f );
+
+    for ( int i = 0; i < NumEntities; ++i )
+    {
+        check( interest.AddEntity( entityX[i], 0.0f, entityGroups[i] ) == i );
+    }
+
+    check( interest.GetNumEntities() == NumEntities );
+
+    const int clientIndex0 = clients[0]->GetClientIndex();
+    const int clientIndex1 = clients[1]->GetClientIndex();
+
+    interest.SetClientView( clientIndex0, 0.0f, 0.0f, 10.0f );
+    interest.SetClientView( clientIndex1, 100.0f, 0.0f, 10.0f );
+    interest.SetClientGroups( clientIndex1, 1 );
+
+    interest.Update();
+
+    const InterestManager::RelevantEntity * entities = NULL;
+
+    check( interest.GetRelevantEntities( clientIndex0, entities ) == 4 );
+    for ( int i = 0; i < 4; ++i )
+    {
+        check( entities[i].entityId == i );
+        check( entities[i].priority == 1.0f );
+    }
+
+    check( interest.GetRelevantEntities( clientIndex1, entities ) == 3 );
+
+    // only two entities fit per-client, per-tick. the ones left out accumulate priority and go first next tick
+
+    const int MaxEntitiesPerClient = 2;
+
+    check( server.SendEntityMessages( interest, 0, MaxEntitiesPerClient, CreateEntityMessage, &server ) == 2 * MaxEntitiesPerClient );
+
+    interest.Update();
+
+    check( interest.GetRelevantEntities( clientIndex0, entities ) == 4 );
+    check( entities[0].entityId == 2 && entities[0].priority == 2.0f );
+    check( entities[1].entityId == 3 && entities[1].priority == 2.0f );
+    check( entities[2].entityId == 0 && entities[2].priority == 1.0f );
+
+    // every relevant entity reaches its client, and nothing else does
+
+    bool entityReceived[NumClients][NumEntities];
+    memset( entityReceived, 0, sizeof( entityReceived ) );
+
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        server.SendEntityMessages( interest, 0, MaxEntitiesPerClient, CreateEntityMessage, &server );
+
+        Server * servers[] = { &server };
+
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+
+        interest.Update();
+
+        for ( int j = 0; j < NumClients; ++j )
+        {
+            while ( true )
+            {
+                Message * message = clients[j]->ReceiveMessage( 0 );
+                if ( !message )
+                    break;
+                check( message->GetType() == TEST_MESSAGE );
+                const int entityId = ( (TestMessage*) message )->sequence;
+                check( entityId < NumEntities );
+                check( entityRelevant[j][entityId] );
+                entityReceived[j][entityId] = true;
+                clients[j]->ReleaseMessage( message );
             }
-            break;
         }
 
-        server.ReleaseMessage( clientIndex, message );
+        if ( memcmp( entityReceived, entityRelevant, sizeof( entityReceived ) ) == 0 )
+            break;
     }
-}
 
-void test_client_server_messages()
-{
-    const uint64_t clientId = 1;
+    check( memcmp( entityReceived, entityRelevant, sizeof( entityReceived ) ) == 0 );
 
-    Address clientAddress( "0.0.0.0", ClientPort );
-    Address serverAddress( "127.0.0.1", ServerPort );
+    // removed clients and entities are no longer relevant
 
-    double time = 100.0;
-    
-    ClientServerConfig config;
-    config.channel[0].messageSendQueueSize = 32;
-    config.channel[0].maxMessagesPerPacket = 8;
-    config.channel[0].maxBlockSize = 1024;
-    config.channel[0].blockFragmentSize = 200;
+    interest.RemoveEntity( 6 );
+    interest.RemoveClient( clientIndex0 );
+    interest.Update();
 
-    Client client( GetDefaultAllocator(), clientAddress, config, adapter, time );
+    check( interest.GetRelevantEntities( clientIndex0, entities ) == 0 );
+    check( interest.GetRelevantEntities( clientIndex1, entities ) == 2 );
+    check( interest.GetNumEntities() == NumEntities - 1 );
 
-    uint8_t privateKey[KeyBytes];
-    memset( privateKey, 0, KeyBytes );
+    // clients only keep their highest priority entities
 
-    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+    InterestManager smallInterest( GetDefaultAllocator(), 16, NumClients, 2, 10.0f );
 
-    server.Start( MaxClients );
+    for ( int i = 0; i < 4; ++i )
+    {
+        check( smallInterest.AddEntity( 0.0f, 0.0f, 0, float( i + 1 ) ) == i );
+    }
 
-    client.SetLatency( 250 );
-    client.SetJitter( 100 );
-    client.SetPacketLoss( 25 );
-    client.SetDuplicates( 25 );
+    smallInterest.SetClientView( 0, 0.0f, 0.0f, 10.0f );
+    smallInterest.Update();
 
-    server.SetLatency( 250 );
-    server.SetJitter( 100 );
-    server.SetPacketLoss( 25 );
-    server.SetDuplicates( 25 );
+    check( smallInterest.GetRelevantEntities( 0, entities ) == 2 );
+    check( entities[0].entityId == 3 && entities[0].priority == 4.0f );
+    check( entities[1].entityId == 2 && entities[1].priority == 3.0f );
 
-    for ( int iteration = 0; iteration < 2; ++iteration )
+    // entities left out by the cap keep accumulating priority, so with more relevant entities than the cap, and more than fit per-tick, every entity is still sent
+
+    const int NumCappedEntities = 8;
+    const int MaxCappedRelevantEntities = 4;
+    const int MaxCappedEntitiesPerTick = 2;
+
+    InterestManager cappedInterest( GetDefaultAllocator(), 16, NumClients, MaxCappedRelevantEntities, 10.0f );
+
+    for ( int i = 0; i < NumCappedEntities; ++i )
     {
-        client.InsecureConnect( privateKey, clientId, serverAddress );
+        check( cappedInterest.AddEntity( 0.0f, 0.0f ) == i );
+    }
 
-        const int NumIterations = 10000;
+    cappedInterest.SetClientView( 0, 0.0f, 0.0f, 10.0f );
 
-        for ( int i = 0; i < NumIterations; ++i )
-        {
-            Client * clients[] = { &client };
-            Server * servers[] = { &server };
-            
-            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+    bool entitySent[NumCappedEntities];
+    memset( entitySent, 0, sizeof( entitySent ) );
 
-            if ( client.ConnectionFailed() )
-                break;
+    int numEntitiesSent = 0;
 
-            if ( !client.IsConnecting() && client.IsConnected() && server.GetNumConnectedClients() == 1 )
-                break;
+    for ( int i = 0; i < 100 && numEntitiesSent < NumCappedEntities; ++i )
+    {
+        cappedInterest.Update();
+
+        check( cappedInterest.GetRelevantEntities( 0, entities ) == MaxCappedRelevantEntities );
+
+        for ( int j = 0; j < MaxCappedEntitiesPerTick; ++j )
+        {
+            const int entityId = entities[j].entityId;
+            if ( !entitySent[entityId] )
+                numEntitiesSent++;
+            entitySent[entityId] = true;
+            cappedInterest.MarkSent( 0, entityId );
         }
+    }
 
-        check( !client.IsConnecting() );
-        check( client.IsConnected() );
-        check( server.GetNumConnectedClients() == 1 );
-        check( client.GetClientIndex() == 0 );
-        check( server.IsClientConnected(0) );
+    check( numEntitiesSent == NumCappedEntities );
 
-        const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+    DestroyClients( NumClients, clients );
 
-        SendClientToServerMessages( client, NumMessagesSent );
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        YOJIMBO_DELETE( GetDefaultAllocator(), MemoryClientTransport, clientTransports[i] );
+    }
 
-        SendServerToClientMessages( server, client.GetClientIndex(), NumMessagesSent );
+    server.Stop();
+}
 
-        int numMessagesReceivedFromClient = 0;
-        int numMessagesReceivedFromServer = 0;
+void test_client_server_broadcast_message()
+{
+    Address serverAddress( "127.0.0.1", ServerPort );
 
-        for ( int i = 0; i < NumIterations; ++i )
-        {
-            if ( !client.IsConnected() )
-                break;
+    double time = 100.0;
 
-            Client * clients[] = { &client };
-            Server * servers[] = { &server };
+    ClientServerConfig config;
+    config.channel[0].messageSendQueueSize = 64;
 
-            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+    uint8_t privateKey[KeyBytes];
+    memset( privateKey, 0, KeyBytes );
 
-            ProcessServerToClientMessages( client, numMessagesReceivedFromServer );
+    const int NumClients = 4;
 
-            ProcessClientToServerMessages( server, client.GetClientIndex(), numMessagesReceivedFromClient );
+    MemoryServerTransport serverTransport( GetDefaultAllocator() );
 
-            if ( numMessagesReceivedFromClient == NumMessagesSent && numMessagesReceivedFromServer == NumMessagesSent )
-                break;
-        }
+    Server server( GetDefaultAllocator(), serverTransport, config, adapter, time );
 
-        check( client.IsConnected() );
-        check( server.IsClientConnected( client.GetClientIndex() ) );
-        check( numMessagesReceivedFromClient == NumMessagesSent );
-        check( numMessagesReceivedFromServer == NumMessagesSent );
+    server.Start( NumClients );
 
-        client.Disconnect();
+    MemoryClientTransport * clientTransports[NumClients];
+    Client * clients[NumClients];
 
-        for ( int i = 0; i < NumIterations; ++i )
-        {
-            Client * clients[] = { &client };
-            Server * servers[] = { &server };
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        clientTransports[i] = YOJIMBO_NEW( GetDefaultAllocator(), MemoryClientTransport, GetDefaultAllocator(), serverTransport );
+        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), *clientTransports[i], config, adapter, time );
+    }
 
-            PumpClientServerUpdate( time, clients, 1, servers, 1 );
+    Server * servers[] = { &server };
 
-            if ( !client.IsConnected() && server.GetNumConnectedClients() == 0 )
-                break;
-        }
+    ConnectClientsAndExchangeMessages( time, clients, NumClients, servers, 1, privateKey, serverAddress, 0 );
 
-        check( !client.IsConnected() && server.GetNumConnectedClients() == 0 );
-    }
+    const int NumIterations = 10000;
 
-    server.Stop();
-}
+    // broadcast to every client except one
 
-void CreateClients( int numClients, Client ** clients, const Address & address, const ClientServerConfig & config, Adapter & _adapter, double time )
-{
-    for ( int i = 0; i < numClients; ++i )
+    const int excludedClientIndex = clients[NumClients-1]->GetClientIndex();
+
+    uint64_t clientMask = ~uint64_t(0);
+    clientMask &= ~( uint64_t(1) << excludedClientIndex );
+
+    const int NumMessagesSent = 32;
+
+    for ( int i = 0; i < NumMessagesSent; ++i )
     {
-        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), address, config, _adapter, time );
-        clients[i]->SetLatency( 250 );
-        clients[i]->SetJitter( 100 );
-        clients[i]->SetPacketLoss( 25 );
-        clients[i]->SetDuplicates( 25 );
+        TestMessage * message = (TestMessage*) server.CreateBroadcastMessage( TEST_MESSAGE );
+        check( message );
+        message->sequence = i;
+        check( server.BroadcastMessage( 0, message, &clientMask ) == NumClients - 1 );
     }
-}
 
-void ConnectClients( int numClients, Client ** clients, const uint8_t privateKey[], const Address & serverAddress )
-{
-    for ( int i = 0; i < numClients; ++i )
+    int numMessagesReceivedFromServer[NumClients];
+
+    memset( numMessagesReceivedFromServer, 0, sizeof( numMessagesReceivedFromServer ) );
+
+    for ( int i = 0; i < NumIterations; ++i )
     {
-        clients[i]->InsecureConnect( privateKey, i + 1, serverAddress );
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+
+        bool allMessagesReceived = true;
+
+        for ( int j = 0; j < NumClients; ++j )
+        {
+            ProcessServerToClientMessages( *clients[j], numMessagesReceivedFromServer[j] );
+
+            if ( j != NumClients - 1 && numMessagesReceivedFromServer[j] != NumMessagesSent )
+                allMessagesReceived = false;
+        }
+
+        if ( allMessagesReceived )
+            break;
     }
-}
 
-void DestroyClients( int numClients, Client ** clients )
-{
-    for ( int i = 0; i < numClients; ++i )
+    for ( int i = 0; i < NumClients - 1; ++i )
     {
-        clients[i]->Disconnect();
-
-        YOJIMBO_DELETE( GetDefaultAllocator(), Client, clients[i] );
+        check( numMessagesReceivedFromServer[i] == NumMessagesSent );
     }
-}
 
-bool AllClientsConnected( int numClients, Server & server, Client ** clients )
-{
-    if ( server.GetNumConnectedClients() != numClients )
-        return false;
+    check( numMessagesReceivedFromServer[NumClients-1] == 0 );
 
-    for ( int i = 0; i < numClients; ++i )
+    // broadcast to all connected clients
+
+    TestMessage * message = (TestMessage*) server.CreateBroadcastMessage( TEST_MESSAGE );
+    check( message );
+    message->sequence = 0;
+    check( server.BroadcastMessage( 0, message, NULL ) == NumClients );
+
+    for ( int i = 0; i < NumIterations; ++i )
     {
-        if ( !clients[i]->IsConnected() )
-            return false;
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
+
+        ProcessServerToClientMessages( *clients[NumClients-1], numMessagesReceivedFromServer[NumClients-1] );
+
+        if ( numMessagesReceivedFromServer[NumClients-1] == 1 )
+            break;
     }
 
-    return true;    
-}
+    check( numMessagesReceivedFromServer[NumClients-1] == 1 );
 
-bool AnyClientDisconnected( int numClients, Client ** clients )
-{
-    for ( int i = 0; i < numClients; ++i )
+    DestroyClients( NumClients, clients );
+
+    for ( int i = 0; i < NumClients; ++i )
     {
-        if ( clients[i]->IsDisconnected() )
-            return true;
+        YOJIMBO_DELETE( GetDefaultAllocator(), MemoryClientTransport, clientTransports[i] );
     }
 
-    return false;
+    server.Stop();
 }
 
-void test_client_server_start_stop_restart()
+void test_client_server_shared_block()
 {
-    Address clientAddress( "0.0.0.0", 0 );
     Address serverAddress( "127.0.0.1", ServerPort );
 
     double time = 100.0;
-    
+
     ClientServerConfig config;
-    config.channel[0].messageSendQueueSize = 32;
-    config.channel[0].maxMessagesPerPacket = 8;
-    config.channel[0].maxBlockSize = 1024;
-    config.channel[0].blockFragmentSize = 200;
+    config.channel[0].maxBlockSize = 16 * 1024;
 
     uint8_t privateKey[KeyBytes];
     memset( privateKey, 0, KeyBytes );
 
-    Server server( GetDefaultAllocator(), privateKey, serverAddress, config, adapter, time );
+    const int NumClients = 4;
 
-    server.Start( MaxClients );
+    MemoryServerTransport serverTransport( GetDefaultAllocator() );
 
-    server.SetLatency( 250 );
-    server.SetJitter( 100 );
-    server.SetPacketLoss( 25 );
-    server.SetDuplicates( 25 );
+    Server server( GetDefaultAllocator(), serverTransport, config, adapter, time );
 
-    int numClients[] = { 3, 5, 1 };
+    server.Start( NumClients );
 
-    const int NumIterations = sizeof( numClients ) / sizeof( int );
+    MemoryClientTransport * clientTransports[NumClients];
+    Client * clients[NumClients];
 
-    for ( int iteration = 0; iteration < NumIterations; ++iteration )
+    for ( int i = 0; i < NumClients; ++i )
     {
-        server.Start( numClients[iteration] );
-
-        Client * clients[MaxClients];
+        clientTransports[i] = YOJIMBO_NEW( GetDefaultAllocator(), MemoryClientTransport, GetDefaultAllocator(), serverTransport );
+        clients[i] = YOJIMBO_NEW( GetDefaultAllocator(), Client, GetDefaultAllocator(), *clientTransports[i], config, adapter, time );
+    }
 
-        CreateClients( numClients[iteration], clients, clientAddress, config, adapter, time );
+    Server * servers[] = { &server };
 
-        ConnectClients( numClients[iteration], clients, privateKey, serverAddress );
+    ConnectClientsAndExchangeMessages( time, clients, NumClients, servers, 1, privateKey, serverAddress, 0 );
 
-        while ( true )
-        {
-            Server * servers[] = { &server };
+    const int NumIterations = 10000;
 
-            PumpClientServerUpdate( time, (Client**) clients, numClients[iteration], servers, 1 );
+    // attach one block to a message for every client
 
-            if ( AnyClientDisconnected( numClients[iteration], clients ) )
-                break;
+    const int BlockSize = 10 * 1024;
 
-            if ( AllClientsConnected( numClients[iteration], server, clients ) )
-                break;
-        }
+    SharedBlock * block = server.CreateSharedBlock( BlockSize );
+    check( block );
+    check( block->GetSize() == BlockSize );
 
-        check( AllClientsConnected( numClients[iteration], server, clients ) );
+    uint8_t * blockData = block->GetData();
+    for ( int i = 0; i < BlockSize; ++i )
+        blockData[i] = uint8_t( i * 7 );
 
-        const int NumMessagesSent = config.channel[0].messageSendQueueSize;
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        const int clientIndex = clients[i]->GetClientIndex();
+        TestBlockMessage * message = (TestBlockMessage*) server.CreateMessage( clientIndex, TEST_BLOCK_MESSAGE );
+        check( message );
+        message->sequence = 1;
+        server.AttachSharedBlockToMessage( clientIndex, message, block );
+        check( message->GetBlockData() == blockData );
+        check( message->GetSharedBlock() == block );
+        check( message->GetAllocator() == NULL );
+        server.SendMessage( clientIndex, 0, message );
+    }
 
-        for ( int clientIndex = 0; clientIndex < numClients[iteration]; ++clientIndex )
-        {
-            SendClientToServerMessages( *clients[clientIndex], NumMessagesSent );
-            SendServerToClientMessages( server, clientIndex, NumMessagesSent );
-        }
+    check( block->GetRefCount() == 2 + NumClients );
 
-        int numMessagesReceivedFromClient[MaxClients];
-        int numMessagesReceivedFromServer[MaxClients];
+    server.ReleaseSharedBlock( block );
 
-        memset( numMessagesReceivedFromClient, 0, sizeof( numMessagesReceivedFromClient ) );
-        memset( numMessagesReceivedFromServer, 0, sizeof( numMessagesReceivedFromServer ) );
+    bool blockReceived[NumClients];
 
-		const int NumInternalIterations = 10000;
+    memset( blockReceived, 0, sizeof( blockReceived ) );
 
-        for ( int i = 0; i < NumInternalIterations; ++i )
-        {
-            Server * servers[] = { &server };
+    for ( int i = 0; i < NumIterations; ++i )
+    {
+        PumpClientServerUpdate( time, clients, NumClients, servers, 1 );
 
-            PumpClientServerUpdate( time, clients, numClients[iteration], servers, 1 );
+        bool allBlocksReceived = true;
 
-            bool allMessagesReceived = true;
+        for ( int j = 0; j < NumClients; ++j )
+        {
+            Message * message = clients[j]->ReceiveMessage( 0 );
 
-            for ( int j = 0; j < numClients[iteration]; ++j )
+            if ( message )
             {
-                ProcessServerToClientMessages( *clients[j], numMessagesReceivedFromServer[j] );
-
-                if ( numMessagesReceivedFromServer[j] != NumMessagesSent )
-                    allMessagesReceived = false;
-
-                int clientIndex = clients[j]->GetClientIndex();
-
-                ProcessClientToServerMessages( server, clientIndex, numMessagesReceivedFromClient[clientIndex] );
-
-                if ( numMessagesReceivedFromClient[clientIndex] != NumMessagesSent )
-                    allMessagesReceived = false;
+                check( message->GetType() == TEST_BLOCK_MESSAGE );
+                TestBlockMessage * blockMessage = (TestBlockMessage*) message;
+                check( blockMessage->sequence == 1 );
+                check( blockMessage->GetBlockSize() == BlockSize );
+                const uint8_t * receivedBlockData = blockMessage->GetBlockData();
+                for ( int k = 0; k < BlockSize; ++k )
+                {
+                    check( receivedBlockData[k] == uint8_t( k * 7 ) );
+                }
+                blockReceived[j] = true;
+                clients[j]->ReleaseMessage( message );
             }
 
-            if ( allMessagesReceived )
-                break;
+            if ( !blockReceived[j] )
+                allBlocksReceived = false;
         }
 
-        for ( int clientIndex = 0; clientIndex < numClients[iteration]; ++clientIndex )
-        {
-            check( numMessagesReceivedFromClient[clientIndex] == NumMessagesSent );
-            check( numMessagesReceivedFromServer[clientIndex] == NumMessagesSent );
-        }
+        if ( allBlocksReceived )
+            break;
+    }
 
-        DestroyClients( numClients[iteration], clients );
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        check( blockReceived[i] );
+    }
 
-        server.Stop();
+    DestroyClients( NumClients, clients );
+
+    for ( int i = 0; i < NumClients; ++i )
+    {
+        YOJIMBO_DELETE( GetDefaultAllocator(), MemoryClientTransport, clientTransports[i] );
     }
+
+    server.Stop();
 }
 
 void test_client_server_message_failed_to_serialize_reliable_ordered()
@@ -2219,10 +4686,24 @@ int main()
         RUN_TEST( test_address );
         RUN_TEST( test_bit_array );
         RUN_TEST( test_sequence_buffer );
+        RUN_TEST( test_timing_histogram );
+        RUN_TEST( test_network_simulator );
+        RUN_TEST( test_network_simulator_bandwidth );
+        RUN_TEST( test_network_simulator_loss_models );
+        RUN_TEST( test_network_simulator_trace );
+        RUN_TEST( test_network_simulator_client_conditions );
+        RUN_TEST( test_random_generator );
+        RUN_TEST( test_network_simulator_seed );
+        RUN_TEST( test_pointer_map );
         RUN_TEST( test_allocator_tlsf );
+        RUN_TEST( test_allocator_mapped_memory );
+        RUN_TEST( test_serialized_message );
 
         RUN_TEST( test_connection_reliable_ordered_messages );
+        RUN_TEST( test_connection_shared_config );
         RUN_TEST( test_connection_reliable_ordered_blocks );
+        RUN_TEST( test_connection_reliable_ordered_latency );
+        RUN_TEST( test_connection_reliable_ordered_blocks_release );
         RUN_TEST( test_connection_reliable_ordered_messages_and_blocks );
         RUN_TEST( test_connection_reliable_ordered_messages_and_blocks_multiple_channels );
         RUN_TEST( test_connection_unreliable_unordered_messages );
@@ -2230,6 +4711,16 @@ int main()
 
         RUN_TEST( test_client_server_messages );
         RUN_TEST( test_client_server_start_stop_restart );
+        RUN_TEST( test_client_server_lightweight_clients );
+        RUN_TEST( test_client_server_worker_threads );
+        RUN_TEST( test_client_server_memory_transport );
+        RUN_TEST( test_client_server_batched_send );
+        RUN_TEST( test_client_server_wakeup_time );
+        RUN_TEST( test_client_server_profile );
+        RUN_TEST( test_server_host );
+        RUN_TEST( test_client_server_interest_management );
+        RUN_TEST( test_client_server_broadcast_message );
+        RUN_TEST( test_client_server_shared_block );
         RUN_TEST( test_client_server_message_failed_to_serialize_reliable_ordered );
         RUN_TEST( test_client_server_message_failed_to_serialize_unreliable_unordered );
         RUN_TEST( test_client_server_message_exhaust_stream_allocator );
@@ -30,10 +30,6 @@
 
 #include <sodium.h>
 
-#if YOJIMBO_DEBUG_MEMORY_LEAKS
-#include <map>
-#endif // YOJIMBO_DEBUG_MEMORY_LEAKS
-
 static yojimbo::Allocator * g_defaultAllocator = NULL;
 
 namespace yojimbo
@@ -246,14 +242,15 @@ namespace yojimbo
     Allocator::~Allocator()
     {
 #if YOJIMBO_DEBUG_MEMORY_LEAKS
-        if ( m_alloc_map.size() )
+        if ( m_alloc_map.GetSize() )
         {
             printf( "you leaked memory!\n\n" );
-            typedef std::map<void*,AllocatorEntry>::iterator itor_type;
-            for ( itor_type i = m_alloc_map.begin(); i != m_alloc_map.end(); ++i )
+            for ( int i = 0; i < m_alloc_map.GetCapacity(); ++i )
             {
-                void * p = i->first;
-                AllocatorEntry entry = i->second;
+                const void * p = m_alloc_map.GetKey( i );
+                if ( !p )
+                    continue;
+                AllocatorEntry entry = m_alloc_map.GetValue( i );
                 printf( "leaked block %p (%d bytes) - %s:%d\n", p, (int) entry.size, entry.file, entry.line );
             }
             printf( "\n" );
@@ -275,13 +272,13 @@ namespace yojimbo
     {
 #if YOJIMBO_DEBUG_MEMORY_LEAKS
 
-        yojimbo_assert( m_alloc_map.find( p ) == m_alloc_map.end() );
+        yojimbo_assert( m_alloc_map.Find( p ) == NULL );
 
         AllocatorEntry entry;
         entry.size = size;
         entry.file = file;
         entry.line = line;
-        m_alloc_map[p] = entry;
+        m_alloc_map.Insert( p, entry );
 
 #else // #if YOJIMBO_DEBUG_MEMORY_LEAKS
 
@@ -299,8 +296,9 @@ namespace yojimbo
         (void) file;
         (void) line;
 #if YOJIMBO_DEBUG_MEMORY_LEAKS
-        yojimbo_assert( m_alloc_map.find( p ) != m_alloc_map.end() );
-        m_alloc_map.erase( p );
+        const bool found = m_alloc_map.Remove( p );
+        yojimbo_assert( found );
+        (void) found;
 #endif // #if YOJIMBO_DEBUG_MEMORY_LEAKS
     }
 
@@ -394,6 +392,26 @@ namespace yojimbo
 
         tlsf_free( m_tlsf, p );
     }
+
+    static void ReleaseFreeBlockWalker( void * ptr, size_t size, int used, void * user )
+    {
+        (void) user;
+        
+        // IMPORTANT: The first two pointers of a free block are the TLSF free list links, and the
+        // last pointer is the previous physical block link of the next block. Leave these alone.
+
+        const size_t LinkBytes = 2 * sizeof( void* );
+
+        if ( used || size <= LinkBytes + sizeof( void* ) )
+            return;
+
+        yojimbo_discard_memory( ( (uint8_t*) ptr ) + LinkBytes, size - LinkBytes - sizeof( void* ) );
+    }
+
+    void TLSF_Allocator::ReleaseFreePages()
+    {
+        tlsf_walk_pool( tlsf_get_pool( m_tlsf ), ReleaseFreeBlockWalker, NULL );
+    }
 }
 
 // ---------------------------------------------------------------------------------
@@ -892,6 +910,361 @@ double yojimbo_time()
 
 // ---------------------------------------------------------------------------------
 
+#if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+// ===============================
+//        Windows (VirtualAlloc)
+// ===============================
+
+static size_t yojimbo_mapped_size( size_t bytes, bool hugePages )
+{
+    SYSTEM_INFO info;
+    GetSystemInfo( &info );
+    size_t pageSize = info.dwPageSize;
+    if ( hugePages && GetLargePageMinimum() > 0 )
+        pageSize = GetLargePageMinimum();
+    return ( bytes + pageSize - 1 ) & ~( pageSize - 1 );
+}
+
+void * yojimbo_map_memory( size_t bytes, bool hugePages )
+{
+    const size_t mappedBytes = yojimbo_mapped_size( bytes, hugePages );
+    void * memory = NULL;
+    if ( hugePages && GetLargePageMinimum() > 0 )
+    {
+        // IMPORTANT: Large pages require the "lock pages in memory" privilege. Without it this fails and we fall back to regular pages.
+        memory = VirtualAlloc( NULL, mappedBytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE );
+    }
+    if ( !memory )
+    {
+        memory = VirtualAlloc( NULL, mappedBytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+    }
+    return memory;
+}
+
+void yojimbo_unmap_memory( void * memory, size_t bytes, bool hugePages )
+{
+    (void) bytes;
+    (void) hugePages;
+    if ( memory )
+    {
+        VirtualFree( memory, 0, MEM_RELEASE );
+    }
+}
+
+static size_t yojimbo_page_size()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo( &info );
+    return info.dwPageSize;
+}
+
+void yojimbo_discard_memory( void * memory, size_t bytes )
+{
+    const uintptr_t pageSize = yojimbo_page_size();
+    const uintptr_t start = ( uintptr_t( memory ) + pageSize - 1 ) & ~( pageSize - 1 );
+    const uintptr_t finish = ( uintptr_t( memory ) + bytes ) & ~( pageSize - 1 );
+    if ( start < finish )
+    {
+        // IMPORTANT: This fails for large page allocations, which can't be reset. The memory is still valid, it just isn't returned to the OS.
+        if ( !VirtualAlloc( (void*) start, finish - start, MEM_RESET, PAGE_READWRITE ) )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_DEBUG, "failed to discard %d bytes of memory (error %d)\n", (int) ( finish - start ), (int) GetLastError() );
+        }
+    }
+}
+
+const void * yojimbo_map_file( const char * filename, size_t * bytes )
+{
+    yojimbo_assert( filename );
+    yojimbo_assert( bytes );
+    HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+    if ( file == INVALID_HANDLE_VALUE )
+    {
+        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to open file %s\n", filename );
+        return NULL;
+    }
+    LARGE_INTEGER size;
+    if ( !GetFileSizeEx( file, &size ) || size.QuadPart <= 0 )
+    {
+        CloseHandle( file );
+        return NULL;
+    }
+    HANDLE mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+    CloseHandle( file );
+    if ( !mapping )
+    {
+        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to map file %s\n", filename );
+        return NULL;
+    }
+    // the view keeps the file mapping alive until it is unmapped
+    const void * memory = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+    CloseHandle( mapping );
+    if ( !memory )
+    {
+        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to map file %s\n", filename );
+        return NULL;
+    }
+    *bytes = (size_t) size.QuadPart;
+    return memory;
+}
+
+void yojimbo_unmap_file( const void * memory, size_t bytes )
+{
+    (void) bytes;
+    if ( memory )
+    {
+        UnmapViewOfFile( memory );
+    }
+}
+
+#else // #if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+// ===============================
+//          MacOS + Linux
+// ===============================
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#if defined( MAP_ANONYMOUS )
+#define YOJIMBO_MAP_ANONYMOUS MAP_ANONYMOUS
+#else // #if defined( MAP_ANONYMOUS )
+#define YOJIMBO_MAP_ANONYMOUS MAP_ANON
+#endif // #if defined( MAP_ANONYMOUS )
+
+static const size_t HugePageSize = 2 * 1024 * 1024;
+
+static size_t yojimbo_page_size()
+{
+    return (size_t) sysconf( _SC_PAGESIZE );
+}
+
+static size_t yojimbo_mapped_size( size_t bytes, bool hugePages )
+{
+    const size_t pageSize = hugePages ? HugePageSize : yojimbo_page_size();
+    return ( bytes + pageSize - 1 ) & ~( pageSize - 1 );
+}
+
+void * yojimbo_map_memory( size_t bytes, bool hugePages )
+{
+    const size_t mappedBytes = yojimbo_mapped_size( bytes, hugePages );
+    void * memory = MAP_FAILED;
+#if defined( MAP_HUGETLB )
+    if ( hugePages )
+    {
+        // IMPORTANT: Explicit huge pages must be reserved up front (vm.nr_hugepages). If there are not enough, fall back to transparent huge pages below.
+        memory = mmap( NULL, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | YOJIMBO_MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    }
+#endif // #if defined( MAP_HUGETLB )
+    if ( memory == MAP_FAILED )
+    {
+        memory = mmap( NULL, mappedBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | YOJIMBO_MAP_ANONYMOUS, -1, 0 );
+        if ( memory == MAP_FAILED )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to map %d bytes of memory\n", (int) mappedBytes );
+            return NULL;
+        }
+#if defined( MADV_HUGEPAGE )
+        if ( hugePages )
+        {
+            madvise( memory, mappedBytes, MADV_HUGEPAGE );
+        }
+#endif // #if defined( MADV_HUGEPAGE )
+    }
+    return memory;
+}
+
+void yojimbo_unmap_memory( void * memory, size_t bytes, bool hugePages )
+{
+    if ( memory )
+    {
+        munmap( memory, yojimbo_mapped_size( bytes, hugePages ) );
+    }
+}
+
+static int yojimbo_discard_pages( void * memory, size_t bytes, uintptr_t pageSize )
+{
+    const uintptr_t start = ( uintptr_t( memory ) + pageSize - 1 ) & ~( pageSize - 1 );
+    const uintptr_t finish = ( uintptr_t( memory ) + bytes ) & ~( pageSize - 1 );
+    if ( start >= finish )
+        return 0;
+#if defined( MADV_FREE ) && !defined( __linux )
+    return madvise( (void*) start, finish - start, MADV_FREE );
+#else // #if defined( MADV_FREE ) && !defined( __linux )
+    return madvise( (void*) start, finish - start, MADV_DONTNEED );
+#endif // #if defined( MADV_FREE ) && !defined( __linux )
+}
+
+void yojimbo_discard_memory( void * memory, size_t bytes )
+{
+    if ( yojimbo_discard_pages( memory, bytes, yojimbo_page_size() ) == 0 )
+        return;
+
+    // IMPORTANT: Explicit huge page mappings (MAP_HUGETLB) reject ranges that are not huge page aligned with EINVAL. Retry with the range shrunk to whole huge pages.
+
+    if ( errno == EINVAL && yojimbo_discard_pages( memory, bytes, HugePageSize ) == 0 )
+        return;
+
+    yojimbo_printf( YOJIMBO_LOG_LEVEL_DEBUG, "failed to discard %d bytes of memory (errno %d)\n", (int) bytes, errno );
+}
+
+const void * yojimbo_map_file( const char * filename, size_t * bytes )
+{
+    yojimbo_assert( filename );
+    yojimbo_assert( bytes );
+    const int file = open( filename, O_RDONLY );
+    if ( file < 0 )
+    {
+        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to open file %s\n", filename );
+        return NULL;
+    }
+    struct stat info;
+    if ( fstat( file, &info ) != 0 || info.st_size <= 0 )
+    {
+        close( file );
+        return NULL;
+    }
+    // the mapping stays valid after the file is closed
+    void * memory = mmap( NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, file, 0 );
+    close( file );
+    if ( memory == MAP_FAILED )
+    {
+        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to map file %s\n", filename );
+        return NULL;
+    }
+    *bytes = (size_t) info.st_size;
+    return memory;
+}
+
+void yojimbo_unmap_file( const void * memory, size_t bytes )
+{
+    if ( memory )
+    {
+        munmap( (void*) memory, bytes );
+    }
+}
+
+#endif // #if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+// ---------------------------------------------------------------------------------
+
+#if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+int yojimbo_atomic_increment( volatile int * value )
+{
+    return (int) InterlockedIncrement( (volatile LONG*) value );
+}
+
+int yojimbo_atomic_decrement( volatile int * value )
+{
+    return (int) InterlockedDecrement( (volatile LONG*) value );
+}
+
+#else // #if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+int yojimbo_atomic_increment( volatile int * value )
+{
+    return __sync_add_and_fetch( value, 1 );
+}
+
+int yojimbo_atomic_decrement( volatile int * value )
+{
+    return __sync_sub_and_fetch( value, 1 );
+}
+
+#endif // #if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+// ---------------------------------------------------------------------------------
+
+namespace yojimbo
+{
+    static const int TimingBucketsPerOctave = 4;
+
+    void TimingHistogram::Reset( double minSeconds )
+    {
+        yojimbo_assert( minSeconds > 0.0 );
+        memset( m_bucket, 0, sizeof( m_bucket ) );
+        m_numWindowSamples = 0;
+        m_numSamples = 0;
+        m_max = 0.0;
+        m_previousMax = 0.0;
+        m_minSeconds = minSeconds;
+    }
+
+    void TimingHistogram::AddSample( double seconds )
+    {
+        // bucket 0 holds samples under the minimum. bucket n >= 1 starts at 2^((n-1)/4) times the minimum
+
+        const double units = seconds / m_minSeconds;
+
+        int bucket = 0;
+        if ( units >= 1.0 )
+            bucket = yojimbo_min( 1 + int( ::log2( units ) * TimingBucketsPerOctave ), NumBuckets - 1 );
+
+        m_bucket[bucket]++;
+        m_numSamples++;
+
+        if ( seconds > m_max )
+            m_max = seconds;
+
+        if ( ++m_numWindowSamples == WindowSize )
+        {
+            for ( int i = 0; i < NumBuckets; ++i )
+                m_bucket[i] >>= 1;
+            m_numWindowSamples = 0;
+            m_previousMax = m_max;
+            m_max = 0.0;
+        }
+    }
+
+    void TimingHistogram::Merge( const TimingHistogram & other )
+    {
+        yojimbo_assert( m_minSeconds == other.m_minSeconds );
+        for ( int i = 0; i < NumBuckets; ++i )
+            m_bucket[i] += other.m_bucket[i];
+        m_numSamples += other.m_numSamples;
+        m_max = yojimbo_max( m_max, other.m_max );
+        m_previousMax = yojimbo_max( m_previousMax, other.m_previousMax );
+    }
+
+    double TimingHistogram::GetPercentile( float percentile ) const
+    {
+        uint64_t total = 0;
+        for ( int i = 0; i < NumBuckets; ++i )
+            total += m_bucket[i];
+
+        const double max = yojimbo_max( m_max, m_previousMax );
+
+        if ( total == 0 )
+            return max;
+
+        // report the top of the bucket the percentile falls in, but never more than the largest sample
+
+        const uint64_t threshold = uint64_t( ceil( total * double( percentile ) ) );
+        uint64_t count = 0;
+        for ( int i = 0; i < NumBuckets - 1; ++i )
+        {
+            count += m_bucket[i];
+            if ( count >= threshold )
+                return yojimbo_min( pow( 2.0, double( i ) / TimingBucketsPerOctave ) * m_minSeconds, max );
+        }
+
+        return max;
+    }
+
+    void TimingHistogram::GetStats( TimingStats & stats ) const
+    {
+        stats.numSamples = m_numSamples;
+        stats.p50 = GetPercentile( 0.5f );
+        stats.p99 = GetPercentile( 0.99f );
+        stats.max = yojimbo_max( m_max, m_previousMax );
+    }
+}
+
+// ---------------------------------------------------------------------------------
+
 #if YOJIMBO_WITH_MBEDTLS
 #include <mbedtls/config.h>
 #include <mbedtls/platform.h>
@@ -1162,6 +1535,7 @@ namespace yojimbo
         channelIndex = 0;
         blockMessage = 0;
         messageFailedToSerialize = 0;
+        sendTime = 0;
         message.numMessages = 0;
         initialized = 1;
     }
@@ -1505,6 +1879,9 @@ namespace yojimbo
 
         serialize_bool( stream, blockMessage );
 
+        if ( channelConfig.type == CHANNEL_TYPE_RELIABLE_ORDERED && channelConfig.sendTimestamps )
+            serialize_bits( stream, sendTime, 32 );
+
         if ( !blockMessage )
         {
             switch ( channelConfig.type )
@@ -1595,6 +1972,15 @@ namespace yojimbo
         memset( m_counters, 0, sizeof( m_counters ) ); 
     }
 
+    bool Channel::GetLatencyStats( int index, TimingStats & stats ) const
+    {
+        yojimbo_assert( index >= 0 );
+        yojimbo_assert( index < CHANNEL_LATENCY_NUM_LATENCIES );
+        (void) index;
+        (void) stats;
+        return false;
+    }
+
     int Channel::GetChannelIndex() const 
     { 
         return m_channelIndex;
@@ -1616,6 +2002,8 @@ namespace yojimbo
 
     // ------------------------------------------------------------------------------------
 
+    static const double ChannelLatencyMinSeconds = 0.001;
+
     ReliableOrderedChannel::ReliableOrderedChannel( Allocator & allocator, MessageFactory & messageFactory, const ChannelConfig & config, int channelIndex, double time ) 
         : Channel( allocator, messageFactory, config, channelIndex, time )
     {
@@ -1630,15 +2018,18 @@ namespace yojimbo
         m_messageReceiveQueue = YOJIMBO_NEW( *m_allocator, SequenceBuffer<MessageReceiveQueueEntry>, *m_allocator, m_config.messageReceiveQueueSize );
         m_sentPacketMessageIds = (uint16_t*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( uint16_t ) * m_config.maxMessagesPerPacket * m_config.sentPacketBufferSize );
 
-        if ( !config.disableBlocks )
-        {
-            m_sendBlock = YOJIMBO_NEW( *m_allocator, SendBlockData, *m_allocator, m_config.maxBlockSize, m_config.GetMaxFragmentsPerBlock() ); 
-            m_receiveBlock = YOJIMBO_NEW( *m_allocator, ReceiveBlockData, *m_allocator, m_config.maxBlockSize, m_config.GetMaxFragmentsPerBlock() );
-        }
-        else
+        // block send and receive data is created on demand. see GetFragmentToSend and ProcessPacketFragment
+
+        m_sendBlock = NULL;
+        m_receiveBlock = NULL;
+
+        // latency histograms are only allocated when asked for. they start at a millisecond, so they cover long resend chains. see ChannelLatency
+
+        m_latency = NULL;
+        if ( m_config.trackLatency )
         {
-            m_sendBlock = NULL;
-            m_receiveBlock = NULL;
+            m_latency = (TimingHistogram*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( TimingHistogram ) * CHANNEL_LATENCY_NUM_LATENCIES );
+            yojimbo_assert( m_latency );
         }
 
         Reset();
@@ -1648,13 +2039,12 @@ namespace yojimbo
     {
         Reset();
 
-        YOJIMBO_DELETE( *m_allocator, SendBlockData, m_sendBlock );
-        YOJIMBO_DELETE( *m_allocator, ReceiveBlockData, m_receiveBlock );
         YOJIMBO_DELETE( *m_allocator, SequenceBuffer<SentPacketEntry>, m_sentPackets );
         YOJIMBO_DELETE( *m_allocator, SequenceBuffer<MessageSendQueueEntry>, m_messageSendQueue );
         YOJIMBO_DELETE( *m_allocator, SequenceBuffer<MessageReceiveQueueEntry>, m_messageReceiveQueue );
         
         YOJIMBO_FREE( *m_allocator, m_sentPacketMessageIds );
+        YOJIMBO_FREE( *m_allocator, m_latency );
 
         m_sentPacketMessageIds = NULL;
     }
@@ -1685,22 +2075,18 @@ namespace yojimbo
         m_messageSendQueue->Reset();
         m_messageReceiveQueue->Reset();
 
-        if ( m_sendBlock )
-        {
-            m_sendBlock->Reset();
-        }
+        m_ackPending = false;
 
-        if ( m_receiveBlock )
-        {
-            m_receiveBlock->Reset();
-            if ( m_receiveBlock->blockMessage )
-            {
-                m_messageFactory->ReleaseMessage( m_receiveBlock->blockMessage );
-                m_receiveBlock->blockMessage = NULL;
-            }
-        }
+        ReleaseSendBlock();
+        ReleaseReceiveBlock();
 
         ResetCounters();
+
+        if ( m_latency )
+        {
+            for ( int i = 0; i < CHANNEL_LATENCY_NUM_LATENCIES; ++i )
+                m_latency[i].Reset( ChannelLatencyMinSeconds );
+        }
     }
 
 #undef SendMessage
@@ -1750,6 +2136,7 @@ namespace yojimbo
         entry->block = message->IsBlockMessage();
         entry->message = message;
         entry->measuredBits = 0;
+        entry->timeQueued = m_time;
         entry->timeLastSent = -1.0;
 
         if ( message->IsBlockMessage() )
@@ -1787,10 +2174,46 @@ namespace yojimbo
     void ReliableOrderedChannel::AdvanceTime( double time )
     {
         m_time = time;
+
+        // release block send and receive data once the channel has stopped sending or receiving blocks for a while
+
+        if ( m_config.blockReleaseTime < 0.0f )
+            return;
+
+        if ( m_sendBlock && !m_sendBlock->active && m_sendBlock->timeLastActive + m_config.blockReleaseTime <= m_time )
+            ReleaseSendBlock();
+
+        if ( m_receiveBlock && !m_receiveBlock->active && !m_receiveBlock->blockMessage && m_receiveBlock->timeLastActive + m_config.blockReleaseTime <= m_time )
+            ReleaseReceiveBlock();
+    }
+
+    void ReliableOrderedChannel::ReleaseSendBlock()
+    {
+        if ( m_sendBlock )
+        {
+            YOJIMBO_DELETE( *m_allocator, SendBlockData, m_sendBlock );
+        }
+    }
+
+    void ReliableOrderedChannel::ReleaseReceiveBlock()
+    {
+        if ( m_receiveBlock )
+        {
+            if ( m_receiveBlock->blockMessage )
+            {
+                m_messageFactory->ReleaseMessage( m_receiveBlock->blockMessage );
+                m_receiveBlock->blockMessage = NULL;
+            }
+            YOJIMBO_DELETE( *m_allocator, ReceiveBlockData, m_receiveBlock );
+        }
     }
     
     int ReliableOrderedChannel::GetPacketData( ChannelPacketData & packetData, uint16_t packetSequence, int availableBits )
     {
+        // every connection packet carries acks, so any packet generated now acks the data received so far
+
+        m_ackPending = false;
+
         if ( !HasMessagesToSend() )
             return 0;
 
@@ -1849,6 +2272,9 @@ namespace yojimbo
         int usedBits = ConservativeMessageHeaderBits;
         int giveUpCounter = 0;
 
+        if ( m_config.sendTimestamps )
+            usedBits += 32;
+
         for ( int i = 0; i < messageLimit; ++i )
         {
             if ( availableBits - usedBits < giveUpBits )
@@ -1889,6 +2315,10 @@ namespace yojimbo
                 usedBits += messageBits;
                 messageIds[numMessageIds++] = messageId;
                 previousMessageId = messageId;
+                if ( entry->timeLastSent >= 0.0 )
+                    m_counters[CHANNEL_COUNTER_MESSAGES_RESENT]++;
+                else
+                    AddLatencySample( CHANNEL_LATENCY_QUEUED, m_time - entry->timeQueued );
                 entry->timeLastSent = m_time;
             }
 
@@ -1905,6 +2335,7 @@ namespace yojimbo
 
         packetData.Initialize();
         packetData.channelIndex = GetChannelIndex();
+        packetData.sendTime = GetSendTimestamp();
         packetData.message.numMessages = numMessageIds;
         
         if ( numMessageIds == 0 )
@@ -1941,11 +2372,13 @@ namespace yojimbo
         }
     }
 
-    void ReliableOrderedChannel::ProcessPacketMessages( int numMessages, Message ** messages )
+    int ReliableOrderedChannel::ProcessPacketMessages( int numMessages, Message ** messages )
     {
         const uint16_t minMessageId = m_receiveMessageId;
         const uint16_t maxMessageId = m_receiveMessageId + m_config.messageReceiveQueueSize - 1;
 
+        int numReceived = 0;
+
         for ( int i = 0; i < (int) numMessages; ++i )
         {
             Message * message = messages[i];
@@ -1961,7 +2394,7 @@ namespace yojimbo
             {
                 // Did you forget to dequeue messages on the receiver?
                 SetErrorLevel( CHANNEL_ERROR_DESYNC );
-                return;
+                return numReceived;
             }
 
             if ( m_messageReceiveQueue->Find( messageId ) )
@@ -1974,13 +2407,17 @@ namespace yojimbo
             {
                 // For some reason we can't insert the message in the receive queue
                 SetErrorLevel( CHANNEL_ERROR_DESYNC );
-                return;
+                return numReceived;
             }
 
             entry->message = message;
 
             m_messageFactory->AcquireMessage( message );
+
+            numReceived++;
         }
+
+        return numReceived;
     }
 
     void ReliableOrderedChannel::ProcessPacketData( const ChannelPacketData & packetData, uint16_t packetSequence )
@@ -1997,8 +2434,14 @@ namespace yojimbo
 
         (void)packetSequence;
 
+        m_ackPending = true;
+
+        int numReceived = 0;
+
         if ( packetData.blockMessage )
         {
+            const bool alreadyReceived = m_messageReceiveQueue->Find( packetData.block.messageId ) != NULL;
+
             ProcessPacketFragment( packetData.block.messageType, 
                                    packetData.block.messageId, 
                                    packetData.block.numFragments, 
@@ -2006,13 +2449,47 @@ namespace yojimbo
                                    packetData.block.fragmentData, 
                                    packetData.block.fragmentSize, 
                                    packetData.block.message );
+
+            if ( !alreadyReceived && m_messageReceiveQueue->Find( packetData.block.messageId ) )
+                numReceived = 1;
         }
         else
         {
-            ProcessPacketMessages( packetData.message.numMessages, packetData.message.messages );
+            numReceived = ProcessPacketMessages( packetData.message.numMessages, packetData.message.messages );
+        }
+
+        if ( m_latency && m_config.sendTimestamps && numReceived > 0 )
+        {
+            // the difference is taken in 32 bits so it survives the timestamp wrapping. clamp small negatives from clock skew to zero
+
+            const int32_t deliveryMilliseconds = int32_t( GetSendTimestamp() - packetData.sendTime );
+            const double delivery = yojimbo_max( deliveryMilliseconds, 0 ) / 1000.0;
+            for ( int i = 0; i < numReceived; ++i )
+                AddLatencySample( CHANNEL_LATENCY_DELIVERED, delivery );
         }
     }
 
+    uint32_t ReliableOrderedChannel::GetSendTimestamp() const
+    {
+        return uint32_t( uint64_t( m_time * 1000.0 ) );
+    }
+
+    void ReliableOrderedChannel::AddLatencySample( int index, double seconds )
+    {
+        if ( m_latency )
+            m_latency[index].AddSample( seconds );
+    }
+
+    bool ReliableOrderedChannel::GetLatencyStats( int index, TimingStats & stats ) const
+    {
+        yojimbo_assert( index >= 0 );
+        yojimbo_assert( index < CHANNEL_LATENCY_NUM_LATENCIES );
+        if ( !m_latency )
+            return false;
+        m_latency[index].GetStats( stats );
+        return true;
+    }
+
     void ReliableOrderedChannel::ProcessAck( uint16_t ack )
     {
         SentPacketEntry * sentPacketEntry = m_sentPackets->Find( ack );
@@ -2029,13 +2506,14 @@ namespace yojimbo
             {
                 yojimbo_assert( sendQueueEntry->message );
                 yojimbo_assert( sendQueueEntry->message->GetId() == messageId );
+                AddLatencySample( CHANNEL_LATENCY_ACKED, m_time - sendQueueEntry->timeQueued );
                 m_messageFactory->ReleaseMessage( sendQueueEntry->message );
                 m_messageSendQueue->Remove( messageId );
                 UpdateOldestUnackedMessageId();
             }
         }
 
-        if ( !m_config.disableBlocks && sentPacketEntry->block && m_sendBlock->active && m_sendBlock->blockMessageId == sentPacketEntry->blockMessageId )
+        if ( !m_config.disableBlocks && sentPacketEntry->block && m_sendBlock && m_sendBlock->active && m_sendBlock->blockMessageId == sentPacketEntry->blockMessageId )
         {        
             const int messageId = sentPacketEntry->blockMessageId;
             const int fragmentId = sentPacketEntry->blockFragmentId;
@@ -2044,11 +2522,13 @@ namespace yojimbo
             {
                 m_sendBlock->ackedFragment->SetBit( fragmentId );
                 m_sendBlock->numAckedFragments++;
+                m_sendBlock->timeLastActive = m_time;
                 if ( m_sendBlock->numAckedFragments == m_sendBlock->numFragments )
                 {
                     m_sendBlock->active = false;
                     MessageSendQueueEntry * sendQueueEntry = m_messageSendQueue->Find( messageId );
                     yojimbo_assert( sendQueueEntry );
+                    AddLatencySample( CHANNEL_LATENCY_ACKED, m_time - sendQueueEntry->timeQueued );
                     m_messageFactory->ReleaseMessage( sendQueueEntry->message );
                     m_messageSendQueue->Remove( messageId );
                     UpdateOldestUnackedMessageId();
@@ -2057,13 +2537,61 @@ namespace yojimbo
         }
     }
 
-    void ReliableOrderedChannel::UpdateOldestUnackedMessageId()
+    double ReliableOrderedChannel::GetNextSendTime() const
     {
-        const uint16_t stopMessageId = m_messageSendQueue->GetSequence();
+        if ( m_ackPending )
+            return m_time;
 
-        while ( true )
-        {
-            if ( m_oldestUnackedMessageId == stopMessageId || m_messageSendQueue->Find( m_oldestUnackedMessageId ) )
+        double nextSendTime = m_time + MaxWakeupInterval;
+
+        if ( !HasMessagesToSend() )
+            return nextSendTime;
+
+        const MessageSendQueueEntry * oldestEntry = m_messageSendQueue->Find( m_oldestUnackedMessageId );
+
+        if ( oldestEntry && oldestEntry->block )
+        {
+            // a block that has not started sending yet goes out with the next packet
+
+            if ( !m_sendBlock || !m_sendBlock->active )
+                return m_time;
+
+            for ( int i = 0; i < m_sendBlock->numFragments; ++i )
+            {
+                if ( !m_sendBlock->ackedFragment->GetBit( i ) )
+                    nextSendTime = yojimbo_min( nextSendTime, m_sendBlock->fragmentSendTime[i] + m_config.blockFragmentResendTime );
+            }
+
+            return nextSendTime;
+        }
+
+        // same window as GetMessagesToSend: stop at the first block message, and don't run ahead of the receiver
+
+        const int messageLimit = yojimbo_min( m_config.messageSendQueueSize, m_config.messageReceiveQueueSize );
+        const int numMessages = yojimbo_min( messageLimit, (int) uint16_t( m_sendMessageId - m_oldestUnackedMessageId ) );
+
+        for ( int i = 0; i < numMessages; ++i )
+        {
+            const MessageSendQueueEntry * entry = m_messageSendQueue->Find( uint16_t( m_oldestUnackedMessageId + i ) );
+            if ( !entry )
+                continue;
+
+            if ( entry->block )
+                break;
+
+            nextSendTime = yojimbo_min( nextSendTime, entry->timeLastSent + m_config.messageResendTime );
+        }
+
+        return nextSendTime;
+    }
+
+    void ReliableOrderedChannel::UpdateOldestUnackedMessageId()
+    {
+        const uint16_t stopMessageId = m_messageSendQueue->GetSequence();
+
+        while ( true )
+        {
+            if ( m_oldestUnackedMessageId == stopMessageId || m_messageSendQueue->Find( m_oldestUnackedMessageId ) )
             {
                 break;
             }
@@ -2097,27 +2625,48 @@ namespace yojimbo
 
         const int blockSize = blockMessage->GetBlockSize();
 
+        if ( !m_sendBlock )
+        {
+            m_sendBlock = YOJIMBO_NEW( *m_allocator, SendBlockData, *m_allocator );
+            if ( !m_sendBlock )
+            {
+                SetErrorLevel( CHANNEL_ERROR_OUT_OF_MEMORY );
+                return NULL;
+            }
+        }
+
         if ( !m_sendBlock->active )
         {
             // start sending this block
 
+            const int blockNumFragments = (int) ceil( blockSize / float( m_config.blockFragmentSize ) );
+
+            yojimbo_assert( blockNumFragments > 0 );
+            yojimbo_assert( blockNumFragments <= m_config.GetMaxFragmentsPerBlock() );
+
+            if ( !m_sendBlock->Reserve( blockNumFragments ) )
+            {
+                SetErrorLevel( CHANNEL_ERROR_OUT_OF_MEMORY );
+                ReleaseSendBlock();
+                return NULL;
+            }
+
             m_sendBlock->active = true;
             m_sendBlock->blockSize = blockSize;
             m_sendBlock->blockMessageId = messageId;
-            m_sendBlock->numFragments = (int) ceil( blockSize / float( m_config.blockFragmentSize ) );
+            m_sendBlock->numFragments = blockNumFragments;
             m_sendBlock->numAckedFragments = 0;
 
-            const int MaxFragmentsPerBlock = m_config.GetMaxFragmentsPerBlock();
-
-            yojimbo_assert( m_sendBlock->numFragments > 0 );
-            yojimbo_assert( m_sendBlock->numFragments <= MaxFragmentsPerBlock );
-
             m_sendBlock->ackedFragment->Clear();
 
-            for ( int i = 0; i < MaxFragmentsPerBlock; ++i )
+            for ( int i = 0; i < blockNumFragments; ++i )
                 m_sendBlock->fragmentSendTime[i] = -1.0;
+
+            AddLatencySample( CHANNEL_LATENCY_QUEUED, m_time - entry->timeQueued );
         }
 
+        m_sendBlock->timeLastActive = m_time;
+
         numFragments = m_sendBlock->numFragments;
 
         // find the next fragment to send (there may not be one)
@@ -2153,6 +2702,10 @@ namespace yojimbo
         {
             memcpy( fragmentData, blockMessage->GetBlockData() + fragmentId * m_config.blockFragmentSize, fragmentBytes );
 
+            m_counters[CHANNEL_COUNTER_FRAGMENTS_SENT]++;
+            if ( m_sendBlock->fragmentSendTime[fragmentId] >= 0.0 )
+                m_counters[CHANNEL_COUNTER_FRAGMENTS_RESENT]++;
+
             m_sendBlock->fragmentSendTime[fragmentId] = m_time;
         }
 
@@ -2173,6 +2726,8 @@ namespace yojimbo
 
         packetData.blockMessage = 1;
 
+        packetData.sendTime = GetSendTimestamp();
+
         packetData.block.fragmentData = fragmentData;
         packetData.block.messageId = messageId;
         packetData.block.fragmentId = fragmentId;
@@ -2184,6 +2739,9 @@ namespace yojimbo
 
         int fragmentBits = ConservativeFragmentHeaderBits + fragmentSize * 8;
 
+        if ( m_config.sendTimestamps )
+            fragmentBits += 32;
+
         if ( fragmentId == 0 )
         {
             MessageSendQueueEntry * entry = m_messageSendQueue->Find( packetData.block.messageId );
@@ -2237,6 +2795,18 @@ namespace yojimbo
             if ( messageId != expectedMessageId )
                 return;
 
+            if ( !m_receiveBlock )
+            {
+                m_receiveBlock = YOJIMBO_NEW( *m_allocator, ReceiveBlockData, *m_allocator );
+                if ( !m_receiveBlock )
+                {
+                    SetErrorLevel( CHANNEL_ERROR_OUT_OF_MEMORY );
+                    return;
+                }
+            }
+
+            m_receiveBlock->timeLastActive = m_time;
+
             // start receiving a new block
 
             if ( !m_receiveBlock->active )
@@ -2244,6 +2814,14 @@ namespace yojimbo
                 yojimbo_assert( numFragments >= 0 );
                 yojimbo_assert( numFragments <= m_config.GetMaxFragmentsPerBlock() );
 
+                if ( !m_receiveBlock->Reserve( numFragments, m_config.blockFragmentSize, m_messageFactory->GetAllocator() ) )
+                {
+                    // Not enough memory to allocate block data
+                    SetErrorLevel( CHANNEL_ERROR_OUT_OF_MEMORY );
+                    ReleaseReceiveBlock();
+                    return;
+                }
+
                 m_receiveBlock->active = true;
                 m_receiveBlock->numFragments = numFragments;
                 m_receiveBlock->numReceivedFragments = 0;
@@ -2317,18 +2895,12 @@ namespace yojimbo
 
                     yojimbo_assert( blockMessage );
 
-                    uint8_t * blockData = (uint8_t*) YOJIMBO_ALLOCATE( m_messageFactory->GetAllocator(), m_receiveBlock->blockSize );
-
-                    if ( !blockData )
-                    {
-                        // Not enough memory to allocate block data
-                        SetErrorLevel( CHANNEL_ERROR_OUT_OF_MEMORY );
-                        return;
-                    }
+                    // hand the block data over to the block message. it was allocated with the message factory allocator, so no copy is needed
 
-                    memcpy( blockData, m_receiveBlock->blockData, m_receiveBlock->blockSize );
+                    blockMessage->AttachBlock( m_messageFactory->GetAllocator(), m_receiveBlock->blockData, m_receiveBlock->blockSize );
 
-                    blockMessage->AttachBlock( m_messageFactory->GetAllocator(), blockData, m_receiveBlock->blockSize );
+                    m_receiveBlock->blockData = NULL;
+                    m_receiveBlock->blockDataAllocator = NULL;
 
                     blockMessage->SetId( messageId );
 
@@ -2549,6 +3121,11 @@ namespace yojimbo
     {
         (void) ack;
     }
+
+    double UnreliableUnorderedChannel::GetNextSendTime() const
+    {
+        return m_messageSendQueue->IsEmpty() ? m_time + MaxWakeupInterval : m_time;
+    }
 }
 
 // ---------------------------------------------------------------------------------
@@ -2598,10 +3175,10 @@ namespace yojimbo
             return true;
         }
 
-        template <typename Stream> bool Serialize( Stream & stream, MessageFactory & messageFactory, const ConnectionConfig & connectionConfig )
+        template <typename Stream> bool Serialize( Stream & stream, MessageFactory & messageFactory, const SharedConnectionConfig & connectionConfig )
         {
-            const int numChannels = connectionConfig.numChannels;
-            serialize_int( stream, numChannelEntries, 0, connectionConfig.numChannels );
+            const int numChannels = connectionConfig.GetNumChannels();
+            serialize_int( stream, numChannelEntries, 0, numChannels );
 #if YOJIMBO_DEBUG_MESSAGE_BUDGET
             yojimbo_assert( stream.GetBitsProcessed() <= ConservativePacketHeaderBits );
 #endif // #if YOJIMBO_DEBUG_MESSAGE_BUDGET
@@ -2622,7 +3199,7 @@ namespace yojimbo
                 for ( int i = 0; i < numChannelEntries; ++i )
                 {
                     yojimbo_assert( channelEntry[i].messageFailedToSerialize == 0 );
-                    if ( !channelEntry[i].SerializeInternal( stream, messageFactory, connectionConfig.channel, numChannels ) )
+                    if ( !channelEntry[i].SerializeInternal( stream, messageFactory, connectionConfig.GetChannelConfigs(), numChannels ) )
                     {
                         yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize channel %d\n", i );
                         return false;
@@ -2632,17 +3209,17 @@ namespace yojimbo
             return true;
         }
 
-        bool SerializeInternal( ReadStream & stream, MessageFactory & _messageFactory, const ConnectionConfig & connectionConfig )
+        bool SerializeInternal( ReadStream & stream, MessageFactory & _messageFactory, const SharedConnectionConfig & connectionConfig )
         {
             return Serialize( stream, _messageFactory, connectionConfig );
         }
 
-        bool SerializeInternal( WriteStream & stream, MessageFactory & _messageFactory, const ConnectionConfig & connectionConfig )
+        bool SerializeInternal( WriteStream & stream, MessageFactory & _messageFactory, const SharedConnectionConfig & connectionConfig )
         {
             return Serialize( stream, _messageFactory, connectionConfig );            
         }
 
-        bool SerializeInternal( MeasureStream & stream, MessageFactory & _messageFactory, const ConnectionConfig & connectionConfig )
+        bool SerializeInternal( MeasureStream & stream, MessageFactory & _messageFactory, const SharedConnectionConfig & connectionConfig )
         {
             return Serialize( stream, _messageFactory, connectionConfig );            
         }
@@ -2656,18 +3233,211 @@ namespace yojimbo
 
     // ------------------------------------------------------------------------------
 
+    SharedConnectionConfig * SharedConnectionConfig::Create( Allocator & allocator, const ConnectionConfig & config )
+    {
+        yojimbo_assert( config.numChannels >= 1 );
+        yojimbo_assert( config.numChannels <= MaxChannels );
+        uint8_t * memory = (uint8_t*) YOJIMBO_ALLOCATE( allocator, sizeof( SharedConnectionConfig ) + sizeof( ChannelConfig ) * config.numChannels );
+        if ( !memory )
+            return NULL;
+        SharedConnectionConfig * sharedConfig = new ( memory ) SharedConnectionConfig();
+        sharedConfig->m_allocator = &allocator;
+        sharedConfig->m_refCount = 1;
+        sharedConfig->m_numChannels = config.numChannels;
+        sharedConfig->m_maxPacketSize = config.maxPacketSize;
+        sharedConfig->m_channel = (ChannelConfig*) ( memory + sizeof( SharedConnectionConfig ) );
+        for ( int i = 0; i < config.numChannels; ++i )
+        {
+            new ( &sharedConfig->m_channel[i] ) ChannelConfig( config.channel[i] );
+        }
+        return sharedConfig;
+    }
+
+    void SharedConnectionConfig::Release()
+    {
+        yojimbo_assert( m_refCount > 0 );
+        m_refCount--;
+        if ( m_refCount == 0 )
+        {
+            Allocator & allocator = *m_allocator;
+            SharedConnectionConfig * sharedConfig = this;
+            YOJIMBO_DELETE( allocator, SharedConnectionConfig, sharedConfig );
+        }
+    }
+
+    // ------------------------------------------------------------------------------
+
+    SharedBlock * SharedBlock::Create( Allocator & allocator, int bytes )
+    {
+        yojimbo_assert( bytes > 0 );
+        uint8_t * memory = (uint8_t*) YOJIMBO_ALLOCATE( allocator, sizeof( SharedBlock ) + bytes );
+        if ( !memory )
+            return NULL;
+        SharedBlock * block = new ( memory ) SharedBlock();
+        block->m_allocator = &allocator;
+        block->m_refCount = 1;
+        block->m_size = bytes;
+        block->m_data = memory + sizeof( SharedBlock );
+        block->m_next = NULL;
+        return block;
+    }
+
+    void SharedBlock::Release()
+    {
+        yojimbo_assert( m_refCount > 0 );
+        if ( yojimbo_atomic_decrement( &m_refCount ) == 0 )
+        {
+            Allocator & allocator = *m_allocator;
+            SharedBlock * block = this;
+            YOJIMBO_DELETE( allocator, SharedBlock, block );
+        }
+    }
+
+    // ------------------------------------------------------------------------------
+
+    static bool SerializeMessageAtOffset( Allocator & allocator, Message & message, void * context, int offset, uint8_t * buffer, int bufferBytes, int & numBits )
+    {
+        WriteStream stream( allocator, buffer, bufferBytes );
+        stream.SetContext( context );
+        if ( offset > 0 )
+            stream.SerializeBits( 0, offset );
+        if ( !message.SerializeInternal( stream ) )
+            return false;
+        stream.Flush();
+        numBits = stream.GetBitsProcessed() - offset;
+        return true;
+    }
+
+    SerializedMessageData * SerializedMessageData::Create( Allocator & allocator, Message & message, void * context )
+    {
+        yojimbo_assert( !message.IsBlockMessage() );
+
+        MeasureStream measureStream( allocator );
+        measureStream.SetContext( context );
+        if ( !message.SerializeInternal( measureStream ) )
+            return NULL;
+
+        // the measure is conservative, so this fits the message at any bit offset
+
+        const int bufferBytes = ( ( 7 + measureStream.GetBitsProcessed() + 31 ) / 32 ) * 4;
+
+        // serialize at bit offsets 0 and 1. if the sizes match the message doesn't align, and the bits can be copied to any offset
+
+        uint8_t * scratch = (uint8_t*) YOJIMBO_ALLOCATE( allocator, bufferBytes * 2 );
+        if ( !scratch )
+            return NULL;
+
+        int numBits[2] = { 0, 0 };
+        if ( !SerializeMessageAtOffset( allocator, message, context, 0, scratch, bufferBytes, numBits[0] ) ||
+             !SerializeMessageAtOffset( allocator, message, context, 1, scratch + bufferBytes, bufferBytes, numBits[1] ) )
+        {
+            YOJIMBO_FREE( allocator, scratch );
+            return NULL;
+        }
+
+        const int numOffsets = ( numBits[0] == numBits[1] ) ? 1 : 8;
+
+        uint8_t * memory = (uint8_t*) YOJIMBO_ALLOCATE( allocator, sizeof( SerializedMessageData ) + bufferBytes * numOffsets );
+        if ( !memory )
+        {
+            YOJIMBO_FREE( allocator, scratch );
+            return NULL;
+        }
+
+        SerializedMessageData * data = new ( memory ) SerializedMessageData();
+        data->m_allocator = &allocator;
+        data->m_refCount = 1;
+        data->m_type = message.GetType();
+        data->m_numOffsets = numOffsets;
+        data->m_bufferBytes = bufferBytes;
+        data->m_data = memory + sizeof( SerializedMessageData );
+        data->m_next = NULL;
+        memset( data->m_numBits, 0, sizeof( data->m_numBits ) );
+
+        if ( numOffsets == 1 )
+        {
+            memcpy( data->m_data, scratch, bufferBytes );
+            data->m_numBits[0] = numBits[0];
+            data->m_maxBits = numBits[0];
+        }
+        else
+        {
+            memcpy( data->m_data, scratch, bufferBytes * 2 );
+            data->m_numBits[0] = numBits[0];
+            data->m_numBits[1] = numBits[1];
+            data->m_maxBits = yojimbo_max( numBits[0], numBits[1] );
+            for ( int offset = 2; offset < numOffsets; ++offset )
+            {
+                const bool result = SerializeMessageAtOffset( allocator, message, context, offset, data->m_data + offset * bufferBytes, bufferBytes, data->m_numBits[offset] );
+                yojimbo_assert( result );
+                (void) result;
+                data->m_maxBits = yojimbo_max( data->m_maxBits, data->m_numBits[offset] );
+            }
+        }
+
+        YOJIMBO_FREE( allocator, scratch );
+
+        return data;
+    }
+
+    void SerializedMessageData::Release()
+    {
+        yojimbo_assert( m_refCount > 0 );
+        if ( yojimbo_atomic_decrement( &m_refCount ) == 0 )
+        {
+            Allocator & allocator = *m_allocator;
+            SerializedMessageData * data = this;
+            YOJIMBO_DELETE( allocator, SerializedMessageData, data );
+        }
+    }
+
+    void SerializedMessageData::Write( WriteStream & stream ) const
+    {
+        const int offset = ( m_numOffsets > 1 ) ? ( stream.GetBitsProcessed() % 8 ) : 0;
+        BitReader reader( m_data + offset * m_bufferBytes, m_bufferBytes );
+        if ( offset > 0 )
+            reader.ReadBits( offset );
+        int bitsRemaining = m_numBits[offset];
+        while ( bitsRemaining > 0 )
+        {
+            const int bits = yojimbo_min( bitsRemaining, 32 );
+            stream.SerializeBits( reader.ReadBits( bits ), bits );
+            bitsRemaining -= bits;
+        }
+    }
+
+    // ------------------------------------------------------------------------------
+
     Connection::Connection( Allocator & allocator, MessageFactory & messageFactory, const ConnectionConfig & connectionConfig, double time ) 
-        : m_connectionConfig( connectionConfig )
+    {
+        SharedConnectionConfig * sharedConfig = SharedConnectionConfig::Create( allocator, connectionConfig );
+        yojimbo_assert( sharedConfig );
+        Initialize( allocator, messageFactory, *sharedConfig, time );
+        sharedConfig->Release();
+    }
+
+    Connection::Connection( Allocator & allocator, MessageFactory & messageFactory, SharedConnectionConfig & connectionConfig, double time ) 
+    {
+        Initialize( allocator, messageFactory, connectionConfig, time );
+    }
+
+    void Connection::Initialize( Allocator & allocator, MessageFactory & messageFactory, SharedConnectionConfig & connectionConfig, double time )
     {
         m_allocator = &allocator;
         m_messageFactory = &messageFactory;
         m_errorLevel = CONNECTION_ERROR_NONE;
-        memset( m_channel, 0, sizeof( m_channel ) );
-        yojimbo_assert( m_connectionConfig.numChannels >= 1 );
-        yojimbo_assert( m_connectionConfig.numChannels <= MaxChannels );
-        for ( int channelIndex = 0; channelIndex < m_connectionConfig.numChannels; ++channelIndex )
-        {
-            switch ( m_connectionConfig.channel[channelIndex].type )
+        m_connectionConfig = &connectionConfig;
+        m_connectionConfig->Acquire();
+        m_numChannels = connectionConfig.GetNumChannels();
+        yojimbo_assert( m_numChannels >= 1 );
+        yojimbo_assert( m_numChannels <= MaxChannels );
+        m_channel = (Channel**) YOJIMBO_ALLOCATE( allocator, sizeof( Channel* ) * m_numChannels );
+        yojimbo_assert( m_channel );
+        memset( m_channel, 0, sizeof( Channel* ) * m_numChannels );
+        for ( int channelIndex = 0; channelIndex < m_numChannels; ++channelIndex )
+        {
+            const ChannelConfig & channelConfig = connectionConfig.GetChannelConfig( channelIndex );
+            switch ( channelConfig.type )
             {
                 case CHANNEL_TYPE_RELIABLE_ORDERED: 
                 {
@@ -2675,7 +3445,7 @@ namespace yojimbo
                                                            ReliableOrderedChannel, 
                                                            *m_allocator, 
                                                            messageFactory, 
-                                                           m_connectionConfig.channel[channelIndex],
+                                                           channelConfig,
                                                            channelIndex, 
                                                            time ); 
                 }
@@ -2687,7 +3457,7 @@ namespace yojimbo
                                                            UnreliableUnorderedChannel, 
                                                            *m_allocator, 
                                                            messageFactory, 
-                                                           m_connectionConfig.channel[channelIndex], 
+                                                           channelConfig, 
                                                            channelIndex, 
                                                            time ); 
                 }
@@ -2703,17 +3473,20 @@ namespace yojimbo
     {
         yojimbo_assert( m_allocator );
         Reset();
-        for ( int i = 0; i < m_connectionConfig.numChannels; ++i )
+        for ( int i = 0; i < m_numChannels; ++i )
         {
             YOJIMBO_DELETE( *m_allocator, Channel, m_channel[i] );
         }
+        YOJIMBO_FREE( *m_allocator, m_channel );
+        m_connectionConfig->Release();
+        m_connectionConfig = NULL;
         m_allocator = NULL;
     }
 
     void Connection::Reset()
     {
         m_errorLevel = CONNECTION_ERROR_NONE;
-        for ( int i = 0; i < m_connectionConfig.numChannels; ++i )
+        for ( int i = 0; i < m_numChannels; ++i )
         {
             m_channel[i]->Reset();
         }
@@ -2722,21 +3495,21 @@ namespace yojimbo
     bool Connection::CanSendMessage( int channelIndex ) const
     {
         yojimbo_assert( channelIndex >= 0 );
-        yojimbo_assert( channelIndex < m_connectionConfig.numChannels );
+        yojimbo_assert( channelIndex < m_numChannels );
         return m_channel[channelIndex]->CanSendMessage();
     }
 
     void Connection::SendMessage( int channelIndex, Message * message )
     {
         yojimbo_assert( channelIndex >= 0 );
-        yojimbo_assert( channelIndex < m_connectionConfig.numChannels );
+        yojimbo_assert( channelIndex < m_numChannels );
         return m_channel[channelIndex]->SendMessage( message );
     }
 
     Message * Connection::ReceiveMessage( int channelIndex )
     {
         yojimbo_assert( channelIndex >= 0 );
-        yojimbo_assert( channelIndex < m_connectionConfig.numChannels );
+        yojimbo_assert( channelIndex < m_numChannels );
         return m_channel[channelIndex]->ReceiveMessage();
     }
 
@@ -2746,9 +3519,23 @@ namespace yojimbo
         m_messageFactory->ReleaseMessage( message );
     }
 
+    uint64_t Connection::GetChannelCounter( int channelIndex, int index ) const
+    {
+        yojimbo_assert( channelIndex >= 0 );
+        yojimbo_assert( channelIndex < m_numChannels );
+        return m_channel[channelIndex]->GetCounter( index );
+    }
+
+    bool Connection::GetChannelLatencyStats( int channelIndex, int index, TimingStats & stats ) const
+    {
+        yojimbo_assert( channelIndex >= 0 );
+        yojimbo_assert( channelIndex < m_numChannels );
+        return m_channel[channelIndex]->GetLatencyStats( index, stats );
+    }
+
     static int WritePacket( void * context, 
                             MessageFactory & messageFactory, 
-                            const ConnectionConfig & connectionConfig, 
+                            const SharedConnectionConfig & connectionConfig, 
                             ConnectionPacket & packet, 
                             uint8_t * buffer, 
                             int bufferSize )
@@ -2776,11 +3563,15 @@ namespace yojimbo
         return stream.GetBytesProcessed();
     }
 
-    bool Connection::GeneratePacket( void * context, uint16_t packetSequence, uint8_t * packetData, int maxPacketBytes, int & packetBytes )
+    bool Connection::GeneratePacket( void * context, uint16_t packetSequence, uint8_t * packetData, int maxPacketBytes, int & packetBytes, TimingHistogram * channelTimings )
     {
+#if !YOJIMBO_PROFILE
+        (void) channelTimings;
+#endif // #if !YOJIMBO_PROFILE
+
         ConnectionPacket packet;
 
-        if ( m_connectionConfig.numChannels > 0 )
+        if ( m_numChannels > 0 )
         {
             int numChannelsWithData = 0;
             bool channelHasData[MaxChannels];
@@ -2789,9 +3580,16 @@ namespace yojimbo
             
             int availableBits = maxPacketBytes * 8 - ConservativePacketHeaderBits;
             
-            for ( int channelIndex = 0; channelIndex < m_connectionConfig.numChannels; ++channelIndex )
+            for ( int channelIndex = 0; channelIndex < m_numChannels; ++channelIndex )
             {
+#if YOJIMBO_PROFILE
+                const double profileStart = channelTimings ? yojimbo_time() : 0.0;
+#endif // #if YOJIMBO_PROFILE
                 int packetDataBits = m_channel[channelIndex]->GetPacketData( channelData[channelIndex], packetSequence, availableBits );
+#if YOJIMBO_PROFILE
+                if ( channelTimings )
+                    channelTimings[channelIndex].AddSample( yojimbo_time() - profileStart );
+#endif // #if YOJIMBO_PROFILE
                 if ( packetDataBits > 0 )
                 {
                     availableBits -= ConservativeChannelHeaderBits;
@@ -2811,7 +3609,7 @@ namespace yojimbo
 
                 int index = 0;
 
-                for ( int channelIndex = 0; channelIndex < m_connectionConfig.numChannels; ++channelIndex )
+                for ( int channelIndex = 0; channelIndex < m_numChannels; ++channelIndex )
                 {
                     if ( channelHasData[channelIndex] )
                     {
@@ -2822,14 +3620,14 @@ namespace yojimbo
             }
         }
 
-        packetBytes = WritePacket( context, *m_messageFactory, m_connectionConfig, packet, packetData, maxPacketBytes );
+        packetBytes = WritePacket( context, *m_messageFactory, *m_connectionConfig, packet, packetData, maxPacketBytes );
 
         return true;
     }
 
     static bool ReadPacket( void * context, 
                             MessageFactory & messageFactory, 
-                            const ConnectionConfig & connectionConfig, 
+                            const SharedConnectionConfig & connectionConfig, 
                             ConnectionPacket & packet, 
                             const uint8_t * buffer, 
                             int bufferSize )
@@ -2868,7 +3666,7 @@ namespace yojimbo
 
         ConnectionPacket packet;
 
-        if ( !ReadPacket( context, *m_messageFactory, m_connectionConfig, packet, packetData, packetBytes ) )
+        if ( !ReadPacket( context, *m_messageFactory, *m_connectionConfig, packet, packetData, packetBytes ) )
         {
             yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to read packet\n" );
             m_errorLevel = CONNECTION_ERROR_READ_PACKET_FAILED;
@@ -2879,7 +3677,7 @@ namespace yojimbo
         {
             const int channelIndex = packet.channelEntry[i].channelIndex;
             yojimbo_assert( channelIndex >= 0 );
-            yojimbo_assert( channelIndex <= m_connectionConfig.numChannels );
+            yojimbo_assert( channelIndex <= m_numChannels );
             m_channel[channelIndex]->ProcessPacketData( packet.channelEntry[i], packetSequence );
             if ( m_channel[channelIndex]->GetErrorLevel() != CHANNEL_ERROR_NONE )
             {
@@ -2895,16 +3693,26 @@ namespace yojimbo
     {
         for ( int i = 0; i < numAcks; ++i )
         {
-            for ( int channelIndex = 0; channelIndex < m_connectionConfig.numChannels; ++channelIndex )
+            for ( int channelIndex = 0; channelIndex < m_numChannels; ++channelIndex )
             {
                 m_channel[channelIndex]->ProcessAck( acks[i] );
             }
         }
     }
 
+    double Connection::GetNextSendTime( double time ) const
+    {
+        double nextSendTime = time + MaxWakeupInterval;
+        for ( int i = 0; i < m_numChannels; ++i )
+        {
+            nextSendTime = yojimbo_min( nextSendTime, m_channel[i]->GetNextSendTime() );
+        }
+        return nextSendTime;
+    }
+
     void Connection::AdvanceTime( double time )
     {
-        for ( int i = 0; i < m_connectionConfig.numChannels; ++i )
+        for ( int i = 0; i < m_numChannels; ++i )
         {
             m_channel[i]->AdvanceTime( time );
 
@@ -2931,123 +3739,1051 @@ namespace yojimbo
 
 namespace yojimbo
 {
-    BaseClient::BaseClient( Allocator & allocator, const ClientServerConfig & config, Adapter & adapter, double time ) : m_config( config )
+    ServerTransport::ServerTransport()
     {
-        m_allocator = &allocator;
-        m_adapter = &adapter;
-        m_time = time;
-        m_context = NULL;
-        m_clientMemory = NULL;
-        m_clientAllocator = NULL;
-        m_endpoint = NULL;
-        m_connection = NULL;
-        m_messageFactory = NULL;
-        m_networkSimulator = NULL;
-        m_clientState = CLIENT_STATE_DISCONNECTED;
-        m_clientIndex = -1;
-        m_packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( allocator, config.maxPacketSize );
+        m_callbackContext = NULL;
+        m_connectDisconnectFunction = NULL;
+        m_sendLoopbackPacketFunction = NULL;
     }
 
-    BaseClient::~BaseClient()
+    void ServerTransport::SetCallbacks( void * context, ConnectDisconnectFunction connectDisconnectFunction, SendLoopbackPacketFunction sendLoopbackPacketFunction )
     {
-        // IMPORTANT: Please disconnect the client before destroying it
-        yojimbo_assert( m_clientState <= CLIENT_STATE_DISCONNECTED );
-        YOJIMBO_FREE( *m_allocator, m_packetBuffer );
-        m_allocator = NULL;
+        m_callbackContext = context;
+        m_connectDisconnectFunction = connectDisconnectFunction;
+        m_sendLoopbackPacketFunction = sendLoopbackPacketFunction;
     }
 
-    void BaseClient::Disconnect()
+    void ServerTransport::ConnectLoopbackClient( int clientIndex, uint64_t clientId, const uint8_t * userData )
     {
-        SetClientState( CLIENT_STATE_DISCONNECTED );
+        (void) clientId;
+        (void) userData;
+        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: transport does not support loopback clients. can't connect loopback client %d\n", clientIndex );
     }
 
-    void BaseClient::AdvanceTime( double time )
+    void ServerTransport::DisconnectLoopbackClient( int clientIndex )
     {
-        m_time = time;
-        if ( m_endpoint )
-        {
-            m_connection->AdvanceTime( time );
-            if ( m_connection->GetErrorLevel() != CONNECTION_ERROR_NONE )
-            {
-                yojimbo_printf( YOJIMBO_LOG_LEVEL_DEBUG, "connection error. disconnecting client\n" );
-                Disconnect();
-                return;
-            }
-            reliable_endpoint_update( m_endpoint, m_time );
-            int numAcks;
-            const uint16_t * acks = reliable_endpoint_get_acks( m_endpoint, &numAcks );
-            m_connection->ProcessAcks( acks, numAcks );
-            reliable_endpoint_clear_acks( m_endpoint );
-        }
-        NetworkSimulator * networkSimulator = GetNetworkSimulator();
-        if ( networkSimulator )
-        {
-            networkSimulator->AdvanceTime( time );
-        }
+        (void) clientIndex;
     }
 
-    void BaseClient::SetLatency( float milliseconds )
+    void ServerTransport::ProcessLoopbackPacket( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
     {
-        if ( m_networkSimulator )
-        {
-            m_networkSimulator->SetLatency( milliseconds );
-        }
+        (void) clientIndex;
+        (void) packetData;
+        (void) packetBytes;
+        (void) packetSequence;
     }
 
-    void BaseClient::SetJitter( float milliseconds )
+    void ServerTransport::ConnectDisconnectCallback( int clientIndex, bool connected )
     {
-        if ( m_networkSimulator )
+        if ( m_connectDisconnectFunction )
         {
-            m_networkSimulator->SetJitter( milliseconds );
+            m_connectDisconnectFunction( m_callbackContext, clientIndex, connected ? 1 : 0 );
         }
     }
 
-    void BaseClient::SetPacketLoss( float percent )
+    void ServerTransport::SendLoopbackPacketCallback( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
     {
-        if ( m_networkSimulator )
+        if ( m_sendLoopbackPacketFunction )
         {
-            m_networkSimulator->SetPacketLoss( percent );
+            m_sendLoopbackPacketFunction( m_callbackContext, clientIndex, packetData, packetBytes, packetSequence );
         }
     }
 
-    void BaseClient::SetDuplicates( float percent )
+    // -----------------------------------------------------------------------------------------------------
+
+    ClientTransport::ClientTransport()
     {
-        if ( m_networkSimulator )
-        {
-            m_networkSimulator->SetDuplicates( percent );
-        }
+        m_callbackContext = NULL;
+        m_sendLoopbackPacketFunction = NULL;
     }
 
-    void BaseClient::SetClientState( ClientState clientState )
+    void ClientTransport::SetCallbacks( void * context, SendLoopbackPacketFunction sendLoopbackPacketFunction )
     {
-        m_clientState = clientState;
+        m_callbackContext = context;
+        m_sendLoopbackPacketFunction = sendLoopbackPacketFunction;
     }
 
-    void BaseClient::CreateInternal()
+    void ClientTransport::ConnectLoopback( int clientIndex, int maxClients )
     {
-        yojimbo_assert( m_allocator );
-        yojimbo_assert( m_adapter );
-        yojimbo_assert( m_clientMemory == NULL );
-        yojimbo_assert( m_clientAllocator == NULL );
-        yojimbo_assert( m_messageFactory == NULL );
-        m_clientMemory = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, m_config.clientMemory );
-        m_clientAllocator = m_adapter->CreateAllocator( *m_allocator, m_clientMemory, m_config.clientMemory );
-        m_messageFactory = m_adapter->CreateMessageFactory( *m_clientAllocator );
-        m_connection = YOJIMBO_NEW( *m_clientAllocator, Connection, *m_clientAllocator, *m_messageFactory, m_config, m_time );
-        yojimbo_assert( m_connection );
-        if ( m_config.networkSimulator )
+        (void) maxClients;
+        yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: transport does not support loopback clients. can't connect loopback client %d\n", clientIndex );
+    }
+
+    void ClientTransport::DisconnectLoopback()
+    {
+    }
+
+    void ClientTransport::ProcessLoopbackPacket( const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    {
+        (void) packetData;
+        (void) packetBytes;
+        (void) packetSequence;
+    }
+
+    void ClientTransport::SendLoopbackPacketCallback( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    {
+        if ( m_sendLoopbackPacketFunction )
         {
-            m_networkSimulator = YOJIMBO_NEW( *m_clientAllocator, NetworkSimulator, *m_clientAllocator, m_config.maxSimulatorPackets, m_time );
+            m_sendLoopbackPacketFunction( m_callbackContext, clientIndex, packetData, packetBytes, packetSequence );
         }
-        reliable_config_t reliable_config;
-        reliable_default_config( &reliable_config );
-        strcpy( reliable_config.name, "client endpoint" );
-        reliable_config.context = (void*) this;
-        reliable_config.max_packet_size = m_config.maxPacketSize;
-        reliable_config.fragment_above = m_config.fragmentPacketsAbove;
-        reliable_config.max_fragments = m_config.maxPacketFragments;
-        reliable_config.fragment_size = m_config.packetFragmentSize; 
-        reliable_config.ack_buffer_size = m_config.ackedPacketsBufferSize;
+    }
+
+    // -----------------------------------------------------------------------------------------------------
+
+    static const double NetcodeUpdateInterval = 0.1;               // netcode.io sends connection and keep-alive packets at 10Hz
+
+    static void * TransportAllocateFunction( void * context, uint64_t bytes )
+    {
+        yojimbo_assert( context );
+        Allocator * allocator = (Allocator*) context;
+        return YOJIMBO_ALLOCATE( *allocator, bytes );
+    }
+
+    static void TransportFreeFunction( void * context, void * pointer )
+    {
+        yojimbo_assert( context );
+        yojimbo_assert( pointer );
+        Allocator * allocator = (Allocator*) context;
+        YOJIMBO_FREE( *allocator, pointer );
+    }
+
+    /**
+        The default server transport. Sends and receives packets with netcode.io.
+     */
+
+    class NetcodeServerTransport : public ServerTransport
+    {
+    public:
+
+        NetcodeServerTransport( Allocator & allocator, const Address & address, uint64_t protocolId, const uint8_t privateKey[] )
+        {
+            m_allocator = &allocator;
+            m_address = address;
+            m_protocolId = protocolId;
+            memcpy( m_privateKey, privateKey, NETCODE_KEY_BYTES );
+            m_server = NULL;
+            m_updateTime = 0.0;
+        }
+
+        ~NetcodeServerTransport()
+        {
+            // IMPORTANT: Please stop the transport before destroying it!
+            yojimbo_assert( !m_server );
+        }
+
+        bool Start( int maxClients, double time )
+        {
+            Stop();
+            char addressString[MaxAddressLength];
+            m_address.ToString( addressString, MaxAddressLength );
+            m_server = netcode_server_create_with_allocator( addressString, 
+                                                             m_protocolId, 
+                                                             m_privateKey, 
+                                                             time, 
+                                                             m_allocator, 
+                                                             TransportAllocateFunction, 
+                                                             TransportFreeFunction );
+            if ( !m_server )
+                return false;
+            netcode_server_connect_disconnect_callback( m_server, this, StaticConnectDisconnectCallbackFunction );
+            netcode_server_send_loopback_packet_callback( m_server, this, StaticSendLoopbackPacketCallbackFunction );
+            netcode_server_start( m_server, maxClients );
+            m_updateTime = time;
+            return true;
+        }
+
+        void Stop()
+        {
+            if ( m_server )
+            {
+                netcode_server_stop( m_server );
+                netcode_server_destroy( m_server );
+                m_server = NULL;
+            }
+        }
+
+        int GetPort() const
+        {
+            yojimbo_assert( m_server );
+            return netcode_server_get_port( m_server );
+        }
+
+        void Update( double time )
+        {
+            netcode_server_update( m_server, time );
+            m_updateTime = time;
+        }
+
+        double GetNextUpdateTime( double time ) const
+        {
+            (void) time;
+            return m_updateTime + NetcodeUpdateInterval;
+        }
+
+        bool Poll( double timeout )
+        {
+            // netcode.io doesn't expose its socket, so we can't wait on it. sleep for the timeout instead
+
+            if ( timeout > 0.0 )
+                yojimbo_sleep( timeout );
+            return true;
+        }
+
+        void SendPackets( const TransportPacket * packets, int numPackets )
+        {
+            // netcode.io owns the socket and sends one packet per call, so a batch is still one system call per packet
+
+            for ( int i = 0; i < numPackets; ++i )
+            {
+                netcode_server_send_packet( m_server, packets[i].clientIndex, packets[i].packetData, packets[i].packetBytes );
+            }
+        }
+
+        int ReceivePackets( int clientIndex, TransportPacket * packets, int maxPackets )
+        {
+            int numPackets = 0;
+            while ( numPackets < maxPackets )
+            {
+                int packetBytes;
+                uint64_t packetSequence;
+                uint8_t * packetData = netcode_server_receive_packet( m_server, clientIndex, &packetBytes, &packetSequence );
+                if ( !packetData )
+                    break;
+                packets[numPackets].clientIndex = clientIndex;
+                packets[numPackets].packetData = packetData;
+                packets[numPackets].packetBytes = packetBytes;
+                numPackets++;
+            }
+            return numPackets;
+        }
+
+        void FreePackets( TransportPacket * packets, int numPackets )
+        {
+            for ( int i = 0; i < numPackets; ++i )
+            {
+                netcode_server_free_packet( m_server, packets[i].packetData );
+                packets[i].packetData = NULL;
+            }
+        }
+
+        void DisconnectClient( int clientIndex )
+        {
+            netcode_server_disconnect_client( m_server, clientIndex );
+        }
+
+        void DisconnectAllClients()
+        {
+            netcode_server_disconnect_all_clients( m_server );
+        }
+
+        bool IsClientConnected( int clientIndex ) const
+        {
+            return netcode_server_client_connected( m_server, clientIndex ) != 0;
+        }
+
+        uint64_t GetClientId( int clientIndex ) const
+        {
+            return netcode_server_client_id( m_server, clientIndex );
+        }
+
+        int GetNumConnectedClients() const
+        {
+            return netcode_server_num_connected_clients( m_server );
+        }
+
+        void ConnectLoopbackClient( int clientIndex, uint64_t clientId, const uint8_t * userData )
+        {
+            netcode_server_connect_loopback_client( m_server, clientIndex, clientId, userData );
+        }
+
+        void DisconnectLoopbackClient( int clientIndex )
+        {
+            netcode_server_disconnect_loopback_client( m_server, clientIndex );
+        }
+
+        bool IsLoopbackClient( int clientIndex ) const
+        {
+            return netcode_server_client_loopback( m_server, clientIndex ) != 0;
+        }
+
+        void ProcessLoopbackPacket( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+        {
+            netcode_server_process_loopback_packet( m_server, clientIndex, packetData, packetBytes, packetSequence );
+        }
+
+    private:
+
+        static void StaticConnectDisconnectCallbackFunction( void * context, int clientIndex, int connected )
+        {
+            NetcodeServerTransport * transport = (NetcodeServerTransport*) context;
+            transport->ConnectDisconnectCallback( clientIndex, connected != 0 );
+        }
+
+        static void StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+        {
+            NetcodeServerTransport * transport = (NetcodeServerTransport*) context;
+            transport->SendLoopbackPacketCallback( clientIndex, packetData, packetBytes, packetSequence );
+        }
+
+        Allocator * m_allocator;                                    ///< Allocator for netcode.io allocations.
+        Address m_address;                                          ///< Address to bind to.
+        uint64_t m_protocolId;                                      ///< The protocol id.
+        uint8_t m_privateKey[NETCODE_KEY_BYTES];                    ///< The private key used to decrypt connect tokens.
+        netcode_server_t * m_server;                                ///< netcode.io server data. NULL if not running.
+        double m_updateTime;                                        ///< The time passed to the last update.
+    };
+
+    /**
+        The default client transport. Sends and receives packets with netcode.io.
+     */
+
+    class NetcodeClientTransport : public ClientTransport
+    {
+    public:
+
+        NetcodeClientTransport( Allocator & allocator, const Address & address )
+        {
+            m_allocator = &allocator;
+            m_address = address;
+            m_client = NULL;
+            m_updateTime = 0.0;
+        }
+
+        ~NetcodeClientTransport()
+        {
+            // IMPORTANT: Please close the transport before destroying it!
+            yojimbo_assert( !m_client );
+        }
+
+        bool Open( double time )
+        {
+            Close();
+            char addressString[MaxAddressLength];
+            m_address.ToString( addressString, MaxAddressLength );
+            m_client = netcode_client_create_with_allocator( addressString, time, m_allocator, TransportAllocateFunction, TransportFreeFunction );
+            if ( !m_client )
+                return false;
+            netcode_client_send_loopback_packet_callback( m_client, this, StaticSendLoopbackPacketCallbackFunction );
+            m_updateTime = time;
+            return true;
+        }
+
+        void Close()
+        {
+            if ( m_client )
+            {
+                netcode_client_destroy( m_client );
+                m_client = NULL;
+            }
+        }
+
+        int GetPort() const
+        {
+            yojimbo_assert( m_client );
+            return netcode_client_get_port( m_client );
+        }
+
+        void Connect( uint64_t clientId, uint8_t * connectToken )
+        {
+            (void) clientId;
+            netcode_client_connect( m_client, connectToken );
+        }
+
+        void Update( double time )
+        {
+            netcode_client_update( m_client, time );
+            m_updateTime = time;
+        }
+
+        double GetNextUpdateTime( double time ) const
+        {
+            (void) time;
+            return m_updateTime + NetcodeUpdateInterval;
+        }
+
+        bool Poll( double timeout )
+        {
+            // netcode.io doesn't expose its socket, so we can't wait on it. sleep for the timeout instead
+
+            if ( timeout > 0.0 )
+                yojimbo_sleep( timeout );
+            return true;
+        }
+
+        ClientState GetState() const
+        {
+            const int state = netcode_client_state( m_client );
+            if ( state < NETCODE_CLIENT_STATE_DISCONNECTED )
+                return CLIENT_STATE_ERROR;
+            else if ( state == NETCODE_CLIENT_STATE_DISCONNECTED )
+                return CLIENT_STATE_DISCONNECTED;
+            else if ( state == NETCODE_CLIENT_STATE_SENDING_CONNECTION_REQUEST )
+                return CLIENT_STATE_CONNECTING;
+            else
+                return CLIENT_STATE_CONNECTED;
+        }
+
+        int GetClientIndex() const
+        {
+            return netcode_client_index( m_client );
+        }
+
+        void SendPackets( const TransportPacket * packets, int numPackets )
+        {
+            for ( int i = 0; i < numPackets; ++i )
+            {
+                netcode_client_send_packet( m_client, packets[i].packetData, packets[i].packetBytes );
+            }
+        }
+
+        int ReceivePackets( TransportPacket * packets, int maxPackets )
+        {
+            int numPackets = 0;
+            while ( numPackets < maxPackets )
+            {
+                int packetBytes;
+                uint64_t packetSequence;
+                uint8_t * packetData = netcode_client_receive_packet( m_client, &packetBytes, &packetSequence );
+                if ( !packetData )
+                    break;
+                packets[numPackets].clientIndex = 0;
+                packets[numPackets].packetData = packetData;
+                packets[numPackets].packetBytes = packetBytes;
+                numPackets++;
+            }
+            return numPackets;
+        }
+
+        void FreePackets( TransportPacket * packets, int numPackets )
+        {
+            for ( int i = 0; i < numPackets; ++i )
+            {
+                netcode_client_free_packet( m_client, packets[i].packetData );
+                packets[i].packetData = NULL;
+            }
+        }
+
+        void ConnectLoopback( int clientIndex, int maxClients )
+        {
+            netcode_client_connect_loopback( m_client, clientIndex, maxClients );
+        }
+
+        void DisconnectLoopback()
+        {
+            netcode_client_disconnect_loopback( m_client );
+        }
+
+        bool IsLoopback() const
+        {
+            return netcode_client_loopback( m_client ) != 0;
+        }
+
+        void ProcessLoopbackPacket( const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+        {
+            netcode_client_process_loopback_packet( m_client, packetData, packetBytes, packetSequence );
+        }
+
+    private:
+
+        static void StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+        {
+            NetcodeClientTransport * transport = (NetcodeClientTransport*) context;
+            transport->SendLoopbackPacketCallback( clientIndex, packetData, packetBytes, packetSequence );
+        }
+
+        Allocator * m_allocator;                                    ///< Allocator for netcode.io allocations.
+        Address m_address;                                          ///< Address to bind to.
+        netcode_client_t * m_client;                                ///< netcode.io client data. NULL if not open.
+        double m_updateTime;                                        ///< The time passed to the last update.
+    };
+
+    // -----------------------------------------------------------------------------------------------------
+
+    static bool QueuePacketCopy( Allocator & allocator, Queue<TransportPacket> & queue, int clientIndex, const uint8_t * packetData, int packetBytes )
+    {
+        if ( queue.IsFull() )
+            return false;
+        uint8_t * packetCopy = (uint8_t*) YOJIMBO_ALLOCATE( allocator, packetBytes );
+        if ( !packetCopy )
+            return false;
+        memcpy( packetCopy, packetData, packetBytes );
+        TransportPacket packet;
+        packet.clientIndex = clientIndex;
+        packet.packetData = packetCopy;
+        packet.packetBytes = packetBytes;
+        queue.Push( packet );
+        return true;
+    }
+
+    MemoryServerTransport::MemoryServerTransport( Allocator & allocator, int packetQueueSize )
+    {
+        yojimbo_assert( packetQueueSize > 0 );
+        m_allocator = &allocator;
+        m_packetQueueSize = packetQueueSize;
+        m_maxClients = 0;
+        m_numConnectedClients = 0;
+        m_clientSlot = NULL;
+    }
+
+    MemoryServerTransport::~MemoryServerTransport()
+    {
+        Stop();
+    }
+
+    bool MemoryServerTransport::Start( int maxClients, double time )
+    {
+        (void) time;
+        yojimbo_assert( maxClients > 0 );
+        Stop();
+        m_clientSlot = (ClientSlot*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( ClientSlot ) * maxClients );
+        if ( !m_clientSlot )
+            return false;
+        m_maxClients = maxClients;
+        for ( int i = 0; i < m_maxClients; ++i )
+        {
+            m_clientSlot[i].state = SLOT_FREE;
+            m_clientSlot[i].client = NULL;
+            m_clientSlot[i].clientId = 0;
+            m_clientSlot[i].packetQueue = YOJIMBO_NEW( *m_allocator, Queue<TransportPacket>, *m_allocator, m_packetQueueSize );
+        }
+        return true;
+    }
+
+    void MemoryServerTransport::Stop()
+    {
+        if ( !m_clientSlot )
+            return;
+        for ( int i = 0; i < m_maxClients; ++i )
+        {
+            if ( m_clientSlot[i].client )
+            {
+                m_clientSlot[i].client->OnServerDisconnect( m_clientSlot[i].state == SLOT_CONNECTING );
+            }
+            if ( m_clientSlot[i].state == SLOT_CONNECTED || m_clientSlot[i].state == SLOT_DISCONNECTING )
+            {
+                ConnectDisconnectCallback( i, false );
+            }
+            ClearPacketQueue( i );
+            YOJIMBO_DELETE( *m_allocator, Queue<TransportPacket>, m_clientSlot[i].packetQueue );
+        }
+        YOJIMBO_FREE( *m_allocator, m_clientSlot );
+        m_maxClients = 0;
+        m_numConnectedClients = 0;
+    }
+
+    void MemoryServerTransport::Update( double time )
+    {
+        (void) time;
+        for ( int i = 0; i < m_maxClients; ++i )
+        {
+            if ( m_clientSlot[i].state == SLOT_CONNECTING )
+            {
+                m_clientSlot[i].state = SLOT_CONNECTED;
+                m_numConnectedClients++;
+                ConnectDisconnectCallback( i, true );
+            }
+            else if ( m_clientSlot[i].state == SLOT_DISCONNECTING )
+            {
+                m_clientSlot[i].state = SLOT_FREE;
+                m_numConnectedClients--;
+                ClearPacketQueue( i );
+                ConnectDisconnectCallback( i, false );
+            }
+        }
+    }
+
+    double MemoryServerTransport::GetNextUpdateTime( double time ) const
+    {
+        // clients finish connecting and disconnecting on the next update
+
+        for ( int i = 0; i < m_maxClients; ++i )
+        {
+            if ( m_clientSlot[i].state == SLOT_CONNECTING || m_clientSlot[i].state == SLOT_DISCONNECTING )
+                return time;
+        }
+        return time + MaxWakeupInterval;
+    }
+
+    bool MemoryServerTransport::Poll( double timeout )
+    {
+        (void) timeout;
+        for ( int i = 0; i < m_maxClients; ++i )
+        {
+            if ( !m_clientSlot[i].packetQueue->IsEmpty() )
+                return true;
+        }
+        return false;
+    }
+
+    void MemoryServerTransport::SendPackets( const TransportPacket * packets, int numPackets )
+    {
+        for ( int i = 0; i < numPackets; ++i )
+        {
+            const int clientIndex = packets[i].clientIndex;
+            yojimbo_assert( clientIndex >= 0 );
+            yojimbo_assert( clientIndex < m_maxClients );
+            if ( m_clientSlot[clientIndex].state == SLOT_CONNECTED )
+            {
+                yojimbo_assert( m_clientSlot[clientIndex].client );
+                m_clientSlot[clientIndex].client->QueuePacket( packets[i].packetData, packets[i].packetBytes );
+            }
+        }
+    }
+
+    int MemoryServerTransport::ReceivePackets( int clientIndex, TransportPacket * packets, int maxPackets )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        Queue<TransportPacket> & packetQueue = *m_clientSlot[clientIndex].packetQueue;
+        int numPackets = 0;
+        while ( numPackets < maxPackets && !packetQueue.IsEmpty() )
+        {
+            packets[numPackets++] = packetQueue.Pop();
+        }
+        return numPackets;
+    }
+
+    void MemoryServerTransport::FreePackets( TransportPacket * packets, int numPackets )
+    {
+        for ( int i = 0; i < numPackets; ++i )
+        {
+            YOJIMBO_FREE( *m_allocator, packets[i].packetData );
+        }
+    }
+
+    void MemoryServerTransport::DisconnectClient( int clientIndex )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        if ( m_clientSlot[clientIndex].state != SLOT_CONNECTED )
+            return;
+        yojimbo_assert( m_clientSlot[clientIndex].client );
+        m_clientSlot[clientIndex].client->OnServerDisconnect( false );
+        m_clientSlot[clientIndex].client = NULL;
+        m_clientSlot[clientIndex].state = SLOT_FREE;
+        m_numConnectedClients--;
+        ClearPacketQueue( clientIndex );
+        ConnectDisconnectCallback( clientIndex, false );
+    }
+
+    void MemoryServerTransport::DisconnectAllClients()
+    {
+        for ( int i = 0; i < m_maxClients; ++i )
+        {
+            DisconnectClient( i );
+        }
+    }
+
+    bool MemoryServerTransport::IsClientConnected( int clientIndex ) const
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        return m_clientSlot[clientIndex].state == SLOT_CONNECTED;
+    }
+
+    uint64_t MemoryServerTransport::GetClientId( int clientIndex ) const
+    {
+        return IsClientConnected( clientIndex ) ? m_clientSlot[clientIndex].clientId : 0;
+    }
+
+    int MemoryServerTransport::AddClient( MemoryClientTransport * client, uint64_t clientId )
+    {
+        yojimbo_assert( client );
+        for ( int i = 0; i < m_maxClients; ++i )
+        {
+            if ( m_clientSlot[i].state == SLOT_FREE )
+            {
+                m_clientSlot[i].state = SLOT_CONNECTING;
+                m_clientSlot[i].client = client;
+                m_clientSlot[i].clientId = clientId;
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void MemoryServerTransport::RemoveClient( int clientIndex )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        m_clientSlot[clientIndex].client = NULL;
+        if ( m_clientSlot[clientIndex].state == SLOT_CONNECTING )
+        {
+            m_clientSlot[clientIndex].state = SLOT_FREE;
+        }
+        else if ( m_clientSlot[clientIndex].state == SLOT_CONNECTED )
+        {
+            // the server finds out on its next update, like it would over the network
+            m_clientSlot[clientIndex].state = SLOT_DISCONNECTING;
+        }
+    }
+
+    void MemoryServerTransport::QueuePacket( int clientIndex, const uint8_t * packetData, int packetBytes )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        if ( m_clientSlot[clientIndex].state != SLOT_CONNECTED )
+            return;
+        QueuePacketCopy( *m_allocator, *m_clientSlot[clientIndex].packetQueue, clientIndex, packetData, packetBytes );
+    }
+
+    void MemoryServerTransport::ClearPacketQueue( int clientIndex )
+    {
+        Queue<TransportPacket> & packetQueue = *m_clientSlot[clientIndex].packetQueue;
+        while ( !packetQueue.IsEmpty() )
+        {
+            TransportPacket packet = packetQueue.Pop();
+            YOJIMBO_FREE( *m_allocator, packet.packetData );
+        }
+    }
+
+    // -----------------------------------------------------------------------------------------------------
+
+    MemoryClientTransport::MemoryClientTransport( Allocator & allocator, MemoryServerTransport & server, int packetQueueSize )
+    {
+        yojimbo_assert( packetQueueSize > 0 );
+        m_allocator = &allocator;
+        m_server = &server;
+        m_packetQueueSize = packetQueueSize;
+        m_state = CLIENT_STATE_DISCONNECTED;
+        m_clientId = 0;
+        m_clientIndex = -1;
+        m_packetQueue = NULL;
+    }
+
+    MemoryClientTransport::~MemoryClientTransport()
+    {
+        Close();
+    }
+
+    bool MemoryClientTransport::Open( double time )
+    {
+        (void) time;
+        Close();
+        m_packetQueue = YOJIMBO_NEW( *m_allocator, Queue<TransportPacket>, *m_allocator, m_packetQueueSize );
+        return m_packetQueue != NULL;
+    }
+
+    void MemoryClientTransport::Close()
+    {
+        if ( m_clientIndex >= 0 )
+        {
+            m_server->RemoveClient( m_clientIndex );
+            m_clientIndex = -1;
+        }
+        m_state = CLIENT_STATE_DISCONNECTED;
+        m_clientId = 0;
+        if ( m_packetQueue )
+        {
+            ClearPacketQueue();
+            YOJIMBO_DELETE( *m_allocator, Queue<TransportPacket>, m_packetQueue );
+        }
+    }
+
+    void MemoryClientTransport::Connect( uint64_t clientId, uint8_t * connectToken )
+    {
+        (void) connectToken;
+        yojimbo_assert( m_packetQueue );
+        if ( m_clientIndex >= 0 )
+        {
+            m_server->RemoveClient( m_clientIndex );
+            m_clientIndex = -1;
+        }
+        m_clientId = clientId;
+        m_state = CLIENT_STATE_CONNECTING;
+    }
+
+    void MemoryClientTransport::Update( double time )
+    {
+        (void) time;
+        if ( m_state != CLIENT_STATE_CONNECTING )
+            return;
+        if ( m_clientIndex < 0 )
+        {
+            m_clientIndex = m_server->AddClient( this, m_clientId );
+            if ( m_clientIndex < 0 )
+            {
+                // connection denied: the server is full or not running
+                m_state = CLIENT_STATE_ERROR;
+                return;
+            }
+        }
+        if ( m_server->IsClientConnected( m_clientIndex ) )
+        {
+            m_state = CLIENT_STATE_CONNECTED;
+        }
+    }
+
+    double MemoryClientTransport::GetNextUpdateTime( double time ) const
+    {
+        return m_state == CLIENT_STATE_CONNECTING ? time : time + MaxWakeupInterval;
+    }
+
+    bool MemoryClientTransport::Poll( double timeout )
+    {
+        (void) timeout;
+        return m_packetQueue && !m_packetQueue->IsEmpty();
+    }
+
+    void MemoryClientTransport::SendPackets( const TransportPacket * packets, int numPackets )
+    {
+        if ( m_state != CLIENT_STATE_CONNECTED )
+            return;
+        for ( int i = 0; i < numPackets; ++i )
+        {
+            m_server->QueuePacket( m_clientIndex, packets[i].packetData, packets[i].packetBytes );
+        }
+    }
+
+    int MemoryClientTransport::ReceivePackets( TransportPacket * packets, int maxPackets )
+    {
+        int numPackets = 0;
+        if ( m_packetQueue )
+        {
+            while ( numPackets < maxPackets && !m_packetQueue->IsEmpty() )
+            {
+                packets[numPackets++] = m_packetQueue->Pop();
+            }
+        }
+        return numPackets;
+    }
+
+    void MemoryClientTransport::FreePackets( TransportPacket * packets, int numPackets )
+    {
+        for ( int i = 0; i < numPackets; ++i )
+        {
+            YOJIMBO_FREE( *m_allocator, packets[i].packetData );
+        }
+    }
+
+    void MemoryClientTransport::QueuePacket( const uint8_t * packetData, int packetBytes )
+    {
+        if ( m_state != CLIENT_STATE_CONNECTED || !m_packetQueue )
+            return;
+        QueuePacketCopy( *m_allocator, *m_packetQueue, 0, packetData, packetBytes );
+    }
+
+    void MemoryClientTransport::OnServerDisconnect( bool denied )
+    {
+        m_clientIndex = -1;
+        m_state = denied ? CLIENT_STATE_ERROR : CLIENT_STATE_DISCONNECTED;
+        if ( m_packetQueue )
+        {
+            ClearPacketQueue();
+        }
+    }
+
+    void MemoryClientTransport::ClearPacketQueue()
+    {
+        while ( !m_packetQueue->IsEmpty() )
+        {
+            TransportPacket packet = m_packetQueue->Pop();
+            YOJIMBO_FREE( *m_allocator, packet.packetData );
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------
+
+namespace yojimbo
+{
+    static uint8_t * AllocateHeapMemory( Allocator & allocator, const ClientServerConfig & config, int bytes )
+    {
+        if ( config.mappedMemory )
+            return (uint8_t*) yojimbo_map_memory( bytes, config.hugePages );
+        else
+            return (uint8_t*) YOJIMBO_ALLOCATE( allocator, bytes );
+    }
+
+    static void FreeHeapMemory( Allocator & allocator, const ClientServerConfig & config, uint8_t * memory, int bytes )
+    {
+        if ( config.mappedMemory )
+            yojimbo_unmap_memory( memory, bytes, config.hugePages );
+        else
+            YOJIMBO_FREE( allocator, memory );
+    }
+
+    BaseClient::BaseClient( Allocator & allocator, const ClientServerConfig & config, Adapter & adapter, double time ) : m_config( config )
+    {
+        m_allocator = &allocator;
+        m_adapter = &adapter;
+        m_time = time;
+        m_context = NULL;
+        m_clientMemory = NULL;
+        m_clientAllocator = NULL;
+        m_endpoint = NULL;
+        m_connection = NULL;
+        m_messageFactory = NULL;
+        m_networkSimulator = NULL;
+        m_clientState = CLIENT_STATE_DISCONNECTED;
+        m_clientIndex = -1;
+        m_packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( allocator, config.maxPacketSize );
+    }
+
+    BaseClient::~BaseClient()
+    {
+        // IMPORTANT: Please disconnect the client before destroying it
+        yojimbo_assert( m_clientState <= CLIENT_STATE_DISCONNECTED );
+        YOJIMBO_FREE( *m_allocator, m_packetBuffer );
+        m_allocator = NULL;
+    }
+
+    void BaseClient::Disconnect()
+    {
+        SetClientState( CLIENT_STATE_DISCONNECTED );
+    }
+
+    void BaseClient::AdvanceTime( double time )
+    {
+        m_time = time;
+        if ( m_endpoint )
+        {
+            m_connection->AdvanceTime( time );
+            if ( m_connection->GetErrorLevel() != CONNECTION_ERROR_NONE )
+            {
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_DEBUG, "connection error. disconnecting client\n" );
+                Disconnect();
+                return;
+            }
+            reliable_endpoint_update( m_endpoint, m_time );
+            int numAcks;
+            const uint16_t * acks = reliable_endpoint_get_acks( m_endpoint, &numAcks );
+            m_connection->ProcessAcks( acks, numAcks );
+            reliable_endpoint_clear_acks( m_endpoint );
+        }
+        NetworkSimulator * networkSimulator = GetNetworkSimulator();
+        if ( networkSimulator )
+        {
+            networkSimulator->AdvanceTime( time );
+        }
+    }
+
+    double BaseClient::GetNextWakeupTime() const
+    {
+        double wakeupTime = m_time + MaxWakeupInterval;
+        if ( m_connection )
+        {
+            wakeupTime = yojimbo_min( wakeupTime, m_connection->GetNextSendTime( m_time ) );
+        }
+        if ( m_networkSimulator && m_networkSimulator->IsActive() )
+        {
+            wakeupTime = yojimbo_min( wakeupTime, m_networkSimulator->GetNextDeliveryTime() );
+        }
+        return wakeupTime;
+    }
+
+    void BaseClient::SetLatency( float milliseconds )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetLatency( milliseconds );
+        }
+    }
+
+    void BaseClient::SetJitter( float milliseconds )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetJitter( milliseconds );
+        }
+    }
+
+    void BaseClient::SetPacketLoss( float percent )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetPacketLoss( percent );
+        }
+    }
+
+    void BaseClient::SetDuplicates( float percent )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetDuplicates( percent );
+        }
+    }
+
+    void BaseClient::SetBandwidth( float kilobitsPerSecond, int burstBytes )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetBandwidth( kilobitsPerSecond, burstBytes );
+        }
+    }
+
+    void BaseClient::SetQueueLimit( int queueBytes, int earlyDropBytes )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetQueueLimit( queueBytes, earlyDropBytes );
+        }
+    }
+
+    void BaseClient::SetBurstLoss( float goodToBadPercent, float badToGoodPercent, float badLossPercent, float goodLossPercent )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetBurstLoss( goodToBadPercent, badToGoodPercent, badLossPercent, goodLossPercent );
+        }
+    }
+
+    void BaseClient::SetReordering( float percent, float milliseconds )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetReordering( percent, milliseconds );
+        }
+    }
+
+    void BaseClient::SetOutage( float periodSeconds, float durationSeconds )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetOutage( periodSeconds, durationSeconds );
+        }
+    }
+
+    void BaseClient::SetNetworkSimulatorSeed( uint64_t seed, uint64_t stream )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetSeed( seed, stream );
+        }
+    }
+
+    void BaseClient::SetClientState( ClientState clientState )
+    {
+        m_clientState = clientState;
+    }
+
+    void BaseClient::CreateInternal( uint64_t clientId )
+    {
+        yojimbo_assert( m_allocator );
+        yojimbo_assert( m_adapter );
+        yojimbo_assert( m_clientMemory == NULL );
+        yojimbo_assert( m_clientAllocator == NULL );
+        yojimbo_assert( m_messageFactory == NULL );
+        m_clientMemory = AllocateHeapMemory( *m_allocator, m_config, m_config.clientMemory );
+        yojimbo_assert( m_clientMemory );
+        m_clientAllocator = m_adapter->CreateAllocator( *m_allocator, m_clientMemory, m_config.clientMemory );
+        m_messageFactory = m_adapter->CreateMessageFactory( *m_clientAllocator );
+        m_connection = YOJIMBO_NEW( *m_clientAllocator, Connection, *m_clientAllocator, *m_messageFactory, m_config, m_time );
+        yojimbo_assert( m_connection );
+        if ( m_config.networkSimulator )
+        {
+            // each client gets its own random stream, so clients in the same process don't drop and delay the same packets
+            m_networkSimulator = YOJIMBO_NEW( *m_clientAllocator, NetworkSimulator, *m_clientAllocator, m_config.maxSimulatorPackets, m_time, m_config.GetMaxTransmitPacketSize(), 0, 0, clientId );
+        }
+        reliable_config_t reliable_config;
+        reliable_default_config( &reliable_config );
+        strcpy( reliable_config.name, "client endpoint" );
+        reliable_config.context = (void*) this;
+        reliable_config.max_packet_size = m_config.maxPacketSize;
+        reliable_config.fragment_above = m_config.fragmentPacketsAbove;
+        reliable_config.max_fragments = m_config.maxPacketFragments;
+        reliable_config.fragment_size = m_config.packetFragmentSize; 
+        reliable_config.ack_buffer_size = m_config.ackedPacketsBufferSize;
         reliable_config.received_packets_buffer_size = m_config.receivedPacketsBufferSize;
         reliable_config.fragment_reassembly_buffer_size = m_config.packetReassemblyBufferSize;
         reliable_config.transmit_packet_function = BaseClient::StaticTransmitPacketFunction;
@@ -3059,381 +4795,1128 @@ namespace yojimbo
         reliable_endpoint_reset( m_endpoint );
     }
 
-    void BaseClient::DestroyInternal()
+    void BaseClient::DestroyInternal()
+    {
+        yojimbo_assert( m_allocator );
+        if ( m_endpoint )
+        {
+            reliable_endpoint_destroy( m_endpoint ); 
+            m_endpoint = NULL;
+        }
+        YOJIMBO_DELETE( *m_clientAllocator, NetworkSimulator, m_networkSimulator );
+        YOJIMBO_DELETE( *m_clientAllocator, Connection, m_connection );
+        YOJIMBO_DELETE( *m_clientAllocator, MessageFactory, m_messageFactory );
+        YOJIMBO_DELETE( *m_allocator, Allocator, m_clientAllocator );
+        FreeHeapMemory( *m_allocator, m_config, m_clientMemory, m_config.clientMemory );
+        m_clientMemory = NULL;
+    }
+
+    void BaseClient::StaticTransmitPacketFunction( void * context, int index, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
+    {
+        (void) index;
+        BaseClient * client = (BaseClient*) context;
+        client->TransmitPacketFunction( packetSequence, packetData, packetBytes );
+    }
+    
+    int BaseClient::StaticProcessPacketFunction( void * context, int index, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
+    {
+        (void) index;
+        BaseClient * client = (BaseClient*) context;
+        return client->ProcessPacketFunction( packetSequence, packetData, packetBytes );
+    }
+
+    void * BaseClient::StaticAllocateFunction( void * context, uint64_t bytes )
+    {
+        yojimbo_assert( context );
+        Allocator * allocator = (Allocator*) context;
+        return YOJIMBO_ALLOCATE( *allocator, bytes );
+    }
+    
+    void BaseClient::StaticFreeFunction( void * context, void * pointer )
+    {
+        yojimbo_assert( context );
+        yojimbo_assert( pointer );
+        Allocator * allocator = (Allocator*) context;
+        YOJIMBO_FREE( *allocator, pointer );
+    }
+
+    Message * BaseClient::CreateMessage( int type )
+    {
+        yojimbo_assert( m_messageFactory );
+        return m_messageFactory->CreateMessage( type );
+    }
+
+    uint8_t * BaseClient::AllocateBlock( int bytes )
+    {
+        return (uint8_t*) YOJIMBO_ALLOCATE( *m_clientAllocator, bytes );
+    }
+
+    void BaseClient::AttachBlockToMessage( Message * message, uint8_t * block, int bytes )
+    {
+        yojimbo_assert( message );
+        yojimbo_assert( block );
+        yojimbo_assert( bytes > 0 );
+        yojimbo_assert( message->IsBlockMessage() );
+        BlockMessage * blockMessage = (BlockMessage*) message;
+        blockMessage->AttachBlock( *m_clientAllocator, block, bytes );
+    }
+
+    void BaseClient::FreeBlock( uint8_t * block )
+    {
+        YOJIMBO_FREE( *m_clientAllocator, block );
+    }
+
+    bool BaseClient::CanSendMessage( int channelIndex ) const
+    {
+        yojimbo_assert( m_connection );
+        return m_connection->CanSendMessage( channelIndex );
+    }
+
+    void BaseClient::SendMessage( int channelIndex, Message * message )
+    {
+        yojimbo_assert( m_connection );
+        m_connection->SendMessage( channelIndex, message );
+    }
+
+    Message * BaseClient::ReceiveMessage( int channelIndex )
+    {
+        yojimbo_assert( m_connection );
+        return m_connection->ReceiveMessage( channelIndex );
+    }
+
+    void BaseClient::ReleaseMessage( Message * message )
+    {
+        yojimbo_assert( m_connection );
+        m_connection->ReleaseMessage( message );
+    }
+
+    void BaseClient::GetNetworkInfo( NetworkInfo & info ) const
+    {
+        memset( &info, 0, sizeof( info ) );
+        if ( m_connection )
+        {
+            yojimbo_assert( m_endpoint );
+            const uint64_t * counters = reliable_endpoint_counters( m_endpoint );
+            info.numPacketsSent = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_SENT];
+            info.numPacketsReceived = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_RECEIVED];
+            info.numPacketsAcked = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_ACKED];
+            info.RTT = reliable_endpoint_rtt( m_endpoint );
+            info.packetLoss = reliable_endpoint_packet_loss( m_endpoint );
+            reliable_endpoint_bandwidth( m_endpoint, &info.sentBandwidth, &info.receivedBandwidth, &info.ackedBandwidth );
+        }
+    }
+
+    uint64_t BaseClient::GetChannelCounter( int channelIndex, int index ) const
+    {
+        return m_connection ? m_connection->GetChannelCounter( channelIndex, index ) : 0;
+    }
+
+    bool BaseClient::GetChannelLatencyStats( int channelIndex, int index, TimingStats & stats ) const
+    {
+        if ( !m_connection )
+            return false;
+        return m_connection->GetChannelLatencyStats( channelIndex, index, stats );
+    }
+
+    // ------------------------------------------------------------------------------------------------------------------
+
+    Client::Client( Allocator & allocator, const Address & address, const ClientServerConfig & config, Adapter & adapter, double time ) 
+        : BaseClient( allocator, config, adapter, time ), m_config( config ), m_address( address )
+    {
+        m_clientId = 0;
+        m_transport = NULL;
+        m_externalTransport = NULL;
+        m_boundAddress = m_address;
+    }
+
+    Client::Client( Allocator & allocator, ClientTransport & transport, const ClientServerConfig & config, Adapter & adapter, double time ) 
+        : BaseClient( allocator, config, adapter, time ), m_config( config )
+    {
+        m_clientId = 0;
+        m_transport = NULL;
+        m_externalTransport = &transport;
+        m_boundAddress = m_address;
+    }
+
+    Client::~Client()
+    {
+        // IMPORTANT: Please disconnect the client before destroying it
+        yojimbo_assert( m_transport == NULL );
+    }
+
+    void Client::InsecureConnect( const uint8_t privateKey[], uint64_t clientId, const Address & address )
+    {
+        InsecureConnect( privateKey, clientId, &address, 1 );
+    }
+
+    void Client::InsecureConnect( const uint8_t privateKey[], uint64_t clientId, const Address serverAddresses[], int numServerAddresses )
+    {
+        yojimbo_assert( serverAddresses );
+        yojimbo_assert( numServerAddresses > 0 );
+        yojimbo_assert( numServerAddresses <= NETCODE_MAX_SERVERS_PER_CONNECT );
+        Disconnect();
+        CreateInternal( clientId );
+        m_clientId = clientId;
+        CreateClient( m_address );
+        if ( !m_transport )
+        {
+            Disconnect();
+            return;
+        }
+        uint8_t connectToken[NETCODE_CONNECT_TOKEN_BYTES];
+        if ( !GenerateInsecureConnectToken( connectToken, privateKey, clientId, serverAddresses, numServerAddresses ) )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to generate insecure connect token\n" );
+            SetClientState( CLIENT_STATE_ERROR );
+            return;
+        }
+        m_transport->Connect( clientId, connectToken );
+        SetClientState( CLIENT_STATE_CONNECTING );
+    }
+
+    bool Client::GenerateInsecureConnectToken( uint8_t * connectToken, 
+                                               const uint8_t privateKey[], 
+                                               uint64_t clientId, 
+                                               const Address serverAddresses[], 
+                                               int numServerAddresses )
+    {
+        char serverAddressStrings[NETCODE_MAX_SERVERS_PER_CONNECT][MaxAddressLength];
+        const char * serverAddressStringPointers[NETCODE_MAX_SERVERS_PER_CONNECT];
+        for ( int i = 0; i < numServerAddresses; ++i ) 
+        {
+            serverAddresses[i].ToString( serverAddressStrings[i], MaxAddressLength );
+            serverAddressStringPointers[i] = serverAddressStrings[i];
+        }
+        return netcode_generate_connect_token( numServerAddresses, 
+                                               serverAddressStringPointers, 
+                                               m_config.timeout,
+                                               m_config.timeout, 
+                                               clientId, 
+                                               m_config.protocolId, 
+                                               0, 
+                                               (uint8_t*)privateKey, 
+                                               connectToken ) == NETCODE_OK;
+    }
+
+    void Client::Connect( uint64_t clientId, uint8_t * connectToken )
     {
-        yojimbo_assert( m_allocator );
-        if ( m_endpoint )
+        yojimbo_assert( connectToken );
+        Disconnect();
+        CreateInternal( clientId );
+        m_clientId = clientId;
+        CreateClient( m_address );
+        if ( !m_transport )
         {
-            reliable_endpoint_destroy( m_endpoint ); 
-            m_endpoint = NULL;
+            Disconnect();
+            return;
+        }
+        m_transport->Connect( clientId, connectToken );
+        if ( m_transport->GetState() > CLIENT_STATE_DISCONNECTED )
+        {
+            SetClientState( CLIENT_STATE_CONNECTING );
+        }
+        else
+        {
+            Disconnect();
         }
-        YOJIMBO_DELETE( *m_clientAllocator, NetworkSimulator, m_networkSimulator );
-        YOJIMBO_DELETE( *m_clientAllocator, Connection, m_connection );
-        YOJIMBO_DELETE( *m_clientAllocator, MessageFactory, m_messageFactory );
-        YOJIMBO_DELETE( *m_allocator, Allocator, m_clientAllocator );
-        YOJIMBO_FREE( *m_allocator, m_clientMemory );
     }
 
-    void BaseClient::StaticTransmitPacketFunction( void * context, int index, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
+    void Client::Disconnect()
     {
-        (void) index;
-        BaseClient * client = (BaseClient*) context;
-        client->TransmitPacketFunction( packetSequence, packetData, packetBytes );
+        BaseClient::Disconnect();
+        DestroyClient();
+        DestroyInternal();
+        m_clientId = 0;
     }
-    
-    int BaseClient::StaticProcessPacketFunction( void * context, int index, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
+
+    void Client::SendPackets()
     {
-        (void) index;
-        BaseClient * client = (BaseClient*) context;
-        return client->ProcessPacketFunction( packetSequence, packetData, packetBytes );
+        if ( !IsConnected() )
+            return;
+        yojimbo_assert( m_transport );
+        uint8_t * packetData = GetPacketBuffer();
+        int packetBytes;
+        uint16_t packetSequence = reliable_endpoint_next_packet_sequence( GetEndpoint() );
+        if ( GetConnection().GeneratePacket( GetContext(), packetSequence, packetData, m_config.maxPacketSize, packetBytes ) )
+        {
+            reliable_endpoint_send_packet( GetEndpoint(), packetData, packetBytes );
+        }
     }
 
-    void * BaseClient::StaticAllocateFunction( void * context, uint64_t bytes )
+    void Client::ReceivePackets()
     {
-        yojimbo_assert( context );
-        Allocator * allocator = (Allocator*) context;
-        return YOJIMBO_ALLOCATE( *allocator, bytes );
+        if ( !IsConnected() )
+            return;
+        yojimbo_assert( m_transport );
+        const int MaxPackets = 64;
+        TransportPacket packets[MaxPackets];
+        while ( true )
+        {
+            const int numPackets = m_transport->ReceivePackets( packets, MaxPackets );
+            for ( int i = 0; i < numPackets; ++i )
+            {
+                reliable_endpoint_receive_packet( GetEndpoint(), packets[i].packetData, packets[i].packetBytes );
+            }
+            m_transport->FreePackets( packets, numPackets );
+            if ( numPackets < MaxPackets )
+                break;
+        }
     }
-    
-    void BaseClient::StaticFreeFunction( void * context, void * pointer )
+
+    void Client::AdvanceTime( double time )
     {
-        yojimbo_assert( context );
-        yojimbo_assert( pointer );
-        Allocator * allocator = (Allocator*) context;
-        YOJIMBO_FREE( *allocator, pointer );
+        BaseClient::AdvanceTime( time );
+        if ( m_transport )
+        {
+            m_transport->Update( time );
+            const ClientState state = m_transport->GetState();
+            if ( state == CLIENT_STATE_ERROR )
+            {
+                Disconnect();
+                SetClientState( CLIENT_STATE_ERROR );
+                return;
+            }
+            else if ( state == CLIENT_STATE_DISCONNECTED )
+            {
+                Disconnect();
+                SetClientState( CLIENT_STATE_DISCONNECTED );
+                return;
+            }
+            SetClientState( state );
+            NetworkSimulator * networkSimulator = GetNetworkSimulator();
+            if ( networkSimulator && networkSimulator->IsActive() )
+            {
+                uint8_t ** packetData = (uint8_t**) alloca( sizeof( uint8_t*) * m_config.maxSimulatorPackets );
+                int * packetBytes = (int*) alloca( sizeof(int) * m_config.maxSimulatorPackets );
+                TransportPacket * packets = (TransportPacket*) alloca( sizeof( TransportPacket ) * m_config.maxSimulatorPackets );
+                int numPackets = networkSimulator->ReceivePackets( m_config.maxSimulatorPackets, packetData, packetBytes, NULL );
+                for ( int i = 0; i < numPackets; ++i )
+                {
+                    packets[i].clientIndex = 0;
+                    packets[i].packetData = packetData[i];
+                    packets[i].packetBytes = packetBytes[i];
+                }
+                m_transport->SendPackets( packets, numPackets );
+                networkSimulator->ReleasePackets( packetData, numPackets );
+            }
+        }
     }
 
-    Message * BaseClient::CreateMessage( int type )
+    double Client::GetNextWakeupTime() const
     {
-        yojimbo_assert( m_messageFactory );
-        return m_messageFactory->CreateMessage( type );
+        double wakeupTime = BaseClient::GetNextWakeupTime();
+        if ( m_transport )
+        {
+            wakeupTime = yojimbo_min( wakeupTime, m_transport->GetNextUpdateTime( GetTime() ) );
+        }
+        return wakeupTime;
     }
 
-    uint8_t * BaseClient::AllocateBlock( int bytes )
+    bool Client::Poll( double timeout )
     {
-        return (uint8_t*) YOJIMBO_ALLOCATE( *m_clientAllocator, bytes );
+        if ( !m_transport )
+            return false;
+        return m_transport->Poll( timeout );
     }
 
-    void BaseClient::AttachBlockToMessage( Message * message, uint8_t * block, int bytes )
+    int Client::GetClientIndex() const
     {
-        yojimbo_assert( message );
-        yojimbo_assert( block );
-        yojimbo_assert( bytes > 0 );
-        yojimbo_assert( message->IsBlockMessage() );
-        BlockMessage * blockMessage = (BlockMessage*) message;
-        blockMessage->AttachBlock( *m_clientAllocator, block, bytes );
+        return m_transport ? m_transport->GetClientIndex() : -1;
     }
 
-    void BaseClient::FreeBlock( uint8_t * block )
+    void Client::ConnectLoopback( int clientIndex, uint64_t clientId, int maxClients )
+    {
+        Disconnect();
+        CreateInternal( clientId );
+        m_clientId = clientId;
+        CreateClient( m_address );
+        if ( !m_transport )
+        {
+            Disconnect();
+            return;
+        }
+        m_transport->ConnectLoopback( clientIndex, maxClients );
+        SetClientState( CLIENT_STATE_CONNECTED );
+    }
+
+    void Client::DisconnectLoopback()
+    {
+        if ( m_transport )
+        {
+            m_transport->DisconnectLoopback();
+        }
+        BaseClient::Disconnect();
+        DestroyClient();
+        DestroyInternal();
+        m_clientId = 0;
+    }
+
+    bool Client::IsLoopback() const
+    {
+        return m_transport && m_transport->IsLoopback();
+    }
+
+    void Client::ProcessLoopbackPacket( const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    {
+        yojimbo_assert( m_transport );
+        m_transport->ProcessLoopbackPacket( packetData, packetBytes, packetSequence );
+    }
+
+    void Client::CreateClient( const Address & address )
+    {
+        DestroyClient();
+        if ( m_externalTransport )
+        {
+            m_transport = m_externalTransport;
+        }
+        else
+        {
+            m_transport = YOJIMBO_NEW( GetClientAllocator(), NetcodeClientTransport, GetClientAllocator(), address );
+        }
+        if ( !m_transport )
+            return;
+        m_transport->SetCallbacks( this, StaticSendLoopbackPacketCallbackFunction );
+        if ( !m_transport->Open( GetTime() ) )
+        {
+            DestroyClient();
+            return;
+        }
+        m_boundAddress.SetPort( m_transport->GetPort() );
+    }
+
+    void Client::DestroyClient()
+    {
+        if ( m_transport )
+        {
+            m_boundAddress = m_address;
+            m_transport->Close();
+            if ( m_transport != m_externalTransport )
+            {
+                YOJIMBO_DELETE( GetClientAllocator(), ClientTransport, m_transport );
+            }
+            m_transport = NULL;
+        }
+    }
+
+    void Client::TransmitPacketFunction( uint16_t packetSequence, uint8_t * packetData, int packetBytes )
+    {
+        (void) packetSequence;
+        NetworkSimulator * networkSimulator = GetNetworkSimulator();
+        if ( networkSimulator && networkSimulator->IsActive() )
+        {
+            networkSimulator->SendPacket( 0, packetData, packetBytes );
+        }
+        else
+        {
+            TransportPacket packet;
+            packet.clientIndex = 0;
+            packet.packetData = packetData;
+            packet.packetBytes = packetBytes;
+            m_transport->SendPackets( &packet, 1 );
+        }
+    }
+
+    int Client::ProcessPacketFunction( uint16_t packetSequence, uint8_t * packetData, int packetBytes )
+    {
+        return (int) GetConnection().ProcessPacket( GetContext(), packetSequence, packetData, packetBytes );
+    }
+
+    void Client::SendLoopbackPacketCallbackFunction( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    {
+        GetAdapter().ClientSendLoopbackPacket( clientIndex, packetData, packetBytes, packetSequence );
+    }
+
+    void Client::StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    {
+        Client * client = (Client*) context;
+        client->SendLoopbackPacketCallbackFunction( clientIndex, packetData, packetBytes, packetSequence );
+    }
+}
+
+// ---------------------------------------------------------------------------------
+
+#if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+typedef HANDLE yojimbo_thread_t;
+typedef CRITICAL_SECTION yojimbo_mutex_t;
+typedef CONDITION_VARIABLE yojimbo_condition_t;
+
+static void yojimbo_mutex_create( yojimbo_mutex_t * mutex ) { InitializeCriticalSection( mutex ); }
+static void yojimbo_mutex_destroy( yojimbo_mutex_t * mutex ) { DeleteCriticalSection( mutex ); }
+static void yojimbo_mutex_lock( yojimbo_mutex_t * mutex ) { EnterCriticalSection( mutex ); }
+static void yojimbo_mutex_unlock( yojimbo_mutex_t * mutex ) { LeaveCriticalSection( mutex ); }
+
+static void yojimbo_condition_create( yojimbo_condition_t * condition ) { InitializeConditionVariable( condition ); }
+static void yojimbo_condition_destroy( yojimbo_condition_t * condition ) { (void) condition; }
+static void yojimbo_condition_wait( yojimbo_condition_t * condition, yojimbo_mutex_t * mutex ) { SleepConditionVariableCS( condition, mutex, INFINITE ); }
+static void yojimbo_condition_signal( yojimbo_condition_t * condition ) { WakeConditionVariable( condition ); }
+static void yojimbo_condition_broadcast( yojimbo_condition_t * condition ) { WakeAllConditionVariable( condition ); }
+
+static DWORD WINAPI yojimbo_thread_entry( LPVOID argument );
+
+static bool yojimbo_thread_create( yojimbo_thread_t * thread, void * argument ) 
+{ 
+    *thread = CreateThread( NULL, 0, yojimbo_thread_entry, argument, 0, NULL );
+    return *thread != NULL;
+}
+
+static void yojimbo_thread_join( yojimbo_thread_t * thread ) 
+{ 
+    WaitForSingleObject( *thread, INFINITE );
+    CloseHandle( *thread );
+}
+
+#else // #if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+#include <pthread.h>
+
+typedef pthread_t yojimbo_thread_t;
+typedef pthread_mutex_t yojimbo_mutex_t;
+typedef pthread_cond_t yojimbo_condition_t;
+
+static void yojimbo_mutex_create( yojimbo_mutex_t * mutex ) { pthread_mutex_init( mutex, NULL ); }
+static void yojimbo_mutex_destroy( yojimbo_mutex_t * mutex ) { pthread_mutex_destroy( mutex ); }
+static void yojimbo_mutex_lock( yojimbo_mutex_t * mutex ) { pthread_mutex_lock( mutex ); }
+static void yojimbo_mutex_unlock( yojimbo_mutex_t * mutex ) { pthread_mutex_unlock( mutex ); }
+
+static void yojimbo_condition_create( yojimbo_condition_t * condition ) { pthread_cond_init( condition, NULL ); }
+static void yojimbo_condition_destroy( yojimbo_condition_t * condition ) { pthread_cond_destroy( condition ); }
+static void yojimbo_condition_wait( yojimbo_condition_t * condition, yojimbo_mutex_t * mutex ) { pthread_cond_wait( condition, mutex ); }
+static void yojimbo_condition_signal( yojimbo_condition_t * condition ) { pthread_cond_signal( condition ); }
+static void yojimbo_condition_broadcast( yojimbo_condition_t * condition ) { pthread_cond_broadcast( condition ); }
+
+static void * yojimbo_thread_entry( void * argument );
+
+static bool yojimbo_thread_create( yojimbo_thread_t * thread, void * argument ) 
+{ 
+    return pthread_create( thread, NULL, yojimbo_thread_entry, argument ) == 0;
+}
+
+static void yojimbo_thread_join( yojimbo_thread_t * thread ) 
+{ 
+    pthread_join( *thread, NULL );
+}
+
+#endif // #if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+namespace yojimbo
+{
+    struct WorkerPoolData
+    {
+        yojimbo_mutex_t mutex;                                      ///< Protects everything below.
+        yojimbo_condition_t workReady;                              ///< Signalled when there is new work, or when the pool is shutting down.
+        yojimbo_condition_t workDone;                               ///< Signalled when the last task has completed.
+        yojimbo_thread_t * threads;                                 ///< The worker threads.
+        int numThreads;                                             ///< Number of worker threads that were started.
+        WorkerPool::TaskFunction function;                          ///< The task function for the current batch of work.
+        void * context;                                             ///< The context for the current batch of work.
+        int numTasks;                                               ///< Number of tasks in the current batch of work.
+        int nextTask;                                               ///< The next task to be picked up.
+        int numTasksDone;                                           ///< Number of tasks completed in the current batch of work.
+        uint64_t batch;                                             ///< Incremented each time a new batch of work is started. Workers sleep until this changes.
+        uint64_t numWorkerTasks;                                    ///< Number of tasks run by worker threads. See WorkerPool::GetNumWorkerTasks.
+        bool quit;                                                  ///< True when the pool is shutting down.
+    };
+
+    /**
+        Pick up and run tasks from the current batch until there are none left.
+        IMPORTANT: The mutex must be locked on entry. It is unlocked while each task runs and locked again on return.
+     */
+
+    static void worker_pool_run_tasks( WorkerPoolData * data, bool workerThread )
+    {
+        while ( data->nextTask < data->numTasks )
+        {
+            const int taskIndex = data->nextTask++;
+            WorkerPool::TaskFunction function = data->function;
+            void * context = data->context;
+            yojimbo_mutex_unlock( &data->mutex );
+            function( context, taskIndex );
+            yojimbo_mutex_lock( &data->mutex );
+            if ( workerThread )
+                data->numWorkerTasks++;
+            if ( ++data->numTasksDone == data->numTasks )
+            {
+                yojimbo_condition_signal( &data->workDone );
+            }
+        }
+    }
+
+    static void worker_pool_thread( WorkerPoolData * data )
+    {
+        uint64_t batch = 0;
+        yojimbo_mutex_lock( &data->mutex );
+        while ( true )
+        {
+            while ( !data->quit && data->batch == batch )
+            {
+                yojimbo_condition_wait( &data->workReady, &data->mutex );
+            }
+            if ( data->quit )
+                break;
+            batch = data->batch;
+            worker_pool_run_tasks( data, true );
+        }
+        yojimbo_mutex_unlock( &data->mutex );
+    }
+}
+
+#if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+static DWORD WINAPI yojimbo_thread_entry( LPVOID argument )
+{
+    yojimbo::worker_pool_thread( (yojimbo::WorkerPoolData*) argument );
+    return 0;
+}
+
+#else // #if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+static void * yojimbo_thread_entry( void * argument )
+{
+    yojimbo::worker_pool_thread( (yojimbo::WorkerPoolData*) argument );
+    return NULL;
+}
+
+#endif // #if YOJIMBO_PLATFORM == YOJIMBO_PLATFORM_WINDOWS
+
+namespace yojimbo
+{
+    WorkerPool::WorkerPool( Allocator & allocator, int numThreads )
     {
-        YOJIMBO_FREE( *m_clientAllocator, block );
+        yojimbo_assert( numThreads >= 0 );
+        m_allocator = &allocator;
+        m_data = (WorkerPoolData*) YOJIMBO_ALLOCATE( allocator, sizeof( WorkerPoolData ) );
+        yojimbo_assert( m_data );
+        yojimbo_mutex_create( &m_data->mutex );
+        yojimbo_condition_create( &m_data->workReady );
+        yojimbo_condition_create( &m_data->workDone );
+        m_data->function = NULL;
+        m_data->context = NULL;
+        m_data->numTasks = 0;
+        m_data->nextTask = 0;
+        m_data->numTasksDone = 0;
+        m_data->batch = 0;
+        m_data->numWorkerTasks = 0;
+        m_data->quit = false;
+        m_data->numThreads = 0;
+        m_data->threads = NULL;
+        if ( numThreads > 0 )
+        {
+            m_data->threads = (yojimbo_thread_t*) YOJIMBO_ALLOCATE( allocator, sizeof( yojimbo_thread_t ) * numThreads );
+            yojimbo_assert( m_data->threads );
+            for ( int i = 0; i < numThreads; ++i )
+            {
+                if ( !yojimbo_thread_create( &m_data->threads[i], m_data ) )
+                {
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to create worker thread %d\n", i );
+                    break;
+                }
+                m_data->numThreads++;
+            }
+        }
+        m_numThreads = m_data->numThreads;
     }
 
-    bool BaseClient::CanSendMessage( int channelIndex ) const
+    WorkerPool::~WorkerPool()
     {
-        yojimbo_assert( m_connection );
-        return m_connection->CanSendMessage( channelIndex );
+        yojimbo_mutex_lock( &m_data->mutex );
+        m_data->quit = true;
+        yojimbo_condition_broadcast( &m_data->workReady );
+        yojimbo_mutex_unlock( &m_data->mutex );
+        for ( int i = 0; i < m_data->numThreads; ++i )
+        {
+            yojimbo_thread_join( &m_data->threads[i] );
+        }
+        if ( m_data->threads )
+        {
+            YOJIMBO_FREE( *m_allocator, m_data->threads );
+        }
+        yojimbo_condition_destroy( &m_data->workDone );
+        yojimbo_condition_destroy( &m_data->workReady );
+        yojimbo_mutex_destroy( &m_data->mutex );
+        YOJIMBO_FREE( *m_allocator, m_data );
+        m_allocator = NULL;
     }
 
-    void BaseClient::SendMessage( int channelIndex, Message * message )
+    void WorkerPool::Run( TaskFunction function, void * context, int numTasks )
     {
-        yojimbo_assert( m_connection );
-        m_connection->SendMessage( channelIndex, message );
+        yojimbo_assert( function );
+        yojimbo_assert( numTasks >= 0 );
+
+        if ( m_numThreads == 0 || numTasks <= 1 )
+        {
+            for ( int i = 0; i < numTasks; ++i )
+                function( context, i );
+            return;
+        }
+
+        yojimbo_mutex_lock( &m_data->mutex );
+        m_data->function = function;
+        m_data->context = context;
+        m_data->numTasks = numTasks;
+        m_data->nextTask = 0;
+        m_data->numTasksDone = 0;
+        m_data->batch++;
+        yojimbo_condition_broadcast( &m_data->workReady );
+        worker_pool_run_tasks( m_data, false );
+        while ( m_data->numTasksDone < m_data->numTasks )
+        {
+            yojimbo_condition_wait( &m_data->workDone, &m_data->mutex );
+        }
+        yojimbo_mutex_unlock( &m_data->mutex );
     }
 
-    Message * BaseClient::ReceiveMessage( int channelIndex )
+    uint64_t WorkerPool::GetNumWorkerTasks() const
     {
-        yojimbo_assert( m_connection );
-        return m_connection->ReceiveMessage( channelIndex );
+        yojimbo_mutex_lock( &m_data->mutex );
+        const uint64_t numWorkerTasks = m_data->numWorkerTasks;
+        yojimbo_mutex_unlock( &m_data->mutex );
+        return numWorkerTasks;
     }
+}
 
-    void BaseClient::ReleaseMessage( Message * message )
+// ---------------------------------------------------------------------------------
+
+namespace yojimbo
+{
+    static const int SlabAlignment = 64;
+
+    SlabPool::SlabPool( Allocator & allocator, int slabBytes, int slabsPerChunk, bool mappedMemory, bool hugePages )
     {
-        yojimbo_assert( m_connection );
-        m_connection->ReleaseMessage( message );
+        yojimbo_assert( slabBytes > 0 );
+        yojimbo_assert( slabsPerChunk > 0 );
+        m_allocator = &allocator;
+        m_slabBytes = slabBytes;
+        m_slabStride = ( slabBytes + SlabAlignment - 1 ) & ~( SlabAlignment - 1 );
+        m_slabsPerChunk = slabsPerChunk;
+        m_mappedMemory = mappedMemory;
+        m_hugePages = mappedMemory && hugePages;
+        m_maxSlabs = 0;
+        m_numSlabs = 0;
+        m_numFreeSlabs = 0;
+        m_chunks = NULL;
+        m_freeSlabs = NULL;
+    }
+
+    SlabPool::~SlabPool()
+    {
+        // IMPORTANT: Please free all slabs before destroying the slab pool!
+        yojimbo_assert( m_numFreeSlabs == m_numSlabs );
+        while ( m_chunks )
+        {
+            Chunk * next = m_chunks->next;
+            if ( m_mappedMemory )
+                yojimbo_unmap_memory( m_chunks->memory, m_chunks->bytes, m_hugePages );
+            else
+                YOJIMBO_FREE( *m_allocator, m_chunks->memory );
+            YOJIMBO_FREE( *m_allocator, m_chunks );
+            m_chunks = next;
+        }
     }
 
-    void BaseClient::GetNetworkInfo( NetworkInfo & info ) const
+    uint8_t * SlabPool::Allocate()
     {
-        memset( &info, 0, sizeof( info ) );
-        if ( m_connection )
+        if ( !m_freeSlabs )
         {
-            yojimbo_assert( m_endpoint );
-            const uint64_t * counters = reliable_endpoint_counters( m_endpoint );
-            info.numPacketsSent = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_SENT];
-            info.numPacketsReceived = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_RECEIVED];
-            info.numPacketsAcked = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_ACKED];
-            info.RTT = reliable_endpoint_rtt( m_endpoint );
-            info.packetLoss = reliable_endpoint_packet_loss( m_endpoint );
-            reliable_endpoint_bandwidth( m_endpoint, &info.sentBandwidth, &info.receivedBandwidth, &info.ackedBandwidth );
-        }
-    }
+            int numSlabs = m_slabsPerChunk;
+            if ( m_maxSlabs > 0 )
+            {
+                if ( m_numSlabs >= m_maxSlabs )
+                    return NULL;
+                numSlabs = yojimbo_min( numSlabs, m_maxSlabs - m_numSlabs );
+            }
 
-    // ------------------------------------------------------------------------------------------------------------------
+            // mapped memory is page aligned. allocated chunks are padded so the slabs can be aligned
 
-    Client::Client( Allocator & allocator, const Address & address, const ClientServerConfig & config, Adapter & adapter, double time ) 
-        : BaseClient( allocator, config, adapter, time ), m_config( config ), m_address( address )
-    {
-        m_clientId = 0;
-        m_client = NULL;
-        m_boundAddress = m_address;
+            const int chunkBytes = m_slabStride * numSlabs + ( m_mappedMemory ? 0 : SlabAlignment );
+            uint8_t * memory = m_mappedMemory ? (uint8_t*) yojimbo_map_memory( chunkBytes, m_hugePages ) : (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, chunkBytes );
+            if ( !memory )
+                return NULL;
+            Chunk * chunk = (Chunk*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( Chunk ) );
+            if ( !chunk )
+            {
+                if ( m_mappedMemory )
+                    yojimbo_unmap_memory( memory, chunkBytes, m_hugePages );
+                else
+                    YOJIMBO_FREE( *m_allocator, memory );
+                return NULL;
+            }
+            chunk->memory = memory;
+            chunk->bytes = chunkBytes;
+            chunk->next = m_chunks;
+            m_chunks = chunk;
+            uint8_t * slabs = (uint8_t*) ( ( uintptr_t( memory ) + SlabAlignment - 1 ) & ~uintptr_t( SlabAlignment - 1 ) );
+            for ( int i = numSlabs - 1; i >= 0; --i )
+            {
+                uint8_t * slab = slabs + i * m_slabStride;
+                *( (uint8_t**) slab ) = m_freeSlabs;
+                m_freeSlabs = slab;
+            }
+            m_numSlabs += numSlabs;
+            m_numFreeSlabs += numSlabs;
+        }
+        uint8_t * slab = m_freeSlabs;
+        m_freeSlabs = *( (uint8_t**) slab );
+        m_numFreeSlabs--;
+        return slab;
     }
 
-    Client::~Client()
+    void SlabPool::SetMaxSlabs( int maxSlabs )
     {
-        // IMPORTANT: Please disconnect the client before destroying it
-        yojimbo_assert( m_client == NULL );
+        yojimbo_assert( maxSlabs >= 0 );
+        m_maxSlabs = maxSlabs;
     }
 
-    void Client::InsecureConnect( const uint8_t privateKey[], uint64_t clientId, const Address & address )
+    void SlabPool::Free( uint8_t * slab )
     {
-        InsecureConnect( privateKey, clientId, &address, 1 );
+        if ( !slab )
+            return;
+        yojimbo_assert( m_numFreeSlabs < m_numSlabs );
+        *( (uint8_t**) slab ) = m_freeSlabs;
+        m_freeSlabs = slab;
+        m_numFreeSlabs++;
     }
+}
 
-    void Client::InsecureConnect( const uint8_t privateKey[], uint64_t clientId, const Address serverAddresses[], int numServerAddresses )
+// ---------------------------------------------------------------------------------
+
+namespace yojimbo
+{
+    InterestManager::InterestManager( Allocator & allocator, int maxEntities, int maxClients, int maxRelevantEntities, float cellSize )
     {
-        yojimbo_assert( serverAddresses );
-        yojimbo_assert( numServerAddresses > 0 );
-        yojimbo_assert( numServerAddresses <= NETCODE_MAX_SERVERS_PER_CONNECT );
-        Disconnect();
-        CreateInternal();
-        m_clientId = clientId;
-        CreateClient( m_address );
-        if ( !m_client )
-        {
-            Disconnect();
-            return;
-        }
-        uint8_t connectToken[NETCODE_CONNECT_TOKEN_BYTES];
-        if ( !GenerateInsecureConnectToken( connectToken, privateKey, clientId, serverAddresses, numServerAddresses ) )
+        yojimbo_assert( maxEntities > 0 );
+        yojimbo_assert( maxClients > 0 );
+        yojimbo_assert( maxRelevantEntities > 0 );
+        yojimbo_assert( cellSize > 0.0f );
+        m_allocator = &allocator;
+        m_maxEntities = maxEntities;
+        m_maxClients = maxClients;
+        m_maxRelevantEntities = yojimbo_min( maxRelevantEntities, maxEntities );
+        m_cellSize = cellSize;
+        m_numEntities = 0;
+        m_freeEntity = 0;
+        m_entities = (EntityData*) YOJIMBO_ALLOCATE( allocator, sizeof( EntityData ) * maxEntities );
+        yojimbo_assert( m_entities );
+        for ( int i = 0; i < maxEntities; ++i )
+        {
+            memset( &m_entities[i], 0, sizeof( EntityData ) );
+            m_entities[i].next = ( i + 1 < maxEntities ) ? i + 1 : -1;
+        }
+        m_clients = (ClientData*) YOJIMBO_ALLOCATE( allocator, sizeof( ClientData ) * maxClients );
+        yojimbo_assert( m_clients );
+        for ( int i = 0; i < maxClients; ++i )
+        {
+            memset( &m_clients[i], 0, sizeof( ClientData ) );
+            m_clients[i].maxTrackedEntities = m_maxRelevantEntities;
+            m_clients[i].relevantEntities = (RelevantEntity*) YOJIMBO_ALLOCATE( allocator, sizeof( RelevantEntity ) * m_maxRelevantEntities );
+            yojimbo_assert( m_clients[i].relevantEntities );
+        }
+        m_gatherData = (GatherData*) YOJIMBO_ALLOCATE( allocator, sizeof( GatherData ) * maxEntities );
+        yojimbo_assert( m_gatherData );
+        memset( m_gatherData, 0, sizeof( GatherData ) * maxEntities );
+        m_gathered = (RelevantEntity*) YOJIMBO_ALLOCATE( allocator, sizeof( RelevantEntity ) * maxEntities );
+        yojimbo_assert( m_gathered );
+        m_numGathered = 0;
+        m_gatherIndex = 0;
+        m_numBuckets = 1;
+        while ( m_numBuckets < maxEntities )
+            m_numBuckets *= 2;
+        m_buckets = (int*) YOJIMBO_ALLOCATE( allocator, sizeof( int ) * m_numBuckets );
+        yojimbo_assert( m_buckets );
+        m_numGroupEntities = 0;
+        m_groupEntities = (int*) YOJIMBO_ALLOCATE( allocator, sizeof( int ) * maxEntities );
+        yojimbo_assert( m_groupEntities );
+        m_updateIndex = 0;
+    }
+
+    InterestManager::~InterestManager()
+    {
+        for ( int i = 0; i < m_maxClients; ++i )
         {
-            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to generate insecure connect token\n" );
-            SetClientState( CLIENT_STATE_ERROR );
-            return;
+            YOJIMBO_FREE( *m_allocator, m_clients[i].relevantEntities );
         }
-        netcode_client_connect( m_client, connectToken );
-        SetClientState( CLIENT_STATE_CONNECTING );
+        YOJIMBO_FREE( *m_allocator, m_entities );
+        YOJIMBO_FREE( *m_allocator, m_clients );
+        YOJIMBO_FREE( *m_allocator, m_gatherData );
+        YOJIMBO_FREE( *m_allocator, m_gathered );
+        YOJIMBO_FREE( *m_allocator, m_buckets );
+        YOJIMBO_FREE( *m_allocator, m_groupEntities );
     }
 
-    bool Client::GenerateInsecureConnectToken( uint8_t * connectToken, 
-                                               const uint8_t privateKey[], 
-                                               uint64_t clientId, 
-                                               const Address serverAddresses[], 
-                                               int numServerAddresses )
+    int InterestManager::AddEntity( float x, float y, uint64_t groupMask, float priority )
     {
-        char serverAddressStrings[NETCODE_MAX_SERVERS_PER_CONNECT][MaxAddressLength];
-        const char * serverAddressStringPointers[NETCODE_MAX_SERVERS_PER_CONNECT];
-        for ( int i = 0; i < numServerAddresses; ++i ) 
-        {
-            serverAddresses[i].ToString( serverAddressStrings[i], MaxAddressLength );
-            serverAddressStringPointers[i] = serverAddressStrings[i];
-        }
-        return netcode_generate_connect_token( numServerAddresses, 
-                                               serverAddressStringPointers, 
-                                               m_config.timeout,
-                                               m_config.timeout, 
-                                               clientId, 
-                                               m_config.protocolId, 
-                                               0, 
-                                               (uint8_t*)privateKey, 
-                                               connectToken ) == NETCODE_OK;
+        if ( m_freeEntity == -1 )
+            return -1;
+        const int entityId = m_freeEntity;
+        EntityData & entity = m_entities[entityId];
+        yojimbo_assert( !entity.active );
+        m_freeEntity = entity.next;
+        entity.x = x;
+        entity.y = y;
+        entity.groupMask = groupMask;
+        entity.priority = priority;
+        entity.next = -1;
+        entity.addedUpdate = m_updateIndex + 1;
+        entity.active = true;
+        m_numEntities++;
+        return entityId;
     }
 
-    void Client::Connect( uint64_t clientId, uint8_t * connectToken )
+    void InterestManager::RemoveEntity( int entityId )
     {
-        yojimbo_assert( connectToken );
-        Disconnect();
-        CreateInternal();
-        m_clientId = clientId;
-        CreateClient( m_address );
-        netcode_client_connect( m_client, connectToken );
-        if ( netcode_client_state( m_client ) > NETCODE_CLIENT_STATE_DISCONNECTED )
-        {
-            SetClientState( CLIENT_STATE_CONNECTING );
-        }
-        else
-        {
-            Disconnect();
-        }
+        yojimbo_assert( entityId >= 0 );
+        yojimbo_assert( entityId < m_maxEntities );
+        EntityData & entity = m_entities[entityId];
+        yojimbo_assert( entity.active );
+        entity.active = false;
+        entity.next = m_freeEntity;
+        m_freeEntity = entityId;
+        m_numEntities--;
     }
 
-    void Client::Disconnect()
+    void InterestManager::SetEntityPosition( int entityId, float x, float y )
     {
-        BaseClient::Disconnect();
-        DestroyClient();
-        DestroyInternal();
-        m_clientId = 0;
+        yojimbo_assert( entityId >= 0 );
+        yojimbo_assert( entityId < m_maxEntities );
+        yojimbo_assert( m_entities[entityId].active );
+        m_entities[entityId].x = x;
+        m_entities[entityId].y = y;
     }
 
-    void Client::SendPackets()
+    void InterestManager::SetEntityGroups( int entityId, uint64_t groupMask )
     {
-        if ( !IsConnected() )
-            return;
-        yojimbo_assert( m_client );
-        uint8_t * packetData = GetPacketBuffer();
-        int packetBytes;
-        uint16_t packetSequence = reliable_endpoint_next_packet_sequence( GetEndpoint() );
-        if ( GetConnection().GeneratePacket( GetContext(), packetSequence, packetData, m_config.maxPacketSize, packetBytes ) )
-        {
-            reliable_endpoint_send_packet( GetEndpoint(), packetData, packetBytes );
-        }
+        yojimbo_assert( entityId >= 0 );
+        yojimbo_assert( entityId < m_maxEntities );
+        yojimbo_assert( m_entities[entityId].active );
+        m_entities[entityId].groupMask = groupMask;
     }
 
-    void Client::ReceivePackets()
+    void InterestManager::SetEntityPriority( int entityId, float priority )
     {
-        if ( !IsConnected() )
-            return;
-        yojimbo_assert( m_client );
-        while ( true )
-        {
-            int packetBytes;
-            uint64_t packetSequence;
-            uint8_t * packetData = netcode_client_receive_packet( m_client, &packetBytes, &packetSequence );
-            if ( !packetData )
-                break;
-            reliable_endpoint_receive_packet( GetEndpoint(), packetData, packetBytes );
-            netcode_client_free_packet( m_client, packetData );
-        }
+        yojimbo_assert( entityId >= 0 );
+        yojimbo_assert( entityId < m_maxEntities );
+        yojimbo_assert( m_entities[entityId].active );
+        m_entities[entityId].priority = priority;
     }
 
-    void Client::AdvanceTime( double time )
+    void InterestManager::SetClientView( int clientIndex, float x, float y, float radius )
     {
-        BaseClient::AdvanceTime( time );
-        if ( m_client )
-        {
-            netcode_client_update( m_client, time );
-            const int state = netcode_client_state( m_client );
-            if ( state < NETCODE_CLIENT_STATE_DISCONNECTED )
-            {
-                Disconnect();
-                SetClientState( CLIENT_STATE_ERROR );
-            }
-            else if ( state == NETCODE_CLIENT_STATE_DISCONNECTED )
-            {
-                Disconnect();
-                SetClientState( CLIENT_STATE_DISCONNECTED );
-            }
-            else if ( state == NETCODE_CLIENT_STATE_SENDING_CONNECTION_REQUEST )
-            {
-                SetClientState( CLIENT_STATE_CONNECTING );
-            }
-            else
-            {
-                SetClientState( CLIENT_STATE_CONNECTED );
-            }
-            NetworkSimulator * networkSimulator = GetNetworkSimulator();
-            if ( networkSimulator && networkSimulator->IsActive() )
-            {
-                uint8_t ** packetData = (uint8_t**) alloca( sizeof( uint8_t*) * m_config.maxSimulatorPackets );
-                int * packetBytes = (int*) alloca( sizeof(int) * m_config.maxSimulatorPackets );
-                int numPackets = networkSimulator->ReceivePackets( m_config.maxSimulatorPackets, packetData, packetBytes, NULL );
-                for ( int i = 0; i < numPackets; ++i )
-                {
-                    netcode_client_send_packet( m_client, (uint8_t*) packetData[i], packetBytes[i] );
-                    YOJIMBO_FREE( networkSimulator->GetAllocator(), packetData[i] );
-                }
-            }
-        }
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        yojimbo_assert( radius >= 0.0f );
+        ClientData & client = m_clients[clientIndex];
+        client.active = true;
+        client.x = x;
+        client.y = y;
+        client.radius = radius;
     }
 
-    int Client::GetClientIndex() const
+    void InterestManager::SetClientGroups( int clientIndex, uint64_t groupMask )
     {
-        return m_client ? netcode_client_index( m_client ) : -1;
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        m_clients[clientIndex].groupMask = groupMask;
     }
 
-    void Client::ConnectLoopback( int clientIndex, uint64_t clientId, int maxClients )
+    void InterestManager::RemoveClient( int clientIndex )
     {
-        Disconnect();
-        CreateInternal();
-        m_clientId = clientId;
-        CreateClient( m_address );
-        netcode_client_connect_loopback( m_client, clientIndex, maxClients );
-        SetClientState( CLIENT_STATE_CONNECTED );
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        ClientData & client = m_clients[clientIndex];
+        client.active = false;
+        client.groupMask = 0;
+        client.numRelevantEntities = 0;
+        client.numTrackedEntities = 0;
+        client.markSentIndex = 0;
     }
 
-    void Client::DisconnectLoopback()
+    int InterestManager::GetBucket( int cellX, int cellY ) const
     {
-        netcode_client_disconnect_loopback( m_client );
-        BaseClient::Disconnect();
-        DestroyClient();
-        DestroyInternal();
-        m_clientId = 0;
+        const uint32_t hash = ( uint32_t( cellX ) * 73856093U ) ^ ( uint32_t( cellY ) * 19349663U );
+        return int( hash & uint32_t( m_numBuckets - 1 ) );
     }
 
-    bool Client::IsLoopback() const
+    void InterestManager::AddRelevantEntity( int entityId )
     {
-        return netcode_client_loopback( m_client ) != 0;
+        GatherData & data = m_gatherData[entityId];
+
+        // entities can be in range and share a group with the client. only add them once
+
+        if ( data.gatheredIndex == m_gatherIndex )
+            return;
+
+        data.gatheredIndex = m_gatherIndex;
+
+        // priority only accumulates while the entity stays relevant. entities coming back into view start over
+
+        const EntityData & entity = m_entities[entityId];
+        float priority = entity.priority;
+        if ( data.previousIndex == m_gatherIndex && entity.addedUpdate != m_updateIndex )
+            priority += data.previousPriority;
+
+        yojimbo_assert( m_numGathered < m_maxEntities );
+        RelevantEntity & relevant = m_gathered[m_numGathered++];
+        relevant.entityId = entityId;
+        relevant.priority = priority;
     }
 
-    void Client::ProcessLoopbackPacket( const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    static int compare_relevant_entities( const void * a, const void * b )
     {
-        netcode_client_process_loopback_packet( m_client, packetData, packetBytes, packetSequence );
+        const InterestManager::RelevantEntity * entityA = (const InterestManager::RelevantEntity*) a;
+        const InterestManager::RelevantEntity * entityB = (const InterestManager::RelevantEntity*) b;
+        if ( entityA->priority > entityB->priority )
+            return -1;
+        if ( entityA->priority < entityB->priority )
+            return 1;
+        return entityA->entityId - entityB->entityId;
     }
 
-    void Client::CreateClient( const Address & address )
+    void InterestManager::Update()
     {
-        DestroyClient();
-        char addressString[MaxAddressLength];
-        address.ToString( addressString, MaxAddressLength );
-        m_client = netcode_client_create_with_allocator( addressString, GetTime(), &GetClientAllocator(), StaticAllocateFunction, StaticFreeFunction );
-        if ( m_client )
+        m_updateIndex++;
+
+        // bucket active entities into the spatial hash grid
+
+        for ( int i = 0; i < m_numBuckets; ++i )
+            m_buckets[i] = -1;
+
+        m_numGroupEntities = 0;
+
+        const float inverseCellSize = 1.0f / m_cellSize;
+
+        for ( int i = 0; i < m_maxEntities; ++i )
         {
-            netcode_client_state_change_callback( m_client, this, StaticStateChangeCallbackFunction );
-            netcode_client_send_loopback_packet_callback( m_client, this, StaticSendLoopbackPacketCallbackFunction );
-            m_boundAddress.SetPort( netcode_client_get_port( m_client ) );
+            EntityData & entity = m_entities[i];
+            if ( !entity.active )
+                continue;
+            entity.cellX = (int) floorf( entity.x * inverseCellSize );
+            entity.cellY = (int) floorf( entity.y * inverseCellSize );
+            const int bucket = GetBucket( entity.cellX, entity.cellY );
+            entity.next = m_buckets[bucket];
+            m_buckets[bucket] = i;
+            if ( entity.groupMask )
+                m_groupEntities[m_numGroupEntities++] = i;
         }
-    }
 
-    void Client::DestroyClient()
-    {
-        if ( m_client )
+        // gather relevant entities for each client from the cells overlapping its view
+
+        for ( int clientIndex = 0; clientIndex < m_maxClients; ++clientIndex )
         {
-            m_boundAddress = m_address;
-            netcode_client_destroy( m_client );
-            m_client = NULL;
-        }
-    }
+            ClientData & client = m_clients[clientIndex];
+
+            // the entities relevant in the previous update are the only ones with priority to carry over, including those left out by the cap
+
+            m_gatherIndex++;
+            m_numGathered = 0;
+            for ( int i = 0; i < client.numTrackedEntities; ++i )
+            {
+                GatherData & data = m_gatherData[client.relevantEntities[i].entityId];
+                data.previousIndex = m_gatherIndex;
+                data.previousPriority = client.relevantEntities[i].priority;
+            }
+            client.numRelevantEntities = 0;
+            client.numTrackedEntities = 0;
+            client.markSentIndex = 0;
+            if ( !client.active )
+                continue;
+
+            const float radiusSquared = client.radius * client.radius;
+            const int minCellX = (int) floorf( ( client.x - client.radius ) * inverseCellSize );
+            const int maxCellX = (int) floorf( ( client.x + client.radius ) * inverseCellSize );
+            const int minCellY = (int) floorf( ( client.y - client.radius ) * inverseCellSize );
+            const int maxCellY = (int) floorf( ( client.y + client.radius ) * inverseCellSize );
+            const double numCells = double( maxCellX - minCellX + 1 ) * double( maxCellY - minCellY + 1 );
+
+            if ( numCells > m_numBuckets )
+            {
+                // the view covers more cells than there are buckets. walking every entity is cheaper
+
+                for ( int i = 0; i < m_maxEntities; ++i )
+                {
+                    const EntityData & entity = m_entities[i];
+                    if ( !entity.active )
+                        continue;
+                    const float dx = entity.x - client.x;
+                    const float dy = entity.y - client.y;
+                    if ( dx * dx + dy * dy <= radiusSquared )
+                        AddRelevantEntity( i );
+                }
+            }
+            else
+            {
+                for ( int cellY = minCellY; cellY <= maxCellY; ++cellY )
+                {
+                    for ( int cellX = minCellX; cellX <= maxCellX; ++cellX )
+                    {
+                        // buckets are shared between cells, so check the entity is in this cell
+
+                        for ( int i = m_buckets[GetBucket( cellX, cellY )]; i != -1; i = m_entities[i].next )
+                        {
+                            const EntityData & entity = m_entities[i];
+                            if ( entity.cellX != cellX || entity.cellY != cellY )
+                                continue;
+                            const float dx = entity.x - client.x;
+                            const float dy = entity.y - client.y;
+                            if ( dx * dx + dy * dy <= radiusSquared )
+                                AddRelevantEntity( i );
+                        }
+                    }
+                }
+            }
+
+            if ( client.groupMask )
+            {
+                for ( int i = 0; i < m_numGroupEntities; ++i )
+                {
+                    const int entityId = m_groupEntities[i];
+                    if ( m_entities[entityId].groupMask & client.groupMask )
+                        AddRelevantEntity( entityId );
+                }
+            }
 
-    void Client::StateChangeCallbackFunction( int previous, int current )
-    {
-        (void) previous;
-        (void) current;
-    }
+            // return the highest priority entities that fit. keep the rest, so their priority keeps accumulating until they make the cut
 
-    void Client::StaticStateChangeCallbackFunction( void * context, int previous, int current )
-    {
-        Client * client = (Client*) context;
-        client->StateChangeCallbackFunction( previous, current );
-    }
+            qsort( m_gathered, m_numGathered, sizeof( RelevantEntity ), compare_relevant_entities );
 
-    void Client::TransmitPacketFunction( uint16_t packetSequence, uint8_t * packetData, int packetBytes )
-    {
-        (void) packetSequence;
-        NetworkSimulator * networkSimulator = GetNetworkSimulator();
-        if ( networkSimulator && networkSimulator->IsActive() )
-        {
-            networkSimulator->SendPacket( 0, packetData, packetBytes );
-        }
-        else
-        {
-            netcode_client_send_packet( m_client, packetData, packetBytes );
-        }
-    }
+            if ( m_numGathered > client.maxTrackedEntities )
+            {
+                YOJIMBO_FREE( *m_allocator, client.relevantEntities );
+                client.maxTrackedEntities = yojimbo_min( yojimbo_max( m_numGathered, client.maxTrackedEntities * 2 ), m_maxEntities );
+                client.relevantEntities = (RelevantEntity*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( RelevantEntity ) * client.maxTrackedEntities );
+                yojimbo_assert( client.relevantEntities );
+            }
 
-    int Client::ProcessPacketFunction( uint16_t packetSequence, uint8_t * packetData, int packetBytes )
-    {
-        return (int) GetConnection().ProcessPacket( GetContext(), packetSequence, packetData, packetBytes );
+            client.numTrackedEntities = m_numGathered;
+            client.numRelevantEntities = yojimbo_min( m_numGathered, m_maxRelevantEntities );
+            memcpy( client.relevantEntities, m_gathered, sizeof( RelevantEntity ) * m_numGathered );
+        }
     }
 
-    void Client::SendLoopbackPacketCallbackFunction( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    int InterestManager::GetRelevantEntities( int clientIndex, const RelevantEntity * & entities ) const
     {
-        GetAdapter().ClientSendLoopbackPacket( clientIndex, packetData, packetBytes, packetSequence );
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        entities = m_clients[clientIndex].relevantEntities;
+        return m_clients[clientIndex].numRelevantEntities;
     }
 
-    void Client::StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    void InterestManager::MarkSent( int clientIndex, int entityId )
     {
-        Client * client = (Client*) context;
-        client->SendLoopbackPacketCallbackFunction( clientIndex, packetData, packetBytes, packetSequence );
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        yojimbo_assert( entityId >= 0 );
+        yojimbo_assert( entityId < m_maxEntities );
+        ClientData & client = m_clients[clientIndex];
+        for ( int i = 0; i < client.numRelevantEntities; ++i )
+        {
+            const int index = ( client.markSentIndex + i ) % client.numRelevantEntities;
+            if ( client.relevantEntities[index].entityId == entityId )
+            {
+                client.relevantEntities[index].priority = 0.0f;
+                client.markSentIndex = index + 1;
+                return;
+            }
+        }
     }
 }
 
@@ -3451,16 +5934,24 @@ namespace yojimbo
         m_maxClients = 0;
         m_globalMemory = NULL;
         m_globalAllocator = NULL;
-        for ( int i = 0; i < MaxClients; ++i )
-        {
-            m_clientMemory[i] = NULL;
-            m_clientAllocator[i] = NULL;
-            m_clientMessageFactory[i] = NULL;
-            m_clientConnection[i] = NULL;
-            m_clientEndpoint[i] = NULL;
-        }
+        m_clientData = NULL;
+        m_connectionConfig = NULL;
         m_networkSimulator = NULL;
         m_packetBuffer = NULL;
+        m_workerPool = NULL;
+        m_numShards = 0;
+        m_sendBatch = NULL;
+        m_globalMessageFactory = NULL;
+        m_broadcasts = NULL;
+        m_sharedBlocks = NULL;
+        m_numConnectedClients = 0;
+        m_connectedClients = NULL;
+        m_clientMemoryPool = NULL;
+#if YOJIMBO_PROFILE
+        for ( int i = 0; i < SERVER_PROFILE_NUM_PHASES; ++i )
+            m_phaseTimings[i].Reset();
+        m_channelTimings = NULL;
+#endif // #if YOJIMBO_PROFILE
     }
 
     BaseServer::~BaseServer()
@@ -3479,31 +5970,59 @@ namespace yojimbo
     void BaseServer::Start( int maxClients )
     {
         Stop();
+        yojimbo_assert( maxClients > 0 );
         m_running = true;
         m_maxClients = maxClients;
+        yojimbo_assert( !m_clientData );
+        m_clientData = (ClientData*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( ClientData ) * m_maxClients );
+        yojimbo_assert( m_clientData );
+        memset( m_clientData, 0, sizeof( ClientData ) * m_maxClients );
+        m_connectedClients = (int*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( int ) * m_maxClients );
+        yojimbo_assert( m_connectedClients );
+        m_numConnectedClients = 0;
         yojimbo_assert( !m_globalMemory );
         yojimbo_assert( !m_globalAllocator );
-        m_globalMemory = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, m_config.serverGlobalMemory );
+        m_globalMemory = AllocateHeapMemory( *m_allocator, m_config, m_config.serverGlobalMemory );
+        yojimbo_assert( m_globalMemory );
         m_globalAllocator = m_adapter->CreateAllocator( *m_allocator, m_globalMemory, m_config.serverGlobalMemory );
         yojimbo_assert( m_globalAllocator );
+        m_connectionConfig = SharedConnectionConfig::Create( *m_globalAllocator, m_config );
+        yojimbo_assert( m_connectionConfig );
+        m_globalMessageFactory = m_adapter->CreateMessageFactory( *m_globalAllocator );
+        yojimbo_assert( m_globalMessageFactory );
         if ( m_config.networkSimulator )
         {
-            m_networkSimulator = YOJIMBO_NEW( *m_globalAllocator, NetworkSimulator, *m_globalAllocator, m_config.maxSimulatorPackets, m_time );
+            m_networkSimulator = YOJIMBO_NEW( *m_globalAllocator, NetworkSimulator, *m_globalAllocator, m_config.maxSimulatorPackets, m_time, m_config.GetMaxTransmitPacketSize(), m_maxClients, 1 );
+        }
+        m_numShards = 1;
+        if ( m_config.serverWorkerThreads > 0 )
+        {
+            m_workerPool = YOJIMBO_NEW( *m_globalAllocator, WorkerPool, *m_globalAllocator, m_config.serverWorkerThreads );
+            yojimbo_assert( m_workerPool );
+            m_numShards = yojimbo_min( m_workerPool->GetNumThreads() + 1, m_maxClients );
         }
+        // sends from worker threads are queued and passed to the transport on the calling thread. see FlushSendQueues
+        const bool queueSends = m_workerPool != NULL;
         for ( int i = 0; i < m_maxClients; ++i )
         {
-            yojimbo_assert( !m_clientMemory[i] );
-            yojimbo_assert( !m_clientAllocator[i] );
+            yojimbo_assert( !m_clientData[i].memory );
+            yojimbo_assert( !m_clientData[i].allocator );
+
+            m_clientData[i].connectedClientsIndex = -1;
             
-            m_clientMemory[i] = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, m_config.serverPerClientMemory );
-            m_clientAllocator[i] = m_adapter->CreateAllocator( *m_allocator, m_clientMemory[i], m_config.serverPerClientMemory );
-            yojimbo_assert( m_clientAllocator[i] );
+            if ( UsesClientMemoryPool() )
+                m_clientData[i].memory = m_clientMemoryPool->Allocate();
+            else
+                m_clientData[i].memory = AllocateHeapMemory( *m_allocator, m_config, m_config.serverPerClientMemory );
+            yojimbo_assert( m_clientData[i].memory );
+            m_clientData[i].allocator = m_adapter->CreateAllocator( *m_allocator, m_clientData[i].memory, m_config.serverPerClientMemory );
+            yojimbo_assert( m_clientData[i].allocator );
             
-            m_clientMessageFactory[i] = m_adapter->CreateMessageFactory( *m_clientAllocator[i] );
-            yojimbo_assert( m_clientMessageFactory[i] );
+            m_clientData[i].messageFactory = m_adapter->CreateMessageFactory( *m_clientData[i].allocator );
+            yojimbo_assert( m_clientData[i].messageFactory );
             
-            m_clientConnection[i] = YOJIMBO_NEW( *m_clientAllocator[i], Connection, *m_clientAllocator[i], *m_clientMessageFactory[i], m_config, m_time );
-            yojimbo_assert( m_clientConnection[i] );
+            m_clientData[i].connection = YOJIMBO_NEW( *m_clientData[i].allocator, Connection, *m_clientData[i].allocator, *m_clientData[i].messageFactory, *m_connectionConfig, m_time );
+            yojimbo_assert( m_clientData[i].connection );
 
             reliable_config_t reliable_config;
             reliable_default_config( &reliable_config );
@@ -3519,40 +6038,93 @@ namespace yojimbo
             reliable_config.fragment_reassembly_buffer_size = m_config.packetReassemblyBufferSize;
             reliable_config.transmit_packet_function = BaseServer::StaticTransmitPacketFunction;
             reliable_config.process_packet_function = BaseServer::StaticProcessPacketFunction;
-            reliable_config.allocator_context = &GetGlobalAllocator();
+            reliable_config.allocator_context = m_clientData[i].allocator;
             reliable_config.allocate_function = BaseServer::StaticAllocateFunction;
             reliable_config.free_function = BaseServer::StaticFreeFunction;
-            m_clientEndpoint[i] = reliable_endpoint_create( &reliable_config, m_time );
-            reliable_endpoint_reset( m_clientEndpoint[i] );
+            m_clientData[i].endpoint = reliable_endpoint_create( &reliable_config, m_time );
+            reliable_endpoint_reset( m_clientData[i].endpoint );
+
+            if ( queueSends )
+            {
+                m_clientData[i].sendQueueSize = yojimbo_max( 1, m_config.maxPacketFragments );
+                m_clientData[i].sendQueue = (QueuedPacket*) YOJIMBO_ALLOCATE( *m_clientData[i].allocator, sizeof( QueuedPacket ) * m_clientData[i].sendQueueSize );
+                yojimbo_assert( m_clientData[i].sendQueue );
+                // fragments split the packet, so all fragments together are at most the packet plus a transmit header for each fragment
+                m_clientData[i].sendBufferBytes = m_config.maxPacketSize + m_clientData[i].sendQueueSize * ConservativeTransmitHeaderBytes;
+                m_clientData[i].sendBuffer = (uint8_t*) YOJIMBO_ALLOCATE( *m_clientData[i].allocator, m_clientData[i].sendBufferBytes );
+                yojimbo_assert( m_clientData[i].sendBuffer );
+            }
+
+            if ( m_workerPool )
+            {
+                m_clientData[i].receiveQueue = (QueuedPacket*) YOJIMBO_ALLOCATE( *m_clientData[i].allocator, sizeof( QueuedPacket ) * ReceiveQueueSize );
+                yojimbo_assert( m_clientData[i].receiveQueue );
+            }
+        }
+        m_packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( *m_globalAllocator, m_config.maxPacketSize * m_numShards );
+        if ( queueSends )
+        {
+            m_sendBatch = (TransportPacket*) YOJIMBO_ALLOCATE( *m_globalAllocator, sizeof( TransportPacket ) * yojimbo_max( 1, m_config.maxPacketFragments ) * m_maxClients );
+            yojimbo_assert( m_sendBatch );
         }
-        m_packetBuffer = (uint8_t*) YOJIMBO_ALLOCATE( *m_globalAllocator, m_config.maxPacketSize );
+#if YOJIMBO_PROFILE
+        m_channelTimings = (TimingHistogram*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( TimingHistogram ) * m_numShards * m_config.numChannels );
+        yojimbo_assert( m_channelTimings );
+        ResetTimingStats();
+#endif // #if YOJIMBO_PROFILE
     }
 
     void BaseServer::Stop()
     {
         if ( IsRunning() )
         {
+#if YOJIMBO_PROFILE
+            YOJIMBO_FREE( *m_allocator, m_channelTimings );
+#endif // #if YOJIMBO_PROFILE
+            YOJIMBO_FREE( *m_globalAllocator, m_sendBatch );
             YOJIMBO_FREE( *m_globalAllocator, m_packetBuffer );
             yojimbo_assert( m_globalMemory );
             yojimbo_assert( m_globalAllocator );
+            YOJIMBO_DELETE( *m_globalAllocator, WorkerPool, m_workerPool );
             YOJIMBO_DELETE( *m_globalAllocator, NetworkSimulator, m_networkSimulator );
             for ( int i = 0; i < m_maxClients; ++i )
             {
-                yojimbo_assert( m_clientMemory[i] );
-                yojimbo_assert( m_clientAllocator[i] );
-                yojimbo_assert( m_clientMessageFactory[i] );
-                yojimbo_assert( m_clientEndpoint[i] );
-                reliable_endpoint_destroy( m_clientEndpoint[i] ); m_clientEndpoint[i] = NULL;
-                YOJIMBO_DELETE( *m_clientAllocator[i], Connection, m_clientConnection[i] );
-                YOJIMBO_DELETE( *m_clientAllocator[i], MessageFactory, m_clientMessageFactory[i] );
-                YOJIMBO_DELETE( *m_allocator, Allocator, m_clientAllocator[i] );
-                YOJIMBO_FREE( *m_allocator, m_clientMemory[i] );
+                yojimbo_assert( m_clientData[i].memory );
+                yojimbo_assert( m_clientData[i].allocator );
+                yojimbo_assert( m_clientData[i].messageFactory );
+                yojimbo_assert( m_clientData[i].endpoint );
+                yojimbo_assert( m_clientData[i].numSendQueuePackets == 0 );
+                yojimbo_assert( m_clientData[i].numReceiveQueuePackets == 0 );
+                YOJIMBO_FREE( *m_clientData[i].allocator, m_clientData[i].sendQueue );
+                YOJIMBO_FREE( *m_clientData[i].allocator, m_clientData[i].sendBuffer );
+                YOJIMBO_FREE( *m_clientData[i].allocator, m_clientData[i].receiveQueue );
+                reliable_endpoint_destroy( m_clientData[i].endpoint ); m_clientData[i].endpoint = NULL;
+                YOJIMBO_DELETE( *m_clientData[i].allocator, Connection, m_clientData[i].connection );
+                YOJIMBO_DELETE( *m_clientData[i].allocator, MessageFactory, m_clientData[i].messageFactory );
+                YOJIMBO_DELETE( *m_allocator, Allocator, m_clientData[i].allocator );
+                if ( UsesClientMemoryPool() )
+                    m_clientMemoryPool->Free( m_clientData[i].memory );
+                else
+                    FreeHeapMemory( *m_allocator, m_config, m_clientData[i].memory, m_config.serverPerClientMemory );
+                m_clientData[i].memory = NULL;
             }
+            YOJIMBO_FREE( *m_allocator, m_clientData );
+            YOJIMBO_FREE( *m_allocator, m_connectedClients );
+            m_numConnectedClients = 0;
+            FreeBroadcasts();
+            yojimbo_assert( !m_broadcasts );
+            FreeSharedBlocks();
+            yojimbo_assert( !m_sharedBlocks );
+            YOJIMBO_DELETE( *m_globalAllocator, MessageFactory, m_globalMessageFactory );
+            m_connectionConfig->Release();
+            m_connectionConfig = NULL;
             YOJIMBO_DELETE( *m_allocator, Allocator, m_globalAllocator );
-            YOJIMBO_FREE( *m_allocator, m_globalMemory );
+            FreeHeapMemory( *m_allocator, m_config, m_globalMemory, m_config.serverGlobalMemory );
+            m_globalMemory = NULL;
         }
         m_running = false;
         m_maxClients = 0;
+        m_numShards = 0;
         m_packetBuffer = NULL;
     }
 
@@ -3561,21 +6133,20 @@ namespace yojimbo
         m_time = time;
         if ( IsRunning() )
         {
-            for ( int i = 0; i < m_maxClients; ++i )
+            RunClientWork( CLIENT_WORK_ADVANCE_TIME );
+            // iterate backwards, since disconnecting a client moves the last connected client into its place
+            for ( int i = m_numConnectedClients - 1; i >= 0; --i )
             {
-                m_clientConnection[i]->AdvanceTime( time );
-                if ( m_clientConnection[i]->GetErrorLevel() != CONNECTION_ERROR_NONE )
+                const int clientIndex = m_connectedClients[i];
+                if ( m_clientData[clientIndex].connectionError )
                 {
-                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "client %d connection is in error state. disconnecting client\n", m_clientConnection[i]->GetErrorLevel() );
-                    DisconnectClient( i );
-                    continue;
+                    m_clientData[clientIndex].connectionError = false;
+                    yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "client %d connection is in error state. disconnecting client\n", clientIndex );
+                    DisconnectClient( clientIndex );
                 }
-                reliable_endpoint_update( m_clientEndpoint[i], m_time );
-                int numAcks;
-                const uint16_t * acks = reliable_endpoint_get_acks( m_clientEndpoint[i], &numAcks );
-                m_clientConnection[i]->ProcessAcks( acks, numAcks );
-                reliable_endpoint_clear_acks( m_clientEndpoint[i] );
             }
+            FreeBroadcasts();
+            FreeSharedBlocks();
             NetworkSimulator * networkSimulator = GetNetworkSimulator();
             if ( networkSimulator )
             {
@@ -3584,6 +6155,23 @@ namespace yojimbo
         }
     }
 
+    double BaseServer::GetNextWakeupTime() const
+    {
+        double wakeupTime = m_time + MaxWakeupInterval;
+        if ( !IsRunning() )
+            return wakeupTime;
+        for ( int i = 0; i < m_numConnectedClients; ++i )
+        {
+            const int clientIndex = m_connectedClients[i];
+            wakeupTime = yojimbo_min( wakeupTime, m_clientData[clientIndex].connection->GetNextSendTime( m_time ) );
+        }
+        if ( m_networkSimulator && m_networkSimulator->IsActive() )
+        {
+            wakeupTime = yojimbo_min( wakeupTime, m_networkSimulator->GetNextDeliveryTime() );
+        }
+        return wakeupTime;
+    }
+
     void BaseServer::SetLatency( float milliseconds )
     {
         if ( m_networkSimulator )
@@ -3616,20 +6204,88 @@ namespace yojimbo
         }
     }
 
+    void BaseServer::SetBandwidth( float kilobitsPerSecond, int burstBytes )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetBandwidth( kilobitsPerSecond, burstBytes );
+        }
+    }
+
+    void BaseServer::SetQueueLimit( int queueBytes, int earlyDropBytes )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetQueueLimit( queueBytes, earlyDropBytes );
+        }
+    }
+
+    void BaseServer::SetBurstLoss( float goodToBadPercent, float badToGoodPercent, float badLossPercent, float goodLossPercent )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetBurstLoss( goodToBadPercent, badToGoodPercent, badLossPercent, goodLossPercent );
+        }
+    }
+
+    void BaseServer::SetReordering( float percent, float milliseconds )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetReordering( percent, milliseconds );
+        }
+    }
+
+    void BaseServer::SetOutage( float periodSeconds, float durationSeconds )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetOutage( periodSeconds, durationSeconds );
+        }
+    }
+
+    void BaseServer::SetNetworkSimulatorSeed( uint64_t seed, uint64_t stream )
+    {
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetSeed( seed, stream );
+        }
+    }
+
+    void BaseServer::SetClientNetworkConditions( int clientIndex, const NetworkConditions & conditions )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->SetClientConditions( clientIndex, conditions );
+        }
+    }
+
+    void BaseServer::ClearClientNetworkConditions( int clientIndex )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        if ( m_networkSimulator )
+        {
+            m_networkSimulator->ClearClientConditions( clientIndex );
+        }
+    }
+
     Message * BaseServer::CreateMessage( int clientIndex, int type )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientMessageFactory[clientIndex] );
-        return m_clientMessageFactory[clientIndex]->CreateMessage( type );
+        yojimbo_assert( m_clientData[clientIndex].messageFactory );
+        return m_clientData[clientIndex].messageFactory->CreateMessage( type );
     }
 
     uint8_t * BaseServer::AllocateBlock( int clientIndex, int bytes )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientAllocator[clientIndex] );
-        return (uint8_t*) YOJIMBO_ALLOCATE( *m_clientAllocator[clientIndex], bytes );
+        yojimbo_assert( m_clientData[clientIndex].allocator );
+        return (uint8_t*) YOJIMBO_ALLOCATE( *m_clientData[clientIndex].allocator, bytes );
     }
 
     void BaseServer::AttachBlockToMessage( int clientIndex, Message * message, uint8_t * block, int bytes )
@@ -3641,46 +6297,160 @@ namespace yojimbo
         yojimbo_assert( bytes > 0 );
         yojimbo_assert( message->IsBlockMessage() );
         BlockMessage * blockMessage = (BlockMessage*) message;
-        blockMessage->AttachBlock( *m_clientAllocator[clientIndex], block, bytes );
+        blockMessage->AttachBlock( *m_clientData[clientIndex].allocator, block, bytes );
     }
 
     void BaseServer::FreeBlock( int clientIndex, uint8_t * block )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        YOJIMBO_FREE( *m_clientAllocator[clientIndex], block );
+        YOJIMBO_FREE( *m_clientData[clientIndex].allocator, block );
+    }
+
+    SharedBlock * BaseServer::CreateSharedBlock( int bytes )
+    {
+        yojimbo_assert( bytes > 0 );
+        SharedBlock * block = SharedBlock::Create( *m_globalAllocator, bytes );
+        if ( !block )
+            return NULL;
+        block->Acquire();
+        block->m_next = m_sharedBlocks;
+        m_sharedBlocks = block;
+        return block;
+    }
+
+    void BaseServer::AttachSharedBlockToMessage( int clientIndex, Message * message, SharedBlock * block )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        yojimbo_assert( message );
+        yojimbo_assert( block );
+        yojimbo_assert( message->IsBlockMessage() );
+        (void) clientIndex;
+        BlockMessage * blockMessage = (BlockMessage*) message;
+        blockMessage->AttachSharedBlock( *block );
+    }
+
+    void BaseServer::ReleaseSharedBlock( SharedBlock * block )
+    {
+        yojimbo_assert( block );
+        yojimbo_assert( block->GetRefCount() > 1 );
+        block->Release();
+    }
+
+    void BaseServer::FreeSharedBlocks()
+    {
+        SharedBlock ** link = &m_sharedBlocks;
+        while ( *link )
+        {
+            SharedBlock * block = *link;
+            if ( block->GetRefCount() == 1 )
+            {
+                *link = block->m_next;
+                block->Release();
+            }
+            else
+            {
+                link = &block->m_next;
+            }
+        }
     }
 
     bool BaseServer::CanSendMessage( int clientIndex, int channelIndex ) const
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
-        return m_clientConnection[clientIndex]->CanSendMessage( channelIndex );
+        yojimbo_assert( m_clientData[clientIndex].connection );
+        return m_clientData[clientIndex].connection->CanSendMessage( channelIndex );
     }
 
     void BaseServer::SendMessage( int clientIndex, int channelIndex, Message * message )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
-        return m_clientConnection[clientIndex]->SendMessage( channelIndex, message );
+        yojimbo_assert( m_clientData[clientIndex].connection );
+        return m_clientData[clientIndex].connection->SendMessage( channelIndex, message );
+    }
+
+    Message * BaseServer::CreateBroadcastMessage( int type )
+    {
+        yojimbo_assert( m_globalMessageFactory );
+        return m_globalMessageFactory->CreateMessage( type );
+    }
+
+    int BaseServer::BroadcastMessage( int channelIndex, Message * message, const uint64_t * clientMask )
+    {
+        yojimbo_assert( message );
+        yojimbo_assert( m_globalMessageFactory );
+
+        if ( message->IsBlockMessage() )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: block messages can't be broadcast\n" );
+            m_globalMessageFactory->ReleaseMessage( message );
+            return 0;
+        }
+
+        SerializedMessageData * data = SerializedMessageData::Create( *m_globalAllocator, *message, m_context );
+
+        m_globalMessageFactory->ReleaseMessage( message );
+
+        if ( !data )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: failed to serialize broadcast message\n" );
+            return 0;
+        }
+
+        int numClients = 0;
+        for ( int j = 0; j < m_numConnectedClients; ++j )
+        {
+            const int i = m_connectedClients[j];
+            if ( clientMask && ( clientMask[i/64] & ( uint64_t(1) << ( i % 64 ) ) ) == 0 )
+                continue;
+            Message * clientMessage = m_clientData[i].messageFactory->CreateSerializedMessage( *data );
+            if ( !clientMessage )
+                continue;
+            m_clientData[i].connection->SendMessage( channelIndex, clientMessage );
+            numClients++;
+        }
+
+        data->m_next = m_broadcasts;
+        m_broadcasts = data;
+
+        return numClients;
+    }
+
+    void BaseServer::FreeBroadcasts()
+    {
+        SerializedMessageData ** link = &m_broadcasts;
+        while ( *link )
+        {
+            SerializedMessageData * data = *link;
+            if ( data->GetRefCount() == 1 )
+            {
+                *link = data->m_next;
+                data->Release();
+            }
+            else
+            {
+                link = &data->m_next;
+            }
+        }
     }
 
     Message * BaseServer::ReceiveMessage( int clientIndex, int channelIndex )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
-        return m_clientConnection[clientIndex]->ReceiveMessage( channelIndex );
+        yojimbo_assert( m_clientData[clientIndex].connection );
+        return m_clientData[clientIndex].connection->ReceiveMessage( channelIndex );
     }
 
     void BaseServer::ReleaseMessage( int clientIndex, Message * message )
     {
         yojimbo_assert( clientIndex >= 0 );
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
-        m_clientConnection[clientIndex]->ReleaseMessage( message );
+        yojimbo_assert( m_clientData[clientIndex].connection );
+        m_clientData[clientIndex].connection->ReleaseMessage( message );
     }
 
     void BaseServer::GetNetworkInfo( int clientIndex, NetworkInfo & info ) const
@@ -3691,23 +6461,53 @@ namespace yojimbo
         memset( &info, 0, sizeof( info ) );
         if ( IsClientConnected( clientIndex ) )
         {
-            yojimbo_assert( m_clientEndpoint[clientIndex] );
-            const uint64_t * counters = reliable_endpoint_counters( m_clientEndpoint[clientIndex] );
+            yojimbo_assert( m_clientData[clientIndex].endpoint );
+            const uint64_t * counters = reliable_endpoint_counters( m_clientData[clientIndex].endpoint );
             info.numPacketsSent = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_SENT];
             info.numPacketsReceived = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_RECEIVED];
             info.numPacketsAcked = counters[RELIABLE_ENDPOINT_COUNTER_NUM_PACKETS_ACKED];
-            info.RTT = reliable_endpoint_rtt( m_clientEndpoint[clientIndex] );
-            info.packetLoss = reliable_endpoint_packet_loss( m_clientEndpoint[clientIndex] );
-            reliable_endpoint_bandwidth( m_clientEndpoint[clientIndex], &info.sentBandwidth, &info.receivedBandwidth, &info.ackedBandwidth );
+            info.RTT = reliable_endpoint_rtt( m_clientData[clientIndex].endpoint );
+            info.packetLoss = reliable_endpoint_packet_loss( m_clientData[clientIndex].endpoint );
+            reliable_endpoint_bandwidth( m_clientData[clientIndex].endpoint, &info.sentBandwidth, &info.receivedBandwidth, &info.ackedBandwidth );
         }
     }
 
+    uint64_t BaseServer::GetChannelCounter( int clientIndex, int channelIndex, int index ) const
+    {
+        yojimbo_assert( IsRunning() );
+        yojimbo_assert( clientIndex >= 0 ); 
+        yojimbo_assert( clientIndex < m_maxClients );
+        if ( !IsClientConnected( clientIndex ) )
+            return 0;
+        yojimbo_assert( m_clientData[clientIndex].connection );
+        return m_clientData[clientIndex].connection->GetChannelCounter( channelIndex, index );
+    }
+
+    bool BaseServer::GetChannelLatencyStats( int clientIndex, int channelIndex, int index, TimingStats & stats ) const
+    {
+        yojimbo_assert( IsRunning() );
+        yojimbo_assert( clientIndex >= 0 ); 
+        yojimbo_assert( clientIndex < m_maxClients );
+        if ( !IsClientConnected( clientIndex ) )
+            return false;
+        yojimbo_assert( m_clientData[clientIndex].connection );
+        return m_clientData[clientIndex].connection->GetChannelLatencyStats( channelIndex, index, stats );
+    }
+
+    Allocator & BaseServer::GetClientAllocator( int clientIndex )
+    {
+        yojimbo_assert( IsRunning() ); 
+        yojimbo_assert( clientIndex >= 0 ); 
+        yojimbo_assert( clientIndex < m_maxClients );
+        return *m_clientData[clientIndex].allocator;
+    }
+
     MessageFactory & BaseServer::GetClientMessageFactory( int clientIndex ) 
     { 
         yojimbo_assert( IsRunning() ); 
         yojimbo_assert( clientIndex >= 0 ); 
         yojimbo_assert( clientIndex < m_maxClients );
-        return *m_clientMessageFactory[clientIndex];
+        return *m_clientData[clientIndex].messageFactory;
     }
 
     reliable_endpoint_t * BaseServer::GetClientEndpoint( int clientIndex )
@@ -3715,7 +6515,154 @@ namespace yojimbo
         yojimbo_assert( IsRunning() ); 
         yojimbo_assert( clientIndex >= 0 ); 
         yojimbo_assert( clientIndex < m_maxClients );
-        return m_clientEndpoint[clientIndex];
+        return m_clientData[clientIndex].endpoint;
+    }
+
+    bool BaseServer::IsClientConnected( int clientIndex ) const
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        if ( !IsRunning() || clientIndex >= m_maxClients )
+            return false;
+        return m_clientData[clientIndex].connectedClientsIndex >= 0;
+    }
+
+    void BaseServer::SetClientConnected( int clientIndex, bool connected )
+    {
+        yojimbo_assert( IsRunning() );
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        ClientData & client = m_clientData[clientIndex];
+        if ( connected )
+        {
+            yojimbo_assert( client.connectedClientsIndex < 0 );
+            yojimbo_assert( m_numConnectedClients < m_maxClients );
+            client.connectedClientsIndex = m_numConnectedClients;
+            m_connectedClients[m_numConnectedClients++] = clientIndex;
+#if YOJIMBO_PROFILE
+            for ( int i = 0; i < CLIENT_PROFILE_NUM_TIMINGS; ++i )
+                client.timing[i].Reset();
+#endif // #if YOJIMBO_PROFILE
+        }
+        else
+        {
+            yojimbo_assert( client.connectedClientsIndex >= 0 );
+            const int lastClientIndex = m_connectedClients[--m_numConnectedClients];
+            m_connectedClients[client.connectedClientsIndex] = lastClientIndex;
+            m_clientData[lastClientIndex].connectedClientsIndex = client.connectedClientsIndex;
+            client.connectedClientsIndex = -1;
+        }
+    }
+
+    void BaseServer::SetClientMemoryPool( SlabPool * pool )
+    {
+        // IMPORTANT: Per-client memory is allocated in Start, so the pool can't change while the server is running
+        yojimbo_assert( !IsRunning() );
+        m_clientMemoryPool = pool;
+    }
+
+    bool BaseServer::UsesClientMemoryPool() const
+    {
+        // per-client memory always matches the config, so ReleaseFreePages only ever discards pages the server mapped
+        return m_clientMemoryPool && m_config.serverPerClientMemory <= m_clientMemoryPool->GetSlabBytes() &&
+            m_clientMemoryPool->IsMappedMemory() == m_config.mappedMemory && m_clientMemoryPool->IsHugePages() == ( m_config.mappedMemory && m_config.hugePages );
+    }
+
+    int BaseServer::SendEntityMessages( InterestManager & interest, int channelIndex, int maxMessagesPerClient, EntityMessageFunction function, void * context )
+    {
+        yojimbo_assert( function );
+        yojimbo_assert( channelIndex >= 0 );
+        yojimbo_assert( channelIndex < m_config.numChannels );
+        int numMessagesSent = 0;
+        for ( int i = 0; i < m_numConnectedClients; ++i )
+        {
+            const int clientIndex = m_connectedClients[i];
+            const InterestManager::RelevantEntity * entities = NULL;
+            const int numEntities = interest.GetRelevantEntities( clientIndex, entities );
+            int numClientMessages = 0;
+            for ( int j = 0; j < numEntities && numClientMessages < maxMessagesPerClient; ++j )
+            {
+                if ( !CanSendMessage( clientIndex, channelIndex ) )
+                    break;
+                Message * message = function( context, clientIndex, entities[j].entityId );
+                if ( !message )
+                    continue;
+                SendMessage( clientIndex, channelIndex, message );
+                interest.MarkSent( clientIndex, entities[j].entityId );
+                numClientMessages++;
+            }
+            numMessagesSent += numClientMessages;
+        }
+        return numMessagesSent;
+    }
+
+    bool BaseServer::GetPhaseTimingStats( ServerProfilePhase phase, TimingStats & stats ) const
+    {
+        yojimbo_assert( phase >= 0 );
+        yojimbo_assert( phase < SERVER_PROFILE_NUM_PHASES );
+#if YOJIMBO_PROFILE
+        m_phaseTimings[phase].GetStats( stats );
+        return true;
+#else // #if YOJIMBO_PROFILE
+        (void) phase;
+        (void) stats;
+        return false;
+#endif // #if YOJIMBO_PROFILE
+    }
+
+    bool BaseServer::GetClientTimingStats( int clientIndex, ClientProfileTiming timing, TimingStats & stats ) const
+    {
+        yojimbo_assert( timing >= 0 );
+        yojimbo_assert( timing < CLIENT_PROFILE_NUM_TIMINGS );
+#if YOJIMBO_PROFILE
+        if ( !IsRunning() )
+            return false;
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        m_clientData[clientIndex].timing[timing].GetStats( stats );
+        return true;
+#else // #if YOJIMBO_PROFILE
+        (void) clientIndex;
+        (void) timing;
+        (void) stats;
+        return false;
+#endif // #if YOJIMBO_PROFILE
+    }
+
+    bool BaseServer::GetChannelTimingStats( int channelIndex, TimingStats & stats ) const
+    {
+        yojimbo_assert( channelIndex >= 0 );
+        yojimbo_assert( channelIndex < m_config.numChannels );
+#if YOJIMBO_PROFILE
+        if ( !IsRunning() )
+            return false;
+        TimingHistogram merged;
+        merged.Reset();
+        for ( int i = 0; i < m_numShards; ++i )
+            merged.Merge( m_channelTimings[i * m_config.numChannels + channelIndex] );
+        merged.GetStats( stats );
+        return true;
+#else // #if YOJIMBO_PROFILE
+        (void) channelIndex;
+        (void) stats;
+        return false;
+#endif // #if YOJIMBO_PROFILE
+    }
+
+    void BaseServer::ResetTimingStats()
+    {
+#if YOJIMBO_PROFILE
+        for ( int i = 0; i < SERVER_PROFILE_NUM_PHASES; ++i )
+            m_phaseTimings[i].Reset();
+        if ( !IsRunning() )
+            return;
+        for ( int i = 0; i < m_numShards * m_config.numChannels; ++i )
+            m_channelTimings[i].Reset();
+        for ( int i = 0; i < m_maxClients; ++i )
+        {
+            for ( int j = 0; j < CLIENT_PROFILE_NUM_TIMINGS; ++j )
+                m_clientData[i].timing[j].Reset();
+        }
+#endif // #if YOJIMBO_PROFILE
     }
 
     Connection & BaseServer::GetClientConnection( int clientIndex )
@@ -3723,13 +6670,30 @@ namespace yojimbo
         yojimbo_assert( IsRunning() ); 
         yojimbo_assert( clientIndex >= 0 ); 
         yojimbo_assert( clientIndex < m_maxClients );
-        yojimbo_assert( m_clientConnection[clientIndex] );
-        return *m_clientConnection[clientIndex];
+        yojimbo_assert( m_clientData[clientIndex].connection );
+        return *m_clientData[clientIndex].connection;
     }
 
     void BaseServer::StaticTransmitPacketFunction( void * context, int index, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
     {
         BaseServer * server = (BaseServer*) context;
+        ClientData & client = server->m_clientData[index];
+        if ( client.sendQueue )
+        {
+            // IMPORTANT: This may be called on a worker thread. Queue a copy of the packet to be sent from the calling thread in one batch. See FlushSendQueues.
+            if ( client.numSendQueuePackets == client.sendQueueSize || client.sendBufferUsed + packetBytes > client.sendBufferBytes )
+            {
+                yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: send queue is full for client %d. dropping packet\n", index );
+                return;
+            }
+            uint8_t * packetCopy = client.sendBuffer + client.sendBufferUsed;
+            memcpy( packetCopy, packetData, packetBytes );
+            client.sendBufferUsed += packetBytes;
+            QueuedPacket & entry = client.sendQueue[client.numSendQueuePackets++];
+            entry.packetData = packetCopy;
+            entry.packetBytes = packetBytes;
+            return;
+        }
         server->TransmitPacketFunction( index, packetSequence, packetData, packetBytes );
     }
     
@@ -3754,6 +6718,201 @@ namespace yojimbo
         YOJIMBO_FREE( *allocator, pointer );
     }
 
+    void BaseServer::GenerateClientPackets()
+    {
+        RunClientWork( CLIENT_WORK_GENERATE_PACKETS );
+        FlushSendQueues();
+    }
+
+    int BaseServer::GetReceiveQueueSpace( int clientIndex ) const
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        yojimbo_assert( HasReceiveQueues() );
+        return ReceiveQueueSize - m_clientData[clientIndex].numReceiveQueuePackets;
+    }
+
+    void BaseServer::ProcessClientPacket( int clientIndex, uint8_t * packetData, int packetBytes )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        yojimbo_assert( packetData );
+#if YOJIMBO_PROFILE
+        const double profileStart = yojimbo_time();
+#endif // #if YOJIMBO_PROFILE
+        reliable_endpoint_receive_packet( m_clientData[clientIndex].endpoint, packetData, packetBytes );
+#if YOJIMBO_PROFILE
+        m_clientData[clientIndex].timing[CLIENT_PROFILE_PROCESS_PACKET].AddSample( yojimbo_time() - profileStart );
+#endif // #if YOJIMBO_PROFILE
+    }
+
+    void BaseServer::QueueReceivedPacket( int clientIndex, uint8_t * packetData, int packetBytes )
+    {
+        yojimbo_assert( GetReceiveQueueSpace( clientIndex ) > 0 );
+        yojimbo_assert( packetData );
+        ClientData & client = m_clientData[clientIndex];
+        QueuedPacket & entry = client.receiveQueue[client.numReceiveQueuePackets++];
+        entry.packetData = packetData;
+        entry.packetBytes = packetBytes;
+    }
+
+    void BaseServer::ProcessReceivedPackets()
+    {
+        RunClientWork( CLIENT_WORK_PROCESS_PACKETS );
+    }
+
+    uint8_t * BaseServer::PopProcessedPacket( int clientIndex )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_maxClients );
+        ClientData & client = m_clientData[clientIndex];
+        if ( client.numProcessedPackets == client.numReceiveQueuePackets )
+        {
+            client.numReceiveQueuePackets = 0;
+            client.numProcessedPackets = 0;
+            return NULL;
+        }
+        return client.receiveQueue[client.numProcessedPackets++].packetData;
+    }
+
+    void BaseServer::RunClientWork( ClientWork work )
+    {
+        const int numShards = yojimbo_min( m_numShards, m_numConnectedClients );
+
+        if ( !m_workerPool || numShards <= 1 )
+        {
+            DoClientWork( work, 0, 0, m_numConnectedClients );
+            return;
+        }
+
+        ClientWorkContext context;
+        context.server = this;
+        context.work = work;
+        context.numShards = numShards;
+
+        m_workerPool->Run( StaticClientWorkFunction, &context, numShards );
+    }
+
+    void BaseServer::StaticClientWorkFunction( void * context, int taskIndex )
+    {
+        ClientWorkContext * clientWorkContext = (ClientWorkContext*) context;
+        BaseServer * server = clientWorkContext->server;
+        const int numShards = clientWorkContext->numShards;
+        const int first = ( server->m_numConnectedClients * taskIndex ) / numShards;
+        const int last = ( server->m_numConnectedClients * ( taskIndex + 1 ) ) / numShards;
+        server->DoClientWork( clientWorkContext->work, taskIndex, first, last );
+    }
+
+    void BaseServer::DoClientWork( ClientWork work, int shardIndex, int first, int last )
+    {
+        yojimbo_assert( shardIndex >= 0 );
+        yojimbo_assert( shardIndex < m_numShards );
+
+        switch ( work )
+        {
+            case CLIENT_WORK_GENERATE_PACKETS:
+            {
+                uint8_t * packetData = m_packetBuffer + shardIndex * m_config.maxPacketSize;
+                TimingHistogram * channelTimings = NULL;
+#if YOJIMBO_PROFILE
+                channelTimings = m_channelTimings + shardIndex * m_config.numChannels;
+#endif // #if YOJIMBO_PROFILE
+                for ( int j = first; j < last; ++j )
+                {
+                    const int i = m_connectedClients[j];
+#if YOJIMBO_PROFILE
+                    const double profileStart = yojimbo_time();
+#endif // #if YOJIMBO_PROFILE
+                    int packetBytes;
+                    uint16_t packetSequence = reliable_endpoint_next_packet_sequence( m_clientData[i].endpoint );
+                    if ( m_clientData[i].connection->GeneratePacket( GetContext(), packetSequence, packetData, m_config.maxPacketSize, packetBytes, channelTimings ) )
+                    {
+                        reliable_endpoint_send_packet( m_clientData[i].endpoint, packetData, packetBytes );
+                    }
+#if YOJIMBO_PROFILE
+                    m_clientData[i].timing[CLIENT_PROFILE_GENERATE_PACKET].AddSample( yojimbo_time() - profileStart );
+#endif // #if YOJIMBO_PROFILE
+                }
+            }
+            break;
+
+            case CLIENT_WORK_PROCESS_PACKETS:
+            {
+                for ( int j = first; j < last; ++j )
+                {
+                    const int i = m_connectedClients[j];
+                    for ( int k = 0; k < m_clientData[i].numReceiveQueuePackets; ++k )
+                    {
+                        QueuedPacket & entry = m_clientData[i].receiveQueue[k];
+                        ProcessClientPacket( i, entry.packetData, entry.packetBytes );
+                    }
+                }
+            }
+            break;
+
+            case CLIENT_WORK_ADVANCE_TIME:
+            {
+                for ( int j = first; j < last; ++j )
+                {
+                    const int i = m_connectedClients[j];
+                    m_clientData[i].connection->AdvanceTime( m_time );
+                    if ( m_clientData[i].connection->GetErrorLevel() != CONNECTION_ERROR_NONE )
+                    {
+                        // disconnecting calls back into netcode.io, so it is done after all clients are processed. see AdvanceTime
+                        m_clientData[i].connectionError = true;
+                        continue;
+                    }
+                    reliable_endpoint_update( m_clientData[i].endpoint, m_time );
+                    int numAcks;
+                    const uint16_t * acks = reliable_endpoint_get_acks( m_clientData[i].endpoint, &numAcks );
+                    m_clientData[i].connection->ProcessAcks( acks, numAcks );
+                    reliable_endpoint_clear_acks( m_clientData[i].endpoint );
+                }
+            }
+            break;
+        }
+    }
+
+    void BaseServer::FlushSendQueues()
+    {
+        if ( !m_sendBatch )
+            return;
+
+        int numPackets = 0;
+        for ( int i = 0; i < m_numConnectedClients; ++i )
+        {
+            const int clientIndex = m_connectedClients[i];
+            ClientData & client = m_clientData[clientIndex];
+            for ( int j = 0; j < client.numSendQueuePackets; ++j )
+            {
+                m_sendBatch[numPackets].clientIndex = clientIndex;
+                m_sendBatch[numPackets].packetData = client.sendQueue[j].packetData;
+                m_sendBatch[numPackets].packetBytes = client.sendQueue[j].packetBytes;
+                numPackets++;
+            }
+        }
+
+        if ( numPackets == 0 )
+            return;
+
+        TransmitPackets( m_sendBatch, numPackets );
+
+        for ( int i = 0; i < m_numConnectedClients; ++i )
+        {
+            ClientData & client = m_clientData[m_connectedClients[i]];
+            client.numSendQueuePackets = 0;
+            client.sendBufferUsed = 0;
+        }
+    }
+
+    void BaseServer::TransmitPackets( const TransportPacket * packets, int numPackets )
+    {
+        for ( int i = 0; i < numPackets; ++i )
+        {
+            TransmitPacketFunction( packets[i].clientIndex, 0, packets[i].packetData, packets[i].packetBytes );
+        }
+    }
+
     // -----------------------------------------------------------------------------------------------------
 
     Server::Server( Allocator & allocator, const uint8_t privateKey[], const Address & address, const ClientServerConfig & config, Adapter & adapter, double time ) 
@@ -3764,222 +6923,478 @@ namespace yojimbo
         m_address = address;
         m_boundAddress = address;
         m_config = config;
-        m_server = NULL;
+        m_transport = NULL;
+        m_externalTransport = NULL;
+    }
+
+    Server::Server( Allocator & allocator, ServerTransport & transport, const ClientServerConfig & config, Adapter & adapter, double time ) 
+        : BaseServer( allocator, config, adapter, time )
+    {
+        memset( m_privateKey, 0, KeyBytes );
+        m_config = config;
+        m_transport = NULL;
+        m_externalTransport = &transport;
     }
 
     Server::~Server()
     {
         // IMPORTANT: Please stop the server before destroying it!
-        yojimbo_assert( !m_server );
+        yojimbo_assert( !m_transport );
     }
 
     void Server::Start( int maxClients )
     {
         if ( IsRunning() )
             Stop();
+
+#if defined( NETCODE_MAX_CLIENTS )
+        // IMPORTANT: Client slots beyond this need netcode.io built with a larger NETCODE_MAX_CLIENTS
+        yojimbo_assert( maxClients <= NETCODE_MAX_CLIENTS );
+#endif // #if defined( NETCODE_MAX_CLIENTS )
         
         BaseServer::Start( maxClients );
-        
-        char addressString[MaxAddressLength];
-        m_address.ToString( addressString, MaxAddressLength );
-        m_server = netcode_server_create_with_allocator( addressString, 
-                                                         m_config.protocolId, 
-                                                         m_privateKey, 
-                                                         GetTime(), 
-                                                         &GetGlobalAllocator(), 
-                                                         StaticAllocateFunction, 
-                                                         StaticFreeFunction );
-        if ( !m_server )
+
+        if ( m_externalTransport )
         {
-            Stop();
-            return;
+            m_transport = m_externalTransport;
+        }
+        else
+        {
+            m_transport = YOJIMBO_NEW( GetGlobalAllocator(), NetcodeServerTransport, GetGlobalAllocator(), m_address, m_config.protocolId, m_privateKey );
         }
 
-        netcode_server_connect_disconnect_callback( m_server, this, StaticConnectDisconnectCallbackFunction );
+        yojimbo_assert( m_transport );
 
-        netcode_server_send_loopback_packet_callback( m_server, this, StaticSendLoopbackPacketCallbackFunction );
-        
-        netcode_server_start( m_server, maxClients );
+        m_transport->SetCallbacks( this, StaticConnectDisconnectCallbackFunction, StaticSendLoopbackPacketCallbackFunction );
+
+        if ( !m_transport->Start( maxClients, GetTime() ) )
+        {
+            Stop();
+            return;
+        }
 
-        m_boundAddress.SetPort( netcode_server_get_port( m_server ) );
+        m_boundAddress.SetPort( m_transport->GetPort() );
     }
 
     void Server::Stop()
     {
-        if ( m_server )
+        if ( m_transport )
         {
             m_boundAddress = m_address;
-            netcode_server_stop( m_server );
-            netcode_server_destroy( m_server );
-            m_server = NULL;
+            m_transport->Stop();
+            if ( m_transport != m_externalTransport )
+            {
+                YOJIMBO_DELETE( GetGlobalAllocator(), ServerTransport, m_transport );
+            }
+            m_transport = NULL;
         }
         BaseServer::Stop();
     }
 
     void Server::DisconnectClient( int clientIndex )
     {
-        yojimbo_assert( m_server );
-        netcode_server_disconnect_client( m_server, clientIndex );
+        yojimbo_assert( m_transport );
+        m_transport->DisconnectClient( clientIndex );
     }
 
     void Server::DisconnectAllClients()
     {
-        yojimbo_assert( m_server );
-        netcode_server_disconnect_all_clients( m_server );
+        yojimbo_assert( m_transport );
+        m_transport->DisconnectAllClients();
     }
 
     void Server::SendPackets()
     {
-        if ( m_server )
+        if ( m_transport )
+        {
+#if YOJIMBO_PROFILE
+            const double profileStart = yojimbo_time();
+#endif // #if YOJIMBO_PROFILE
+            GenerateClientPackets();
+#if YOJIMBO_PROFILE
+            AddPhaseTiming( SERVER_PROFILE_SEND_PACKETS, yojimbo_time() - profileStart );
+#endif // #if YOJIMBO_PROFILE
+        }
+    }
+
+    void Server::ReceivePackets()
+    {
+        if ( m_transport )
         {
-            const int maxClients = GetMaxClients();
-            for ( int i = 0; i < maxClients; ++i )
+            // transport calls stay on this thread. with worker threads, packets are queued per-client, processed in parallel then freed here
+
+#if YOJIMBO_PROFILE
+            const double profileStart = yojimbo_time();
+#endif // #if YOJIMBO_PROFILE
+            TransportPacket packets[ReceiveQueueSize];
+            const int numConnectedClients = GetNumConnectedClients();
+            const int * connectedClients = GetConnectedClients();
+            if ( HasReceiveQueues() )
             {
-                if ( IsClientConnected( i ) )
+                bool receiveQueueFull = true;
+                while ( receiveQueueFull )
                 {
-                    uint8_t * packetData = GetPacketBuffer();
-                    int packetBytes;
-                    uint16_t packetSequence = reliable_endpoint_next_packet_sequence( GetClientEndpoint(i) );
-                    if ( GetClientConnection(i).GeneratePacket( GetContext(), packetSequence, packetData, m_config.maxPacketSize, packetBytes ) )
+                    receiveQueueFull = false;
+                    for ( int j = 0; j < numConnectedClients; ++j )
+                    {
+                        const int clientIndex = connectedClients[j];
+                        const int receiveQueueSpace = GetReceiveQueueSpace( clientIndex );
+                        const int numPackets = m_transport->ReceivePackets( clientIndex, packets, receiveQueueSpace );
+                        for ( int i = 0; i < numPackets; ++i )
+                        {
+                            QueueReceivedPacket( clientIndex, packets[i].packetData, packets[i].packetBytes );
+                        }
+                        if ( numPackets == receiveQueueSpace )
+                            receiveQueueFull = true;
+                    }
+                    ProcessReceivedPackets();
+                    for ( int j = 0; j < numConnectedClients; ++j )
                     {
-                        reliable_endpoint_send_packet( GetClientEndpoint(i), packetData, packetBytes );
+                        const int clientIndex = connectedClients[j];
+                        int numPackets = 0;
+                        while ( uint8_t * packetData = PopProcessedPacket( clientIndex ) )
+                        {
+                            packets[numPackets].clientIndex = clientIndex;
+                            packets[numPackets].packetData = packetData;
+                            packets[numPackets].packetBytes = 0;
+                            numPackets++;
+                        }
+                        m_transport->FreePackets( packets, numPackets );
                     }
                 }
             }
+            else
+            {
+                // without worker threads there is nothing to hand packets off to, so process them as they are received
+
+                for ( int j = 0; j < numConnectedClients; ++j )
+                {
+                    const int clientIndex = connectedClients[j];
+                    int numPackets = ReceiveQueueSize;
+                    while ( numPackets == ReceiveQueueSize )
+                    {
+                        numPackets = m_transport->ReceivePackets( clientIndex, packets, ReceiveQueueSize );
+                        for ( int i = 0; i < numPackets; ++i )
+                        {
+                            ProcessClientPacket( clientIndex, packets[i].packetData, packets[i].packetBytes );
+                        }
+                        m_transport->FreePackets( packets, numPackets );
+                    }
+                }
+            }
+#if YOJIMBO_PROFILE
+            AddPhaseTiming( SERVER_PROFILE_RECEIVE_PACKETS, yojimbo_time() - profileStart );
+#endif // #if YOJIMBO_PROFILE
         }
     }
 
-    void Server::ReceivePackets()
+    void Server::AdvanceTime( double time )
     {
-        if ( m_server )
+#if YOJIMBO_PROFILE
+        const double profileStart = yojimbo_time();
+#endif // #if YOJIMBO_PROFILE
+        if ( m_transport )
+        {
+            m_transport->Update( time );
+        }
+        BaseServer::AdvanceTime( time );
+        NetworkSimulator * networkSimulator = GetNetworkSimulator();
+        if ( networkSimulator && networkSimulator->IsActive() )
         {
-            const int maxClients = GetMaxClients();
-            for ( int clientIndex = 0; clientIndex < maxClients; ++clientIndex )
+#if YOJIMBO_PROFILE
+            const double simulatorStart = yojimbo_time();
+#endif // #if YOJIMBO_PROFILE
+            uint8_t ** packetData = (uint8_t**) alloca( sizeof( uint8_t*) * m_config.maxSimulatorPackets );
+            int * packetBytes = (int*) alloca( sizeof(int) * m_config.maxSimulatorPackets );
+            int * to = (int*) alloca( sizeof(int) * m_config.maxSimulatorPackets );
+            TransportPacket * packets = (TransportPacket*) alloca( sizeof( TransportPacket ) * m_config.maxSimulatorPackets );
+            int numPackets = networkSimulator->ReceivePackets( m_config.maxSimulatorPackets, packetData, packetBytes, to );
+            for ( int i = 0; i < numPackets; ++i )
             {
-                while ( true )
-                {
-                    int packetBytes;
-                    uint64_t packetSequence;
-                    uint8_t * packetData = netcode_server_receive_packet( m_server, clientIndex, &packetBytes, &packetSequence );
-                    if ( !packetData )
-                        break;
-                    reliable_endpoint_receive_packet( GetClientEndpoint( clientIndex ), packetData, packetBytes );
-                    netcode_server_free_packet( m_server, packetData );
-                }
+                packets[i].clientIndex = to[i];
+                packets[i].packetData = packetData[i];
+                packets[i].packetBytes = packetBytes[i];
             }
+            m_transport->SendPackets( packets, numPackets );
+            networkSimulator->ReleasePackets( packetData, numPackets );
+#if YOJIMBO_PROFILE
+            AddPhaseTiming( SERVER_PROFILE_NETWORK_SIMULATOR, yojimbo_time() - simulatorStart );
+#endif // #if YOJIMBO_PROFILE
         }
+#if YOJIMBO_PROFILE
+        AddPhaseTiming( SERVER_PROFILE_ADVANCE_TIME, yojimbo_time() - profileStart );
+#endif // #if YOJIMBO_PROFILE
     }
 
-    void Server::AdvanceTime( double time )
+    double Server::GetNextWakeupTime() const
     {
-        if ( m_server )
+        double wakeupTime = BaseServer::GetNextWakeupTime();
+        if ( m_transport )
         {
-            netcode_server_update( m_server, time );
+            wakeupTime = yojimbo_min( wakeupTime, m_transport->GetNextUpdateTime( GetTime() ) );
         }
-        BaseServer::AdvanceTime( time );
+        return wakeupTime;
+    }
+
+    bool Server::Poll( double timeout )
+    {
+        if ( !m_transport )
+            return false;
+        return m_transport->Poll( timeout );
+    }
+
+    uint64_t Server::GetClientId( int clientIndex ) const
+    {
+        return m_transport ? m_transport->GetClientId( clientIndex ) : 0;
+    }
+
+    void Server::ConnectLoopbackClient( int clientIndex, uint64_t clientId, const uint8_t * userData )
+    {
+        yojimbo_assert( m_transport );
+        m_transport->ConnectLoopbackClient( clientIndex, clientId, userData );
+    }
+
+    void Server::DisconnectLoopbackClient( int clientIndex )
+    {
+        yojimbo_assert( m_transport );
+        m_transport->DisconnectLoopbackClient( clientIndex );
+    }
+
+    bool Server::IsLoopbackClient( int clientIndex ) const
+    {
+        return m_transport && m_transport->IsLoopbackClient( clientIndex );
+    }
+
+    void Server::ProcessLoopbackPacket( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    {
+        yojimbo_assert( m_transport );
+        m_transport->ProcessLoopbackPacket( clientIndex, packetData, packetBytes, packetSequence );
+    }
+
+    void Server::TransmitPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
+    {
+        (void) packetSequence;
+        NetworkSimulator * networkSimulator = GetNetworkSimulator();
+        if ( networkSimulator && networkSimulator->IsActive() )
+        {
+            networkSimulator->SendPacket( clientIndex, packetData, packetBytes );
+        }
+        else
+        {
+            TransportPacket packet;
+            packet.clientIndex = clientIndex;
+            packet.packetData = packetData;
+            packet.packetBytes = packetBytes;
+            m_transport->SendPackets( &packet, 1 );
+        }
+    }
+
+    void Server::TransmitPackets( const TransportPacket * packets, int numPackets )
+    {
         NetworkSimulator * networkSimulator = GetNetworkSimulator();
         if ( networkSimulator && networkSimulator->IsActive() )
         {
-            uint8_t ** packetData = (uint8_t**) alloca( sizeof( uint8_t*) * m_config.maxSimulatorPackets );
-            int * packetBytes = (int*) alloca( sizeof(int) * m_config.maxSimulatorPackets );
-            int * to = (int*) alloca( sizeof(int) * m_config.maxSimulatorPackets );
-            int numPackets = networkSimulator->ReceivePackets( m_config.maxSimulatorPackets, packetData, packetBytes, to );
-            for ( int i = 0; i < numPackets; ++i )
-            {
-                netcode_server_send_packet( m_server, to[i], (uint8_t*) packetData[i], packetBytes[i] );
-                YOJIMBO_FREE( networkSimulator->GetAllocator(), packetData[i] );
-            }
+            for ( int i = 0; i < numPackets; ++i )
+            {
+                networkSimulator->SendPacket( packets[i].clientIndex, packets[i].packetData, packets[i].packetBytes );
+            }
+        }
+        else
+        {
+            m_transport->SendPackets( packets, numPackets );
+        }
+    }
+
+    int Server::ProcessPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
+    {
+        return (int) GetClientConnection(clientIndex).ProcessPacket( GetContext(), packetSequence, packetData, packetBytes );
+    }
+
+    void Server::ConnectDisconnectCallbackFunction( int clientIndex, int connected )
+    {
+        if ( connected == 0 )
+        {
+            GetAdapter().OnServerClientDisconnected( clientIndex );
+            reliable_endpoint_reset( GetClientEndpoint( clientIndex ) );
+            GetClientConnection( clientIndex ).Reset();
+            NetworkSimulator * networkSimulator = GetNetworkSimulator();
+            if ( networkSimulator && networkSimulator->IsActive() )
+            {
+                networkSimulator->DiscardClientPackets( clientIndex );
+            }
+            if ( m_config.mappedMemory )
+            {
+                GetClientAllocator( clientIndex ).ReleaseFreePages();
+            }
+            SetClientConnected( clientIndex, false );
+        }
+        else
+        {
+            SetClientConnected( clientIndex, true );
+            GetAdapter().OnServerClientConnected( clientIndex );
+        }
+    }
+
+    void Server::SendLoopbackPacketCallbackFunction( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    {
+        GetAdapter().ServerSendLoopbackPacket( clientIndex, packetData, packetBytes, packetSequence );
+    }
+
+    void Server::StaticConnectDisconnectCallbackFunction( void * context, int clientIndex, int connected )
+    {
+        Server * server = (Server*) context;
+        server->ConnectDisconnectCallbackFunction( clientIndex, connected );
+    }
+
+    void Server::StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    {
+        Server * server = (Server*) context;
+        server->SendLoopbackPacketCallbackFunction( clientIndex, packetData, packetBytes, packetSequence );
+    }
+}
+
+// ---------------------------------------------------------------------------------
+
+namespace yojimbo
+{
+    ServerHost::ServerHost( Allocator & allocator, int maxServers, int numWorkerThreads, int clientMemoryBytes, double time, bool mappedMemory, bool hugePages )
+    {
+        yojimbo_assert( maxServers > 0 );
+        yojimbo_assert( numWorkerThreads >= 0 );
+        m_allocator = &allocator;
+        m_maxServers = maxServers;
+        m_numServers = 0;
+        m_servers = (Server**) YOJIMBO_ALLOCATE( allocator, sizeof( Server* ) * maxServers );
+        yojimbo_assert( m_servers );
+        m_workerPool = NULL;
+        if ( numWorkerThreads > 0 )
+        {
+            m_workerPool = YOJIMBO_NEW( allocator, WorkerPool, allocator, numWorkerThreads );
+            yojimbo_assert( m_workerPool );
+        }
+        // one slab per chunk. per-client slabs are large, so the pool only ever holds as many as the servers have needed at once
+        m_clientMemoryPool = YOJIMBO_NEW( allocator, SlabPool, allocator, clientMemoryBytes, 1, mappedMemory, hugePages );
+        yojimbo_assert( m_clientMemoryPool );
+        m_time = time;
+    }
+
+    ServerHost::~ServerHost()
+    {
+        while ( m_numServers > 0 )
+        {
+            DestroyServer( m_servers[m_numServers - 1] );
         }
+        YOJIMBO_DELETE( *m_allocator, SlabPool, m_clientMemoryPool );
+        YOJIMBO_DELETE( *m_allocator, WorkerPool, m_workerPool );
+        YOJIMBO_FREE( *m_allocator, m_servers );
     }
 
-    bool Server::IsClientConnected( int clientIndex ) const
+    Server * ServerHost::CreateServer( const uint8_t privateKey[], const Address & address, const ClientServerConfig & config, Adapter & adapter )
     {
-        return netcode_server_client_connected( m_server, clientIndex ) != 0;
+        if ( m_numServers == m_maxServers )
+            return NULL;
+        return AddServer( YOJIMBO_NEW( *m_allocator, Server, *m_allocator, privateKey, address, config, adapter, m_time ), config );
     }
 
-    uint64_t Server::GetClientId( int clientIndex ) const
+    Server * ServerHost::CreateServer( ServerTransport & transport, const ClientServerConfig & config, Adapter & adapter )
     {
-        return netcode_server_client_id( m_server, clientIndex );
+        if ( m_numServers == m_maxServers )
+            return NULL;
+        return AddServer( YOJIMBO_NEW( *m_allocator, Server, *m_allocator, transport, config, adapter, m_time ), config );
     }
 
-    int Server::GetNumConnectedClients() const
+    Server * ServerHost::AddServer( Server * server, const ClientServerConfig & config )
     {
-        return netcode_server_num_connected_clients( m_server );
+        // IMPORTANT: Servers run their client work on whichever thread updates them. Per-server worker threads would nest inside the host worker pool
+        yojimbo_assert( config.serverWorkerThreads == 0 );
+        (void) config;
+        if ( !server )
+            return NULL;
+        server->SetClientMemoryPool( m_clientMemoryPool );
+        m_servers[m_numServers++] = server;
+        return server;
     }
 
-    void Server::ConnectLoopbackClient( int clientIndex, uint64_t clientId, const uint8_t * userData )
+    void ServerHost::DestroyServer( Server * server )
     {
-        netcode_server_connect_loopback_client( m_server, clientIndex, clientId, userData );
+        yojimbo_assert( server );
+        for ( int i = 0; i < m_numServers; ++i )
+        {
+            if ( m_servers[i] == server )
+            {
+                server->Stop();
+                YOJIMBO_DELETE( *m_allocator, Server, server );
+                m_servers[i] = m_servers[--m_numServers];
+                return;
+            }
+        }
+        // IMPORTANT: Only destroy servers created by this host!
+        yojimbo_assert( false );
     }
 
-    void Server::DisconnectLoopbackClient( int clientIndex )
+    void ServerHost::SendPackets()
     {
-        netcode_server_disconnect_loopback_client( m_server, clientIndex );
+        RunServerWork( SERVER_WORK_SEND_PACKETS );
     }
 
-    bool Server::IsLoopbackClient( int clientIndex ) const
+    void ServerHost::ReceivePackets()
     {
-        return netcode_server_client_loopback( m_server, clientIndex ) != 0;
+        RunServerWork( SERVER_WORK_RECEIVE_PACKETS );
     }
 
-    void Server::ProcessLoopbackPacket( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    void ServerHost::AdvanceTime( double time )
     {
-        netcode_server_process_loopback_packet( m_server, clientIndex, packetData, packetBytes, packetSequence );
+        m_time = time;
+        RunServerWork( SERVER_WORK_ADVANCE_TIME );
     }
 
-    void Server::TransmitPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
+    double ServerHost::GetNextWakeupTime() const
     {
-        (void) packetSequence;
-        NetworkSimulator * networkSimulator = GetNetworkSimulator();
-        if ( networkSimulator && networkSimulator->IsActive() )
-        {
-            networkSimulator->SendPacket( clientIndex, packetData, packetBytes );
-        }
-        else
+        double wakeupTime = m_time + MaxWakeupInterval;
+        for ( int i = 0; i < m_numServers; ++i )
         {
-            netcode_server_send_packet( m_server, clientIndex, packetData, packetBytes );
+            wakeupTime = yojimbo_min( wakeupTime, m_servers[i]->GetNextWakeupTime() );
         }
+        return wakeupTime;
     }
 
-    int Server::ProcessPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes )
-    {
-        return (int) GetClientConnection(clientIndex).ProcessPacket( GetContext(), packetSequence, packetData, packetBytes );
-    }
-
-    void Server::ConnectDisconnectCallbackFunction( int clientIndex, int connected )
+    void ServerHost::RunServerWork( ServerWork work )
     {
-        if ( connected == 0 )
+        ServerWorkContext context;
+        context.host = this;
+        context.work = work;
+        if ( m_workerPool )
         {
-            GetAdapter().OnServerClientDisconnected( clientIndex );
-            reliable_endpoint_reset( GetClientEndpoint( clientIndex ) );
-            GetClientConnection( clientIndex ).Reset();
-            NetworkSimulator * networkSimulator = GetNetworkSimulator();
-            if ( networkSimulator && networkSimulator->IsActive() )
-            {
-                networkSimulator->DiscardClientPackets( clientIndex );
-            }
+            m_workerPool->Run( StaticServerWorkFunction, &context, m_numServers );
         }
         else
         {
-            GetAdapter().OnServerClientConnected( clientIndex );
+            for ( int i = 0; i < m_numServers; ++i )
+                StaticServerWorkFunction( &context, i );
         }
     }
 
-    void Server::SendLoopbackPacketCallbackFunction( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
+    void ServerHost::StaticServerWorkFunction( void * context, int taskIndex )
     {
-        GetAdapter().ServerSendLoopbackPacket( clientIndex, packetData, packetBytes, packetSequence );
-    }
+        ServerWorkContext * workContext = (ServerWorkContext*) context;
+        ServerHost * host = workContext->host;
+        yojimbo_assert( taskIndex >= 0 );
+        yojimbo_assert( taskIndex < host->m_numServers );
+        Server * server = host->m_servers[taskIndex];
+        switch ( workContext->work )
+        {
+            case SERVER_WORK_SEND_PACKETS:
+                server->SendPackets();
+                break;
 
-    void Server::StaticConnectDisconnectCallbackFunction( void * context, int clientIndex, int connected )
-    {
-        Server * server = (Server*) context;
-        server->ConnectDisconnectCallbackFunction( clientIndex, connected );
-    }
+            case SERVER_WORK_RECEIVE_PACKETS:
+                server->ReceivePackets();
+                break;
 
-    void Server::StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence )
-    {
-        Server * server = (Server*) context;
-        server->SendLoopbackPacketCallbackFunction( clientIndex, packetData, packetBytes, packetSequence );
+            case SERVER_WORK_ADVANCE_TIME:
+                server->AdvanceTime( host->m_time );
+                break;
+        }
     }
 }
 
@@ -3987,18 +7402,45 @@ namespace yojimbo
 
 namespace yojimbo
 {
-    NetworkSimulator::NetworkSimulator( Allocator & allocator, int numPackets, double time )
+    static const int SimulatorPacketsPerChunk = 32;
+
+    NetworkSimulator::NetworkSimulator( Allocator & allocator, int numPackets, double time, int maxPacketBytes, int numClients, uint64_t seed, uint64_t stream ) : m_random( seed, stream )
     {
         yojimbo_assert( numPackets > 0 );
+        yojimbo_assert( maxPacketBytes > 0 );
+        yojimbo_assert( numClients >= 0 );
         m_allocator = &allocator;
-        m_currentIndex = 0;
+        m_maxPacketBytes = maxPacketBytes;
+        m_packetPool = YOJIMBO_NEW( allocator, SlabPool, allocator, maxPacketBytes, yojimbo_min( numPackets, SimulatorPacketsPerChunk ) );
+        yojimbo_assert( m_packetPool );
+        m_packetPool->SetMaxSlabs( numPackets );
         m_time = time;
-        m_latency = 0.0f;
-        m_jitter = 0.0f;
-        m_packetLoss = 0.0f;
-        m_duplicates = 0.0f;
+        m_sequence = 0;
+        m_numOverflowPackets = 0;
+        m_numOversizedPackets = 0;
+        m_link.clientConditions = false;
+        m_link.traceIndex = 0;
+        ResetLinkState( m_link );
+        m_numClientLinks = numClients;
+        m_clientLinks = NULL;
+        if ( numClients > 0 )
+        {
+            m_clientLinks = (Link*) YOJIMBO_ALLOCATE( allocator, sizeof( Link ) * numClients );
+            yojimbo_assert( m_clientLinks );
+            for ( int i = 0; i < numClients; ++i )
+            {
+                m_clientLinks[i] = m_link;
+            }
+        }
+        m_traceFile = NULL;
+        m_traceFileBytes = 0;
+        m_traceEntries = NULL;
+        m_numTraceEntries = 0;
+        m_traceLoop = false;
+        m_numQueueDrops = 0;
         m_active = false;
-        m_numPacketEntries = numPackets;
+        m_maxPacketEntries = numPackets;
+        m_numPacketEntries = 0;
         m_packetEntries = (PacketEntry*) YOJIMBO_ALLOCATE( allocator, sizeof( PacketEntry ) * numPackets );
         yojimbo_assert( m_packetEntries );
         memset( m_packetEntries, 0, sizeof( PacketEntry ) * numPackets );
@@ -4008,37 +7450,261 @@ namespace yojimbo
     {
         yojimbo_assert( m_allocator );
         yojimbo_assert( m_packetEntries );
-        yojimbo_assert( m_numPacketEntries > 0 );
+        yojimbo_assert( m_maxPacketEntries > 0 );
         DiscardPackets();
+        ClearTrace();
         YOJIMBO_FREE( *m_allocator, m_packetEntries );
-        m_numPacketEntries = 0;
+        YOJIMBO_FREE( *m_allocator, m_clientLinks );
+        YOJIMBO_DELETE( *m_allocator, SlabPool, m_packetPool );
+        m_maxPacketEntries = 0;
         m_allocator = NULL;
     }
 
     void NetworkSimulator::SetLatency( float milliseconds )
     {
-        m_latency = milliseconds;
-        UpdateActive();
+        m_link.conditions.latency = milliseconds;
+        UpdateLinks( false );
     }
 
     void NetworkSimulator::SetJitter( float milliseconds )
     {
-        m_jitter = milliseconds;
-        UpdateActive();
+        m_link.conditions.jitter = milliseconds;
+        UpdateLinks( false );
     }
 
     void NetworkSimulator::SetPacketLoss( float percent )
     {
-        m_packetLoss = percent;
-        UpdateActive();
+        m_link.conditions.packetLoss = percent;
+        UpdateLinks( false );
     }
 
     void NetworkSimulator::SetDuplicates( float percent )
     {
-        m_duplicates = percent;
+        m_link.conditions.duplicates = percent;
+        UpdateLinks( false );
+    }
+
+    void NetworkSimulator::SetBurstLoss( float goodToBadPercent, float badToGoodPercent, float badLossPercent, float goodLossPercent )
+    {
+        m_link.conditions.burstGoodToBad = goodToBadPercent;
+        m_link.conditions.burstBadToGood = badToGoodPercent;
+        m_link.conditions.burstBadLoss = badLossPercent;
+        m_link.conditions.burstGoodLoss = goodLossPercent;
+        UpdateLinks( true );
+    }
+
+    void NetworkSimulator::SetReordering( float percent, float milliseconds )
+    {
+        yojimbo_assert( milliseconds >= 0.0f );
+        m_link.conditions.reordering = percent;
+        m_link.conditions.reorderDelay = milliseconds;
+        UpdateLinks( false );
+    }
+
+    void NetworkSimulator::SetOutage( float periodSeconds, float durationSeconds )
+    {
+        yojimbo_assert( periodSeconds >= 0.0f );
+        yojimbo_assert( durationSeconds >= 0.0f );
+        yojimbo_assert( durationSeconds <= periodSeconds );
+        m_link.conditions.outagePeriod = periodSeconds;
+        m_link.conditions.outageDuration = durationSeconds;
+        UpdateLinks( true );
+    }
+
+    void NetworkSimulator::SetSeed( uint64_t seed, uint64_t stream )
+    {
+        m_random.Seed( seed, stream );
+    }
+
+    bool NetworkSimulator::LoadTrace( const char * filename, bool loop )
+    {
+        ClearTrace();
+
+        size_t bytes = 0;
+        const void * file = yojimbo_map_file( filename, &bytes );
+        if ( !file )
+            return false;
+
+        const NetworkTraceHeader * header = (const NetworkTraceHeader*) file;
+        const size_t maxEntries = bytes >= sizeof( NetworkTraceHeader ) ? ( bytes - sizeof( NetworkTraceHeader ) ) / sizeof( NetworkTraceEntry ) : 0;
+        const uint32_t numEntries = maxEntries > 0 ? network_to_host( header->numEntries ) : 0;
+
+        if ( maxEntries == 0 ||
+             network_to_host( header->magic ) != NetworkTraceMagic || 
+             network_to_host( header->version ) != NetworkTraceVersion ||
+             numEntries == 0 || numEntries > maxEntries || numEntries > 0x7FFFFFFF )
+        {
+            yojimbo_printf( YOJIMBO_LOG_LEVEL_ERROR, "error: %s is not a valid network trace\n", filename );
+            yojimbo_unmap_file( file, bytes );
+            return false;
+        }
+
+        m_traceFile = file;
+        m_traceFileBytes = bytes;
+        m_traceEntries = (const NetworkTraceEntry*) ( header + 1 );
+        m_numTraceEntries = (int) numEntries;
+        m_traceLoop = loop;
+        ResetTraceIndex();
+        UpdateActive();
+        return true;
+    }
+
+    void NetworkSimulator::ClearTrace()
+    {
+        yojimbo_unmap_file( m_traceFile, m_traceFileBytes );
+        m_traceFile = NULL;
+        m_traceFileBytes = 0;
+        m_traceEntries = NULL;
+        m_numTraceEntries = 0;
+        m_traceLoop = false;
+        ResetTraceIndex();
+        UpdateActive();
+    }
+
+    bool NetworkSimulator::IsTracePlaying( int to ) const
+    {
+        const Link & link = GetLink( to );
+        return !link.clientConditions && link.traceIndex < m_numTraceEntries;
+    }
+
+    void NetworkSimulator::ResetTraceIndex()
+    {
+        m_link.traceIndex = 0;
+        for ( int i = 0; i < m_numClientLinks; ++i )
+            m_clientLinks[i].traceIndex = 0;
+    }
+
+    void NetworkSimulator::SetClientConditions( int clientIndex, const NetworkConditions & conditions )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_numClientLinks );
+        Link & link = m_clientLinks[clientIndex];
+        link.conditions = conditions;
+        link.clientConditions = true;
+        ResetLinkState( link );
+        UpdateActive();
+    }
+
+    void NetworkSimulator::ClearClientConditions( int clientIndex )
+    {
+        yojimbo_assert( clientIndex >= 0 );
+        yojimbo_assert( clientIndex < m_numClientLinks );
+        Link & link = m_clientLinks[clientIndex];
+        link.conditions = m_link.conditions;
+        link.clientConditions = false;
+        ResetLinkState( link );
+        UpdateActive();
+    }
+
+    const NetworkConditions & NetworkSimulator::GetConditions( int to ) const
+    {
+        return GetLink( to ).conditions;
+    }
+
+    NetworkSimulator::Link & NetworkSimulator::GetLink( int to )
+    {
+        return ( to >= 0 && to < m_numClientLinks ) ? m_clientLinks[to] : m_link;
+    }
+
+    const NetworkSimulator::Link & NetworkSimulator::GetLink( int to ) const
+    {
+        return ( to >= 0 && to < m_numClientLinks ) ? m_clientLinks[to] : m_link;
+    }
+
+    void NetworkSimulator::UpdateLinks( bool resetState )
+    {
+        if ( resetState )
+            ResetLinkState( m_link );
+
+        for ( int i = 0; i < m_numClientLinks; ++i )
+        {
+            Link & link = m_clientLinks[i];
+            if ( link.clientConditions )
+                continue;
+            link.conditions = m_link.conditions;
+            if ( resetState )
+                ResetLinkState( link );
+        }
+
         UpdateActive();
     }
 
+    void NetworkSimulator::ResetLinkState( Link & link )
+    {
+        link.burstBad = false;
+        link.outageStartTime = m_time;
+        link.tokens = link.conditions.burstBytes;
+        link.tokenTime = m_time;
+    }
+
+    void NetworkSimulator::SetBandwidth( float kilobitsPerSecond, int burstBytes )
+    {
+        yojimbo_assert( kilobitsPerSecond >= 0.0f );
+        yojimbo_assert( burstBytes >= 0 );
+        m_link.conditions.bandwidth = kilobitsPerSecond;
+        m_link.conditions.burstBytes = burstBytes;
+        UpdateLinks( true );
+    }
+
+    void NetworkSimulator::SetQueueLimit( int queueBytes, int earlyDropBytes )
+    {
+        yojimbo_assert( queueBytes >= 0 );
+        yojimbo_assert( earlyDropBytes >= 0 );
+        yojimbo_assert( earlyDropBytes == 0 || earlyDropBytes < queueBytes );
+        m_link.conditions.queueBytes = queueBytes;
+        m_link.conditions.earlyDropBytes = earlyDropBytes;
+        UpdateLinks( false );
+    }
+
+    int NetworkSimulator::GetQueuedBytes( int to ) const
+    {
+        const Link & link = GetLink( to );
+        if ( link.conditions.bandwidth <= 0.0f )
+            return 0;
+        const double bytesPerSecond = link.conditions.bandwidth * 1000.0 / 8.0;
+        const double tokens = link.tokens + yojimbo_max( 0.0, m_time - link.tokenTime ) * bytesPerSecond;
+        return (int) ceil( yojimbo_max( 0.0, -tokens ) );
+    }
+
+    bool NetworkSimulator::SendLinkPacket( Link & link, int packetBytes, double & queueDelay )
+    {
+        const NetworkConditions & conditions = link.conditions;
+
+        yojimbo_assert( conditions.bandwidth > 0.0f );
+
+        const double bytesPerSecond = conditions.bandwidth * 1000.0 / 8.0;
+
+        link.tokens = yojimbo_min( double( conditions.burstBytes ), link.tokens + yojimbo_max( 0.0, m_time - link.tokenTime ) * bytesPerSecond );
+        link.tokenTime = m_time;
+
+        const double queuedBytes = yojimbo_max( 0.0, -link.tokens );
+
+        if ( conditions.queueBytes > 0 )
+        {
+            if ( queuedBytes + packetBytes > conditions.queueBytes )
+            {
+                m_numQueueDrops++;
+                return false;
+            }
+
+            if ( conditions.earlyDropBytes > 0 && queuedBytes > conditions.earlyDropBytes )
+            {
+                const double dropChance = ( queuedBytes - conditions.earlyDropBytes ) / double( conditions.queueBytes - conditions.earlyDropBytes );
+                if ( m_random.GenerateFloat( 0.0f, 1.0f ) < dropChance )
+                {
+                    m_numQueueDrops++;
+                    return false;
+                }
+            }
+        }
+
+        link.tokens -= packetBytes;
+
+        queueDelay = yojimbo_max( 0.0, -link.tokens ) / bytesPerSecond;
+
+        return true;
+    }
+
     bool NetworkSimulator::IsActive() const
     {
         return m_active;
@@ -4047,7 +7713,11 @@ namespace yojimbo
     void NetworkSimulator::UpdateActive()
     {
         bool previous = m_active;
-        m_active = m_latency != 0.0f || m_jitter != 0.0f || m_packetLoss != 0.0f || m_duplicates != 0.0f;
+        m_active = m_link.conditions.IsActive() || m_traceFile != NULL;
+        for ( int i = 0; i < m_numClientLinks && !m_active; ++i )
+        {
+            m_active = m_clientLinks[i].conditions.IsActive();
+        }
         if ( previous && !m_active )
         {
             DiscardPackets();
@@ -4060,41 +7730,147 @@ namespace yojimbo
         yojimbo_assert( packetData );
         yojimbo_assert( packetBytes > 0 );
 
-        if ( random_float( 0.0f, 100.0f ) <= m_packetLoss )
+        if ( packetBytes > m_maxPacketBytes )
         {
+            m_numOversizedPackets++;
             return;
         }
 
-        PacketEntry & packetEntry = m_packetEntries[m_currentIndex];
+        Link & link = GetLink( to );
+
+        const NetworkConditions & conditions = link.conditions;
+
+        double delay = 0.0;
+
+        if ( IsTracePlaying( to ) )
+        {
+            const NetworkTraceEntry & entry = m_traceEntries[link.traceIndex++];
+            if ( m_traceLoop && link.traceIndex == m_numTraceEntries )
+                link.traceIndex = 0;
+            if ( network_to_host( entry.flags ) & NetworkTraceDropped )
+                return;
+            delay = network_to_host( entry.delay ) / 1000000.0;
+        }
+        else
+        {
+            if ( IsPacketLost( link ) )
+                return;
+
+            delay = conditions.latency / 1000.0;
+
+            if ( conditions.jitter > 0 )
+                delay += m_random.GenerateFloat( -conditions.jitter, +conditions.jitter ) / 1000.0;
+        }
+
+        if ( conditions.reordering > 0 && m_random.GenerateFloat( 0.0f, 100.0f ) < conditions.reordering )
+            delay += conditions.reorderDelay / 1000.0;
+
+        if ( conditions.bandwidth > 0.0f )
+        {
+            double queueDelay = 0.0;
+            if ( !SendLinkPacket( link, packetBytes, queueDelay ) )
+                return;
+            delay += queueDelay;
+        }
+
+        AddPacketEntry( to, packetData, packetBytes, m_time + delay );
+
+        if ( m_random.GenerateFloat( 0.0f, 100.0f ) <= conditions.duplicates )
+        {
+            AddPacketEntry( to, packetData, packetBytes, m_time + delay + m_random.GenerateFloat( 0.0f, 1.0f ) );
+        }
+    }
+
+    bool NetworkSimulator::IsPacketLost( Link & link )
+    {
+        const NetworkConditions & conditions = link.conditions;
+
+        // step the burst loss state for every packet, so outages and independent loss don't stretch or shorten bursts
 
-        if ( packetEntry.packetData )
+        if ( conditions.burstGoodToBad > 0.0f )
         {
-            YOJIMBO_FREE( *m_allocator, packetEntry.packetData );
-            packetEntry = PacketEntry();
+            if ( link.burstBad )
+            {
+                if ( m_random.GenerateFloat( 0.0f, 100.0f ) < conditions.burstBadToGood )
+                    link.burstBad = false;
+            }
+            else
+            {
+                if ( m_random.GenerateFloat( 0.0f, 100.0f ) < conditions.burstGoodToBad )
+                    link.burstBad = true;
+            }
         }
 
-        double delay = m_latency / 1000.0;
+        if ( conditions.outagePeriod > 0.0f && fmod( m_time - link.outageStartTime, double( conditions.outagePeriod ) ) < conditions.outageDuration )
+            return true;
+
+        if ( m_random.GenerateFloat( 0.0f, 100.0f ) <= conditions.packetLoss )
+            return true;
+
+        if ( conditions.burstGoodToBad > 0.0f && m_random.GenerateFloat( 0.0f, 100.0f ) < ( link.burstBad ? conditions.burstBadLoss : conditions.burstGoodLoss ) )
+            return true;
+
+        return false;
+    }
+
+    void NetworkSimulator::AddPacketEntry( int to, uint8_t * packetData, int packetBytes, double deliveryTime )
+    {
+        // IMPORTANT: when the simulator is full the new packet is dropped, like a full router queue. Packets already in flight are never evicted
+
+        if ( m_numPacketEntries == m_maxPacketEntries )
+        {
+            m_numOverflowPackets++;
+            return;
+        }
 
-        if ( m_jitter > 0 )
-            delay += random_float( -m_jitter, +m_jitter ) / 1000.0;
+        uint8_t * buffer = m_packetPool->Allocate();
+        if ( !buffer )
+        {
+            m_numOverflowPackets++;
+            return;
+        }
 
+        const int index = m_numPacketEntries++;
+        PacketEntry & packetEntry = m_packetEntries[index];
         packetEntry.to = to;
-        packetEntry.packetData = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, packetBytes );
+        packetEntry.deliveryTime = deliveryTime;
+        packetEntry.sequence = m_sequence++;
+        packetEntry.packetData = buffer;
         memcpy( packetEntry.packetData, packetData, packetBytes );
         packetEntry.packetBytes = packetBytes;
-        packetEntry.deliveryTime = m_time + delay;
-        m_currentIndex = ( m_currentIndex + 1 ) % m_numPacketEntries;
+        SiftUp( index );
+    }
+
+    void NetworkSimulator::SiftUp( int index )
+    {
+        PacketEntry packetEntry = m_packetEntries[index];
+        while ( index > 0 )
+        {
+            const int parent = ( index - 1 ) / 2;
+            if ( !IsEarlier( packetEntry, m_packetEntries[parent] ) )
+                break;
+            m_packetEntries[index] = m_packetEntries[parent];
+            index = parent;
+        }
+        m_packetEntries[index] = packetEntry;
+    }
 
-        if ( random_float( 0.0f, 100.0f ) <= m_duplicates )
+    void NetworkSimulator::SiftDown( int index )
+    {
+        PacketEntry packetEntry = m_packetEntries[index];
+        while ( true )
         {
-            PacketEntry & nextPacketEntry = m_packetEntries[m_currentIndex];
-            nextPacketEntry.to = to;
-            nextPacketEntry.packetData = (uint8_t*) YOJIMBO_ALLOCATE( *m_allocator, packetBytes );
-            memcpy( nextPacketEntry.packetData, packetData, packetBytes );
-            nextPacketEntry.packetBytes = packetBytes;
-            nextPacketEntry.deliveryTime = m_time + delay + random_float( 0, +1.0 );
-            m_currentIndex = ( m_currentIndex + 1 ) % m_numPacketEntries;
+            int child = index * 2 + 1;
+            if ( child >= m_numPacketEntries )
+                break;
+            if ( child + 1 < m_numPacketEntries && IsEarlier( m_packetEntries[child+1], m_packetEntries[child] ) )
+                child++;
+            if ( !IsEarlier( m_packetEntries[child], packetEntry ) )
+                break;
+            m_packetEntries[index] = m_packetEntries[child];
+            index = child;
         }
+        m_packetEntries[index] = packetEntry;
     }
 
     int NetworkSimulator::ReceivePackets( int maxPackets, uint8_t * packetData[], int packetBytes[], int to[] )
@@ -4104,48 +7880,67 @@ namespace yojimbo
 
         int numPackets = 0;
 
-        for ( int i = 0; i < yojimbo_min( m_numPacketEntries, maxPackets ); ++i )
+        while ( numPackets < maxPackets && m_numPacketEntries > 0 && m_packetEntries[0].deliveryTime < m_time )
         {
-            if ( !m_packetEntries[i].packetData )
-                continue;
+            packetData[numPackets] = m_packetEntries[0].packetData;
+            packetBytes[numPackets] = m_packetEntries[0].packetBytes;
+            if ( to )
+            {
+                to[numPackets] = m_packetEntries[0].to;
+            }
+            numPackets++;
 
-            if ( m_packetEntries[i].deliveryTime < m_time )
+            m_numPacketEntries--;
+            if ( m_numPacketEntries > 0 )
             {
-                packetData[numPackets] = m_packetEntries[i].packetData;
-                packetBytes[numPackets] = m_packetEntries[i].packetBytes;
-                if ( to )
-                {
-                    to[numPackets] = m_packetEntries[i].to;
-                }
-                m_packetEntries[i].packetData = NULL;
-                numPackets++;
+                m_packetEntries[0] = m_packetEntries[m_numPacketEntries];
+                SiftDown( 0 );
             }
         }
 
         return numPackets;
     }
 
+    void NetworkSimulator::ReleasePackets( uint8_t * packetData[], int numPackets )
+    {
+        for ( int i = 0; i < numPackets; ++i )
+        {
+            m_packetPool->Free( packetData[i] );
+        }
+    }
+
     void NetworkSimulator::DiscardPackets()
     {
         for ( int i = 0; i < m_numPacketEntries; ++i )
         {
-            PacketEntry & packetEntry = m_packetEntries[i];
-            if ( !packetEntry.packetData )
-                continue;
-            YOJIMBO_FREE( *m_allocator, packetEntry.packetData );
-            packetEntry = PacketEntry();
+            m_packetPool->Free( m_packetEntries[i].packetData );
         }
+        m_numPacketEntries = 0;
     }
 
     void NetworkSimulator::DiscardClientPackets( int clientIndex )
     {
+        // compact the remaining packets, then rebuild the heap from the bottom up
+
+        int numPacketEntries = 0;
         for ( int i = 0; i < m_numPacketEntries; ++i )
         {
             PacketEntry & packetEntry = m_packetEntries[i];
-            if ( !packetEntry.packetData || packetEntry.to != clientIndex )
+            if ( packetEntry.to == clientIndex )
+            {
+                m_packetPool->Free( packetEntry.packetData );
                 continue;
-            YOJIMBO_FREE( *m_allocator, packetEntry.packetData );
-            packetEntry = PacketEntry();
+            }
+            m_packetEntries[numPacketEntries++] = packetEntry;
+        }
+
+        if ( numPacketEntries == m_numPacketEntries )
+            return;
+
+        m_numPacketEntries = numPacketEntries;
+        for ( int i = m_numPacketEntries / 2 - 1; i >= 0; --i )
+        {
+            SiftDown( i );
         }
     }
 
@@ -4153,6 +7948,14 @@ namespace yojimbo
     {
         m_time = time;
     }
+
+    double NetworkSimulator::GetNextDeliveryTime() const
+    {
+        double nextDeliveryTime = m_time + MaxWakeupInterval;
+        if ( m_numPacketEntries > 0 )
+            nextDeliveryTime = yojimbo_min( nextDeliveryTime, m_packetEntries[0].deliveryTime );
+        return nextDeliveryTime;
+    }
 }
 
 // ---------------------------------------------------------------------------------
@@ -133,6 +133,10 @@
 
 #define YOJIMBO_ENABLE_LOGGING                      1
 
+#ifndef YOJIMBO_PROFILE
+#define YOJIMBO_PROFILE                             0
+#endif // #ifndef YOJIMBO_PROFILE
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <stddef.h>
@@ -141,9 +145,6 @@
 #include <string.h>
 #include <memory.h>
 #include <math.h>
-#if YOJIMBO_DEBUG_MESSAGE_LEAKS
-#include <map>
-#endif // #if YOJIMBO_DEBUG_MESSAGE_LEAKS
 
 // windows =p
 #ifdef SendMessage
@@ -158,8 +159,9 @@ struct reliable_endpoint_t;
 
 namespace yojimbo
 {
-    const int MaxClients = 64;                                      ///< The maximum number of clients supported by this library. You can increase this if you want, but this library is designed around patterns that work best for [2,64] player games. If your game has less than 64 clients, reducing this will save memory.
+    const int MaxClients = 64;                                      ///< The default number of client slots for games. This is not a hard limit: per-client server state is sized at runtime by Server::Start, up to the number of clients supported by netcode.io. For servers with hundreds or thousands of clients see ClientServerConfig::SetLightweightClientProfile.
     const int MaxChannels = 64;                                     ///< The maximum number of message channels supported by this library. If you need less than 64 channels per-packet, reducing this will save memory.
+    const double MaxWakeupInterval = 1.0;                           ///< The furthest ahead Server::GetNextWakeupTime and Client::GetNextWakeupTime will look (seconds). Idle servers and clients still wake up at least this often.
     const int KeyBytes = 32;                                        ///< Size of encryption key for dedicated client/server in bytes. Must be equal to key size for libsodium encryption primitive. Do not change.
     const int ConnectTokenBytes = 2048;                             ///< Size of the encrypted connect token data return from the matchmaker. Must equal size of NETCODE_CONNECT_TOKEN_BYTE (2048).
     const uint32_t SerializeCheckValue = 0x12345678;                ///< The value written to the stream for serialize checks. See WriteStream::SerializeCheck and ReadStream::SerializeCheck.
@@ -167,6 +169,7 @@ namespace yojimbo
     const int ConservativeFragmentHeaderBits = 64;                  ///< Conservative number of bits per-fragment header.
     const int ConservativeChannelHeaderBits = 32;                   ///< Conservative number of bits per-channel header.
     const int ConservativePacketHeaderBits = 16;                    ///< Conservative number of bits per-packet header.
+    const int ConservativeTransmitHeaderBytes = 64;                 ///< Conservative number of bytes reliable.io adds to each packet or packet fragment when it is transmitted. See ClientServerConfig::GetMaxTransmitPacketSize.
 
     /// Determines the reliability and ordering guarantees for a channel.
 
@@ -217,6 +220,9 @@ namespace yojimbo
         int blockFragmentSize;                                      ///< Blocks are split up into fragments of this size (bytes). Reliable-ordered channel only.
         float messageResendTime;                                    ///< Minimum delay between message resends (seconds). Avoids sending the same message too frequently. Reliable-ordered channel only.
         float blockFragmentResendTime;                              ///< Minimum delay between block fragment resends (seconds). Avoids sending the same fragment too frequently. Reliable-ordered channel only.
+        float blockReleaseTime;                                     ///< Block send and receive state is allocated on demand, and released after no blocks have been sent or received for this long (seconds). Set to a negative value to keep it once allocated. Reliable-ordered channel only.
+        bool trackLatency;                                          ///< Track how long messages take to get through the channel in latency histograms. The histograms are only allocated when this is set. See ChannelLatency. Reliable-ordered channel only.
+        bool sendTimestamps;                                        ///< Include a 32 bit send timestamp in each packet, so the receiver can measure one-way delivery latency (CHANNEL_LATENCY_DELIVERED). The receiver also needs trackLatency set. Only meaningful when both sides share a synchronized clock. Must match on client and server. Reliable-ordered channel only.
 
         ChannelConfig() : type ( CHANNEL_TYPE_RELIABLE_ORDERED )
         {
@@ -230,6 +236,9 @@ namespace yojimbo
             blockFragmentSize = 1024;
             messageResendTime = 0.1f;
             blockFragmentResendTime = 0.25f;
+            blockReleaseTime = 10.0f;
+            trackLatency = false;
+            sendTimestamps = false;
         }
 
         int GetMaxFragmentsPerBlock() const
@@ -278,6 +287,9 @@ namespace yojimbo
         int packetReassemblyBufferSize;                         ///< Number of packet entries in the fragmentation reassembly buffer.
         int ackedPacketsBufferSize;                             ///< Number of packet entries in the acked packet buffer. Consider your packet send rate and aim to have at least a few seconds worth of entries.
         int receivedPacketsBufferSize;                          ///< Number of packet entries in the received packet sequence buffer. Consider your packet send rate and aim to have at least a few seconds worth of entries.
+        bool mappedMemory;                                      ///< If true then client and server heaps are mapped directly from the operating system instead of being allocated from the allocator passed in. Free pages in per-client heaps are returned to the OS when a client disconnects.
+        bool hugePages;                                         ///< If true and mappedMemory is set, heaps are backed by huge pages where available (explicit huge pages first, then transparent huge pages). Reduces TLB misses with large per-client heaps.
+        int serverWorkerThreads;                                ///< Number of worker threads the server uses to generate packets, process packets and process acks for clients in parallel. 0 does all per-client work on the thread calling the server. Socket and netcode.io calls always stay on the calling thread. See WorkerPool.
 
         ClientServerConfig()
         {
@@ -294,6 +306,47 @@ namespace yojimbo
             packetReassemblyBufferSize = 64;
             ackedPacketsBufferSize = 256;
             receivedPacketsBufferSize = 256;
+            mappedMemory = false;
+            hugePages = false;
+            serverWorkerThreads = 0;
+        }
+
+        /**
+            Get the largest packet passed to the transport.
+            Packets above fragmentPacketsAbove are split into fragments of packetFragmentSize, so this is usually much smaller than maxPacketSize. Used to size network simulator packet buffers.
+            @returns The maximum transmitted packet size (bytes), including a conservative estimate of the reliable.io header.
+         */
+
+        int GetMaxTransmitPacketSize() const
+        {
+            const int maxUnfragmentedBytes = fragmentPacketsAbove > packetFragmentSize ? fragmentPacketsAbove : packetFragmentSize;
+            return ( maxUnfragmentedBytes < maxPacketSize ? maxUnfragmentedBytes : maxPacketSize ) + ConservativeTransmitHeaderBytes;
+        }
+
+        /**
+            Configure for lightweight clients.
+            Use this for lobby, chat and relay servers that need hundreds to thousands of clients per-process, each exchanging small messages.
+            Shrinks message queues and packet buffers, disables blocks on all channels, keeps packets below the fragmentation threshold and scales server per-client memory down to match.
+            Call this after setting numChannels and channel types. You can adjust individual settings afterwards.
+         */
+
+        void SetLightweightClientProfile()
+        {
+            maxPacketSize = 1024;
+            fragmentPacketsAbove = maxPacketSize;
+            maxPacketFragments = 1;
+            packetReassemblyBufferSize = 4;
+            ackedPacketsBufferSize = 64;
+            receivedPacketsBufferSize = 64;
+            serverPerClientMemory = 256 * 1024;
+            for ( int i = 0; i < numChannels; ++i )
+            {
+                channel[i].disableBlocks = true;
+                channel[i].sentPacketBufferSize = 256;
+                channel[i].messageSendQueueSize = 64;
+                channel[i].messageReceiveQueueSize = 64;
+                channel[i].maxMessagesPerPacket = 16;
+            }
         }
     };
 }
@@ -396,6 +449,71 @@ void yojimbo_sleep( double time );
 
 double yojimbo_time();
 
+/**
+    Map a block of memory directly from the operating system.
+    Used to back client and server heaps when ClientServerConfig::mappedMemory is set. Falls back to regular pages if huge pages are not available.
+    @param bytes The size of the block of memory (bytes). This is rounded up to the page size, or huge page size if hugePages is true.
+    @param hugePages If true, try to back the memory with huge pages.
+    @returns Page aligned, zero initialized block of memory, or NULL if the memory could not be mapped.
+    @see yojimbo_unmap_memory
+ */
+
+void * yojimbo_map_memory( size_t bytes, bool hugePages );
+
+/**
+    Unmap a block of memory mapped with yojimbo_map_memory.
+    @param memory The block of memory to unmap. May be NULL.
+    @param bytes The size of the block of memory (bytes). Must match the size passed in to yojimbo_map_memory.
+    @param hugePages Must match the value passed in to yojimbo_map_memory.
+ */
+
+void yojimbo_unmap_memory( void * memory, size_t bytes, bool hugePages );
+
+/**
+    Tell the operating system the contents of a range of memory are no longer needed, so the physical pages backing it can be reclaimed.
+    The range is shrunk inwards to whole pages, so it is safe to pass in ranges that share a page with memory still in use. Discarded pages read back as zero (or stale data on some platforms) when touched again.
+    @param memory Pointer to the start of the range.
+    @param bytes The size of the range (bytes).
+ */
+
+void yojimbo_discard_memory( void * memory, size_t bytes );
+
+/**
+    Map a file into memory, read only.
+    Pages are read in from the file as they are touched, so large files can be mapped without reading them in up front.
+    @param filename The name of the file to map.
+    @param bytes Set to the size of the file (bytes) [out].
+    @returns The contents of the file, or NULL if the file could not be opened or mapped. Empty files can't be mapped.
+    @see yojimbo_unmap_file
+ */
+
+const void * yojimbo_map_file( const char * filename, size_t * bytes );
+
+/**
+    Unmap a file mapped with yojimbo_map_file.
+    @param memory The mapped file contents. May be NULL.
+    @param bytes The size of the file returned by yojimbo_map_file.
+ */
+
+void yojimbo_unmap_file( const void * memory, size_t bytes );
+
+/**
+    Atomically increment an integer.
+    Used for reference counts on data shared between client slots, which can be released from server worker threads.
+    @param value Pointer to the integer to increment.
+    @returns The value after it was incremented.
+ */
+
+int yojimbo_atomic_increment( volatile int * value );
+
+/**
+    Atomically decrement an integer.
+    @param value Pointer to the integer to decrement.
+    @returns The value after it was decremented.
+ */
+
+int yojimbo_atomic_decrement( volatile int * value );
+
 #define YOJIMBO_LOG_LEVEL_NONE      0
 #define YOJIMBO_LOG_LEVEL_ERROR     1
 #define YOJIMBO_LOG_LEVEL_INFO      2
@@ -455,9 +573,6 @@ void yojimbo_set_assert_function( void (*function)( const char * /*condition*/,
 
 #include <stdint.h>
 #include <new>
-#if YOJIMBO_DEBUG_MEMORY_LEAKS
-#include <map>
-#endif // YOJIMBO_DEBUG_MEMORY_LEAKS
 
 typedef void* tlsf_t;
 
@@ -505,6 +620,194 @@ namespace yojimbo
         }
     }
 
+    /**
+        An open addressing hash table keyed by pointer.
+        This is used by the debug leak tracking in Allocator and MessageFactory, which sees every allocation and message, so it has to be fast.
+        Uses linear probing with backward shift deletion, so there are no tombstones and lookups stay short under heavy insert/remove churn.
+        IMPORTANT: Storage comes from malloc and free directly, not from a yojimbo allocator. This avoids recursing into allocator leak tracking and keeps debug bookkeeping out of per-client heap budgets.
+     */
+
+    template <typename T> class PointerMap
+    {
+    public:
+
+        /**
+            Pointer map constructor.
+            No memory is allocated until the first insert.
+         */
+
+        PointerMap()
+        {
+            m_size = 0;
+            m_capacity = 0;
+            m_keys = NULL;
+            m_values = NULL;
+        }
+
+        /**
+            Pointer map destructor.
+         */
+
+        ~PointerMap()
+        {
+            free( m_keys );
+            free( m_values );
+        }
+
+        /**
+            Insert an entry into the map.
+            IMPORTANT: The key must not already be in the map. Will assert otherwise.
+            @param key The pointer key. Must not be NULL.
+            @param value The value to associate with the key.
+         */
+
+        void Insert( const void * key, const T & value )
+        {
+            yojimbo_assert( key );
+            if ( ( m_size + 1 ) * 2 > m_capacity )
+            {
+                Grow();
+            }
+            int index = Hash( key );
+            while ( m_keys[index] )
+            {
+                yojimbo_assert( m_keys[index] != key );
+                index = ( index + 1 ) & ( m_capacity - 1 );
+            }
+            m_keys[index] = key;
+            m_values[index] = value;
+            m_size++;
+        }
+
+        /**
+            Remove an entry from the map.
+            @param key The pointer key.
+            @returns True if the entry was found and removed, false if the key is not in the map.
+         */
+
+        bool Remove( const void * key )
+        {
+            int index = FindIndex( key );
+            if ( index < 0 )
+                return false;
+            m_keys[index] = NULL;
+            m_size--;
+            int next = ( index + 1 ) & ( m_capacity - 1 );
+            while ( m_keys[next] )
+            {
+                const int ideal = Hash( m_keys[next] );
+                if ( ( ( next - ideal ) & ( m_capacity - 1 ) ) >= ( ( next - index ) & ( m_capacity - 1 ) ) )
+                {
+                    m_keys[index] = m_keys[next];
+                    m_values[index] = m_values[next];
+                    m_keys[next] = NULL;
+                    index = next;
+                }
+                next = ( next + 1 ) & ( m_capacity - 1 );
+            }
+            return true;
+        }
+
+        /**
+            Find the value associated with a key.
+            @param key The pointer key.
+            @returns A pointer to the value, or NULL if the key is not in the map.
+         */
+
+        T * Find( const void * key )
+        {
+            const int index = FindIndex( key );
+            return ( index >= 0 ) ? &m_values[index] : NULL;
+        }
+
+        /**
+            Get the number of entries in the map.
+            @returns The number of entries.
+         */
+
+        int GetSize() const { return m_size; }
+
+        /**
+            Get the number of slots in the map.
+            Use this with GetKey and GetValue to iterate across all entries.
+            @returns The number of slots.
+         */
+
+        int GetCapacity() const { return m_capacity; }
+
+        /**
+            Get the key stored in a slot.
+            @param index The slot index in [0,GetCapacity()-1].
+            @returns The key stored in the slot, or NULL if the slot is empty.
+         */
+
+        const void * GetKey( int index ) const { yojimbo_assert( index >= 0 ); yojimbo_assert( index < m_capacity ); return m_keys[index]; }
+
+        /**
+            Get the value stored in a slot.
+            @param index The slot index in [0,GetCapacity()-1]. The slot must not be empty.
+            @returns The value stored in the slot.
+         */
+
+        const T & GetValue( int index ) const { yojimbo_assert( index >= 0 ); yojimbo_assert( index < m_capacity ); yojimbo_assert( m_keys[index] ); return m_values[index]; }
+
+    private:
+
+        int Hash( const void * key ) const
+        {
+            uint64_t h = (uint64_t) (uintptr_t) key;
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            return int( h & uint64_t( m_capacity - 1 ) );
+        }
+
+        int FindIndex( const void * key ) const
+        {
+            if ( !key || m_size == 0 )
+                return -1;
+            int index = Hash( key );
+            while ( m_keys[index] )
+            {
+                if ( m_keys[index] == key )
+                    return index;
+                index = ( index + 1 ) & ( m_capacity - 1 );
+            }
+            return -1;
+        }
+
+        void Grow()
+        {
+            const void ** oldKeys = m_keys;
+            T * oldValues = m_values;
+            const int oldCapacity = m_capacity;
+            m_capacity = m_capacity ? m_capacity * 2 : 256;
+            m_keys = (const void**) calloc( m_capacity, sizeof( void* ) );
+            m_values = (T*) malloc( m_capacity * sizeof( T ) );
+            yojimbo_assert( m_keys );
+            yojimbo_assert( m_values );
+            m_size = 0;
+            for ( int i = 0; i < oldCapacity; ++i )
+            {
+                if ( oldKeys[i] )
+                {
+                    Insert( oldKeys[i], oldValues[i] );
+                }
+            }
+            free( oldKeys );
+            free( oldValues );
+        }
+
+        int m_size;                                                 ///< The number of entries in the map.
+        int m_capacity;                                             ///< The number of slots in the map. Always a power of two, or zero before the first insert.
+        const void ** m_keys;                                       ///< Array of keys. NULL means the slot is empty.
+        T * m_values;                                               ///< Array of values, parallel to the key array.
+
+        PointerMap( const PointerMap<T> & other );
+
+        PointerMap<T> & operator = ( const PointerMap<T> & other );
+    };
+
 #if YOJIMBO_DEBUG_MEMORY_LEAKS
 
     /**
@@ -585,6 +888,14 @@ namespace yojimbo
 
         void ClearError() { m_errorLevel = ALLOCATOR_ERROR_NONE; }
 
+        /**
+            Return physical pages that back free memory in this allocator to the operating system.
+            This is called on the per-client allocator when a client disconnects from the server, if ClientServerConfig::mappedMemory is set. The default implementation does nothing.
+            @see yojimbo_discard_memory
+         */
+
+        virtual void ReleaseFreePages() {}
+
     protected:
 
         /**
@@ -619,7 +930,7 @@ namespace yojimbo
         AllocatorErrorLevel m_errorLevel;                                       ///< The allocator error level.
 
 #if YOJIMBO_DEBUG_MEMORY_LEAKS
-        std::map<void*,AllocatorEntry> m_alloc_map;                             ///< Debug only data structure used to find and report memory leaks.
+        PointerMap<AllocatorEntry> m_alloc_map;                                 ///< Debug only data structure used to find and report memory leaks.
 #endif // #if YOJIMBO_DEBUG_MEMORY_LEAKS
 
     private:
@@ -721,6 +1032,13 @@ namespace yojimbo
 
         void Free( void * p, const char * file, int line );
 
+        /**
+            Walk the TLSF pool and discard the pages inside each free block.
+            Block headers and free list links are left untouched, so the heap remains valid.
+         */
+
+        void ReleaseFreePages();
+
     private:
 
         tlsf_t m_tlsf;              ///< The TLSF allocator instance backing this allocator.
@@ -771,6 +1089,94 @@ namespace yojimbo
         return a + r;
     }
 
+    /**
+        A small, fast pseudo random number generator (PCG32) with its own state.
+        Unlike random_int and random_float, each instance is seeded explicitly and doesn't share state with anything else, so a run seeded with the same value produces exactly the same sequence, on any platform, and separate simulations don't interfere with each other.
+        IMPORTANT: This is not a cryptographically secure random. It's used for the network simulator and tests.
+        See http://www.pcg-random.org
+     */
+
+    class RandomGenerator
+    {
+    public:
+
+        /**
+            Create a random generator.
+            @param seed The seed value. Generators with the same seed and stream produce the same sequence.
+            @param stream Selects one of 2^63 independent sequences. Use different streams to give generators with the same seed different sequences.
+         */
+
+        explicit RandomGenerator( uint64_t seed = 0, uint64_t stream = 0 )
+        {
+            Seed( seed, stream );
+        }
+
+        /**
+            Reset the generator to the start of the sequence for a seed.
+            @param seed The seed value.
+            @param stream The stream to use. See RandomGenerator::RandomGenerator.
+         */
+
+        void Seed( uint64_t seed, uint64_t stream = 0 )
+        {
+            m_state = 0;
+            m_increment = ( stream << 1 ) | 1;
+            GenerateUint32();
+            m_state += seed;
+            GenerateUint32();
+        }
+
+        /**
+            Generate a random 32 bit unsigned integer.
+            @returns A pseudo random value in [0,2^32-1].
+         */
+
+        uint32_t GenerateUint32()
+        {
+            const uint64_t previous = m_state;
+            m_state = previous * 6364136223846793005ULL + m_increment;
+            const uint32_t xorshifted = uint32_t( ( ( previous >> 18 ) ^ previous ) >> 27 );
+            const uint32_t rotate = uint32_t( previous >> 59 );
+            return ( xorshifted >> rotate ) | ( xorshifted << ( ( 32 - rotate ) & 31 ) );
+        }
+
+        /**
+            Generate a random integer between a and b (inclusive).
+            @param a The minimum integer value to generate.
+            @param b The maximum integer value to generate.
+            @returns A pseudo random integer value in [a,b].
+         */
+
+        int GenerateInt( int a, int b )
+        {
+            yojimbo_assert( a < b );
+            const uint64_t range = uint64_t( int64_t( b ) - int64_t( a ) ) + 1;
+            const int result = int( int64_t( a ) + int64_t( ( GenerateUint32() * range ) >> 32 ) );
+            yojimbo_assert( result >= a );
+            yojimbo_assert( result <= b );
+            return result;
+        }
+
+        /**
+            Generate a random float between a and b.
+            @param a The minimum float value to generate.
+            @param b The maximum float value to generate.
+            @returns A pseudo random float value in [a,b).
+         */
+
+        float GenerateFloat( float a, float b )
+        {
+            yojimbo_assert( a < b );
+            const float random = ( GenerateUint32() >> 8 ) * ( 1.0f / 16777216.0f );
+            return a + random * ( b - a );
+        }
+
+    private:
+
+        uint64_t m_state;                                   ///< The generator state. Advances each time a value is generated.
+        uint64_t m_increment;                               ///< The stream increment. Always odd.
+    };
+
     /**
         Calculates the population count of an unsigned 32 bit integer at compile time.
         Population count is the number of bits in the integer that set to 1.
@@ -1595,6 +2001,72 @@ namespace yojimbo
         SequenceBuffer<T> & operator = ( const SequenceBuffer<T> & other );
     };
 
+    /// Summary of the timing samples in a TimingHistogram.
+
+    struct TimingStats
+    {
+        uint64_t numSamples;                                        ///< Number of samples added to the histogram. Includes samples that have since rolled out of the window.
+        double p50;                                                 ///< 50th percentile (seconds).
+        double p99;                                                 ///< 99th percentile (seconds).
+        double max;                                                 ///< Maximum sample in the current and previous window (seconds).
+    };
+
+    /**
+        A rolling histogram of timing samples.
+        Samples are binned into buckets four per-octave, from the minimum sample time passed to Reset up. Percentiles are accurate to the bucket size, about 19%.
+        Once a window of samples has been added, all bucket counts are halved, so old samples fade out and the histogram follows recent behavior.
+        Has no constructor so it can live in memory cleared with memset. Call Reset before first use.
+        @see ServerProfilePhase
+     */
+
+    class TimingHistogram
+    {
+    public:
+
+        static const int NumBuckets = 80;                           ///< Number of buckets. Bucket n >= 1 starts at 2^((n-1)/4) times the minimum sample time. With the default of one microsecond, the last bucket holds all samples above about 0.74 seconds, well past any tick budget.
+
+        static const int WindowSize = 1024;                         ///< Number of samples added before bucket counts are halved.
+
+        /**
+            Clear all samples.
+            @param minSeconds Samples below this go in the first bucket, and the buckets above it cover 2^19.5 times this. The default of one microsecond suits tick and operation timings.
+         */
+
+        void Reset( double minSeconds = 0.000001 );
+
+        /**
+            Add a timing sample.
+            @param seconds The time taken (seconds).
+         */
+
+        void AddSample( double seconds );
+
+        /**
+            Add the samples from another histogram to this one.
+            @param other The histogram to merge in. Must have been reset with the same minimum sample time.
+         */
+
+        void Merge( const TimingHistogram & other );
+
+        /**
+            Get the p50, p99 and maximum of recent samples.
+            @param stats The timing stats [out].
+         */
+
+        void GetStats( TimingStats & stats ) const;
+
+    private:
+
+        double GetPercentile( float percentile ) const;
+
+        uint32_t m_bucket[NumBuckets];                              ///< Sample count per-bucket.
+        uint32_t m_numWindowSamples;                                ///< Samples added since bucket counts were last halved.
+        uint64_t m_numSamples;                                      ///< Total samples added.
+        double m_max;                                               ///< Maximum sample in the current window.
+        double m_previousMax;                                       ///< Maximum sample in the previous window.
+        double m_minSeconds;                                        ///< The start of bucket 1 (seconds). See Reset.
+    };
+
     /**
         Bitpacks unsigned integer values to a buffer.
         Integer bit values are written to a 64 bit scratch value from right to left.
@@ -3622,6 +4094,90 @@ namespace yojimbo
         uint32_t m_blockMessage : 1;                ///< 1 if this is a block message. 0 otherwise. If 1 then you can cast the Message* to BlockMessage*. Lightweight RTTI.
     };
 
+    /**
+        An immutable block of data that can be attached to many block messages, across different clients, without copying it.
+        Use this to send the same large block (eg. level data) to many clients. The block is allocated once, instead of once per-client heap.
+        The reference count is atomic, since block messages can be released on server worker threads.
+        IMPORTANT: Don't modify the block data once it has been attached to a message.
+        @see BaseServer::CreateSharedBlock
+        @see BlockMessage::AttachSharedBlock
+     */
+
+    class SharedBlock
+    {
+    public:
+
+        /**
+            Create a shared block.
+            @param allocator The allocator used to allocate the block. The block is freed with this allocator when the last reference is released.
+            @param bytes The size of the block (bytes).
+            @returns The shared block with one reference, or NULL if the allocation failed.
+         */
+
+        static SharedBlock * Create( Allocator & allocator, int bytes );
+
+        /**
+            Add a reference to the shared block.
+         */
+
+        void Acquire() { yojimbo_assert( m_refCount > 0 ); yojimbo_atomic_increment( &m_refCount ); }
+
+        /**
+            Remove a reference from the shared block.
+            When the reference count reaches zero the block is freed with the allocator passed in to Create.
+            IMPORTANT: Make sure the last reference is released on a thread that is allowed to use that allocator.
+         */
+
+        void Release();
+
+        /**
+            Get the reference count.
+            @returns The reference count.
+         */
+
+        int GetRefCount() const { return m_refCount; }
+
+        /**
+            Get the block data.
+            Fill this in before attaching the block to any messages.
+            @returns The block data.
+         */
+
+        uint8_t * GetData() { return m_data; }
+
+        /**
+            Get a constant pointer to the block data.
+            @returns The block data.
+         */
+
+        const uint8_t * GetData() const { return m_data; }
+
+        /**
+            Get the size of the block.
+            @returns The size of the block (bytes).
+         */
+
+        int GetSize() const { return m_size; }
+
+    private:
+
+        friend class BaseServer;
+
+        SharedBlock() {}
+
+        ~SharedBlock() {}
+
+        Allocator * m_allocator;                                ///< The allocator this block was allocated with.
+        volatile int m_refCount;                                ///< The reference count. The block is freed when this reaches zero.
+        int m_size;                                             ///< The size of the block (bytes).
+        uint8_t * m_data;                                       ///< The block data, stored immediately after this object in the same allocation.
+        SharedBlock * m_next;                                   ///< The next shared block the server holds a reference to. See BaseServer::CreateSharedBlock.
+
+        SharedBlock( const SharedBlock & other );
+
+        SharedBlock & operator = ( const SharedBlock & other );
+    };
+
     /**
         A message which can have a block of data attached to it.
         @see ChannelConfig
@@ -3637,7 +4193,7 @@ namespace yojimbo
             @see MessageFactory::CreateMessage
          */
 
-        explicit BlockMessage() : Message( 1 ), m_allocator(NULL), m_blockData(NULL), m_blockSize(0) {}
+        explicit BlockMessage() : Message( 1 ), m_allocator(NULL), m_sharedBlock(NULL), m_blockData(NULL), m_blockSize(0) {}
 
         /**
             Attach a block to this message.
@@ -3656,9 +4212,27 @@ namespace yojimbo
             m_blockSize = blockSize;
         }
 
-        /** 
-            Detach the block from this message.
-            By doing this you are responsible for copying the block pointer and allocator and making sure the block is freed.
+        /**
+            Attach a shared block to this message.
+            A reference is added to the shared block, and released when the message is destroyed. The block data is not copied.
+            You can only attach one block. This method will assert if a block is already attached.
+            @see Server::AttachSharedBlockToMessage
+         */
+
+        void AttachSharedBlock( SharedBlock & block )
+        {
+            yojimbo_assert( block.GetSize() > 0 );
+            yojimbo_assert( !m_blockData );
+            block.Acquire();
+            m_sharedBlock = &block;
+            m_blockData = block.GetData();
+            m_blockSize = block.GetSize();
+        }
+
+        /** 
+            Detach the block from this message.
+            By doing this you are responsible for copying the block pointer and allocator and making sure the block is freed.
+            For shared blocks, the reference held by the message passes to you. Get it with GetSharedBlock before detaching, and release it when you are done.
             This could be used for example, if you wanted to copy off the block and store it somewhere, without the cost of copying it.
             @see Client::DetachBlockFromMessage
             @see Server::DetachBlockFromMessage
@@ -3667,13 +4241,14 @@ namespace yojimbo
         void DetachBlock()
         {
             m_allocator = NULL;
+            m_sharedBlock = NULL;
             m_blockData = NULL;
             m_blockSize = 0;
         }
 
         /**
             Get the allocator used to allocate the block.
-            @returns The allocator for the block. NULL if no block is attached to this message.
+            @returns The allocator for the block. NULL if no block is attached to this message, or if the block is shared.
          */
 
         Allocator * GetAllocator()
@@ -3681,6 +4256,16 @@ namespace yojimbo
             return m_allocator;
         }
 
+        /**
+            Get the shared block attached to this message.
+            @returns The shared block. NULL if no block is attached to this message, or if the block is not shared.
+         */
+
+        SharedBlock * GetSharedBlock()
+        {
+            return m_sharedBlock;
+        }
+
         /**
             Get the block data pointer.
             @returns The block data pointer. NULL if no block is attached.
@@ -3727,7 +4312,7 @@ namespace yojimbo
     protected:
 
         /**
-            If a block was attached to the message, it is freed here.
+            If a block was attached to the message, it is freed here. Shared blocks have their reference released instead.
          */
 
         ~BlockMessage()
@@ -3738,15 +4323,169 @@ namespace yojimbo
                 m_blockSize = 0;
                 m_allocator = NULL;
             }
+            if ( m_sharedBlock )
+            {
+                m_sharedBlock->Release();
+                m_sharedBlock = NULL;
+                m_blockData = NULL;
+                m_blockSize = 0;
+            }
         }
 
     private:
 
-        Allocator * m_allocator;                    ///< Allocator for the block attached to the message. NULL if no block is attached.
+        Allocator * m_allocator;                    ///< Allocator for the block attached to the message. NULL if no block is attached, or if the block is shared.
+        SharedBlock * m_sharedBlock;                ///< The shared block attached to the message. NULL if no block is attached, or if the block is not shared.
         uint8_t * m_blockData;                      ///< The block data. NULL if no block is attached.
         int m_blockSize;                            ///< The block size (bytes). 0 if no block is attached.
     };
 
+    /**
+        A message serialized once, so it can be sent to many clients without measuring and serializing it again for each client.
+        Each client gets a SerializedMessage that refers to this data, and the serialized bits are copied straight into that client's packets.
+        Messages that align to a byte boundary while serializing (eg. serialize_bytes, serialize_string) are serialized once for each of the 8 possible bit offsets, and the copy that matches the position in the packet is written.
+        The reference count is atomic, since clients can drop their reference on server worker threads.
+        @see BaseServer::BroadcastMessage
+     */
+
+    class SerializedMessageData
+    {
+    public:
+
+        /**
+            Serialize a message.
+            @param allocator The allocator used to allocate the serialized data. The data is freed with this allocator when the last reference is released.
+            @param message The message to serialize. Block messages are not supported.
+            @param context The serialization context, or NULL.
+            @returns The serialized message data with one reference, or NULL if the message failed to serialize or the allocation failed.
+         */
+
+        static SerializedMessageData * Create( Allocator & allocator, Message & message, void * context );
+
+        /**
+            Add a reference to the serialized message data.
+         */
+
+        void Acquire() { yojimbo_assert( m_refCount > 0 ); yojimbo_atomic_increment( &m_refCount ); }
+
+        /**
+            Remove a reference from the serialized message data.
+            When the reference count reaches zero the data is freed with the allocator passed in to Create.
+            IMPORTANT: Make sure the last reference is released on a thread that is allowed to use that allocator.
+         */
+
+        void Release();
+
+        /**
+            Get the reference count.
+            @returns The reference count.
+         */
+
+        int GetRefCount() const { return m_refCount; }
+
+        /**
+            Get the type of the message that was serialized.
+            @returns The message type.
+         */
+
+        int GetType() const { return m_type; }
+
+        /**
+            Get the maximum number of bits the message takes to write, across all bit offsets.
+            @returns The number of bits.
+         */
+
+        int GetMaxBits() const { return m_maxBits; }
+
+        /**
+            Copy the serialized message to a stream.
+            @param stream The stream to write to.
+         */
+
+        void Write( WriteStream & stream ) const;
+
+    private:
+
+        friend class BaseServer;
+
+        SerializedMessageData() {}
+
+        ~SerializedMessageData() {}
+
+        Allocator * m_allocator;                                ///< The allocator this data was allocated with.
+        volatile int m_refCount;                                ///< The reference count. The data is freed when this reaches zero.
+        int m_type;                                             ///< The type of the message that was serialized.
+        int m_numOffsets;                                       ///< 1 if the message does not align while serializing. 8 if it does, and it was serialized at each bit offset.
+        int m_maxBits;                                          ///< The maximum number of bits the message takes to write, across all bit offsets.
+        int m_numBits[8];                                       ///< The number of bits the message takes to write at each bit offset.
+        int m_bufferBytes;                                      ///< The size of the buffer for each bit offset (bytes). Each buffer starts with offset zero bits, followed by the message.
+        uint8_t * m_data;                                       ///< The buffers for each bit offset, stored immediately after this object in the same allocation.
+        SerializedMessageData * m_next;                         ///< The next broadcast the server holds a reference to. See BaseServer::BroadcastMessage.
+
+        SerializedMessageData( const SerializedMessageData & other );
+
+        SerializedMessageData & operator = ( const SerializedMessageData & other );
+    };
+
+    /**
+        A message that writes data serialized once for many clients.
+        The message factory creates these for each client a message is broadcast to. They have the type of the original message, so they are read back on the other side as that message.
+        These messages are send only.
+        @see SerializedMessageData
+        @see MessageFactory::CreateSerializedMessage
+     */
+
+    class SerializedMessage : public Message
+    {
+    public:
+
+        /**
+            Serialized message constructor.
+            Don't call this directly, use MessageFactory::CreateSerializedMessage instead.
+            @param data The serialized message data. A reference is added to it.
+         */
+
+        explicit SerializedMessage( SerializedMessageData & data ) : m_data( &data )
+        {
+            SetType( data.GetType() );
+            data.Acquire();
+        }
+
+        /**
+            Get the serialized message data.
+            @returns The serialized message data.
+         */
+
+        const SerializedMessageData & GetData() const { return *m_data; }
+
+        bool SerializeInternal( ReadStream & stream ) { (void) stream; yojimbo_assert( !"serialized messages are send only" ); return false; }
+
+        bool SerializeInternal( WriteStream & stream ) { m_data->Write( stream ); return true; }
+
+        bool SerializeInternal( MeasureStream & stream )
+        {
+            for ( int bits = m_data->GetMaxBits(); bits > 0; bits -= 32 )
+                stream.SerializeBits( 0, yojimbo_min( bits, 32 ) );
+            return true;
+        }
+
+    protected:
+
+        /**
+            Releases the reference to the serialized message data.
+         */
+
+        ~SerializedMessage()
+        {
+            m_data->Release();
+            m_data = NULL;
+        }
+
+    private:
+
+        SerializedMessageData * m_data;             ///< The serialized message data.
+    };
+
     /**
         Message factory error level.
      */
@@ -3799,14 +4538,15 @@ namespace yojimbo
             m_allocator = NULL;
 
             #if YOJIMBO_DEBUG_MESSAGE_LEAKS
-            if ( allocated_messages.size() )
+            if ( allocated_messages.GetSize() )
             {
                 printf( "you leaked messages!\n" );
-                printf( "%d messages leaked\n", (int) allocated_messages.size() );
-                typedef std::map<void*,int>::iterator itor_type;
-                for ( itor_type i = allocated_messages.begin(); i != allocated_messages.end(); ++i ) 
+                printf( "%d messages leaked\n", allocated_messages.GetSize() );
+                for ( int i = 0; i < allocated_messages.GetCapacity(); ++i ) 
                 {
-                    Message * message = (Message*) i->first;
+                    Message * message = (Message*) allocated_messages.GetKey( i );
+                    if ( !message )
+                        continue;
                     printf( "leaked message %p (type %d, refcount %d)\n", message, message->GetType(), message->GetRefCount() );
                 }
                 exit(1);
@@ -3835,8 +4575,33 @@ namespace yojimbo
                 return NULL;
             }
             #if YOJIMBO_DEBUG_MESSAGE_LEAKS
-            allocated_messages[message] = 1;
-            yojimbo_assert( allocated_messages.find( message ) != allocated_messages.end() );
+            allocated_messages.Insert( message, 1 );
+            #endif // #if YOJIMBO_DEBUG_MESSAGE_LEAKS
+            return message;
+        }
+
+        /**
+            Create a message that writes data serialized once for many clients.
+            IMPORTANT: Check the message pointer returned by this call. It can be NULL if there is no memory to create a message!
+            @param data The serialized message data. The message adds a reference to it, and releases it when the message is destroyed.
+            @returns The allocated message, or NULL if the message could not be allocated. If the message allocation fails, the message factory error level is set to MESSAGE_FACTORY_ERROR_FAILED_TO_ALLOCATE_MESSAGE.
+            @see BaseServer::BroadcastMessage
+         */
+
+        Message * CreateSerializedMessage( SerializedMessageData & data )
+        {
+            yojimbo_assert( data.GetType() >= 0 );
+            yojimbo_assert( data.GetType() < m_numTypes );
+            yojimbo_assert( m_allocator );
+            void * memory = YOJIMBO_ALLOCATE( *m_allocator, sizeof( SerializedMessage ) );
+            if ( !memory )
+            {
+                m_errorLevel = MESSAGE_FACTORY_ERROR_FAILED_TO_ALLOCATE_MESSAGE;
+                return NULL;
+            }
+            Message * message = new ( memory ) SerializedMessage( data );
+            #if YOJIMBO_DEBUG_MESSAGE_LEAKS
+            allocated_messages.Insert( message, 1 );
             #endif // #if YOJIMBO_DEBUG_MESSAGE_LEAKS
             return message;
         }
@@ -3873,8 +4638,9 @@ namespace yojimbo
             if ( message->GetRefCount() == 0 )
             {
                 #if YOJIMBO_DEBUG_MESSAGE_LEAKS
-                yojimbo_assert( allocated_messages.find( message ) != allocated_messages.end() );
-                allocated_messages.erase( message );
+                const bool found = allocated_messages.Remove( message );
+                yojimbo_assert( found );
+                (void) found;
                 #endif // #if YOJIMBO_DEBUG_MESSAGE_LEAKS
                 yojimbo_assert( m_allocator );
                 YOJIMBO_DELETE( *m_allocator, Message, message );
@@ -3942,7 +4708,7 @@ namespace yojimbo
     private:
 
         #if YOJIMBO_DEBUG_MESSAGE_LEAKS
-        std::map<void*,int> allocated_messages;                                 ///< The set of allocated messages for this factory. Used to track down message leaks.
+        PointerMap<int> allocated_messages;                                     ///< The set of allocated messages for this factory. Used to track down message leaks.
         #endif // #if YOJIMBO_DEBUG_MESSAGE_LEAKS
         
         Allocator * m_allocator;                                                ///< The allocator used to create messages.
@@ -4013,6 +4779,7 @@ namespace yojimbo
         uint32_t initialized : 1;
         uint32_t blockMessage : 1;
         uint32_t messageFailedToSerialize : 1;
+        uint32_t sendTime;
 
         struct MessageData
         {
@@ -4059,9 +4826,27 @@ namespace yojimbo
     {
         CHANNEL_COUNTER_MESSAGES_SENT,                          ///< Number of messages sent over this channel.
         CHANNEL_COUNTER_MESSAGES_RECEIVED,                      ///< Number of messages received over this channel.
+        CHANNEL_COUNTER_MESSAGES_RESENT,                        ///< Number of times a message was included in a packet again, because it wasn't acked in time. Reliable-ordered channel only.
+        CHANNEL_COUNTER_FRAGMENTS_SENT,                         ///< Number of block fragments sent, including resends. Reliable-ordered channel only.
+        CHANNEL_COUNTER_FRAGMENTS_RESENT,                       ///< Number of block fragments sent again, because they weren't acked in time. Reliable-ordered channel only.
         CHANNEL_COUNTER_NUM_COUNTERS                            ///< The number of channel counters.
     };
 
+    /**
+        Channel latencies are timing histograms of how long messages take to get through a channel. Reliable-ordered channel only, and only when ChannelConfig::trackLatency is set.
+        Latency histograms start at one millisecond, instead of one microsecond like the tick timing histograms, so they cover latencies up to about 12 minutes.
+        Block messages are treated as a single message: queued until their first fragment is sent, acked once all fragments are acked and delivered once all fragments are received.
+        @see Channel::GetLatencyStats
+     */
+
+    enum ChannelLatency
+    {
+        CHANNEL_LATENCY_QUEUED,                                 ///< Time from the message being sent by the user until it is first included in a packet.
+        CHANNEL_LATENCY_ACKED,                                  ///< Time from the message being sent by the user until it is acked. Includes queue time and resends.
+        CHANNEL_LATENCY_DELIVERED,                              ///< Time from the packet carrying the message being sent until the message is received. Measured on the receiver, relative to the sender's clock. Requires ChannelConfig::sendTimestamps.
+        CHANNEL_LATENCY_NUM_LATENCIES                           ///< The number of channel latencies.
+    };
+
     /**
         Channel error level.
         If the channel gets into an error state, it sets an error state on the corresponding connection. See yojimbo::CONNECTION_ERROR_CHANNEL.
@@ -4107,6 +4892,12 @@ namespace yojimbo
 
         /**
             Channel constructor.
+            IMPORTANT: The channel keeps a reference to the config rather than a copy, so the config must outlive the channel. Don't pass in a temporary. Connections point their channels at the shared connection config, which lives as long as they do.
+            @param allocator The allocator to use.
+            @param messageFactory Message factory for creating and destroying messages.
+            @param config The configuration for this channel. Must outlive the channel.
+            @param channelIndex The channel index in [0,numChannels-1].
+            @param time The current time.
          */
 
         Channel( Allocator & allocator, MessageFactory & messageFactory, const ChannelConfig & config, int channelIndex, double time );
@@ -4182,6 +4973,16 @@ namespace yojimbo
 
         virtual void ProcessAck( uint16_t sequence ) = 0;
 
+        /**
+            Get the next time this channel has data to include in a connection packet.
+            Depending on the channel type:
+                1. The earliest time an unacked message or block fragment is due to be resent, or now if there are received messages to ack (reliable-ordered channel),
+                2. Now if there are messages in the send queue (unreliable-unordered).
+            @returns The next send time (seconds). Channels with nothing to send return MaxWakeupInterval past the current channel time.
+         */
+
+        virtual double GetNextSendTime() const = 0;
+
     public:
 
         /**
@@ -4213,6 +5014,15 @@ namespace yojimbo
 
         void ResetCounters();
 
+        /**
+            Get latency stats for messages through this channel.
+            @param index The latency to get. See ChannelLatency.
+            @param stats The latency stats [out].
+            @returns True if the channel tracks latency and the stats were filled in, false otherwise. See ChannelConfig::trackLatency.
+         */
+
+        virtual bool GetLatencyStats( int index, TimingStats & stats ) const;
+
     protected:
 
         /**
@@ -4224,7 +5034,7 @@ namespace yojimbo
 
     protected:
 
-        const ChannelConfig m_config;                                                   ///< Channel configuration data.
+        const ChannelConfig & m_config;                                                 ///< Channel configuration data. Not copied: this references the config passed in to the constructor, which must outlive the channel.
         Allocator * m_allocator;                                                        ///< Allocator for allocations matching life cycle of this channel.
         int m_channelIndex;                                                             ///< The channel index in [0,numChannels-1].
         double m_time;                                                                  ///< The current time.
@@ -4249,8 +5059,9 @@ namespace yojimbo
             Reliable ordered channel constructor.
             @param allocator The allocator to use.
             @param messageFactory Message factory for creating and destroying messages.
-            @param config The configuration for this channel.
+            @param config The configuration for this channel. Referenced, not copied, so it must outlive the channel. See Channel::Channel.
             @param channelIndex The channel index in [0,numChannels-1].
+            @param time The current time.
          */
 
         ReliableOrderedChannel( Allocator & allocator, MessageFactory & messageFactory, const ChannelConfig & config, int channelIndex, double time );
@@ -4278,6 +5089,10 @@ namespace yojimbo
 
         void ProcessAck( uint16_t ack );
 
+        double GetNextSendTime() const;
+
+        bool GetLatencyStats( int index, TimingStats & stats ) const;
+
         /**
             Are there any unacked messages in the send queue?
             Messages are acked individually and remain in the send queue until acked.
@@ -4326,9 +5141,10 @@ namespace yojimbo
             Any messages that have not already been received are added to the message receive queue. Messages that are added to the receive queue have a reference added. See Message::AddRef.
             @param numMessages The number of messages to process.
             @param messages Array of pointers to messages.
+            @returns The number of messages added to the receive queue.
          */
 
-        void ProcessPacketMessages( int numMessages, Message ** messages );
+        int ProcessPacketMessages( int numMessages, Message ** messages );
 
         /**
             Track the oldest unacked message id in the send queue.
@@ -4340,6 +5156,21 @@ namespace yojimbo
 
         void UpdateOldestUnackedMessageId();
 
+        /**
+            Get the timestamp written to packets when ChannelConfig::sendTimestamps is enabled.
+            @returns The current time in milliseconds, wrapped to 32 bits.
+         */
+
+        uint32_t GetSendTimestamp() const;
+
+        /**
+            Add a sample to a latency histogram, if the channel tracks latency.
+            @param index The latency. See ChannelLatency.
+            @param seconds The latency sample (seconds).
+         */
+
+        void AddLatencySample( int index, double seconds );
+
         /**
             True if we are currently sending a block message.
             Block messages are treated differently to regular messages. 
@@ -4417,6 +5248,20 @@ namespace yojimbo
                                     int fragmentBytes, 
                                     BlockMessage * blockMessage );
 
+        /**
+            Destroy the block send data, if any.
+            The block send data is created again on demand the next time a block is sent.
+         */
+
+        void ReleaseSendBlock();
+
+        /**
+            Destroy the block receive data, if any.
+            Releases the partially received block message and block data, if any. The block receive data is created again on demand the next time a block fragment is received.
+         */
+
+        void ReleaseReceiveBlock();
+
     protected:
 
         /**
@@ -4427,6 +5272,7 @@ namespace yojimbo
         struct MessageSendQueueEntry
         {
             Message * message;                                                          ///< Pointer to the message. When inserted in the send queue the message has one reference. It is released when the message is acked and removed from the send queue.
+            double timeQueued;                                                          ///< The time the message was added to the send queue. Used to measure queue and ack latency.
             double timeLastSent;                                                        ///< The time the message was last sent. Used to implement ChannelConfig::messageResendTime.
             uint32_t measuredBits : 31;                                                 ///< The number of bits the message takes up in a bit stream.
             uint32_t block : 1;                                                         ///< 1 if this is a block message. Block messages are treated differently to regular messages when sent over a reliable-ordered channel.
@@ -4458,31 +5304,51 @@ namespace yojimbo
 
         /**
             Internal state for a block being sent across the reliable ordered channel.
-            Stores the block data and tracks which fragments have been acked. The block send completes when all fragments have been acked.
+            Tracks which fragments have been acked. The block send completes when all fragments have been acked. Fragment data is read directly from the block attached to the message, so the block is not copied.
+            Created on the first block send and destroyed after the channel has been idle for ChannelConfig::blockReleaseTime. Fragment tracking is sized to the blocks actually sent, not the maximum block size.
             IMPORTANT: Although there can be multiple block messages in the message send and receive queues, only one data block can be in flights over the wire at a time.
          */
 
         struct SendBlockData
         {
-            SendBlockData( Allocator & allocator, int maxBlockSize, int maxFragmentsPerBlock )
+            SendBlockData( Allocator & allocator )
             {
                 m_allocator = &allocator;
-                ackedFragment = YOJIMBO_NEW( allocator, BitArray, allocator, maxFragmentsPerBlock );
-                fragmentSendTime = (double*) YOJIMBO_ALLOCATE( allocator, sizeof( double) * maxFragmentsPerBlock );
-                blockData = (uint8_t*) YOJIMBO_ALLOCATE( allocator, maxBlockSize );
-                yojimbo_assert( ackedFragment );
-                yojimbo_assert( fragmentSendTime );
-                yojimbo_assert( blockData );
+                maxFragments = 0;
+                ackedFragment = NULL;
+                fragmentSendTime = NULL;
+                timeLastActive = 0.0;
                 Reset();
             }
 
             ~SendBlockData()
             {
                 YOJIMBO_DELETE( *m_allocator, BitArray, ackedFragment );
-                YOJIMBO_FREE( *m_allocator, blockData );
                 YOJIMBO_FREE( *m_allocator, fragmentSendTime );
             }
 
+            /**
+                Make sure there is room to track the fragments of a block.
+                Grows the fragment tracking data if necessary. Existing data is discarded.
+                @param numFragments The number of fragments in the block about to be sent.
+                @returns True if successful, false if the allocation failed.
+             */
+
+            bool Reserve( int numFragments )
+            {
+                if ( numFragments <= maxFragments )
+                    return true;
+                YOJIMBO_DELETE( *m_allocator, BitArray, ackedFragment );
+                YOJIMBO_FREE( *m_allocator, fragmentSendTime );
+                maxFragments = 0;
+                ackedFragment = YOJIMBO_NEW( *m_allocator, BitArray, *m_allocator, numFragments );
+                fragmentSendTime = (double*) YOJIMBO_ALLOCATE( *m_allocator, sizeof( double ) * numFragments );
+                if ( !ackedFragment || !fragmentSendTime )
+                    return false;
+                maxFragments = numFragments;
+                return true;
+            }
+
             void Reset()
             {
                 active = false;
@@ -4496,14 +5362,15 @@ namespace yojimbo
             int blockSize;                                                              ///< The size of the block (bytes).
             int numFragments;                                                           ///< Number of fragments in the block being sent.
             int numAckedFragments;                                                      ///< Number of acked fragments in the block being sent.
+            int maxFragments;                                                           ///< Number of fragments the tracking data below has room for.
             uint16_t blockMessageId;                                                    ///< The message id the block is attached to.
             BitArray * ackedFragment;                                                   ///< Has fragment n been received?
             double * fragmentSendTime;                                                  ///< Last time fragment was sent.
-            uint8_t * blockData;                                                        ///< The block data.
+            double timeLastActive;                                                      ///< Last time a fragment was sent or acked. Used to release this data once the channel stops sending blocks.
 
         private:
 
-            Allocator * m_allocator;                                                    ///< Allocator used to create the block data.
+            Allocator * m_allocator;                                                    ///< Allocator used to create the fragment tracking data.
         
             SendBlockData( const SendBlockData & other );
             
@@ -4513,25 +5380,72 @@ namespace yojimbo
         /**
             Internal state for a block being received across the reliable ordered channel.
             Stores the fragments received over the network for the block, and completes once all fragments have been received.
+            Created on the first block fragment received and destroyed after the channel has been idle for ChannelConfig::blockReleaseTime. 
+            Block data is allocated with the message factory allocator when the first fragment of a block arrives, sized to the number of fragments in the block. When the block completes, this buffer is attached to the block message directly.
             IMPORTANT: Although there can be multiple block messages in the message send and receive queues, only one data block can be in flights over the wire at a time.
          */
 
         struct ReceiveBlockData
         {
-            ReceiveBlockData( Allocator & allocator, int maxBlockSize, int maxFragmentsPerBlock )
+            ReceiveBlockData( Allocator & allocator )
             {
                 m_allocator = &allocator;
-                receivedFragment = YOJIMBO_NEW( allocator, BitArray, allocator, maxFragmentsPerBlock );
-                blockData = (uint8_t*) YOJIMBO_ALLOCATE( allocator, maxBlockSize );
-                yojimbo_assert( receivedFragment && blockData );
+                maxFragments = 0;
+                receivedFragment = NULL;
+                blockData = NULL;
+                blockDataAllocator = NULL;
                 blockMessage = NULL;
+                timeLastActive = 0.0;
                 Reset();
             }
 
             ~ReceiveBlockData()
             {
                 YOJIMBO_DELETE( *m_allocator, BitArray, receivedFragment );
-                YOJIMBO_FREE( *m_allocator, blockData );
+                FreeBlockData();
+            }
+
+            /**
+                Make sure there is room to receive a block.
+                Grows the fragment tracking data if necessary and allocates the block data.
+                @param numFragments The number of fragments in the block about to be received.
+                @param fragmentSize The size of each fragment (bytes). The last fragment may be smaller.
+                @param blockAllocator The allocator for the block data. This should be the message factory allocator, since the block data is handed over to the block message once received.
+                @returns True if successful, false if an allocation failed.
+             */
+
+            bool Reserve( int numFragments, int fragmentSize, Allocator & blockAllocator )
+            {
+                FreeBlockData();
+                if ( numFragments > maxFragments )
+                {
+                    YOJIMBO_DELETE( *m_allocator, BitArray, receivedFragment );
+                    maxFragments = 0;
+                    receivedFragment = YOJIMBO_NEW( *m_allocator, BitArray, *m_allocator, numFragments );
+                    if ( !receivedFragment )
+                        return false;
+                    maxFragments = numFragments;
+                }
+                blockData = (uint8_t*) YOJIMBO_ALLOCATE( blockAllocator, numFragments * fragmentSize );
+                if ( !blockData )
+                    return false;
+                blockDataAllocator = &blockAllocator;
+                return true;
+            }
+
+            /**
+                Free the block data, if any.
+                Called when the block data was not handed over to a block message, eg. on reset.
+             */
+
+            void FreeBlockData()
+            {
+                if ( blockData )
+                {
+                    yojimbo_assert( blockDataAllocator );
+                    YOJIMBO_FREE( *blockDataAllocator, blockData );
+                }
+                blockDataAllocator = NULL;
             }
 
             void Reset()
@@ -4547,16 +5461,19 @@ namespace yojimbo
             bool active;                                                                ///< True if we are currently receiving a block.
             int numFragments;                                                           ///< The number of fragments in this block
             int numReceivedFragments;                                                   ///< The number of fragments received.
+            int maxFragments;                                                           ///< Number of fragments the received fragment bit array has room for.
             uint16_t messageId;                                                         ///< The message id corresponding to the block.
             int messageType;                                                            ///< Message type of the block being received.
             uint32_t blockSize;                                                         ///< Block size in bytes.
             BitArray * receivedFragment;                                                ///< Has fragment n been received?
-            uint8_t * blockData;                                                        ///< Block data for receive.
+            uint8_t * blockData;                                                        ///< Block data for receive. NULL if no block is being received.
+            Allocator * blockDataAllocator;                                             ///< The allocator the block data was allocated with.
             BlockMessage * blockMessage;                                                ///< Block message (sent with fragment 0).
+            double timeLastActive;                                                      ///< Last time a fragment was received. Used to release this data once the channel stops receiving blocks.
 
         private:
 
-            Allocator * m_allocator;                                                    ///< Allocator used to free the data on shutdown.
+            Allocator * m_allocator;                                                    ///< Allocator used to create the fragment tracking data.
 
             ReceiveBlockData( const ReceiveBlockData & other );
             
@@ -4572,8 +5489,10 @@ namespace yojimbo
         SequenceBuffer<MessageSendQueueEntry> * m_messageSendQueue;                     ///< Message send queue.
         SequenceBuffer<MessageReceiveQueueEntry> * m_messageReceiveQueue;               ///< Message receive queue.
         uint16_t * m_sentPacketMessageIds;                                              ///< Array of n message ids per sent connection packet. Allows the maximum number of messages per-packet to be allocated dynamically.
-        SendBlockData * m_sendBlock;                                                    ///< Data about the block being currently sent.
-        ReceiveBlockData * m_receiveBlock;                                              ///< Data about the block being currently received.
+        SendBlockData * m_sendBlock;                                                    ///< Data about the block being currently sent. NULL until the first block is sent, and again after the channel has not sent blocks for a while.
+        ReceiveBlockData * m_receiveBlock;                                              ///< Data about the block being currently received. NULL until the first block fragment is received, and again after the channel has not received blocks for a while.
+        TimingHistogram * m_latency;                                                    ///< Latency histograms, indexed by ChannelLatency. NULL unless ChannelConfig::trackLatency is set.
+        bool m_ackPending;                                                              ///< True if message or fragment data was received since the last packet was generated. The next packet acks it, so the channel wants to send now. See GetNextSendTime.
 
     private:
 
@@ -4592,11 +5511,12 @@ namespace yojimbo
     public:
 
         /** 
-            Reliable ordered channel constructor.
+            Unreliable unordered channel constructor.
             @param allocator The allocator to use.
             @param messageFactory Message factory for creating and destroying messages.
-            @param config The configuration for this channel.
+            @param config The configuration for this channel. Referenced, not copied, so it must outlive the channel. See Channel::Channel.
             @param channelIndex The channel index in [0,numChannels-1].
+            @param time The current time.
          */
 
         UnreliableUnorderedChannel( Allocator & allocator, MessageFactory & messageFactory, const ChannelConfig & config, int channelIndex, double time );
@@ -4624,6 +5544,8 @@ namespace yojimbo
 
         void ProcessAck( uint16_t ack );
 
+        double GetNextSendTime() const;
+
     protected:
 
         Queue<Message*> * m_messageSendQueue;                   ///< Message send queue.
@@ -4647,6 +5569,97 @@ namespace yojimbo
         CONNECTION_ERROR_READ_PACKET_FAILED,                    ///< Failed to read packet. Received an invalid packet?     
     };
 
+    /**
+        Immutable, reference counted connection configuration.
+        ConnectionConfig reserves space for MaxChannels channel configs. This class stores only the numChannels channel configs actually used, contiguously, in a single allocation.
+        The server creates one of these in Start and shares it across all client connections, instead of each connection storing its own copy. 
+        Channels keep a reference to their ChannelConfig inside this object, so it must outlive them. Connection takes care of this by holding a reference.
+     */
+
+    class SharedConnectionConfig
+    {
+    public:
+
+        /**
+            Create a shared connection config.
+            @param allocator The allocator used to allocate the config. The config is freed with this allocator when the last reference is released.
+            @param config The connection config to copy. Only the first numChannels channel configs are copied.
+            @returns The shared connection config with one reference, or NULL if the allocation failed.
+         */
+
+        static SharedConnectionConfig * Create( Allocator & allocator, const ConnectionConfig & config );
+
+        /**
+            Add a reference to the shared connection config.
+         */
+
+        void Acquire() { yojimbo_assert( m_refCount > 0 ); m_refCount++; }
+
+        /**
+            Remove a reference from the shared connection config.
+            When the reference count reaches zero the config is destroyed and freed with the allocator passed in to Create.
+         */
+
+        void Release();
+
+        /**
+            Get the reference count.
+            @returns The reference count.
+         */
+
+        int GetRefCount() const { return m_refCount; }
+
+        /**
+            Get the number of channels.
+            @returns The number of channels in [1,MaxChannels].
+         */
+
+        int GetNumChannels() const { return m_numChannels; }
+
+        /**
+            Get the maximum packet size.
+            @returns The maximum size of packets generated for this connection (bytes).
+         */
+
+        int GetMaxPacketSize() const { return m_maxPacketSize; }
+
+        /**
+            Get the array of channel configs.
+            @returns Pointer to the first of GetNumChannels() channel configs.
+         */
+
+        const ChannelConfig * GetChannelConfigs() const { return m_channel; }
+
+        /**
+            Get the config for a channel.
+            @param channelIndex The channel index in [0,numChannels-1].
+            @returns The channel config.
+         */
+
+        const ChannelConfig & GetChannelConfig( int channelIndex ) const 
+        { 
+            yojimbo_assert( channelIndex >= 0 ); 
+            yojimbo_assert( channelIndex < m_numChannels ); 
+            return m_channel[channelIndex]; 
+        }
+
+    private:
+
+        SharedConnectionConfig() {}
+
+        ~SharedConnectionConfig() {}
+
+        Allocator * m_allocator;                                ///< The allocator this config was allocated with.
+        int m_refCount;                                         ///< The reference count. The config is freed when this reaches zero.
+        int m_numChannels;                                      ///< The number of channels.
+        int m_maxPacketSize;                                    ///< The maximum size of packets generated for this connection (bytes).
+        ChannelConfig * m_channel;                              ///< Channel configs, stored immediately after this object in the same allocation.
+
+        SharedConnectionConfig( const SharedConnectionConfig & other );
+
+        SharedConnectionConfig & operator = ( const SharedConnectionConfig & other );
+    };
+
     /**
         Sends and receives messages across a set of user defined channels.
      */
@@ -4657,6 +5670,8 @@ namespace yojimbo
 
         Connection( Allocator & allocator, MessageFactory & messageFactory, const ConnectionConfig & connectionConfig, double time );
 
+        Connection( Allocator & allocator, MessageFactory & messageFactory, SharedConnectionConfig & connectionConfig, double time );
+
         ~Connection();
 
         void Reset();
@@ -4669,7 +5684,7 @@ namespace yojimbo
 
         void ReleaseMessage( Message * message );
 
-        bool GeneratePacket( void * context, uint16_t packetSequence, uint8_t * packetData, int maxPacketBytes, int & packetBytes );
+        bool GeneratePacket( void * context, uint16_t packetSequence, uint8_t * packetData, int maxPacketBytes, int & packetBytes, TimingHistogram * channelTimings = NULL );
 
         bool ProcessPacket( void * context, uint16_t packetSequence, const uint8_t * packetData, int packetBytes );
 
@@ -4677,40 +5692,165 @@ namespace yojimbo
 
         void AdvanceTime( double time );
 
+        /**
+            Get the next time any channel on this connection has data to send.
+            @param time The current time (seconds).
+            @returns The earliest next send time across all channels, no later than MaxWakeupInterval past the current time. See Channel::GetNextSendTime.
+         */
+
+        double GetNextSendTime( double time ) const;
+
+        /**
+            Get a counter value for a channel.
+            @param channelIndex The channel index in [0,numChannels-1].
+            @param index The counter index. See ChannelCounters.
+            @returns The value of the counter.
+         */
+
+        uint64_t GetChannelCounter( int channelIndex, int index ) const;
+
+        /**
+            Get latency stats for a channel.
+            @param channelIndex The channel index in [0,numChannels-1].
+            @param index The latency index. See ChannelLatency.
+            @param stats The latency stats [out].
+            @returns True if the channel tracks latency and the stats were filled in, false otherwise. See ChannelConfig::trackLatency.
+         */
+
+        bool GetChannelLatencyStats( int channelIndex, int index, TimingStats & stats ) const;
+
         ConnectionErrorLevel GetErrorLevel() { return m_errorLevel; }
 
     private:
 
         Allocator * m_allocator;                                ///< Allocator passed in to the connection constructor.
         MessageFactory * m_messageFactory;                      ///< Message factory for creating and destroying messages.
-        ConnectionConfig m_connectionConfig;                    ///< Connection configuration.
-        Channel * m_channel[MaxChannels];                       ///< Array of connection channels. Array size corresponds to m_connectionConfig.numChannels
+        SharedConnectionConfig * m_connectionConfig;            ///< Connection configuration. Shared with other connections, eg. all client connections on the server. The connection holds a reference to it.
+        int m_numChannels;                                      ///< The number of channels. Copied from the connection configuration.
+        Channel ** m_channel;                                   ///< Array of connection channels. Array size corresponds to m_numChannels.
         ConnectionErrorLevel m_errorLevel;                      ///< The connection error level.
+
+        void Initialize( Allocator & allocator, MessageFactory & messageFactory, SharedConnectionConfig & connectionConfig, double time );
+
+        Connection( const Connection & other );
+
+        Connection & operator = ( const Connection & other );
     };
 
+    class SlabPool;
+
+    const uint32_t NetworkTraceMagic = 0x5254594A;                  ///< Identifies network trace files. Reads as "JYTR" in little endian byte order.
+    const uint32_t NetworkTraceVersion = 1;                         ///< The network trace file format version.
+    const uint32_t NetworkTraceDropped = 1;                         ///< Network trace entry flag: the packet was dropped.
+
     /**
-        Simulates packet loss, latency, jitter and duplicate packets.
-        This is useful during development, so your game is tested and played under real world conditions, instead of ideal LAN conditions.
-        This simulator works on packet send. This means that if you want 125ms of latency (round trip), you must to add 125/2 = 62.5ms of latency to each side.
+        The header at the start of a network trace file.
+        Trace files are a header followed by numEntries NetworkTraceEntry records. All values are in network byte order (little endian).
+        @see NetworkSimulator::LoadTrace
      */
 
-    class NetworkSimulator
+    struct NetworkTraceHeader
     {
-    public:
+        uint32_t magic;                                             ///< Must be NetworkTraceMagic.
+        uint32_t version;                                           ///< Must be NetworkTraceVersion.
+        uint32_t numEntries;                                        ///< The number of entries following the header.
+        uint32_t reserved;                                          ///< Set to zero.
+    };
 
-        /**
-            Create a network simulator.
-            Initial network conditions are set to:
-                Latency: 0ms
-                Jitter: 0ms
+    /// The delay and drop decision for one packet in a network trace.
+
+    struct NetworkTraceEntry
+    {
+        uint32_t delay;                                             ///< The one-way delay of the packet (microseconds).
+        uint32_t flags;                                             ///< Packet flags. See NetworkTraceDropped.
+    };
+
+    /**
+        Network conditions applied by the network simulator.
+        Defaults to a perfect network. Used to give clients their own network conditions on the server. See NetworkSimulator::SetClientConditions.
+     */
+
+    struct NetworkConditions
+    {
+        float latency;                                              ///< Latency in milliseconds. See NetworkSimulator::SetLatency.
+        float jitter;                                               ///< Jitter in milliseconds +/-. See NetworkSimulator::SetJitter.
+        float packetLoss;                                           ///< Packet loss percentage. See NetworkSimulator::SetPacketLoss.
+        float duplicates;                                           ///< Duplicate packet percentage. See NetworkSimulator::SetDuplicates.
+        float burstGoodToBad;                                       ///< Percentage chance per-packet of moving to the bad burst loss state. See NetworkSimulator::SetBurstLoss.
+        float burstBadToGood;                                       ///< Percentage chance per-packet of moving back to the good burst loss state.
+        float burstBadLoss;                                         ///< Packet loss percentage in the bad burst loss state.
+        float burstGoodLoss;                                        ///< Packet loss percentage in the good burst loss state.
+        float reordering;                                           ///< Percentage chance of reordering a packet. See NetworkSimulator::SetReordering.
+        float reorderDelay;                                         ///< Extra delay for reordered packets in milliseconds.
+        float outagePeriod;                                         ///< Time between the start of each outage (seconds). 0 = no outages. See NetworkSimulator::SetOutage.
+        float outageDuration;                                       ///< Length of each outage (seconds).
+        float bandwidth;                                            ///< Link bandwidth in kilobits per-second. 0 = unlimited. See NetworkSimulator::SetBandwidth.
+        int burstBytes;                                             ///< Size of the link token bucket (bytes).
+        int queueBytes;                                             ///< Maximum bytes queued waiting for the link. 0 = unlimited. See NetworkSimulator::SetQueueLimit.
+        int earlyDropBytes;                                         ///< Queued bytes above which packets are dropped at random. 0 = tail drop only.
+
+        NetworkConditions()
+        {
+            latency = 0.0f;
+            jitter = 0.0f;
+            packetLoss = 0.0f;
+            duplicates = 0.0f;
+            burstGoodToBad = 0.0f;
+            burstBadToGood = 0.0f;
+            burstBadLoss = 0.0f;
+            burstGoodLoss = 0.0f;
+            reordering = 0.0f;
+            reorderDelay = 0.0f;
+            outagePeriod = 0.0f;
+            outageDuration = 0.0f;
+            bandwidth = 0.0f;
+            burstBytes = 0;
+            queueBytes = 0;
+            earlyDropBytes = 0;
+        }
+
+        /**
+            Are any of the network conditions non-zero?
+            @returns True if these conditions would change packets sent through the simulator.
+         */
+
+        bool IsActive() const
+        {
+            return latency != 0.0f || jitter != 0.0f || packetLoss != 0.0f || duplicates != 0.0f || burstGoodToBad != 0.0f || 
+                   reordering != 0.0f || outagePeriod != 0.0f || bandwidth != 0.0f;
+        }
+    };
+
+    /**
+        Simulates packet loss, latency, jitter, duplicate packets, reordering, outages and bandwidth limited links.
+        This is useful during development, so your game is tested and played under real world conditions, instead of ideal LAN conditions.
+        This simulator works on packet send. This means that if you want 125ms of latency (round trip), you must to add 125/2 = 62.5ms of latency to each side.
+        Buffered packets are kept in a min-heap ordered by delivery time, so receiving packets only costs as much as the packets that are due.
+        Packet data is copied into fixed size buffers from a pool owned by the simulator, so simulating packets doesn't allocate once the pool has warmed up.
+        The setters below apply to every packet sent. A simulator created with client links can also give each client its own network conditions, so a single server can simulate a mix of good and bad connections.
+     */
+
+    class NetworkSimulator
+    {
+    public:
+
+        /**
+            Create a network simulator.
+            Initial network conditions are set to:
+                Latency: 0ms
+                Jitter: 0ms
                 Packet Loss: 0%
                 Duplicates: 0%
             @param allocator The allocator to use.
-            @param numPackets The maximum number of packets that can be stored in the simulator at any time.
+            @param numPackets The maximum number of packets that can be stored in the simulator at any time. Packets sent while the simulator is full are dropped.
             @param time The initial time value in seconds.
+            @param maxPacketBytes The maximum size of packets sent through the simulator (bytes). This is the size of each pooled packet buffer. Clients and servers pass in ClientServerConfig::GetMaxTransmitPacketSize.
+            @param numClients The number of client links. Packets sent to client indices [0,numClients-1] go through their own link, with its own bandwidth queue, burst loss state and optional network conditions. The server passes in its maximum number of clients. Leave as zero for simulators that send to a single destination.
+            @param seed The seed for the simulator's random generator. Simulators created with the same seed and stream, sent the same packets at the same times, make exactly the same decisions. See NetworkSimulator::SetSeed.
+            @param stream The random generator stream. Give simulators in the same process different streams so they make different decisions from the same seed. Clients use their client id.
          */
 
-        NetworkSimulator( Allocator & allocator, int numPackets, double time );
+        NetworkSimulator( Allocator & allocator, int numPackets, double time, int maxPacketBytes = 8 * 1024 + ConservativeTransmitHeaderBytes, int numClients = 0, uint64_t seed = 0, uint64_t stream = 0 );
 
         /**
             Network simulator destructor.
@@ -4750,9 +5890,140 @@ namespace yojimbo
 
         void SetDuplicates( float percent );
 
+        /**
+            Set bursty packet loss, using the Gilbert-Elliott model.
+            The link moves between a good state and a bad state, checked once per-packet sent. Packets are lost at a different rate in each state, so losses come in bursts, like they do on Wi-Fi and cellular links. This is applied on top of SetPacketLoss.
+            On average, bursts last 100 / badToGoodPercent packets.
+            @param goodToBadPercent The percentage chance of moving from the good state to the bad state, per-packet. 0% = burst loss is disabled.
+            @param badToGoodPercent The percentage chance of moving from the bad state back to the good state, per-packet.
+            @param badLossPercent The packet loss percentage in the bad state.
+            @param goodLossPercent The packet loss percentage in the good state.
+         */
+
+        void SetBurstLoss( float goodToBadPercent, float badToGoodPercent, float badLossPercent = 100.0f, float goodLossPercent = 0.0f );
+
+        /**
+            Set the chance of packets being reordered.
+            Reordered packets are held back by an extra delay, so packets sent after them within that time arrive first.
+            @param percent The percentage chance of a packet being reordered. 0% = no reordering.
+            @param milliseconds How far back reordered packets are held (milliseconds). Packets sent up to this long after a reordered packet overtake it.
+         */
+
+        void SetReordering( float percent, float milliseconds );
+
+        /**
+            Set periodic outages, where the link drops every packet.
+            Outages start when this is called, then repeat every period.
+            @param periodSeconds The time from the start of one outage to the start of the next (seconds). 0 = no outages.
+            @param durationSeconds How long each outage lasts (seconds).
+         */
+
+        void SetOutage( float periodSeconds, float durationSeconds );
+
+        /**
+            Reseed the random generator used for packet loss, jitter, duplicates, reordering and early drops.
+            Log the seed of a failing soak or test run, then reseed with it to replay the run bit-for-bit.
+            @param seed The new seed value.
+            @param stream The random generator stream. See RandomGenerator::Seed.
+         */
+
+        void SetSeed( uint64_t seed, uint64_t stream = 0 );
+
+        /**
+            Get the random generator used by the network simulator.
+            @returns The network simulator's random generator.
+         */
+
+        RandomGenerator & GetRandomGenerator() { return m_random; }
+
+        /**
+            Replay packet delays and drops recorded from a real network.
+            Each packet sent takes the delay and drop decision of the next entry in the trace. While the trace is playing it replaces latency, jitter, packet loss, burst loss and outages. Reordering, duplicates and bandwidth limits still apply on top.
+            Each client link plays the trace from its own position, so every client sees the whole recording no matter how many clients share the simulator. Clients with their own network conditions (see SetClientConditions) don't use the trace.
+            The trace file is memory mapped, so long traces don't have to fit in memory. See NetworkTraceHeader for the file format.
+            @param filename The trace file to load.
+            @param loop If true, the trace starts over from the beginning when it runs out. Otherwise packets go back to the regular network conditions once the trace is finished.
+            @returns True if the trace was loaded, false if the file could not be mapped or is not a valid trace.
+         */
+
+        bool LoadTrace( const char * filename, bool loop );
+
+        /**
+            Stop replaying the network trace and unmap the trace file.
+         */
+
+        void ClearTrace();
+
+        /**
+            Is a network trace being replayed for packets sent to a slot index?
+            @param to The slot index. Use 0 for simulators without client links.
+            @returns True if a trace is loaded and there are entries left to play for this slot, and the client does not have its own network conditions. Always true for looping traces.
+         */
+
+        bool IsTracePlaying( int to = 0 ) const;
+
+        /**
+            Give a client its own network conditions.
+            Packets sent to this client use these conditions instead of the ones set with SetLatency, SetPacketLoss and so on.
+            @param clientIndex The client index, in [0,numClients-1]. See the numClients parameter passed in to the constructor.
+            @param conditions The network conditions for packets sent to this client.
+         */
+
+        void SetClientConditions( int clientIndex, const NetworkConditions & conditions );
+
+        /**
+            Go back to using the regular network conditions for a client.
+            @param clientIndex The client index, in [0,numClients-1].
+         */
+
+        void ClearClientConditions( int clientIndex );
+
+        /**
+            Get the network conditions that apply to packets sent to a slot index.
+            @param to The slot index. Use 0 for simulators without client links.
+            @returns The client network conditions, if set with SetClientConditions, otherwise the regular network conditions.
+         */
+
+        const NetworkConditions & GetConditions( int to = 0 ) const;
+
+        /**
+            Limit the bandwidth of the simulated link.
+            Packets are sent through a token bucket. Once the bucket is empty, packets queue up behind each other and each packet is delayed by the time it takes to send the packets ahead of it, on top of latency and jitter.
+            Each simulator models one direction, so set bandwidth on both sides of the connection to limit both directions. Each client link has its own token bucket and queue.
+            @param kilobitsPerSecond The link bandwidth in kilobits per-second. 0 = unlimited.
+            @param burstBytes The size of the token bucket (bytes). Up to this many bytes can be sent at once after the link has been idle. 0 = no bursts.
+         */
+
+        void SetBandwidth( float kilobitsPerSecond, int burstBytes = 0 );
+
+        /**
+            Set the size of the queue in front of the bandwidth limited link.
+            Packets that would overflow the queue are dropped (tail drop). With early drop enabled, packets are also dropped at random once the queue is longer than the early drop threshold, with a drop chance that rises linearly to 100% at the queue limit (RED).
+            Only applies when bandwidth is limited. See NetworkSimulator::SetBandwidth.
+            @param queueBytes The maximum number of bytes queued waiting for the link. 0 = unlimited.
+            @param earlyDropBytes Start dropping packets at random once this many bytes are queued. 0 = tail drop only. Must be less than queueBytes.
+         */
+
+        void SetQueueLimit( int queueBytes, int earlyDropBytes = 0 );
+
+        /**
+            Get the number of bytes currently queued waiting for the bandwidth limited link.
+            @param to The slot index of the link. Use 0 for simulators without client links.
+            @returns The number of queued bytes. Always zero if bandwidth is not limited.
+         */
+
+        int GetQueuedBytes( int to = 0 ) const;
+
+        /**
+            Get the number of packets dropped by the link queue.
+            @returns The number of packets dropped because the link queue was full, or by random early drop.
+         */
+
+        uint64_t GetNumQueueDrops() const { return m_numQueueDrops; }
+
         /**
             Is the network simulator active?
-            The network simulator is active when packet loss, latency, duplicates or jitter are non-zero values.
+            The network simulator is active when packet loss, latency, duplicates, jitter, burst loss, reordering, outages or bandwidth limits are non-zero values, for all packets or for any client, or a network trace is loaded.
             This is used by the transport to know whether it should shunt packets through the simulator, or send them directly to the network. This is a minor optimization.
          */
 
@@ -4761,16 +6032,18 @@ namespace yojimbo
         /**
             Queue a packet to send.
             IMPORTANT: Ownership of the packet data pointer is *not* transferred to the network simulator. It makes a copy of the data instead.
+            If the simulator already holds the maximum number of packets, the packet is dropped. See NetworkSimulator::GetNumOverflowPackets.
             @param to The slot index the packet should be sent to.
             @param packetData The packet data.
-            @param packetBytes The packet size (bytes).
+            @param packetBytes The packet size (bytes). Packets larger than the maxPacketBytes passed in to the constructor are dropped. See NetworkSimulator::GetNumOversizedPackets.
          */
         
         void SendPacket( int to, uint8_t * packetData, int packetBytes );
 
         /**
             Receive packets sent to any address.
-            IMPORTANT: You take ownership of the packet data you receive and are responsible for freeing it. See NetworkSimulator::GetAllocator.
+            Packets are received in order of delivery time.
+            IMPORTANT: The packet data you receive is borrowed from the simulator packet pool. Return it with NetworkSimulator::ReleasePackets once you are done with it.
             @param maxPackets The maximum number of packets to receive.
             @param packetData Array of packet data pointers to be filled [out].
             @param packetBytes Array of packet sizes to be filled [out].
@@ -4780,6 +6053,14 @@ namespace yojimbo
 
         int ReceivePackets( int maxPackets, uint8_t * packetData[], int packetBytes[], int to[] );
 
+        /**
+            Return received packet data to the simulator packet pool.
+            @param packetData Array of packet data pointers from NetworkSimulator::ReceivePackets.
+            @param numPackets The number of packets to release.
+         */
+
+        void ReleasePackets( uint8_t * packetData[], int numPackets );
+
         /**
             Discard all packets in the network simulator.
             This is useful if the simulator needs to be reset and used for another purpose.
@@ -4803,8 +6084,31 @@ namespace yojimbo
         void AdvanceTime( double time );
 
         /**
-            Get the allocator to use to free packet data.
-            @returns The allocator that packet data is allocated with.
+            Get the time the next packet held by the network simulator is due to be delivered.
+            @returns The earliest delivery time of any queued packet (seconds), or MaxWakeupInterval past the current simulator time if no packets are queued.
+         */
+
+        double GetNextDeliveryTime() const;
+
+        /**
+            Get the number of packets dropped because the simulator was full.
+            If this is non-zero, increase ClientServerConfig::maxSimulatorPackets.
+            @returns The number of packets dropped on send because the simulator already held the maximum number of packets.
+         */
+
+        uint64_t GetNumOverflowPackets() const { return m_numOverflowPackets; }
+
+        /**
+            Get the number of packets dropped because they were larger than the simulator packet buffers.
+            If this is non-zero, the maxPacketBytes passed in to the constructor is too small for the packets being sent. See ClientServerConfig::GetMaxTransmitPacketSize.
+            @returns The number of packets dropped on send because they were larger than maxPacketBytes.
+         */
+
+        uint64_t GetNumOversizedPackets() const { return m_numOversizedPackets; }
+
+        /**
+            Get the allocator passed in to the constructor.
+            @returns The allocator the simulator packet pool is allocated with.
          */
 
         Allocator & GetAllocator() { yojimbo_assert( m_allocator ); return *m_allocator; }
@@ -4820,11 +6124,33 @@ namespace yojimbo
 
     private:
 
-        Allocator * m_allocator;                        ///< The allocator passed in to the constructor. It's used to allocate and free packet data.
-        float m_latency;                                ///< Latency in milliseconds
-        float m_jitter;                                 ///< Jitter in milliseconds +/-
-        float m_packetLoss;                             ///< Packet loss percentage.
-        float m_duplicates;                             ///< Duplicate packet percentage
+        Allocator * m_allocator;                        ///< The allocator passed in to the constructor.
+        SlabPool * m_packetPool;                        ///< Pool of packet buffers. Each buffer holds one packet of up to m_maxPacketBytes. Never holds more buffers than the simulator holds packets.
+        int m_maxPacketBytes;                           ///< The maximum packet size (bytes).
+
+        /// The state of a simulated link, and the network conditions applied to it.
+
+        struct Link
+        {
+            NetworkConditions conditions;               ///< The network conditions for this link. A copy of the regular network conditions, unless the client has its own.
+            bool clientConditions;                      ///< True if the client has its own network conditions. See SetClientConditions.
+            bool burstBad;                              ///< True if burst loss is in the bad state.
+            double outageStartTime;                     ///< Time the first outage started.
+            double tokens;                              ///< Bytes in the link token bucket as of tokenTime. Negative values are bytes queued waiting for the link.
+            double tokenTime;                           ///< Time the link token bucket was last updated.
+            int traceIndex;                             ///< The trace entry applied to the next packet sent over this link.
+        };
+
+        Link m_link;                                    ///< The link for packets not sent to a client link. Holds the regular network conditions.
+        int m_numClientLinks;                           ///< The number of client links.
+        Link * m_clientLinks;                           ///< Per-client links, indexed by the slot index packets are sent to. NULL if there are no client links.
+        const void * m_traceFile;                       ///< The mapped network trace file. NULL if no trace is loaded.
+        size_t m_traceFileBytes;                        ///< The size of the mapped network trace file (bytes).
+        const NetworkTraceEntry * m_traceEntries;       ///< The entries in the network trace file.
+        int m_numTraceEntries;                          ///< The number of entries in the network trace.
+        bool m_traceLoop;                               ///< True if the trace starts over when it runs out.
+        uint64_t m_numQueueDrops;                       ///< Number of packets dropped by the link queue.
+        RandomGenerator m_random;                       ///< Random generator for all random decisions made by the simulator.
         bool m_active;                                  ///< True if network simulator is active, eg. if any of the network settings above are enabled.
 
         /// A packet buffered in the network simulator.
@@ -4835,20 +6161,98 @@ namespace yojimbo
             {
                 to = 0;
                 deliveryTime = 0.0;
+                sequence = 0;
                 packetData = NULL;
                 packetBytes = 0;
             }
 
             int to;                                     ///< To index this packet should be sent to (for server -> client packets).
             double deliveryTime;                        ///< Delivery time for this packet (seconds).
-            uint8_t * packetData;                       ///< Packet data (owns this pointer).
+            uint64_t sequence;                          ///< Send order of this packet. Orders packets with the same delivery time.
+            uint8_t * packetData;                       ///< Packet data. A buffer from the packet pool.
             int packetBytes;                            ///< Size of packet in bytes.
         };
 
         double m_time;                                  ///< Current time from last call to advance time.
-        int m_currentIndex;                             ///< Current index in the packet entry array. New packets are inserted here.
-        int m_numPacketEntries;                         ///< Number of elements in the packet entry array.
-        PacketEntry * m_packetEntries;                  ///< Pointer to dynamically allocated packet entries. This is where buffered packets are stored.
+        uint64_t m_sequence;                            ///< Sequence number assigned to the next packet entry added.
+        uint64_t m_numOverflowPackets;                  ///< Number of packets dropped because the packet entry heap was full.
+        uint64_t m_numOversizedPackets;                 ///< Number of packets dropped because they were larger than m_maxPacketBytes.
+        int m_maxPacketEntries;                         ///< Maximum number of packet entries that can be buffered.
+        int m_numPacketEntries;                         ///< Number of packet entries currently buffered.
+        PacketEntry * m_packetEntries;                  ///< Min-heap of buffered packet entries, ordered by delivery time. The next packet to deliver is at index 0.
+
+        /**
+            Add a packet to the delivery heap.
+            The packet is dropped if the heap is full.
+         */
+
+        void AddPacketEntry( int to, uint8_t * packetData, int packetBytes, double deliveryTime );
+
+        /**
+            Get the link packets sent to a slot index go through.
+            @param to The slot index.
+            @returns The client link if the slot index has one, otherwise the default link.
+         */
+
+        Link & GetLink( int to );
+
+        const Link & GetLink( int to ) const;
+
+        /**
+            Copy the regular network conditions to client links without their own conditions.
+            @param resetState If true, also reset burst loss, outage and token bucket state on those links.
+         */
+
+        void UpdateLinks( bool resetState );
+
+        /**
+            Reset the burst loss, outage and token bucket state of a link.
+         */
+
+        void ResetLinkState( Link & link );
+
+        void ResetTraceIndex();
+
+        /**
+            Send a packet through the bandwidth limited link.
+            @param link The link to send the packet through.
+            @param packetBytes The packet size (bytes).
+            @param queueDelay The time the packet waits for the packets queued ahead of it, plus its own serialization time (seconds) [out].
+            @returns True if the packet was queued, false if it was dropped by the link queue.
+         */
+
+        bool SendLinkPacket( Link & link, int packetBytes, double & queueDelay );
+
+        /**
+            Should the packet being sent be lost?
+            Applies independent packet loss, burst loss and outages, and advances the burst loss state.
+            @param link The link the packet is sent through.
+            @returns True if the packet should be dropped.
+         */
+
+        bool IsPacketLost( Link & link );
+
+        /**
+            Restore heap order after the entry at the given index moved towards the root.
+         */
+
+        void SiftUp( int index );
+
+        /**
+            Restore heap order after the entry at the given index moved towards the leaves.
+         */
+
+        void SiftDown( int index );
+
+        /**
+            Is packet entry a due to be delivered before packet entry b?
+            Ties are broken by send order, so packets with the same delivery time are received in the order they were sent.
+         */
+
+        bool IsEarlier( const PacketEntry & a, const PacketEntry & b ) const
+        {
+            return a.deliveryTime < b.deliveryTime || ( a.deliveryTime == b.deliveryTime && a.sequence < b.sequence );
+        }
     };
 
     /** 
@@ -4984,7 +6388,7 @@ namespace yojimbo
         /**
             Start the server and allocate client slots.
             Each client that connects to this server occupies one of the client slots allocated by this function.
-            @param maxClients The number of client slots to allocate. Must be in range [1,MaxClients]
+            @param maxClients The number of client slots to allocate. Must be at least 1, and no more than the number of clients supported by netcode.io. Per-client state is allocated for each slot, so consider ClientServerConfig::SetLightweightClientProfile for large values.
             @see Server::Stop
          */
 
@@ -5036,6 +6440,24 @@ namespace yojimbo
 
         virtual void AdvanceTime( double time ) = 0;
 
+        /**
+            Get the next time the server has work to do.
+            This considers message and block fragment resends, acks for received messages, packets held by the network simulator and transport timers. Call SendPackets, ReceivePackets and AdvanceTime once this time is reached, instead of on a fixed tick, so an idle server can sleep and a busy one reacts sooner.
+            @returns The next wakeup time (seconds), no later than MaxWakeupInterval past the current server time.
+            @see Poll
+         */
+
+        virtual double GetNextWakeupTime() const = 0;
+
+        /**
+            Wait until packets arrive from clients, or the timeout expires.
+            Typically called with the time until GetNextWakeupTime. Transports that can not wait on their socket, including netcode.io, sleep for the timeout instead.
+            @param timeout The maximum time to wait (seconds).
+            @returns True if there may be packets to receive, false if there are definitely none.
+         */
+
+        virtual bool Poll( double timeout ) = 0;
+
         /**
             Is the server running?
             The server is running after you have called Server::Start. It is not running before the first server start, and after you call Server::Stop.
@@ -5076,6 +6498,15 @@ namespace yojimbo
 
         virtual int GetNumConnectedClients() const = 0;
 
+        /**
+            Get the indices of the client slots with connected clients.
+            Use this to loop over connected clients, instead of checking every client slot with IsClientConnected. 
+            The order is not stable. It changes as clients connect and disconnect.
+            @returns Array of GetNumConnectedClients() client indices. Valid until the next time a client connects or disconnects.
+         */
+
+        virtual const int * GetConnectedClients() const = 0;
+
         /**
             Gets the current server time.
             @see Server::AdvanceTime
@@ -5119,6 +6550,34 @@ namespace yojimbo
 
         virtual void FreeBlock( int clientIndex, uint8_t * block ) = 0;
 
+        /**
+            Create a block of data that can be attached to block messages for many clients, without a copy per-client.
+            The block is allocated from the server global heap. Fill in the block data, attach it to messages with AttachSharedBlockToMessage, then release your reference with ReleaseSharedBlock.
+            The server keeps its own reference, and frees the block once no messages refer to it.
+            @param bytes The size of the block (bytes).
+            @returns The shared block with one reference for the caller, or NULL if the block could not be allocated.
+         */
+
+        virtual SharedBlock * CreateSharedBlock( int bytes ) = 0;
+
+        /**
+            Attach a shared block to a message.
+            The message adds a reference to the block. The same block can be attached to messages for any number of clients.
+            @param clientIndex The index of the client the message belongs to.
+            @param message The message to attach the block to. This message must be derived from BlockMessage.
+            @param block The shared block to attach. Must be created via Server::CreateSharedBlock.
+         */
+
+        virtual void AttachSharedBlockToMessage( int clientIndex, Message * message, SharedBlock * block ) = 0;
+
+        /**
+            Release a reference to a shared block, returned by CreateSharedBlock.
+            IMPORTANT: Release all references to shared blocks before stopping the server.
+            @param block The shared block.
+         */
+
+        virtual void ReleaseSharedBlock( SharedBlock * block ) = 0;
+
         /**
             Can we send a message to a particular client on a channel?
             @param clientIndex The index of the client to send a message to.
@@ -5137,6 +6596,27 @@ namespace yojimbo
 
         virtual void SendMessage( int clientIndex, int channelIndex, Message * message ) = 0;
 
+        /**
+            Create a message to send to many clients with BroadcastMessage.
+            The message is allocated from the server global heap, instead of a client heap.
+            @param type The type of the message to create. The message types corresponds to the message factory created by the adaptor set on the server.
+            @returns The message, or NULL if the message could not be allocated.
+         */
+
+        virtual Message * CreateBroadcastMessage( int type ) = 0;
+
+        /**
+            Send a message to many clients over a channel.
+            The message is serialized once, and each client gets a small message that refers to the serialized bits, which are copied straight into its packets. This avoids creating, measuring and serializing the message once per-client.
+            As with SendMessage, make sure each client can send a message on the channel first. See CanSendMessage.
+            @param channelIndex The channel index in range [0,numChannels-1].
+            @param message The message to send. Must be created with CreateBroadcastMessage, and must not be a block message. The server takes ownership of the message.
+            @param clientMask Bit mask of the client indices to send the message to. Bit (clientIndex%64) of clientMask[clientIndex/64] is set for each client to send to. Pass NULL to send to all connected clients. Clients that are not connected are skipped.
+            @returns The number of clients the message was sent to.
+         */
+
+        virtual int BroadcastMessage( int channelIndex, Message * message, const uint64_t * clientMask ) = 0;
+
         /**
             Receive a message from a client over a channel.
             @param clientIndex The index of the client to receive messages from.
@@ -5203,78 +6683,931 @@ namespace yojimbo
     };
 
     /**
-        Common functionality across all server implementations.
+        A packet passed to or from a transport.
      */
 
-    class BaseServer : public ServerInterface
+    struct TransportPacket
     {
-    public:
+        int clientIndex;                                            ///< The client slot the packet is sent to, or was received from. Always 0 for client transports.
+        uint8_t * packetData;                                       ///< The packet data.
+        int packetBytes;                                            ///< The size of the packet (bytes).
+    };
 
-        BaseServer( Allocator & allocator, const ClientServerConfig & config, Adapter & adapter, double time );
+    /**
+        Sends and receives packets for a server, and keeps track of which clients are connected.
+        By default Server uses netcode.io, which provides UDP sockets, connect tokens and packet encryption. Pass a transport in to the Server constructor to use something else. 
+        For example, MemoryServerTransport exchanges packets with clients in the same process without any sockets, which is useful for tests and benchmarks.
+        Transports are driven entirely by the server. They are started and stopped with the server, updated in Server::AdvanceTime, and only called from the thread calling the server.
+        @see ClientTransport
+     */
 
-        ~BaseServer();
+    class ServerTransport
+    {
+    public:
 
-        void SetContext( void * context );
+        /// Called when a client connects (connected = 1) or disconnects (connected = 0).
 
-        void Start( int maxClients );
+        typedef void (*ConnectDisconnectFunction)( void * context, int clientIndex, int connected );
 
-        void Stop();
+        /// Called when the transport has a packet to send to a loopback client.
 
-        void AdvanceTime( double time );
+        typedef void (*SendLoopbackPacketFunction)( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence );
 
-        bool IsRunning() const { return m_running; }
+        ServerTransport();
 
-        int GetMaxClients() const { return m_maxClients; }
+        virtual ~ServerTransport() {}
 
-        double GetTime() const { return m_time; }
+        /**
+            Set the functions called when clients connect and disconnect, and when there are packets to send to loopback clients.
+            The server sets these before starting the transport.
+            @param context The context passed to the callback functions.
+            @param connectDisconnectFunction Called when a client connects or disconnects.
+            @param sendLoopbackPacketFunction Called when there is a packet to send to a loopback client.
+         */
 
-        void SetLatency( float milliseconds );
+        void SetCallbacks( void * context, ConnectDisconnectFunction connectDisconnectFunction, SendLoopbackPacketFunction sendLoopbackPacketFunction );
 
-        void SetJitter( float milliseconds );
+        /**
+            Start accepting client connections.
+            @param maxClients The number of client slots.
+            @param time The current time (seconds).
+            @returns True if the transport started successfully, false otherwise (eg. failed to bind the socket).
+         */
 
-        void SetPacketLoss( float percent );
+        virtual bool Start( int maxClients, double time ) = 0;
 
-        void SetDuplicates( float percent );
+        /**
+            Disconnect all clients and stop accepting client connections.
+         */
 
-        Message * CreateMessage( int clientIndex, int type );
+        virtual void Stop() = 0;
 
-        uint8_t * AllocateBlock( int clientIndex, int bytes );
+        /**
+            Get the port the transport is bound to.
+            @returns The port number, or 0 if the transport does not use sockets.
+         */
 
-        void AttachBlockToMessage( int clientIndex, Message * message, uint8_t * block, int bytes );
+        virtual int GetPort() const = 0;
 
-        void FreeBlock( int clientIndex, uint8_t * block );
+        /**
+            Update the transport.
+            This is where client connections are accepted, and clients that have timed out are disconnected.
+            @param time The current time (seconds).
+         */
 
-        bool CanSendMessage( int clientIndex, int channelIndex ) const;
+        virtual void Update( double time ) = 0;
 
-        void SendMessage( int clientIndex, int channelIndex, Message * message );
+        /**
+            Get the next time the transport needs Update to be called, eg. to send keep-alive packets or finish connecting clients.
+            @param time The current time (seconds).
+            @returns The next update time (seconds). The default implementation returns MaxWakeupInterval past the current time.
+         */
 
-        Message * ReceiveMessage( int clientIndex, int channelIndex );
+        virtual double GetNextUpdateTime( double time ) const { return time + MaxWakeupInterval; }
 
-        void ReleaseMessage( int clientIndex, Message * message );
+        /**
+            Wait for packets to arrive.
+            Transports that can not wait on packets return immediately. The default implementation does this.
+            @param timeout The maximum time to wait (seconds).
+            @returns True if there may be packets to receive, false if there are definitely none.
+         */
 
-        void GetNetworkInfo( int clientIndex, NetworkInfo & info ) const;
+        virtual bool Poll( double timeout ) { (void) timeout; return true; }
 
-    protected:
+        /**
+            Send a batch of packets to connected clients.
+            Packets for clients that are not connected are dropped. Packet data is copied, so it can be freed when this returns.
+            With worker threads, the server passes every packet it generates in one call to Server::SendPackets as a single batch. Otherwise packets are passed in one at a time, as they are generated.
+            @param packets The packets to send. TransportPacket::clientIndex is the client slot to send each packet to.
+            @param numPackets The number of packets to send.
+         */
 
-        uint8_t * GetPacketBuffer() { return m_packetBuffer; }
+        virtual void SendPackets( const TransportPacket * packets, int numPackets ) = 0;
 
-        void * GetContext() { return m_context; }
+        /**
+            Receive a batch of packets from a client.
+            Packets must be passed back to FreePackets once they have been processed.
+            @param clientIndex The client slot to receive packets from.
+            @param packets The array of packets to fill [out].
+            @param maxPackets The maximum number of packets to receive.
+            @returns The number of packets received. Less than maxPackets if there are no more packets to receive.
+         */
 
-        Adapter & GetAdapter() { yojimbo_assert( m_adapter ); return *m_adapter; }
+        virtual int ReceivePackets( int clientIndex, TransportPacket * packets, int maxPackets ) = 0;
 
-        Allocator & GetGlobalAllocator() { yojimbo_assert( m_globalAllocator ); return *m_globalAllocator; }
+        /**
+            Free packets returned by ReceivePackets.
+            @param packets The packets to free.
+            @param numPackets The number of packets to free.
+         */
 
-        MessageFactory & GetClientMessageFactory( int clientIndex );
+        virtual void FreePackets( TransportPacket * packets, int numPackets ) = 0;
 
-        NetworkSimulator * GetNetworkSimulator() { return m_networkSimulator; }
+        /**
+            Disconnect a client.
+            The connect/disconnect callback is called for the client before this returns. Does nothing if the client is not connected.
+            @param clientIndex The client slot.
+         */
 
-        reliable_endpoint_t * GetClientEndpoint( int clientIndex );
+        virtual void DisconnectClient( int clientIndex ) = 0;
 
-        Connection & GetClientConnection( int clientIndex );
+        /**
+            Disconnect all connected clients, including loopback clients.
+            The connect/disconnect callback is called for each client before this returns.
+         */
 
-        virtual void TransmitPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes ) = 0;
+        virtual void DisconnectAllClients() = 0;
 
-        virtual int ProcessPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes ) = 0;
+        /**
+            Is a client connected to a client slot?
+            @param clientIndex The client slot.
+            @returns True if a client is connected to the slot, false otherwise.
+         */
+
+        virtual bool IsClientConnected( int clientIndex ) const = 0;
+
+        /**
+            Get the id of a connected client.
+            @param clientIndex The client slot.
+            @returns The client id passed in when the client connected. Only valid if the client is connected.
+         */
+
+        virtual uint64_t GetClientId( int clientIndex ) const = 0;
+
+        /**
+            Get the number of connected clients.
+            @returns The number of connected clients, including loopback clients.
+         */
+
+        virtual int GetNumConnectedClients() const = 0;
+
+        /**
+            Connect a loopback client.
+            Loopback clients are only supported by transports that override this. The default implementation logs an error.
+            @see ServerInterface::ConnectLoopbackClient
+         */
+
+        virtual void ConnectLoopbackClient( int clientIndex, uint64_t clientId, const uint8_t * userData );
+
+        /**
+            Disconnect a loopback client.
+            The default implementation does nothing.
+            @param clientIndex The client slot of the loopback client.
+            @see ServerInterface::DisconnectLoopbackClient
+         */
+
+        virtual void DisconnectLoopbackClient( int clientIndex );
+
+        /**
+            Is the client in a slot a loopback client?
+            @param clientIndex The client slot.
+            @returns True if a loopback client is connected to the slot. The default implementation always returns false.
+         */
+
+        virtual bool IsLoopbackClient( int clientIndex ) const { (void) clientIndex; return false; }
+
+        /**
+            Pass a packet sent by a loopback client in to the server.
+            The packet is received through ReceivePackets like any other packet. The default implementation drops it.
+            @param clientIndex The client slot of the loopback client.
+            @param packetData The packet data.
+            @param packetBytes The size of the packet (bytes).
+            @param packetSequence The packet sequence number.
+            @see ServerInterface::ProcessLoopbackPacket
+         */
+
+        virtual void ProcessLoopbackPacket( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence );
+
+    protected:
+
+        /**
+            Call this when a client connects or disconnects.
+            @param clientIndex The client slot.
+            @param connected True if the client connected, false if it disconnected.
+         */
+
+        void ConnectDisconnectCallback( int clientIndex, bool connected );
+
+        /**
+            Call this to pass a packet to a loopback client.
+            @param clientIndex The client slot of the loopback client.
+            @param packetData The packet data.
+            @param packetBytes The size of the packet (bytes).
+            @param packetSequence The packet sequence number.
+         */
+
+        void SendLoopbackPacketCallback( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence );
+
+    private:
+
+        void * m_callbackContext;                                           ///< The context passed to the callback functions.
+        ConnectDisconnectFunction m_connectDisconnectFunction;              ///< Called when a client connects or disconnects.
+        SendLoopbackPacketFunction m_sendLoopbackPacketFunction;            ///< Called when there is a packet to send to a loopback client.
+    };
+
+    class MemoryClientTransport;
+
+    /**
+        A server transport that exchanges packets with MemoryClientTransport instances in the same process.
+        There are no sockets, no encryption and no connect tokens. Packets are copied into per-client queues, and are available to receive on the next call to ReceivePackets.
+        Clients connect on the next call to Update after they call ClientTransport::Connect, or are denied if there are no free client slots.
+        Use this for tests and benchmarks of everything above the transport layer. 
+        IMPORTANT: Memory transports are not thread safe. Update the server and all its clients from the same thread.
+     */
+
+    class MemoryServerTransport : public ServerTransport
+    {
+    public:
+
+        /**
+            Memory server transport constructor.
+            @param allocator The allocator used for client slots and packet copies.
+            @param packetQueueSize The maximum number of packets queued per-client. Additional packets are dropped.
+         */
+
+        explicit MemoryServerTransport( Allocator & allocator, int packetQueueSize = 256 );
+
+        ~MemoryServerTransport();
+
+        bool Start( int maxClients, double time );
+
+        void Stop();
+
+        int GetPort() const { return 0; }
+
+        void Update( double time );
+
+        double GetNextUpdateTime( double time ) const;
+
+        bool Poll( double timeout );
+
+        void SendPackets( const TransportPacket * packets, int numPackets );
+
+        int ReceivePackets( int clientIndex, TransportPacket * packets, int maxPackets );
+
+        void FreePackets( TransportPacket * packets, int numPackets );
+
+        void DisconnectClient( int clientIndex );
+
+        void DisconnectAllClients();
+
+        bool IsClientConnected( int clientIndex ) const;
+
+        uint64_t GetClientId( int clientIndex ) const;
+
+        int GetNumConnectedClients() const { return m_numConnectedClients; }
+
+        /**
+            Request a client slot. Called by MemoryClientTransport.
+            @param client The client transport.
+            @param clientId The client id.
+            @returns The client slot, or -1 if the server is not running or there are no free client slots.
+         */
+
+        int AddClient( MemoryClientTransport * client, uint64_t clientId );
+
+        /**
+            Give up a client slot. Called by MemoryClientTransport when it disconnects.
+            @param clientIndex The client slot returned by AddClient.
+         */
+
+        void RemoveClient( int clientIndex );
+
+        /**
+            Queue a packet sent by a client. Called by MemoryClientTransport.
+            @param clientIndex The client slot returned by AddClient.
+            @param packetData The packet data. This is copied.
+            @param packetBytes The size of the packet (bytes).
+         */
+
+        void QueuePacket( int clientIndex, const uint8_t * packetData, int packetBytes );
+
+    private:
+
+        /// The state of a client slot.
+
+        enum SlotState
+        {
+            SLOT_FREE,                                                      ///< The slot is free.
+            SLOT_CONNECTING,                                                ///< A client has taken the slot. It connects on the next update.
+            SLOT_CONNECTED,                                                 ///< The client is connected.
+            SLOT_DISCONNECTING                                              ///< The client has disconnected. The slot is freed on the next update.
+        };
+
+        /// Data for a client slot.
+
+        struct ClientSlot
+        {
+            SlotState state;                                                ///< The state of the slot.
+            MemoryClientTransport * client;                                 ///< The client transport. NULL unless connecting or connected.
+            uint64_t clientId;                                              ///< The client id.
+            Queue<TransportPacket> * packetQueue;                           ///< Packets received from the client, waiting to be received by the server.
+        };
+
+        void ClearPacketQueue( int clientIndex );
+
+        Allocator * m_allocator;                                            ///< The allocator passed in to the constructor.
+        int m_packetQueueSize;                                              ///< The maximum number of packets queued per-client.
+        int m_maxClients;                                                   ///< The number of client slots. 0 if not running.
+        int m_numConnectedClients;                                          ///< The number of connected clients.
+        ClientSlot * m_clientSlot;                                          ///< Array of client slots. NULL if not running.
+
+        MemoryServerTransport( const MemoryServerTransport & other );
+
+        MemoryServerTransport & operator = ( const MemoryServerTransport & other );
+    };
+
+    struct WorkerPoolData;
+
+    /**
+        A fixed pool of worker threads that run tasks in parallel.
+        The server uses this to split per-client work into shards of client slots when ClientServerConfig::serverWorkerThreads is non-zero. 
+        The thread calling Run takes part in the work, and Run only returns once all tasks have completed, so work is never left running in the background.
+     */
+
+    class WorkerPool
+    {
+    public:
+
+        /**
+            A task function.
+            @param context The context passed in to WorkerPool::Run.
+            @param taskIndex The index of the task to run in [0,numTasks-1].
+         */
+
+        typedef void (*TaskFunction)( void * context, int taskIndex );
+
+        /**
+            Worker pool constructor.
+            Starts the worker threads. They sleep until there is work to do.
+            @param allocator The allocator used for the pool's internal data.
+            @param numThreads The number of worker threads to start.
+         */
+
+        WorkerPool( Allocator & allocator, int numThreads );
+
+        /**
+            Worker pool destructor.
+            Wakes up and joins all worker threads.
+         */
+
+        ~WorkerPool();
+
+        /**
+            Run a set of tasks and wait until they have all completed.
+            Tasks are picked up by whichever thread is free first. Each task is run exactly once.
+            @param function The task function to call.
+            @param context The context passed in to each call to the task function.
+            @param numTasks The number of tasks to run.
+         */
+
+        void Run( TaskFunction function, void * context, int numTasks );
+
+        /**
+            Get the number of worker threads.
+            @returns The number of worker threads, not including the thread calling Run.
+         */
+
+        int GetNumThreads() const { return m_numThreads; }
+
+        /**
+            Get the number of tasks run by worker threads.
+            Tasks run on the thread calling Run are not counted, so this stays at zero if the workers never pick up any work.
+            @returns The number of tasks run by worker threads since the pool was created.
+         */
+
+        uint64_t GetNumWorkerTasks() const;
+
+    private:
+
+        Allocator * m_allocator;                                    ///< The allocator passed in to the constructor.
+        int m_numThreads;                                           ///< The number of worker threads.
+        WorkerPoolData * m_data;                                    ///< Platform specific thread, lock and task data.
+
+        WorkerPool( const WorkerPool & other );
+
+        WorkerPool & operator = ( const WorkerPool & other );
+    };
+
+    /**
+        A pool of fixed size memory slabs.
+        Slabs are carved out of chunks allocated on demand, and freed slabs are kept for reuse instead of being returned to the allocator. Chunks are only freed when the pool is destroyed, so size chunks to the number of slabs you expect to use at once.
+        Chunks can be mapped from the OS instead of allocated, so memory for the pool matches ClientServerConfig::mappedMemory and ClientServerConfig::hugePages.
+        Servers can take their per-client memory from a slab pool, so when one server stops and another starts, the new server reuses the same memory. See BaseServer::SetClientMemoryPool.
+        The network simulator also keeps its packet buffers in a slab pool.
+        IMPORTANT: The slab pool is not thread safe. Servers only allocate and free client memory in Start and Stop.
+     */
+
+    class SlabPool
+    {
+    public:
+
+        /**
+            Slab pool constructor.
+            @param allocator The allocator used to allocate chunks of slabs.
+            @param slabBytes The size of each slab (bytes).
+            @param slabsPerChunk The number of slabs allocated at a time when the pool runs out of free slabs.
+            @param mappedMemory If true, chunks are mapped with yojimbo_map_memory instead of allocated. The allocator is only used for chunk bookkeeping.
+            @param hugePages If true, mapped chunks are backed by huge pages. Ignored unless mappedMemory is true.
+         */
+
+        SlabPool( Allocator & allocator, int slabBytes, int slabsPerChunk = 16, bool mappedMemory = false, bool hugePages = false );
+
+        /**
+            Slab pool destructor.
+            IMPORTANT: All slabs must be freed before the pool is destroyed.
+         */
+
+        ~SlabPool();
+
+        /**
+            Allocate a slab.
+            @returns Pointer to a slab of GetSlabBytes bytes, or NULL if a new chunk of slabs could not be allocated.
+         */
+
+        uint8_t * Allocate();
+
+        /**
+            Return a slab to the pool.
+            @param slab A slab allocated with this pool.
+         */
+
+        void Free( uint8_t * slab );
+
+        int GetSlabBytes() const { return m_slabBytes; }
+
+        int GetNumSlabs() const { return m_numSlabs; }
+
+        int GetNumFreeSlabs() const { return m_numFreeSlabs; }
+
+        /**
+            Limit the number of slabs in the pool.
+            Once the pool holds this many slabs, Allocate returns NULL until a slab is freed. The last chunk is cut short so the pool never holds more than this.
+            @param maxSlabs The maximum number of slabs. Zero for no limit.
+         */
+
+        void SetMaxSlabs( int maxSlabs );
+
+        bool IsMappedMemory() const { return m_mappedMemory; }
+
+        bool IsHugePages() const { return m_hugePages; }
+
+    private:
+
+        struct Chunk
+        {
+            uint8_t * memory;                                       ///< The memory for the slabs in this chunk. Allocated, or mapped if the pool maps memory.
+            int bytes;                                              ///< The size of the chunk memory (bytes).
+            Chunk * next;                                           ///< The next chunk in the list.
+        };
+
+        Allocator * m_allocator;                                    ///< The allocator passed in to the constructor.
+        int m_slabBytes;                                            ///< The size of each slab (bytes).
+        int m_slabStride;                                           ///< Distance between slabs in a chunk. The slab size rounded up to a cache line.
+        int m_slabsPerChunk;                                        ///< The number of slabs per-chunk.
+        int m_maxSlabs;                                             ///< The maximum number of slabs. Zero for no limit. See SetMaxSlabs.
+        bool m_mappedMemory;                                        ///< True if chunks are mapped with yojimbo_map_memory.
+        bool m_hugePages;                                           ///< True if mapped chunks are backed by huge pages.
+        int m_numSlabs;                                             ///< The number of slabs in all chunks.
+        int m_numFreeSlabs;                                         ///< The number of slabs in the free list.
+        Chunk * m_chunks;                                           ///< List of chunks. Kept apart from the slabs, so mapped chunks are exactly the slabs they hold.
+        uint8_t * m_freeSlabs;                                      ///< List of free slabs. The first bytes of each free slab point to the next free slab.
+
+        SlabPool( const SlabPool & other );
+
+        SlabPool & operator = ( const SlabPool & other );
+    };
+
+    /**
+        Decides which entities are relevant to each client, so the server only sends entity updates to clients that need them.
+        The application registers entities with a position and an optional group mask, and gives each client a view position and radius. Each call to Update buckets entities into a spatial hash grid, then gathers the entities for each client from the grid cells that overlap its view, plus any entities that share a group with the client. The cost depends on the entities near each client, not clients x entities.
+        Relevant entities accumulate their priority each update until they are sent to the client, so entities that miss out on a packet move up the list for the next one. This includes entities left out by maxRelevantEntities, so every relevant entity is eventually sent.
+        Memory is O(maxEntities + maxClients x relevant entities per-client). Each client only keeps priorities for the entities relevant to it. This starts at maxRelevantEntities per-client and grows if a client has more entities relevant at once.
+        Positions are 2D. For 3D games pass in coordinates on the ground plane.
+        @see BaseServer::SendEntityMessages
+     */
+
+    class InterestManager
+    {
+    public:
+
+        /// An entity relevant to a client.
+
+        struct RelevantEntity
+        {
+            int entityId;                                           ///< The entity id.
+            float priority;                                         ///< Priority accumulated since the entity was last sent to the client.
+        };
+
+        /**
+            Interest manager constructor.
+            @param allocator The allocator used for entity, client and grid data.
+            @param maxEntities The maximum number of entities.
+            @param maxClients The number of client slots. Client indices match server client indices.
+            @param maxRelevantEntities The maximum number of entities returned for each client by GetRelevantEntities. If more entities are relevant, only the highest priority entities are returned. The rest keep accumulating priority, so they are returned in a later update.
+            @param cellSize The size of each grid cell. Roughly the view radius of a typical client works well.
+         */
+
+        InterestManager( Allocator & allocator, int maxEntities, int maxClients, int maxRelevantEntities, float cellSize );
+
+        ~InterestManager();
+
+        /**
+            Add an entity.
+            @param x The entity x position.
+            @param y The entity y position.
+            @param groupMask The groups the entity belongs to. The entity is relevant to all clients in any of these groups, wherever they are.
+            @param priority The priority added to the entity each update while it is relevant to a client and not sent.
+            @returns The entity id, or -1 if there are already maxEntities entities.
+         */
+
+        int AddEntity( float x, float y, uint64_t groupMask = 0, float priority = 1.0f );
+
+        void RemoveEntity( int entityId );
+
+        void SetEntityPosition( int entityId, float x, float y );
+
+        void SetEntityGroups( int entityId, uint64_t groupMask );
+
+        void SetEntityPriority( int entityId, float priority );
+
+        int GetNumEntities() const { return m_numEntities; }
+
+        /**
+            Set the view of a client. 
+            Entities within the view radius of the client view position are relevant to the client. Clients receive no entities until their view is set.
+            @param clientIndex The client index.
+            @param x The view x position.
+            @param y The view y position.
+            @param radius The view radius.
+         */
+
+        void SetClientView( int clientIndex, float x, float y, float radius );
+
+        /**
+            Set the groups a client belongs to.
+            @param clientIndex The client index.
+            @param groupMask The client group mask. Entities with a group in this mask are relevant to the client.
+         */
+
+        void SetClientGroups( int clientIndex, uint64_t groupMask );
+
+        /**
+            Remove a client.
+            Call this when a client disconnects. Clears the client view, groups and accumulated priorities.
+            @param clientIndex The client index.
+         */
+
+        void RemoveClient( int clientIndex );
+
+        /**
+            Rebuild the spatial grid and the set of relevant entities for each client.
+            Call this once per-tick, before sending entity updates.
+         */
+
+        void Update();
+
+        /**
+            Get the entities relevant to a client, as of the last update.
+            @param clientIndex The client index.
+            @param entities Set to the array of relevant entities, in order of decreasing priority [out].
+            @returns The number of relevant entities.
+         */
+
+        int GetRelevantEntities( int clientIndex, const RelevantEntity * & entities ) const;
+
+        /**
+            Mark an entity as sent to a client.
+            Resets the priority the entity has accumulated for the client. Does nothing if the entity was not relevant to the client in the last update.
+            @param clientIndex The client index.
+            @param entityId The entity id.
+         */
+
+        void MarkSent( int clientIndex, int entityId );
+
+    private:
+
+        /// Per-entity data.
+
+        struct EntityData
+        {
+            float x;                                                ///< The entity x position.
+            float y;                                                ///< The entity y position.
+            uint64_t groupMask;                                     ///< The groups the entity belongs to.
+            float priority;                                         ///< Priority added each update while relevant and not sent.
+            int cellX;                                              ///< Grid cell x coordinate. Set in Update.
+            int cellY;                                              ///< Grid cell y coordinate. Set in Update.
+            int next;                                               ///< Next entity in the same grid bucket, or the next free entity when not active. -1 at the end of the list.
+            uint32_t addedUpdate;                                   ///< The first update after the entity was added. Entity ids are reused, so priority left over from a removed entity is not carried into this update.
+            bool active;                                            ///< True if the entity has been added and not removed.
+        };
+
+        /// Per-client data.
+
+        struct ClientData
+        {
+            bool active;                                            ///< True once the client view has been set.
+            float x;                                                ///< The view x position.
+            float y;                                                ///< The view y position.
+            float radius;                                           ///< The view radius.
+            uint64_t groupMask;                                     ///< The groups the client belongs to.
+            int numRelevantEntities;                                ///< The number of entities returned by GetRelevantEntities. At most maxRelevantEntities.
+            int numTrackedEntities;                                 ///< The number of entities relevant to the client, including entities left out by maxRelevantEntities.
+            int maxTrackedEntities;                                 ///< The size of the relevant entity array. Starts at maxRelevantEntities and grows in Update.
+            int markSentIndex;                                      ///< Where MarkSent starts looking for the next entity. Entities are usually sent in order.
+            RelevantEntity * relevantEntities;                      ///< The entities relevant to the client, sorted by priority. The first numRelevantEntities are returned by GetRelevantEntities, the rest keep accumulating priority until they make the cut.
+        };
+
+        /// Per-entity data used while gathering the relevant entities for one client. Shared by all clients, since clients are gathered one at a time.
+
+        struct GatherData
+        {
+            float previousPriority;                                 ///< Priority the entity had for the client after the previous update.
+            uint32_t previousIndex;                                 ///< Set to the gather index if the entity was relevant to the client in the previous update.
+            uint32_t gatheredIndex;                                 ///< Set to the gather index once the entity has been gathered, so it is only added once.
+        };
+
+        void AddRelevantEntity( int entityId );
+
+        int GetBucket( int cellX, int cellY ) const;
+
+        Allocator * m_allocator;                                    ///< The allocator passed in to the constructor.
+        int m_maxEntities;                                          ///< The maximum number of entities.
+        int m_maxClients;                                           ///< The number of client slots.
+        float m_cellSize;                                           ///< The size of each grid cell.
+        int m_numEntities;                                          ///< The number of active entities.
+        int m_freeEntity;                                           ///< Head of the free entity list. -1 if all entities are active.
+        EntityData * m_entities;                                    ///< Entity data, indexed by entity id.
+        ClientData * m_clients;                                     ///< Client data, indexed by client index.
+        int m_maxRelevantEntities;                                  ///< The maximum number of entities relevant to each client.
+        GatherData * m_gatherData;                                  ///< Gather data, indexed by entity id.
+        RelevantEntity * m_gathered;                                ///< Entities gathered for the current client, before they are sorted and the highest priority entities are kept. Sized to maxEntities.
+        int m_numGathered;                                          ///< The number of entities gathered for the current client.
+        uint32_t m_gatherIndex;                                     ///< Incremented for each client gathered, so gather data does not need clearing.
+        int m_numBuckets;                                           ///< The number of spatial hash buckets. A power of two at least maxEntities.
+        int * m_buckets;                                            ///< First entity in each spatial hash bucket, or -1 if empty.
+        int m_numGroupEntities;                                     ///< The number of entities with a non-zero group mask.
+        int * m_groupEntities;                                      ///< Entities with a non-zero group mask. Rebuilt in Update.
+        uint32_t m_updateIndex;                                     ///< Incremented each update.
+
+        InterestManager( const InterestManager & other );
+
+        InterestManager & operator = ( const InterestManager & other );
+    };
+
+    /// Server tick phases timed when YOJIMBO_PROFILE is enabled. See BaseServer::GetPhaseTimingStats.
+
+    enum ServerProfilePhase
+    {
+        SERVER_PROFILE_RECEIVE_PACKETS,                             ///< Server::ReceivePackets. Includes processing packets for all clients.
+        SERVER_PROFILE_ADVANCE_TIME,                                ///< Server::AdvanceTime. Includes updating the transport and the network simulator.
+        SERVER_PROFILE_SEND_PACKETS,                                ///< Server::SendPackets. Includes generating packets for all clients.
+        SERVER_PROFILE_NETWORK_SIMULATOR,                           ///< Passing packets from the network simulator to the transport in Server::AdvanceTime.
+        SERVER_PROFILE_NUM_PHASES
+    };
+
+    /// Per-client operations timed when YOJIMBO_PROFILE is enabled. See BaseServer::GetClientTimingStats.
+
+    enum ClientProfileTiming
+    {
+        CLIENT_PROFILE_GENERATE_PACKET,                             ///< Generating and sending one packet to the client.
+        CLIENT_PROFILE_PROCESS_PACKET,                              ///< Processing one packet received from the client.
+        CLIENT_PROFILE_NUM_TIMINGS
+    };
+
+    /**
+        Common functionality across all server implementations.
+     */
+
+    class BaseServer : public ServerInterface
+    {
+    public:
+
+        BaseServer( Allocator & allocator, const ClientServerConfig & config, Adapter & adapter, double time );
+
+        ~BaseServer();
+
+        void SetContext( void * context );
+
+        void Start( int maxClients );
+
+        void Stop();
+
+        void AdvanceTime( double time );
+
+        double GetNextWakeupTime() const;
+
+        bool IsRunning() const { return m_running; }
+
+        int GetMaxClients() const { return m_maxClients; }
+
+        bool IsClientConnected( int clientIndex ) const;
+
+        int GetNumConnectedClients() const { return m_numConnectedClients; }
+
+        const int * GetConnectedClients() const { return m_connectedClients; }
+
+        const WorkerPool * GetWorkerPool() const { return m_workerPool; }
+
+        double GetTime() const { return m_time; }
+
+        void SetLatency( float milliseconds );
+
+        void SetJitter( float milliseconds );
+
+        void SetPacketLoss( float percent );
+
+        void SetDuplicates( float percent );
+
+        void SetBandwidth( float kilobitsPerSecond, int burstBytes = 0 );
+
+        void SetQueueLimit( int queueBytes, int earlyDropBytes = 0 );
+
+        void SetBurstLoss( float goodToBadPercent, float badToGoodPercent, float badLossPercent = 100.0f, float goodLossPercent = 0.0f );
+
+        void SetReordering( float percent, float milliseconds );
+
+        void SetOutage( float periodSeconds, float durationSeconds );
+
+        void SetNetworkSimulatorSeed( uint64_t seed, uint64_t stream = 0 );
+
+        void SetClientNetworkConditions( int clientIndex, const NetworkConditions & conditions );
+
+        void ClearClientNetworkConditions( int clientIndex );
+
+        Message * CreateMessage( int clientIndex, int type );
+
+        uint8_t * AllocateBlock( int clientIndex, int bytes );
+
+        void AttachBlockToMessage( int clientIndex, Message * message, uint8_t * block, int bytes );
+
+        void FreeBlock( int clientIndex, uint8_t * block );
+
+        SharedBlock * CreateSharedBlock( int bytes );
+
+        void AttachSharedBlockToMessage( int clientIndex, Message * message, SharedBlock * block );
+
+        void ReleaseSharedBlock( SharedBlock * block );
+
+        bool CanSendMessage( int clientIndex, int channelIndex ) const;
+
+        void SendMessage( int clientIndex, int channelIndex, Message * message );
+
+        Message * CreateBroadcastMessage( int type );
+
+        int BroadcastMessage( int channelIndex, Message * message, const uint64_t * clientMask );
+
+        Message * ReceiveMessage( int clientIndex, int channelIndex );
+
+        void ReleaseMessage( int clientIndex, Message * message );
+
+        void GetNetworkInfo( int clientIndex, NetworkInfo & info ) const;
+
+        /**
+            Get timing stats for a server tick phase.
+            Only available when the library is compiled with YOJIMBO_PROFILE. Otherwise the profiling code compiles out and this returns false.
+            @param phase The server tick phase.
+            @param stats The timing stats [out].
+            @returns True if the stats were retrieved.
+         */
+
+        bool GetPhaseTimingStats( ServerProfilePhase phase, TimingStats & stats ) const;
+
+        /**
+            Get timing stats for a client.
+            Stats are reset each time a client connects to the slot. Use this to find the clients that are expensive to update.
+            @param clientIndex The client index.
+            @param timing The per-client operation.
+            @param stats The timing stats [out].
+            @returns True if the stats were retrieved. False if YOJIMBO_PROFILE is not enabled.
+         */
+
+        bool GetClientTimingStats( int clientIndex, ClientProfileTiming timing, TimingStats & stats ) const;
+
+        /**
+            Get timing stats for a channel.
+            Times Channel::GetPacketData for this channel, across all clients.
+            @param channelIndex The channel index in [0,numChannels-1].
+            @param stats The timing stats [out].
+            @returns True if the stats were retrieved. False if YOJIMBO_PROFILE is not enabled.
+         */
+
+        bool GetChannelTimingStats( int channelIndex, TimingStats & stats ) const;
+
+        /**
+            Get a channel counter for a client.
+            Counters are reset each time a client connects to the slot.
+            @param clientIndex The client index.
+            @param channelIndex The channel index in [0,numChannels-1].
+            @param index The counter index. See ChannelCounters.
+            @returns The value of the counter, or zero if the client is not connected.
+         */
+
+        uint64_t GetChannelCounter( int clientIndex, int channelIndex, int index ) const;
+
+        /**
+            Get channel latency stats for a client.
+            Latency stats are reset each time a client connects to the slot.
+            @param clientIndex The client index.
+            @param channelIndex The channel index in [0,numChannels-1].
+            @param index The latency index. See ChannelLatency.
+            @param stats The latency stats [out].
+            @returns True if the client is connected, the channel tracks latency and the stats were filled in, false otherwise.
+         */
+
+        bool GetChannelLatencyStats( int clientIndex, int channelIndex, int index, TimingStats & stats ) const;
+
+        /**
+            Reset all timing stats.
+         */
+
+        void ResetTimingStats();
+
+        /**
+            Take per-client memory from a slab pool instead of allocating it for each client slot.
+            Only used if ClientServerConfig::serverPerClientMemory fits in a slab and the pool maps memory the same way as ClientServerConfig::mappedMemory and ClientServerConfig::hugePages, otherwise per-client memory is allocated as usual. Call this before Start.
+            @param pool The slab pool. It must outlive the server. Pass NULL to stop using a slab pool.
+            @see ServerHost
+         */
+
+        void SetClientMemoryPool( SlabPool * pool );
+
+        /**
+            Creates the update message for an entity.
+            @param context The context passed in to SendEntityMessages.
+            @param clientIndex The client the message is sent to.
+            @param entityId The entity to create an update message for.
+            @returns The message, created with CreateMessage for this client, or NULL to skip the entity.
+         */
+
+        typedef Message * (*EntityMessageFunction)( void * context, int clientIndex, int entityId );
+
+        /**
+            Send entity update messages to each connected client, for the entities relevant to that client.
+            Entities are sent in order of priority, up to the per-client limit and while the channel can send messages. Entities that are sent have their priority reset. Call InterestManager::Update first.
+            @param interest The interest manager that decides which entities are relevant to each client.
+            @param channelIndex The channel to send entity messages on.
+            @param maxMessagesPerClient The maximum number of entity messages to send to each client.
+            @param function Creates the message for each entity.
+            @param context Passed to the message function.
+            @returns The total number of entity messages sent.
+         */
+
+        int SendEntityMessages( InterestManager & interest, int channelIndex, int maxMessagesPerClient, EntityMessageFunction function, void * context );
+
+    protected:
+
+        uint8_t * GetPacketBuffer() { return m_packetBuffer; }
+
+        void * GetContext() { return m_context; }
+
+        Adapter & GetAdapter() { yojimbo_assert( m_adapter ); return *m_adapter; }
+
+        Allocator & GetGlobalAllocator() { yojimbo_assert( m_globalAllocator ); return *m_globalAllocator; }
+
+        Allocator & GetClientAllocator( int clientIndex );
+
+        MessageFactory & GetClientMessageFactory( int clientIndex );
+
+        NetworkSimulator * GetNetworkSimulator() { return m_networkSimulator; }
+
+        reliable_endpoint_t * GetClientEndpoint( int clientIndex );
+
+        Connection & GetClientConnection( int clientIndex );
+
+        /**
+            Add a client to, or remove a client from the list of connected clients.
+            Call this when a client connects or disconnects. Per-client work only runs for connected clients.
+            @param clientIndex The client index.
+            @param connected True if the client connected, false if it disconnected.
+         */
+
+        void SetClientConnected( int clientIndex, bool connected );
+
+#if YOJIMBO_PROFILE
+
+        /**
+            Add a timing sample for a server tick phase.
+            @param phase The server tick phase.
+            @param seconds The time taken (seconds).
+         */
+
+        void AddPhaseTiming( ServerProfilePhase phase, double seconds ) { m_phaseTimings[phase].AddSample( seconds ); }
+
+#endif // #if YOJIMBO_PROFILE
+
+        virtual void TransmitPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes ) = 0;
+
+        virtual int ProcessPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes ) = 0;
+
+        /**
+            Transmit a batch of packets queued while generating packets.
+            Called once per-call to GenerateClientPackets when worker threads are enabled. The default implementation passes each packet to TransmitPacketFunction, with a packet sequence of zero.
+            @param packets The packets to send. Packet data is only valid until this returns.
+            @param numPackets The number of packets to send.
+         */
+
+        virtual void TransmitPackets( const TransportPacket * packets, int numPackets );
 
         static void StaticTransmitPacketFunction( void * context, int index, uint16_t packetSequence, uint8_t * packetData, int packetBytes );
         
@@ -5284,7 +7617,170 @@ namespace yojimbo
         
         static void StaticFreeFunction( void * context, void * pointer );
 
-    private:
+        /**
+            Generate and send a packet to each connected client.
+            When worker threads are enabled, packets are generated in parallel and the packets sent by the reliable.io endpoints are queued per-client, then passed to TransmitPackets in one batch on the calling thread once all clients are done.
+            Without worker threads, packets are passed to TransmitPacketFunction as they are generated.
+         */
+
+        void GenerateClientPackets();
+
+        static const int ReceiveQueueSize = 64;                     ///< Number of received packets that can be queued per-client before they must be processed.
+
+        /**
+            Check if received packets are queued per-client before being processed.
+            Receive queues only exist when worker threads are enabled, so packets can be processed in parallel. Otherwise pass each packet to ProcessClientPacket as soon as it is received.
+            @returns True if worker threads are enabled and packets should go through QueueReceivedPacket, ProcessReceivedPackets and PopProcessedPacket.
+         */
+
+        bool HasReceiveQueues() const { return m_workerPool != NULL; }
+
+        /**
+            Check if per-client memory is taken from the client memory pool.
+            @returns True if a pool was set with SetClientMemoryPool, per-client memory fits in a slab and the pool maps memory the same way as the config.
+         */
+
+        bool UsesClientMemoryPool() const;
+
+        /**
+            Pass a packet received from a client to its reliable.io endpoint and connection.
+            @param clientIndex The client index.
+            @param packetData The packet data. Can be freed once this returns.
+            @param packetBytes The size of the packet (bytes).
+         */
+
+        void ProcessClientPacket( int clientIndex, uint8_t * packetData, int packetBytes );
+
+        /**
+            Get the number of packets that can be queued for a client before calling ProcessReceivedPackets.
+            Only valid when HasReceiveQueues is true.
+            @param clientIndex The client index.
+            @returns The number of free entries in the receive queue for this client.
+         */
+
+        int GetReceiveQueueSpace( int clientIndex ) const;
+
+        /**
+            Queue a packet received from a client, to be processed by ProcessReceivedPackets.
+            Only valid when HasReceiveQueues is true. The packet data is not copied. It must stay valid until it is handed back by PopProcessedPacket.
+            @param clientIndex The client index.
+            @param packetData The packet data.
+            @param packetBytes The size of the packet (bytes).
+         */
+
+        void QueueReceivedPacket( int clientIndex, uint8_t * packetData, int packetBytes );
+
+        /**
+            Pass all queued packets to their client's reliable.io endpoint and connection.
+            When worker threads are enabled, clients are processed in parallel. Packets for the same client are always processed in the order they were queued.
+         */
+
+        void ProcessReceivedPackets();
+
+        /**
+            Take back a processed packet from a client receive queue, so it can be freed.
+            @param clientIndex The client index.
+            @returns The packet data passed in to QueueReceivedPacket, or NULL once the receive queue is empty.
+         */
+
+        uint8_t * PopProcessedPacket( int clientIndex );
+
+    private:
+
+        /// Per-client work that can be split across the worker threads.
+
+        enum ClientWork
+        {
+            CLIENT_WORK_GENERATE_PACKETS,                           ///< Generate a packet for each connected client. See GenerateClientPackets.
+            CLIENT_WORK_PROCESS_PACKETS,                            ///< Process queued packets for each client. See ProcessReceivedPackets.
+            CLIENT_WORK_ADVANCE_TIME                                ///< Advance time and process acks for each client. See AdvanceTime.
+        };
+
+        /// Passed to StaticClientWorkFunction by RunClientWork.
+
+        struct ClientWorkContext
+        {
+            BaseServer * server;                                    ///< The server doing the work.
+            ClientWork work;                                        ///< The work to do.
+            int numShards;                                          ///< The number of shards the connected clients are split into.
+        };
+
+        /**
+            Do per-client work for all connected clients.
+            When worker threads are enabled, the connected client list is split into contiguous shards, one per-thread plus one for the calling thread. Otherwise all clients are processed on the calling thread.
+            @param work The work to do.
+         */
+
+        void RunClientWork( ClientWork work );
+
+        /**
+            Do per-client work for one shard of connected clients.
+            IMPORTANT: This can run on a worker thread. It must only touch the data for the client slots in the shard.
+            @param work The work to do.
+            @param shardIndex The index of the shard. Selects the packet buffer to use.
+            @param first The first entry in the connected client list for this shard.
+            @param last One past the last entry in the connected client list for this shard.
+         */
+
+        void DoClientWork( ClientWork work, int shardIndex, int first, int last );
+
+        /**
+            Gather packets queued while generating packets into one batch and pass it to TransmitPackets.
+         */
+
+        void FlushSendQueues();
+
+        static void StaticClientWorkFunction( void * context, int taskIndex );
+
+        /**
+            Free serialized broadcast data once all clients are done with it.
+            The server keeps a reference to the data for each broadcast, so the last reference is always released on the thread calling the server, even when clients release theirs on worker threads.
+         */
+
+        void FreeBroadcasts();
+
+        /**
+            Free shared blocks once all messages are done with them, and their creator has released them.
+            As with broadcasts, the server keeps a reference to each shared block so the last reference is released on the thread calling the server.
+         */
+
+        void FreeSharedBlocks();
+
+        /// A packet handed off between the thread calling the server and per-client work.
+
+        struct QueuedPacket
+        {
+            uint8_t * packetData;                                   ///< The packet data.
+            int packetBytes;                                        ///< The size of the packet (bytes).
+        };
+
+        /**
+            Per-client slot data.
+            Everything the server touches for a client slot each tick is kept together, in one array sized at runtime, instead of a set of parallel arrays sized to a compile time limit.
+         */
+
+        struct ClientData
+        {
+            uint8_t * memory;                                       ///< The block of memory backing the per-client allocator. Allocated with m_allocator, or mapped from the OS if ClientServerConfig::mappedMemory is set.
+            Allocator * allocator;                                  ///< The per-client allocator. Used for allocations related to this client, including its reliable.io endpoint.
+            MessageFactory * messageFactory;                        ///< The per-client message factory. This silos message allocations per-client slot.
+            Connection * connection;                                ///< The per-client connection. This is how messages are exchanged with the client.
+            reliable_endpoint_t * endpoint;                         ///< The per-client reliable.io endpoint.
+            bool connectionError;                                   ///< Set when the connection goes into an error state while advancing time. The client is disconnected once all clients have been processed.
+            int connectedClientsIndex;                              ///< Index of this client in the connected client list. -1 if the client is not connected.
+            QueuedPacket * sendQueue;                               ///< Packets sent by the reliable.io endpoint while generating packets, waiting to be passed to TransmitPackets. Packet data points into sendBuffer. Allocated with the per-client allocator. NULL unless worker threads are enabled.
+            int sendQueueSize;                                      ///< Maximum number of packets in the send queue. One packet, or one per-fragment for fragmented packets.
+            int numSendQueuePackets;                                ///< Number of packets in the send queue.
+            uint8_t * sendBuffer;                                   ///< Data for the packets in the send queue, back to back. Allocated once with the per-client allocator and reused each time packets are generated. NULL when sendQueue is NULL.
+            int sendBufferBytes;                                    ///< Size of the send buffer (bytes). Enough for a packet of ClientServerConfig::maxPacketSize split into sendQueueSize fragments.
+            int sendBufferUsed;                                     ///< Bytes of the send buffer used by packets in the send queue.
+            QueuedPacket * receiveQueue;                            ///< Packets received for this client, waiting to be processed. ReceiveQueueSize entries allocated with the per-client allocator. NULL unless worker threads are enabled. See HasReceiveQueues.
+            int numReceiveQueuePackets;                             ///< Number of packets in the receive queue.
+            int numProcessedPackets;                                ///< Number of packets in the receive queue already handed back by PopProcessedPacket.
+#if YOJIMBO_PROFILE
+            TimingHistogram timing[CLIENT_PROFILE_NUM_TIMINGS];     ///< Per-client timings. Only touched by the client work shard that owns this client.
+#endif // #if YOJIMBO_PROFILE
+        };
 
         ClientServerConfig m_config;                                ///< Base client/server config.
         Allocator * m_allocator;                                    ///< Allocator passed in to constructor.
@@ -5293,15 +7789,25 @@ namespace yojimbo
         int m_maxClients;                                           ///< Maximum number of clients supported.
         bool m_running;                                             ///< True if server is currently running, eg. after "Start" is called, before "Stop".
         double m_time;                                              ///< Current server time in seconds.
-        uint8_t * m_globalMemory;                                   ///< The block of memory backing the global allocator. Allocated with m_allocator.
-        uint8_t * m_clientMemory[MaxClients];                       ///< The block of memory backing the per-client allocators. Allocated with m_allocator.
+        uint8_t * m_globalMemory;                                   ///< The block of memory backing the global allocator. Allocated with m_allocator, or mapped from the OS if ClientServerConfig::mappedMemory is set.
         Allocator * m_globalAllocator;                              ///< The global allocator. Used for allocations that don't belong to a specific client.
-        Allocator * m_clientAllocator[MaxClients];                  ///< Array of per-client allocator. These are used for allocations related to connected clients.
-        MessageFactory * m_clientMessageFactory[MaxClients];        ///< Array of per-client message factories. This silos message allocations per-client slot.
-        Connection * m_clientConnection[MaxClients];                ///< Array of per-client connection classes. This is how messages are exchanged with clients.
-        reliable_endpoint_t * m_clientEndpoint[MaxClients];         ///< Array of per-client reliable.io endpoints.
+        ClientData * m_clientData;                                  ///< Array of per-client data, sized to the number of client slots passed in to Start. Allocated with m_allocator.
+        SharedConnectionConfig * m_connectionConfig;                ///< Connection config shared by all client connections. Allocated with the global allocator.
         NetworkSimulator * m_networkSimulator;                      ///< The network simulator used to simulate packet loss, latency, jitter etc. Optional. 
-        uint8_t * m_packetBuffer;                                   ///< Buffer used when writing packets.
+        uint8_t * m_packetBuffer;                                   ///< Buffer used when writing packets. One per client work shard, each ClientServerConfig::maxPacketSize bytes.
+        WorkerPool * m_workerPool;                                  ///< Worker threads for per-client work. NULL unless ClientServerConfig::serverWorkerThreads is non-zero.
+        int m_numShards;                                            ///< Maximum number of shards connected clients are split into for per-client work. One per-worker thread plus one for the calling thread.
+        int m_numConnectedClients;                                  ///< Number of connected clients.
+        int * m_connectedClients;                                   ///< Dense list of connected client indices, so per-client work scales with connected clients, not client slots. Allocated with m_allocator.
+        TransportPacket * m_sendBatch;                              ///< Packets gathered from all client send queues by FlushSendQueues. Sized to hold every client send queue. NULL unless worker threads are enabled.
+        MessageFactory * m_globalMessageFactory;                    ///< Message factory for broadcast messages. Allocated with the global allocator.
+        SerializedMessageData * m_broadcasts;                       ///< List of serialized broadcast data the server holds a reference to. See FreeBroadcasts.
+        SharedBlock * m_sharedBlocks;                               ///< List of shared blocks the server holds a reference to. See FreeSharedBlocks.
+        SlabPool * m_clientMemoryPool;                              ///< Slab pool that per-client memory is taken from. NULL if per-client memory is allocated with m_allocator. See SetClientMemoryPool.
+#if YOJIMBO_PROFILE
+        TimingHistogram m_phaseTimings[SERVER_PROFILE_NUM_PHASES];  ///< Timings per server tick phase.
+        TimingHistogram * m_channelTimings;                         ///< Channel::GetPacketData timings, one set of channels per client work shard so worker threads never share a histogram. Allocated with m_allocator.
+#endif // #if YOJIMBO_PROFILE
     };
 
     /**
@@ -5314,6 +7820,17 @@ namespace yojimbo
 
         Server( Allocator & allocator, const uint8_t privateKey[], const Address & address, const ClientServerConfig & config, Adapter & adapter, double time );
 
+        /**
+            Create a server that uses a custom transport instead of netcode.io.
+            @param allocator The allocator for all memory used by the server.
+            @param transport The transport used to send and receive packets. It must outlive the server. The server starts and stops it.
+            @param config The client/server configuration.
+            @param adapter The adapter specifies the allocator and message factory to use.
+            @param time The current time in seconds.
+         */
+
+        Server( Allocator & allocator, ServerTransport & transport, const ClientServerConfig & config, Adapter & adapter, double time );
+
         ~Server();
 
         void Start( int maxClients );
@@ -5330,11 +7847,11 @@ namespace yojimbo
 
         void AdvanceTime( double time );
 
-        bool IsClientConnected( int clientIndex ) const;
+        double GetNextWakeupTime() const;
 
-        uint64_t GetClientId( int clientIndex ) const;
+        bool Poll( double timeout );
 
-        int GetNumConnectedClients() const;
+        uint64_t GetClientId( int clientIndex ) const;
 
         void ConnectLoopbackClient( int clientIndex, uint64_t clientId, const uint8_t * userData );
 
@@ -5350,6 +7867,8 @@ namespace yojimbo
 
         void TransmitPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes );
 
+        void TransmitPackets( const TransportPacket * packets, int numPackets );
+
         int ProcessPacketFunction( int clientIndex, uint16_t packetSequence, uint8_t * packetData, int packetBytes );
 
         void ConnectDisconnectCallbackFunction( int clientIndex, int connected );
@@ -5361,12 +7880,152 @@ namespace yojimbo
         static void StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence );
 
         ClientServerConfig m_config;
-        netcode_server_t * m_server;
+        ServerTransport * m_transport;                      // the transport while the server is running, otherwise NULL
+        ServerTransport * m_externalTransport;              // transport passed in to the constructor. if NULL, a netcode.io transport is created in Start
         Address m_address;                                  // original address passed to ctor
         Address m_boundAddress;                             // address after socket bind, eg. valid port
         uint8_t m_privateKey[KeyBytes];
     };
 
+    /**
+        Runs many servers in one process.
+        All servers share a worker pool, a slab pool for per-client memory and the host time. Each call to SendPackets, ReceivePackets and AdvanceTime updates all servers, in parallel across the worker threads, so many small servers use the available cores without one process per-server. Per-client memory is reused as servers are destroyed and created.
+        Servers are created and destroyed through the host, and started and stopped by the caller as usual.
+        IMPORTANT: Servers are updated in parallel, so anything shared between servers, such as an allocator passed in to a custom transport, must be thread safe. Each server updates its clients on whichever thread runs it, so ClientServerConfig::serverWorkerThreads must be zero.
+     */
+
+    class ServerHost
+    {
+    public:
+
+        /**
+            Server host constructor.
+            @param allocator The allocator used for the servers, the worker pool and the slab pool.
+            @param maxServers The maximum number of servers the host can run at the same time.
+            @param numWorkerThreads The number of worker threads that update servers in addition to the calling thread. Zero updates all servers on the calling thread.
+            @param clientMemoryBytes The slab size for per-client memory. Servers with ClientServerConfig::serverPerClientMemory up to this size take per-client memory from the slab pool.
+            @param time The current time (seconds).
+            @param mappedMemory If true, slabs are mapped from the OS. Only servers with a matching ClientServerConfig::mappedMemory take per-client memory from the slab pool.
+            @param hugePages If true, mapped slabs are backed by huge pages. Must match ClientServerConfig::hugePages for servers to use the slab pool.
+         */
+
+        ServerHost( Allocator & allocator, int maxServers, int numWorkerThreads, int clientMemoryBytes, double time, bool mappedMemory = false, bool hugePages = false );
+
+        /**
+            Server host destructor.
+            Stops and destroys any servers still on the host.
+         */
+
+        ~ServerHost();
+
+        /**
+            Create a server that uses netcode.io.
+            @param privateKey The private key used to generate and decrypt connect tokens.
+            @param address The address the server binds to.
+            @param config The client/server configuration.
+            @param adapter The adapter for the server.
+            @returns The server, or NULL if the host is full. The server is not running until you start it.
+         */
+
+        Server * CreateServer( const uint8_t privateKey[], const Address & address, const ClientServerConfig & config, Adapter & adapter );
+
+        /**
+            Create a server that uses a custom transport.
+            @param transport The transport used to send and receive packets. It must outlive the server.
+            @param config The client/server configuration.
+            @param adapter The adapter for the server.
+            @returns The server, or NULL if the host is full. The server is not running until you start it.
+         */
+
+        Server * CreateServer( ServerTransport & transport, const ClientServerConfig & config, Adapter & adapter );
+
+        /**
+            Stop and destroy a server created by this host.
+            @param server The server to destroy.
+         */
+
+        void DestroyServer( Server * server );
+
+        /**
+            Generate and send packets for all servers.
+            @see Server::SendPackets
+         */
+
+        void SendPackets();
+
+        /**
+            Receive and process packets for all servers.
+            @see Server::ReceivePackets
+         */
+
+        void ReceivePackets();
+
+        /**
+            Advance the host time, and the time of all servers.
+            @param time The current time (seconds).
+            @see Server::AdvanceTime
+         */
+
+        void AdvanceTime( double time );
+
+        /**
+            Get the next time any server on the host has work to do.
+            @returns The earliest next wakeup time across all servers (seconds). See Server::GetNextWakeupTime.
+         */
+
+        double GetNextWakeupTime() const;
+
+        double GetTime() const { return m_time; }
+
+        int GetNumServers() const { return m_numServers; }
+
+        Server * GetServer( int index ) { yojimbo_assert( index >= 0 ); yojimbo_assert( index < m_numServers ); return m_servers[index]; }
+
+        SlabPool & GetClientMemoryPool() { return *m_clientMemoryPool; }
+
+    private:
+
+        /// Per-server work run across the worker threads.
+
+        enum ServerWork
+        {
+            SERVER_WORK_SEND_PACKETS,
+            SERVER_WORK_RECEIVE_PACKETS,
+            SERVER_WORK_ADVANCE_TIME
+        };
+
+        /// Passed to StaticServerWorkFunction by RunServerWork.
+
+        struct ServerWorkContext
+        {
+            ServerHost * host;                                      ///< The host doing the work.
+            ServerWork work;                                        ///< The work to do for each server.
+        };
+
+        /**
+            Do work for each server on the host, in parallel across the worker threads.
+            @param work The work to do.
+         */
+
+        void RunServerWork( ServerWork work );
+
+        Server * AddServer( Server * server, const ClientServerConfig & config );
+
+        static void StaticServerWorkFunction( void * context, int taskIndex );
+
+        Allocator * m_allocator;                                    ///< The allocator passed in to the constructor.
+        int m_maxServers;                                           ///< The maximum number of servers.
+        int m_numServers;                                           ///< The number of servers on the host.
+        Server ** m_servers;                                        ///< Array of servers on the host. Servers are swapped into the last slot when destroyed, so the array is always dense.
+        WorkerPool * m_workerPool;                                  ///< Worker threads shared by all servers.
+        SlabPool * m_clientMemoryPool;                              ///< Slab pool for per-client memory, shared by all servers.
+        double m_time;                                              ///< The host time. Passed to servers as they are created, and to all servers in AdvanceTime.
+
+        ServerHost( const ServerHost & other );
+
+        ServerHost & operator = ( const ServerHost & other );
+    };
+
     /**
         The set of client states.
      */
@@ -5379,6 +8038,257 @@ namespace yojimbo
         CLIENT_STATE_CONNECTED,
     };
 
+    /**
+        Sends and receives packets for a client, and manages the connection to the server.
+        By default Client uses netcode.io. Pass a transport in to the Client constructor to use something else, eg. MemoryClientTransport.
+        The client opens the transport when it starts connecting and closes it when it disconnects.
+        @see ServerTransport
+     */
+
+    class ClientTransport
+    {
+    public:
+
+        /// Called when the transport has a packet to send to the server for a loopback client.
+
+        typedef void (*SendLoopbackPacketFunction)( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence );
+
+        ClientTransport();
+
+        virtual ~ClientTransport() {}
+
+        /**
+            Set the function called when there are loopback packets to send to the server.
+            @param context The context passed to the callback function.
+            @param sendLoopbackPacketFunction Called when there is a loopback packet to send to the server.
+         */
+
+        void SetCallbacks( void * context, SendLoopbackPacketFunction sendLoopbackPacketFunction );
+
+        /**
+            Get ready to connect, eg. by creating the socket.
+            @param time The current time (seconds).
+            @returns True if successful, false otherwise.
+         */
+
+        virtual bool Open( double time ) = 0;
+
+        /**
+            Disconnect from the server, if connected, and release everything created by Open.
+         */
+
+        virtual void Close() = 0;
+
+        /**
+            Get the port the transport is bound to.
+            @returns The port number, or 0 if the transport does not use sockets.
+         */
+
+        virtual int GetPort() const = 0;
+
+        /**
+            Start connecting to the server.
+            @param clientId The client id.
+            @param connectToken The connect token. Transports that do not need connect tokens ignore this.
+         */
+
+        virtual void Connect( uint64_t clientId, uint8_t * connectToken ) = 0;
+
+        /**
+            Update the transport.
+            This is where the connection to the server is established and timed out.
+            @param time The current time (seconds).
+         */
+
+        virtual void Update( double time ) = 0;
+
+        /**
+            Get the state of the connection to the server.
+            @returns The connection state. CLIENT_STATE_ERROR if the connection failed, eg. connection denied or timed out.
+         */
+
+        virtual ClientState GetState() const = 0;
+
+        /**
+            Get the client slot on the server.
+            @returns The client index, or -1 if not connected.
+         */
+
+        virtual int GetClientIndex() const = 0;
+
+        /**
+            Get the next time the transport needs Update to be called, eg. to send keep-alive packets or connection requests.
+            @param time The current time (seconds).
+            @returns The next update time (seconds). The default implementation returns MaxWakeupInterval past the current time.
+         */
+
+        virtual double GetNextUpdateTime( double time ) const { return time + MaxWakeupInterval; }
+
+        /**
+            Wait for packets to arrive.
+            Transports that can not wait on packets return immediately. The default implementation does this.
+            @param timeout The maximum time to wait (seconds).
+            @returns True if there may be packets to receive, false if there are definitely none.
+         */
+
+        virtual bool Poll( double timeout ) { (void) timeout; return true; }
+
+        /**
+            Send a batch of packets to the server.
+            Packet data is copied, so it can be freed when this returns.
+            @param packets The packets to send.
+            @param numPackets The number of packets to send.
+         */
+
+        virtual void SendPackets( const TransportPacket * packets, int numPackets ) = 0;
+
+        /**
+            Receive a batch of packets from the server.
+            Packets must be passed back to FreePackets once they have been processed.
+            @param packets The array of packets to fill [out].
+            @param maxPackets The maximum number of packets to receive.
+            @returns The number of packets received. Less than maxPackets if there are no more packets to receive.
+         */
+
+        virtual int ReceivePackets( TransportPacket * packets, int maxPackets ) = 0;
+
+        /**
+            Free packets returned by ReceivePackets.
+            @param packets The packets to free.
+            @param numPackets The number of packets to free.
+         */
+
+        virtual void FreePackets( TransportPacket * packets, int numPackets ) = 0;
+
+        /**
+            Connect as a loopback client.
+            Loopback clients are only supported by transports that override this. The default implementation logs an error.
+            @see ClientInterface::ConnectLoopback
+         */
+
+        virtual void ConnectLoopback( int clientIndex, int maxClients );
+
+        /**
+            Disconnect a loopback client.
+            The default implementation does nothing.
+            @see ClientInterface::DisconnectLoopback
+         */
+
+        virtual void DisconnectLoopback();
+
+        /**
+            Is this a loopback client?
+            @returns True if connected as a loopback client. The default implementation always returns false.
+         */
+
+        virtual bool IsLoopback() const { return false; }
+
+        /**
+            Pass a packet sent by the server in to a loopback client.
+            The packet is received through ReceivePackets like any other packet. The default implementation drops it.
+            @param packetData The packet data.
+            @param packetBytes The size of the packet (bytes).
+            @param packetSequence The packet sequence number.
+            @see ClientInterface::ProcessLoopbackPacket
+         */
+
+        virtual void ProcessLoopbackPacket( const uint8_t * packetData, int packetBytes, uint64_t packetSequence );
+
+    protected:
+
+        /**
+            Call this to pass a loopback packet to the server.
+            @param clientIndex The client slot of the loopback client.
+            @param packetData The packet data.
+            @param packetBytes The size of the packet (bytes).
+            @param packetSequence The packet sequence number.
+         */
+
+        void SendLoopbackPacketCallback( int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence );
+
+    private:
+
+        void * m_callbackContext;                                           ///< The context passed to the callback function.
+        SendLoopbackPacketFunction m_sendLoopbackPacketFunction;            ///< Called when there is a loopback packet to send to the server.
+    };
+
+    /**
+        A client transport that connects to a MemoryServerTransport in the same process.
+        IMPORTANT: Memory transports are not thread safe. Update the server and all its clients from the same thread.
+        @see MemoryServerTransport
+     */
+
+    class MemoryClientTransport : public ClientTransport
+    {
+    public:
+
+        /**
+            Memory client transport constructor.
+            @param allocator The allocator used for packet copies.
+            @param server The server transport to connect to. Must outlive this transport.
+            @param packetQueueSize The maximum number of packets queued from the server. Additional packets are dropped.
+         */
+
+        MemoryClientTransport( Allocator & allocator, MemoryServerTransport & server, int packetQueueSize = 256 );
+
+        ~MemoryClientTransport();
+
+        bool Open( double time );
+
+        void Close();
+
+        int GetPort() const { return 0; }
+
+        void Connect( uint64_t clientId, uint8_t * connectToken );
+
+        void Update( double time );
+
+        ClientState GetState() const { return m_state; }
+
+        int GetClientIndex() const { return m_state == CLIENT_STATE_CONNECTED ? m_clientIndex : -1; }
+
+        double GetNextUpdateTime( double time ) const;
+
+        bool Poll( double timeout );
+
+        void SendPackets( const TransportPacket * packets, int numPackets );
+
+        int ReceivePackets( TransportPacket * packets, int maxPackets );
+
+        void FreePackets( TransportPacket * packets, int numPackets );
+
+        /**
+            Queue a packet sent by the server. Called by MemoryServerTransport.
+            @param packetData The packet data. This is copied.
+            @param packetBytes The size of the packet (bytes).
+         */
+
+        void QueuePacket( const uint8_t * packetData, int packetBytes );
+
+        /**
+            Called by MemoryServerTransport when the server disconnects this client, or denies the connection.
+            @param denied True if the connection was denied, false if the client was disconnected.
+         */
+
+        void OnServerDisconnect( bool denied );
+
+    private:
+
+        void ClearPacketQueue();
+
+        Allocator * m_allocator;                                            ///< The allocator passed in to the constructor.
+        MemoryServerTransport * m_server;                                   ///< The server transport to connect to.
+        int m_packetQueueSize;                                              ///< The maximum number of packets queued from the server.
+        ClientState m_state;                                                ///< The connection state.
+        uint64_t m_clientId;                                                ///< The client id passed in to Connect.
+        int m_clientIndex;                                                  ///< The client slot on the server, or -1 if we don't have one.
+        Queue<TransportPacket> * m_packetQueue;                             ///< Packets received from the server. NULL unless open.
+
+        MemoryClientTransport( const MemoryClientTransport & other );
+
+        MemoryClientTransport & operator = ( const MemoryClientTransport & other );
+    };
+
     /** 
         The common interface for all clients.
      */
@@ -5424,6 +8334,24 @@ namespace yojimbo
 
         virtual void AdvanceTime( double time ) = 0;
 
+        /**
+            Get the next time the client has work to do.
+            This considers message and block fragment resends, acks for received messages, packets held by the network simulator and transport timers.
+            @returns The next wakeup time (seconds), no later than MaxWakeupInterval past the current client time.
+            @see ServerInterface::GetNextWakeupTime
+         */
+
+        virtual double GetNextWakeupTime() const = 0;
+
+        /**
+            Wait until packets arrive from the server, or the timeout expires.
+            Transports that can not wait on their socket, including netcode.io, sleep for the timeout instead.
+            @param timeout The maximum time to wait (seconds).
+            @returns True if there may be packets to receive, false if there are definitely none.
+         */
+
+        virtual bool Poll( double timeout ) = 0;
+
         /**
             Is the client connecting to a server?
             This is true while the client is negotiation connection with a server.
@@ -5617,6 +8545,8 @@ namespace yojimbo
 
         void AdvanceTime( double time );
 
+        double GetNextWakeupTime() const;
+
         bool IsConnecting() const { return m_clientState == CLIENT_STATE_CONNECTING; }
 
         bool IsConnected() const { return m_clientState == CLIENT_STATE_CONNECTED; }
@@ -5639,6 +8569,18 @@ namespace yojimbo
 
         void SetDuplicates( float percent );
 
+        void SetBandwidth( float kilobitsPerSecond, int burstBytes = 0 );
+
+        void SetQueueLimit( int queueBytes, int earlyDropBytes = 0 );
+
+        void SetBurstLoss( float goodToBadPercent, float badToGoodPercent, float badLossPercent = 100.0f, float goodLossPercent = 0.0f );
+
+        void SetReordering( float percent, float milliseconds );
+
+        void SetOutage( float periodSeconds, float durationSeconds );
+
+        void SetNetworkSimulatorSeed( uint64_t seed, uint64_t stream = 0 );
+
         Message * CreateMessage( int type );
 
         uint8_t * AllocateBlock( int bytes );
@@ -5657,6 +8599,25 @@ namespace yojimbo
 
         void GetNetworkInfo( NetworkInfo & info ) const;
 
+        /**
+            Get a channel counter.
+            @param channelIndex The channel index in [0,numChannels-1].
+            @param index The counter index. See ChannelCounters.
+            @returns The value of the counter, or zero if the client has no connection.
+         */
+
+        uint64_t GetChannelCounter( int channelIndex, int index ) const;
+
+        /**
+            Get channel latency stats.
+            @param channelIndex The channel index in [0,numChannels-1].
+            @param index The latency index. See ChannelLatency.
+            @param stats The latency stats [out].
+            @returns True if the client has a connection, the channel tracks latency and the stats were filled in, false otherwise.
+         */
+
+        bool GetChannelLatencyStats( int channelIndex, int index, TimingStats & stats ) const;
+
     protected:
 
         uint8_t * GetPacketBuffer() { return m_packetBuffer; }
@@ -5665,7 +8626,7 @@ namespace yojimbo
 
         Adapter & GetAdapter() { yojimbo_assert( m_adapter ); return *m_adapter; }
 
-        void CreateInternal();
+        void CreateInternal( uint64_t clientId );
 
         void DestroyInternal();
 
@@ -5735,6 +8696,16 @@ namespace yojimbo
 
         explicit Client( Allocator & allocator, const Address & address, const ClientServerConfig & config, Adapter & adapter, double time );
 
+        /**
+            Create a client that uses a custom transport instead of netcode.io.
+            @param allocator The allocator for all memory used by the client.
+            @param transport The transport used to connect to the server. It must outlive the client. The client opens it when connecting and closes it on disconnect.
+            @param config The client/server configuration.
+            @param time The current time in seconds. See ClientInterface::AdvanceTime
+         */
+
+        explicit Client( Allocator & allocator, ClientTransport & transport, const ClientServerConfig & config, Adapter & adapter, double time );
+
         ~Client();
 
         void InsecureConnect( const uint8_t privateKey[], uint64_t clientId, const Address & address );
@@ -5751,6 +8722,10 @@ namespace yojimbo
 
         void AdvanceTime( double time );
 
+        double GetNextWakeupTime() const;
+
+        bool Poll( double timeout );
+
         int GetClientIndex() const;
 
         uint64_t GetClientId() const { return m_clientId; }
@@ -5777,10 +8752,6 @@ namespace yojimbo
 
         void DestroyClient();
 
-        void StateChangeCallbackFunction( int previous, int current );
-
-        static void StaticStateChangeCallbackFunction( void * context, int previous, int current );
-
         void TransmitPacketFunction( uint16_t packetSequence, uint8_t * packetData, int packetBytes );
 
         int ProcessPacketFunction( uint16_t packetSequence, uint8_t * packetData, int packetBytes );
@@ -5790,7 +8761,8 @@ namespace yojimbo
         static void StaticSendLoopbackPacketCallbackFunction( void * context, int clientIndex, const uint8_t * packetData, int packetBytes, uint64_t packetSequence );
 
         ClientServerConfig m_config;                    ///< Client/server configuration.
-        netcode_client_t * m_client;                    ///< netcode.io client data.
+        ClientTransport * m_transport;                  ///< The transport while connecting or connected, otherwise NULL.
+        ClientTransport * m_externalTransport;          ///< The transport passed in to the constructor. If NULL, a netcode.io transport is created on each connect.
         Address m_address;                              ///< Original address passed to ctor.
         Address m_boundAddress;                         ///< Address after socket bind, eg. with valid port
         uint64_t m_clientId;                            ///< The globally unique client id (set on each call to connect)